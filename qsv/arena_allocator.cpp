@@ -0,0 +1,189 @@
+#include "arena_allocator.h"
+
+#include <iomanip>
+#include <iostream>
+
+#include "utils.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+ArenaBufferAllocator::ArenaBufferAllocator()
+{
+	m_nAllocs = 0;
+	m_nRecycled = 0;
+	m_nMappedBytes = 0;
+	m_nLargePageBytes = 0;
+	m_dAllocTime = 0;
+}
+
+ArenaBufferAllocator::~ArenaBufferAllocator()
+{
+	for (size_t i = 0; i < m_Chunks.size(); i++)
+	{
+		UnmapChunk(m_Chunks[i]);
+	}
+}
+
+// same layout as SysMemBufferAllocator, so that its LockBuffer finds the data
+size_t ArenaBufferAllocator::GetBlockSize(mfxU32 nbytes)
+{
+	size_t nSize = MSDK_ALIGN32(sizeof(sBuffer)) + (size_t)nbytes + 32;
+	return (nSize + MSDK_ARENA_BLOCK_ALIGNMENT - 1) & ~(size_t)(MSDK_ARENA_BLOCK_ALIGNMENT - 1);
+}
+
+mfxStatus ArenaBufferAllocator::AllocBuffer(mfxU32 nbytes, mfxU16 type, mfxMemId *mid)
+{
+	if (!mid)
+		return MFX_ERR_NULL_PTR;
+
+	if (0 == (type & MFX_MEMTYPE_SYSTEM_MEMORY))
+		return MFX_ERR_UNSUPPORTED;
+
+	CTimer t;
+	t.Start();
+
+	size_t nBlockSize = GetBlockSize(nbytes);
+	mfxU8* pBlock = NULL;
+
+	AutomaticMutex lock(m_Mutex);
+
+	std::vector<mfxU8*>& freeList = m_FreeLists[nBlockSize];
+	if (!freeList.empty())
+	{
+		pBlock = freeList.back();
+		freeList.pop_back();
+		m_nRecycled++;
+	}
+	else
+	{
+		pBlock = CarveBlock(nBlockSize);
+		if (!pBlock)
+			return MFX_ERR_MEMORY_ALLOC;
+	}
+
+	sBuffer *bs = (sBuffer *)pBlock;
+	bs->id = ID_BUFFER;
+	bs->type = type;
+	bs->nbytes = nbytes;
+	*mid = (mfxHDL) bs;
+
+	m_nAllocs++;
+	m_dAllocTime += t.GetTime();
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus ArenaBufferAllocator::FreeBuffer(mfxMemId mid)
+{
+	sBuffer *bs = (sBuffer *)mid;
+	if (!bs || ID_BUFFER != bs->id)
+		return MFX_ERR_INVALID_HANDLE;
+
+	AutomaticMutex lock(m_Mutex);
+
+	m_FreeLists[GetBlockSize(bs->nbytes)].push_back((mfxU8*)bs);
+
+	return MFX_ERR_NONE;
+}
+
+// m_Mutex must be held
+mfxU8* ArenaBufferAllocator::CarveBlock(size_t nBlockSize)
+{
+	if (m_Chunks.empty() || m_Chunks.back().nSize - m_Chunks.back().nUsed < nBlockSize)
+	{
+		// the rest of the current chunk stays unused, frames of one allocation request share a size
+		if (!MapChunk(nBlockSize))
+			return NULL;
+	}
+
+	sChunk& chunk = m_Chunks.back();
+	mfxU8* pBlock = chunk.pBase + chunk.nUsed;
+	chunk.nUsed += nBlockSize;
+
+	return pBlock;
+}
+
+// m_Mutex must be held
+bool ArenaBufferAllocator::MapChunk(size_t nMinSize)
+{
+	sChunk chunk;
+	chunk.nSize = MSDK_MAX((size_t)MSDK_ARENA_CHUNK_SIZE,
+		(nMinSize + MSDK_ARENA_LARGE_PAGE_SIZE - 1) & ~(size_t)(MSDK_ARENA_LARGE_PAGE_SIZE - 1));
+	chunk.nUsed = 0;
+	chunk.bLargePages = false;
+
+#if defined(_WIN32) || defined(_WIN64)
+	// large pages need SeLockMemoryPrivilege, without it VirtualAlloc fails and normal pages are used
+	chunk.pBase = NULL;
+	SIZE_T nLargePage = GetLargePageMinimum();
+	if (nLargePage && 0 == chunk.nSize % nLargePage)
+	{
+		chunk.pBase = (mfxU8*)VirtualAlloc(NULL, chunk.nSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		chunk.bLargePages = (NULL != chunk.pBase);
+	}
+	if (!chunk.pBase)
+	{
+		chunk.pBase = (mfxU8*)VirtualAlloc(NULL, chunk.nSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+	if (!chunk.pBase)
+		return false;
+#else
+	// explicit huge pages need a reserved pool (vm.nr_hugepages), otherwise ask for transparent ones
+	void* pBase = mmap(NULL, chunk.nSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	chunk.bLargePages = (MAP_FAILED != pBase);
+	if (MAP_FAILED == pBase)
+	{
+		pBase = mmap(NULL, chunk.nSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == pBase)
+			return false;
+#ifdef MADV_HUGEPAGE
+		madvise(pBase, chunk.nSize, MADV_HUGEPAGE);
+#endif
+	}
+	chunk.pBase = (mfxU8*)pBase;
+#endif
+
+	m_Chunks.push_back(chunk);
+
+	m_nMappedBytes += chunk.nSize;
+	if (chunk.bLargePages)
+		m_nLargePageBytes += chunk.nSize;
+
+	return true;
+}
+
+void ArenaBufferAllocator::UnmapChunk(const sChunk& chunk)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	VirtualFree(chunk.pBase, 0, MEM_RELEASE);
+#else
+	munmap(chunk.pBase, chunk.nSize);
+#endif
+}
+
+mfxU64 ArenaBufferAllocator::GetMappedBytes()
+{
+	AutomaticMutex lock(m_Mutex);
+
+	return m_nMappedBytes;
+}
+
+void ArenaBufferAllocator::PrintStatistics()
+{
+	AutomaticMutex lock(m_Mutex);
+
+	if (!m_nAllocs)
+	{
+		return;
+	}
+
+	std::cout << "Arena allocator: " << m_nAllocs << " buffers (" << m_nRecycled << " recycled), "
+		<< std::fixed << std::setprecision(2) << (mfxF64)m_nMappedBytes / (1024 * 1024) << " MB mapped, "
+		<< (mfxF64)m_nLargePageBytes / (1024 * 1024) << " MB in large pages, "
+		<< m_dAllocTime * 1000 << " ms allocating" << std::endl;
+	std::cout.unsetf(std::ios::floatfield);
+}
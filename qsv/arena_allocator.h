@@ -0,0 +1,60 @@
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include "sysmem_allocator.h"
+#include "thread_defs.h"
+
+// size of one arena mapping, a multiple of the 2 MB large page size
+#define MSDK_ARENA_CHUNK_SIZE (64 * 1024 * 1024)
+#define MSDK_ARENA_LARGE_PAGE_SIZE (2 * 1024 * 1024)
+// blocks are rounded up to this granularity, which is also the size class step
+#define MSDK_ARENA_BLOCK_ALIGNMENT 4096
+
+// Buffer allocator that carves buffers out of large mappings instead of calling calloc for each one.
+// Mappings use 2 MB large pages where the OS grants them and normal pages otherwise. Freed buffers go to
+// per-size-class free lists, so frames reallocated after a reset are neither zeroed nor faulted in again.
+// Buffer contents are not zero filled. Mappings are only returned to the OS when the allocator is destroyed.
+class ArenaBufferAllocator : public SysMemBufferAllocator
+{
+public:
+	ArenaBufferAllocator();
+	virtual ~ArenaBufferAllocator();
+
+	virtual mfxStatus AllocBuffer(mfxU32 nbytes, mfxU16 type, mfxMemId *mid);
+	virtual mfxStatus FreeBuffer(mfxMemId mid);
+
+	virtual void PrintStatistics();
+	virtual mfxU64 GetMappedBytes();
+
+protected:
+	struct sChunk
+	{
+		mfxU8* pBase;
+		size_t nSize;
+		size_t nUsed;
+		bool bLargePages;
+	};
+
+	static size_t GetBlockSize(mfxU32 nbytes);
+	mfxU8* CarveBlock(size_t nBlockSize);
+	bool MapChunk(size_t nMinSize);
+	static void UnmapChunk(const sChunk& chunk);
+
+	std::vector<sChunk> m_Chunks; // the last one is carved from
+	std::map<size_t, std::vector<mfxU8*> > m_FreeLists; // by block size
+
+	MSDKMutex m_Mutex;
+
+	// statistics
+	mfxU32 m_nAllocs;
+	mfxU32 m_nRecycled;
+	mfxU64 m_nMappedBytes;
+	mfxU64 m_nLargePageBytes;
+	mfxF64 m_dAllocTime;
+
+private:
+	ArenaBufferAllocator(const ArenaBufferAllocator&);
+	void operator=(const ArenaBufferAllocator&);
+};
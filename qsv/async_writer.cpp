@@ -0,0 +1,486 @@
+#include "async_writer.h"
+
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+
+#include "trace.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// upper bound for the number of payloads written by one system call
+#define MSDK_ASYNC_WRITE_MAX_BATCH 64
+// coalescing buffer for small payloads, payloads at least this large are written directly
+#define MSDK_ASYNC_WRITE_STAGING_SIZE (4 * 1024 * 1024)
+#define MSDK_ASYNC_WRITE_ALIGNMENT 4096
+
+CAsyncBitstreamWriter::CAsyncBitstreamWriter(CBitstreamPool* pBitstreamPool, mfxU16 nDurability, mfxU32 nMaxPending)
+{
+	m_pBitstreamPool = pBitstreamPool;
+	m_nDurability = nDurability;
+	m_nMaxPending = MSDK_MAX(nMaxPending, 1);
+	m_pLatency = NULL;
+	m_pTimings = NULL;
+
+#if defined(_WIN32) || defined(_WIN64)
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_pStaging = NULL;
+#else
+	m_fd = -1;
+#endif
+
+	m_nInFlight = 0;
+	m_WriteStatus = MFX_ERR_NONE;
+	m_bStop = false;
+
+	m_nFramesWritten = 0;
+	m_nBytesWritten = 0;
+	m_nWrites = 0;
+	m_nSyncs = 0;
+	m_dWriteTime = 0;
+	m_dStallTime = 0;
+	m_nLastSync = 0;
+}
+
+CAsyncBitstreamWriter::~CAsyncBitstreamWriter()
+{
+	Close();
+}
+
+mfxStatus CAsyncBitstreamWriter::Init(const std::string& strFileName)
+{
+	MSDK_CHECK_POINTER(m_pBitstreamPool, MFX_ERR_NULL_PTR);
+
+	if (strFileName.empty()) {
+		return MFX_ERR_NONE;
+	}
+
+	Close();
+
+#if defined(_WIN32) || defined(_WIN64)
+	m_hFile = CreateFileA(strFileName.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (INVALID_HANDLE_VALUE == m_hFile) {
+		return MFX_ERR_NULL_PTR;
+	}
+
+	m_pStaging = (mfxU8*)_aligned_malloc(MSDK_ASYNC_WRITE_STAGING_SIZE, MSDK_ASYNC_WRITE_ALIGNMENT);
+	MSDK_CHECK_POINTER(m_pStaging, MFX_ERR_MEMORY_ALLOC);
+#else
+	m_fd = open(strFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (m_fd < 0) {
+		return MFX_ERR_NULL_PTR;
+	}
+#endif
+
+	m_nInFlight = 0;
+	m_WriteStatus = MFX_ERR_NONE;
+	m_bStop = false;
+	m_nLastSync = msdk_time_get_tick();
+
+	mfxStatus sts = MFX_ERR_NONE;
+
+	m_pFrameQueued.reset(new MSDKEvent(sts, false, false));
+	MSDK_CHECK_STATUS(sts, "MSDKEvent failed");
+
+	m_pFrameWritten.reset(new MSDKEvent(sts, false, false));
+	MSDK_CHECK_STATUS(sts, "MSDKEvent failed");
+
+	m_pThread.reset(new MSDKThread(sts, ThreadRoutine, this));
+	MSDK_CHECK_STATUS(sts, "MSDKThread failed");
+
+	m_sFile = strFileName;
+	m_bInited = true;
+
+	return MFX_ERR_NONE;
+}
+
+void CAsyncBitstreamWriter::Close()
+{
+	if (m_pThread.get())
+	{
+		// the thread drains the queue before it exits
+		{
+			AutomaticMutex lock(m_Mutex);
+			m_bStop = true;
+		}
+		m_pFrameQueued->Signal();
+		m_pThread->Wait();
+		m_pThread.reset();
+	}
+
+	m_pFrameQueued.reset();
+	m_pFrameWritten.reset();
+
+	// payloads left behind by a failed write
+	while (!m_Queue.empty() && m_pBitstreamPool)
+	{
+		m_pBitstreamPool->Release(&m_Queue.front().Bitstream);
+		m_Queue.pop_front();
+	}
+
+#if defined(_WIN32) || defined(_WIN64)
+	if (INVALID_HANDLE_VALUE != m_hFile)
+	{
+		if (MSDK_DURABILITY_NONE != m_nDurability)
+		{
+			SyncFile();
+		}
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+
+	if (m_pStaging)
+	{
+		_aligned_free(m_pStaging);
+		m_pStaging = NULL;
+	}
+#else
+	if (m_fd >= 0)
+	{
+		if (MSDK_DURABILITY_NONE != m_nDurability)
+		{
+			SyncFile();
+		}
+		close(m_fd);
+		m_fd = -1;
+	}
+#endif
+
+	CSmplBitstreamWriter::Close();
+}
+
+bool CAsyncBitstreamWriter::SetFrameLatency(CFrameLatency* pLatency, CStageTimings* pTimings)
+{
+	m_pLatency = pLatency;
+	m_pTimings = pTimings;
+
+	return true;
+}
+
+mfxStatus CAsyncBitstreamWriter::WriteNextFrame(mfxBitstream *pMfxBitstream, mfxU32 nFrameOrder)
+{
+	// check if writer is initialized
+	MSDK_CHECK_ERROR(m_bInited, false, MFX_ERR_NOT_INITIALIZED);
+	MSDK_CHECK_POINTER(pMfxBitstream, MFX_ERR_NULL_PTR);
+
+	m_nProcessedFramesNum++;
+	m_nProcessedBytes += pMfxBitstream->DataLength;
+
+	if (!pMfxBitstream->DataLength)
+	{
+		// nothing to wait for
+		if (m_pLatency)
+		{
+			m_pLatency->Stop(nFrameOrder, m_pTimings);
+		}
+		return MFX_ERR_NONE;
+	}
+
+	mfxStatus sts = MFX_ERR_NONE;
+	{
+		AutomaticMutex lock(m_Mutex);
+
+		// backpressure, the output cannot keep up with the encoder
+		if (m_Queue.size() >= m_nMaxPending && MFX_ERR_NONE == m_WriteStatus)
+		{
+			CTimer t;
+			t.Start();
+
+			while (m_Queue.size() >= m_nMaxPending && MFX_ERR_NONE == m_WriteStatus)
+			{
+				m_Mutex.Unlock();
+				m_pFrameWritten->Wait();
+				m_Mutex.Lock();
+			}
+
+			m_dStallTime += t.GetTime();
+		}
+
+		sts = m_WriteStatus;
+		if (MFX_ERR_NONE == sts)
+		{
+			sPayload payload;
+			payload.Bitstream = *pMfxBitstream;
+			payload.nFrameOrder = nFrameOrder;
+			m_Queue.push_back(payload);
+		}
+	}
+	MSDK_CHECK_STATUS(sts, "writing the output file failed");
+
+	m_pFrameQueued->Signal();
+
+	// the payload belongs to the queue now, the task continues with a fresh buffer
+	pMfxBitstream->Data = NULL;
+	pMfxBitstream->MaxLength = 0;
+
+	sts = m_pBitstreamPool->Acquire(pMfxBitstream);
+	MSDK_CHECK_STATUS(sts, "m_pBitstreamPool->Acquire failed");
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CAsyncBitstreamWriter::Flush()
+{
+	if (!m_pThread.get())
+	{
+		return MFX_ERR_NONE;
+	}
+
+	AutomaticMutex lock(m_Mutex);
+
+	while ((!m_Queue.empty() || m_nInFlight) && MFX_ERR_NONE == m_WriteStatus)
+	{
+		m_Mutex.Unlock();
+		m_pFrameWritten->Wait();
+		m_Mutex.Lock();
+	}
+
+	return m_WriteStatus;
+}
+
+unsigned int MFX_STDCALL CAsyncBitstreamWriter::ThreadRoutine(void* pArg)
+{
+	static_cast<CAsyncBitstreamWriter*>(pArg)->WriteFrames();
+	return 0;
+}
+
+void CAsyncBitstreamWriter::WriteFrames()
+{
+	msdk_trace_set_thread_name("writer");
+
+	std::vector<sPayload> batch;
+	batch.reserve(MSDK_ASYNC_WRITE_MAX_BATCH);
+
+	for (;;)
+	{
+		bool bStop = false;
+		{
+			AutomaticMutex lock(m_Mutex);
+
+			// after a failure payloads stay queued and are released by Close
+			while (!m_Queue.empty() && batch.size() < MSDK_ASYNC_WRITE_MAX_BATCH && MFX_ERR_NONE == m_WriteStatus)
+			{
+				batch.push_back(m_Queue.front());
+				m_Queue.pop_front();
+			}
+			m_nInFlight = (mfxU32)batch.size();
+			bStop = m_bStop;
+		}
+
+		if (batch.empty())
+		{
+			if (bStop)
+			{
+				break;
+			}
+
+			if (MSDK_DURABILITY_PERIODIC == m_nDurability)
+			{
+				m_pFrameQueued->TimedWait(MSDK_DURABILITY_SYNC_INTERVAL);
+			}
+			else
+			{
+				m_pFrameQueued->Wait();
+			}
+		}
+		else
+		{
+			CTimer t;
+			t.Start();
+
+			mfxStatus sts = WriteBatch(batch);
+
+			m_dWriteTime += t.GetTime();
+
+			for (size_t i = 0; i < batch.size(); i++)
+			{
+				m_nFramesWritten++;
+
+				if (MFX_ERR_NONE == sts && m_pLatency)
+				{
+					m_pLatency->Stop(batch[i].nFrameOrder, m_pTimings);
+				}
+
+				// print encoding progress to console every certain number of frames, off the sync path
+				if (MFX_ERR_NONE == sts && (1 == m_nFramesWritten || 0 == (m_nFramesWritten % 100)))
+				{
+					std::cout << "Frame number: " << m_nFramesWritten << std::endl;
+				}
+
+				m_pBitstreamPool->Release(&batch[i].Bitstream);
+			}
+			batch.clear();
+
+			{
+				AutomaticMutex lock(m_Mutex);
+				m_nInFlight = 0;
+				if (MFX_ERR_NONE == m_WriteStatus)
+				{
+					m_WriteStatus = sts;
+				}
+			}
+
+			m_pFrameWritten->Signal();
+		}
+
+		if (MSDK_DURABILITY_PERIODIC == m_nDurability &&
+			MSDK_GET_TIME(msdk_time_get_tick(), m_nLastSync, CTimer::GetFrequency()) * 1000 >= MSDK_DURABILITY_SYNC_INTERVAL)
+		{
+			SyncFile();
+		}
+	}
+}
+
+mfxStatus CAsyncBitstreamWriter::WriteBatch(const std::vector<sPayload>& batch)
+{
+	mfxStatus sts = MFX_ERR_NONE;
+
+#if defined(_WIN32) || defined(_WIN64)
+	// there is no gather write for buffered handles, so small payloads are coalesced into one WriteFile
+	mfxU32 nStaged = 0;
+
+	for (size_t i = 0; i < batch.size() && MFX_ERR_NONE == sts; i++)
+	{
+		const mfxU8* pData = batch[i].Bitstream.Data + batch[i].Bitstream.DataOffset;
+		mfxU32 nSize = batch[i].Bitstream.DataLength;
+
+		if (nStaged + nSize > MSDK_ASYNC_WRITE_STAGING_SIZE && nStaged)
+		{
+			sts = WriteBuffer(m_pStaging, nStaged);
+			nStaged = 0;
+		}
+
+		if (nSize >= MSDK_ASYNC_WRITE_STAGING_SIZE)
+		{
+			if (MFX_ERR_NONE == sts)
+				sts = WriteBuffer(pData, nSize);
+			continue;
+		}
+
+		memcpy(m_pStaging + nStaged, pData, nSize);
+		nStaged += nSize;
+	}
+
+	if (nStaged && MFX_ERR_NONE == sts)
+	{
+		sts = WriteBuffer(m_pStaging, nStaged);
+	}
+#else
+	struct iovec iov[MSDK_ASYNC_WRITE_MAX_BATCH];
+	int nIov = 0;
+
+	for (size_t i = 0; i < batch.size(); i++)
+	{
+		iov[nIov].iov_base = batch[i].Bitstream.Data + batch[i].Bitstream.DataOffset;
+		iov[nIov].iov_len = batch[i].Bitstream.DataLength;
+		nIov++;
+	}
+
+	struct iovec* pIov = iov;
+	while (nIov)
+	{
+		ssize_t nWritten = writev(m_fd, pIov, nIov);
+		if (nWritten < 0)
+		{
+			if (EINTR == errno)
+				continue;
+			return MFX_ERR_UNDEFINED_BEHAVIOR;
+		}
+
+		m_nWrites++;
+		m_nBytesWritten += (mfxU64)nWritten;
+
+		// skip what went out, a short write continues in the middle of a payload
+		while (nIov && (size_t)nWritten >= pIov->iov_len)
+		{
+			nWritten -= (ssize_t)pIov->iov_len;
+			pIov++;
+			nIov--;
+		}
+		if (nIov)
+		{
+			pIov->iov_base = (mfxU8*)pIov->iov_base + nWritten;
+			pIov->iov_len -= (size_t)nWritten;
+		}
+	}
+#endif
+
+	return sts;
+}
+
+mfxStatus CAsyncBitstreamWriter::WriteBuffer(const mfxU8* pData, mfxU32 nSize)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	while (nSize)
+	{
+		DWORD nWritten = 0;
+		if (!WriteFile(m_hFile, pData, nSize, &nWritten, NULL) || !nWritten)
+		{
+			return MFX_ERR_UNDEFINED_BEHAVIOR;
+		}
+
+		m_nWrites++;
+		m_nBytesWritten += nWritten;
+
+		pData += nWritten;
+		nSize -= nWritten;
+	}
+#else
+	while (nSize)
+	{
+		ssize_t nWritten = write(m_fd, pData, nSize);
+		if (nWritten < 0)
+		{
+			if (EINTR == errno)
+				continue;
+			return MFX_ERR_UNDEFINED_BEHAVIOR;
+		}
+
+		m_nWrites++;
+		m_nBytesWritten += (mfxU64)nWritten;
+
+		pData += nWritten;
+		nSize -= (mfxU32)nWritten;
+	}
+#endif
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CAsyncBitstreamWriter::SyncFile()
+{
+	m_nLastSync = msdk_time_get_tick();
+	m_nSyncs++;
+
+#if defined(_WIN32) || defined(_WIN64)
+	if (!FlushFileBuffers(m_hFile))
+		return MFX_ERR_UNDEFINED_BEHAVIOR;
+#else
+	if (fdatasync(m_fd))
+		return MFX_ERR_UNDEFINED_BEHAVIOR;
+#endif
+
+	return MFX_ERR_NONE;
+}
+
+void CAsyncBitstreamWriter::PrintStatistics()
+{
+	if (!m_nFramesWritten)
+	{
+		return;
+	}
+
+	std::cout << "Async writer: " << m_nFramesWritten << " frames, "
+		<< std::fixed << std::setprecision(2) << (mfxF64)m_nBytesWritten / (1024 * 1024) << " MB in "
+		<< m_nWrites << " writes, " << m_nSyncs << " syncs, "
+		<< m_dWriteTime * 1000 << " ms writing, " << m_dStallTime * 1000 << " ms stalled on a full queue" << std::endl;
+	std::cout.unsetf(std::ios::floatfield);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mfxstructures.h"
+
+#include "bitstream_pool.h"
+#include "stage_timings.h"
+#include "thread_defs.h"
+#include "utils.h"
+
+// how hard the async writer tries to get written data onto stable storage
+enum {
+	MSDK_DURABILITY_NONE = 0,     // leave it to the OS
+	MSDK_DURABILITY_PERIODIC = 1, // flush file data every MSDK_DURABILITY_SYNC_INTERVAL ms and on close
+	MSDK_DURABILITY_ON_CLOSE = 2  // flush file data once when the file is closed
+};
+
+#define MSDK_DURABILITY_SYNC_INTERVAL 1000
+
+// default number of payloads that may wait for the writer thread
+#define MSDK_ASYNC_WRITE_QUEUE_DEPTH 120
+
+// Takes ownership of encoded payloads instead of writing them on the sync path.
+// The task gets an empty buffer from the bitstream pool in exchange. A background thread writes queued
+// payloads in batches with as few system calls as possible, then returns their buffers to the pool.
+// At most nMaxPending payloads are queued, beyond that WriteNextFrame blocks.
+class CAsyncBitstreamWriter : public CSmplBitstreamWriter
+{
+public:
+	CAsyncBitstreamWriter(CBitstreamPool* pBitstreamPool, mfxU16 nDurability, mfxU32 nMaxPending);
+	virtual ~CAsyncBitstreamWriter();
+
+	virtual mfxStatus Init(const std::string& strFileName);
+	virtual mfxStatus WriteNextFrame(mfxBitstream *pMfxBitstream, mfxU32 nFrameOrder);
+	// the latency of a frame ends once its payload is in the file, not when it is queued
+	virtual bool SetFrameLatency(CFrameLatency* pLatency, CStageTimings* pTimings);
+	virtual mfxStatus Flush();
+	virtual void Close();
+
+	virtual void PrintStatistics();
+
+protected:
+	struct sPayload
+	{
+		mfxBitstream Bitstream;
+		mfxU32 nFrameOrder;
+	};
+
+	static unsigned int MFX_STDCALL ThreadRoutine(void* pArg);
+	void WriteFrames();
+	mfxStatus WriteBatch(const std::vector<sPayload>& batch);
+	mfxStatus WriteBuffer(const mfxU8* pData, mfxU32 nSize);
+	mfxStatus SyncFile();
+
+	CBitstreamPool* m_pBitstreamPool;
+	mfxU16 m_nDurability;
+	mfxU32 m_nMaxPending;
+	CFrameLatency* m_pLatency;
+	CStageTimings* m_pTimings;
+
+#if defined(_WIN32) || defined(_WIN64)
+	HANDLE m_hFile;
+	mfxU8* m_pStaging; // small payloads are coalesced here into one WriteFile
+#else
+	int m_fd;
+#endif
+
+	std::deque<sPayload> m_Queue;
+	mfxU32 m_nInFlight; // payloads taken off the queue by the writer thread but not yet written
+	mfxStatus m_WriteStatus;
+	volatile bool m_bStop;
+
+	MSDKMutex m_Mutex;
+	std::auto_ptr<MSDKEvent> m_pFrameQueued;
+	std::auto_ptr<MSDKEvent> m_pFrameWritten;
+	std::auto_ptr<MSDKThread> m_pThread;
+
+	// statistics, all but m_dStallTime are updated by the writer thread
+	mfxU32 m_nFramesWritten;
+	mfxU64 m_nBytesWritten;
+	mfxU32 m_nWrites;
+	mfxU32 m_nSyncs;
+	mfxF64 m_dWriteTime;
+	mfxF64 m_dStallTime;
+	msdk_tick m_nLastSync;
+
+private:
+	CAsyncBitstreamWriter(const CAsyncBitstreamWriter&);
+	void operator=(const CAsyncBitstreamWriter&);
+};
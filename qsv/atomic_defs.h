@@ -0,0 +1,27 @@
+#pragma once
+
+#include "mfxdefs.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <intrin.h>
+#endif
+
+// mfxFrameData::Locked is shared with the SDK, which updates it atomically as well
+
+inline mfxU16 msdk_atomic_inc16(volatile mfxU16* pVariable)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	return (mfxU16)_InterlockedIncrement16((volatile short*)pVariable);
+#else
+	return __sync_add_and_fetch(pVariable, 1);
+#endif
+}
+
+inline mfxU16 msdk_atomic_dec16(volatile mfxU16* pVariable)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	return (mfxU16)_InterlockedDecrement16((volatile short*)pVariable);
+#else
+	return __sync_sub_and_fetch(pVariable, 1);
+#endif
+}
@@ -0,0 +1,128 @@
+// Load throughput of CSmplYUVReader with stdio reads against the memory mapped input (-mmap), into NV12
+// surfaces whose pitch matches the frame width (NV12 input is mapped in place) or is padded (copied).
+//
+// reader_bench [file width height i420|nv12]; without arguments a 1080p I420 file is generated and removed.
+// Every configuration runs twice and the second, page cache warm, pass is reported.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+#define BENCH_GENERATED_FRAMES 60
+
+// keeps the reads of the loaded frames from being optimized away
+static volatile mfxU32 g_nSink;
+
+static double LoadAll(const std::string& file, mfxU32 nFourCC, bool bMap, mfxU16 w, mfxU16 h, mfxU16 nPitch, mfxU32* pnFrames)
+{
+	CSmplYUVReader reader;
+	std::list<std::string> inputs(1, file);
+	if (MFX_ERR_NONE != reader.Init(inputs, nFourCC, false, bMap))
+	{
+		return -1;
+	}
+
+	std::vector<mfxU8> planes((size_t)nPitch * h * 3 / 2);
+	mfxFrameSurface1 surface;
+	memset(&surface, 0, sizeof(surface));
+	surface.Info.FourCC = MFX_FOURCC_NV12;
+	surface.Info.Width = w;
+	surface.Info.Height = h;
+	surface.Info.CropW = w;
+	surface.Info.CropH = h;
+	surface.Data.Y = &planes[0];
+	surface.Data.UV = surface.Data.Y + (size_t)nPitch * h;
+	surface.Data.V = surface.Data.UV + 1;
+	surface.Data.Pitch = nPitch;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	mfxU32 nFrames = 0;
+	mfxU32 nSum = 0;
+	while (MFX_ERR_NONE == reader.LoadNextFrame(&surface))
+	{
+		// the encoder reads every frame, a mapped one is only paged in here
+		for (mfxU32 y = 0; y < h; y += 16)
+		{
+			nSum += surface.Data.Y[(size_t)y * nPitch];
+		}
+		nFrames++;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	reader.RestoreSurfaces();
+
+	g_nSink = nSum;
+	*pnFrames = nFrames;
+	return seconds;
+}
+
+int main(int argc, char** argv)
+{
+	std::string file = "reader_bench.yuv";
+	mfxU16 w = 1920, h = 1080;
+	mfxU32 nFourCC = MFX_FOURCC_I420;
+	bool bGenerated = argc < 5;
+
+	if (bGenerated)
+	{
+		FILE* f = fopen(file.c_str(), "wb");
+		if (!f)
+		{
+			std::fprintf(stderr, "cannot create %s\n", file.c_str());
+			return 1;
+		}
+		std::vector<mfxU8> frame((size_t)w * h * 3 / 2);
+		for (mfxU32 i = 0; i < BENCH_GENERATED_FRAMES; i++)
+		{
+			for (size_t j = 0; j < frame.size(); j++)
+			{
+				frame[j] = (mfxU8)(j * 7 + i);
+			}
+			fwrite(&frame[0], 1, frame.size(), f);
+		}
+		fclose(f);
+	}
+	else
+	{
+		file = argv[1];
+		w = (mfxU16)atoi(argv[2]);
+		h = (mfxU16)atoi(argv[3]);
+		nFourCC = strcmp(argv[4], "nv12") ? (mfxU32)MFX_FOURCC_I420 : (mfxU32)MFX_FOURCC_NV12;
+	}
+
+	const mfxU16 pitches[] = { w, (mfxU16)(MSDK_ALIGN32(w) + 64) };
+
+	std::printf("%s %ux%u %s\n", file.c_str(), w, h, MFX_FOURCC_NV12 == nFourCC ? "NV12" : "I420");
+	for (int p = 0; p < 2; p++)
+	{
+		for (int m = 0; m < 2; m++)
+		{
+			mfxU32 nFrames = 0;
+			double seconds = 0;
+			for (int pass = 0; pass < 2; pass++)
+			{
+				seconds = LoadAll(file, nFourCC, 1 == m, w, h, pitches[p], &nFrames);
+			}
+			if (seconds < 0 || !nFrames)
+			{
+				std::fprintf(stderr, "cannot read %s\n", file.c_str());
+				return 1;
+			}
+
+			double megabytes = (double)nFrames * w * h * 3 / 2 / (1024 * 1024);
+			std::printf("  pitch %5u %-5s %8.3f ms/frame %9.1f MB/s\n", pitches[p], m ? "mmap" : "stdio", seconds * 1000 / nFrames,
+				megabytes / seconds);
+		}
+	}
+
+	if (bGenerated)
+	{
+		remove(file.c_str());
+	}
+
+	return 0;
+}
@@ -0,0 +1,111 @@
+// Throughput of CFrameScaler for the ladder rungs it is used for, 4K to 1080p, 1080p to 540p (both 2:1, the box
+// path) and 1080p to 720p, with either filter and with the C against the AVX2 kernels.
+//
+// scaler_bench [threads]; threads includes the calling thread, the default of 1 measures the kernels alone and 0
+// uses every CPU as the pipeline does by default.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "scaler.h"
+#include "utils.h"
+
+// every configuration runs for at least this long after a warm-up of a few frames
+#define BENCH_SECONDS 1.0
+#define BENCH_WARM_UP_FRAMES 5
+
+struct sBenchFrame
+{
+	std::vector<mfxU8> Buffer;
+	mfxFrameSurface1 Surface;
+};
+
+static void InitFrame(sBenchFrame* pFrame, mfxU16 w, mfxU16 h)
+{
+	mfxU32 nPitch = MSDK_ALIGN32(w);
+	pFrame->Buffer.resize((size_t)nPitch * (h + (h + 1) / 2));
+	for (size_t i = 0; i < pFrame->Buffer.size(); i++)
+	{
+		pFrame->Buffer[i] = (mfxU8)rand();
+	}
+
+	mfxFrameSurface1& s = pFrame->Surface;
+	memset(&s, 0, sizeof(s));
+	s.Info.FourCC = MFX_FOURCC_NV12;
+	s.Info.Width = w;
+	s.Info.Height = h;
+	s.Info.CropW = w;
+	s.Info.CropH = h;
+	s.Data.Y = &pFrame->Buffer[0];
+	s.Data.UV = s.Data.Y + (size_t)nPitch * h;
+	s.Data.PitchLow = (mfxU16)nPitch;
+}
+
+int main(int argc, char** argv)
+{
+	mfxU32 nThreads = argc > 1 ? (mfxU32)atoi(argv[1]) : 1;
+	const mfxU16 sizes[][4] = { { 3840, 2160, 1920, 1080 }, { 1920, 1080, 960, 540 }, { 1920, 1080, 1280, 720 } };
+
+	bool bAvx2 = false;
+#if defined(MSDK_X86_SIMD)
+	bAvx2 = CpuSupportsAVX2();
+#endif
+	if (!bAvx2)
+	{
+		std::printf("the CPU has no AVX2, CFrameScaler runs the C kernels in both columns\n");
+	}
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		sBenchFrame src, dst;
+		InitFrame(&src, sizes[i][0], sizes[i][1]);
+		InitFrame(&dst, sizes[i][2], sizes[i][3]);
+
+		for (mfxU16 nFilter = MSDK_SCALE_BILINEAR; nFilter <= MSDK_SCALE_AREA; nFilter++)
+		{
+			double msPerFrame[2] = { 0, 0 };
+			mfxU32 nUsedThreads = 0;
+
+			for (int simd = 0; simd < 2; simd++)
+			{
+				CFrameScaler scaler;
+				if (MFX_ERR_NONE != scaler.Init(nFilter, nThreads, 1 == simd))
+				{
+					std::fprintf(stderr, "CFrameScaler::Init failed\n");
+					return 1;
+				}
+				nUsedThreads = scaler.GetThreadCount();
+
+				for (int j = 0; j < BENCH_WARM_UP_FRAMES; j++)
+				{
+					scaler.Scale(&src.Surface, &dst.Surface);
+				}
+
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				mfxU32 nFrames = 0;
+				double seconds = 0;
+				do
+				{
+					if (MFX_ERR_NONE != scaler.Scale(&src.Surface, &dst.Surface))
+					{
+						std::fprintf(stderr, "CFrameScaler::Scale failed\n");
+						return 1;
+					}
+					nFrames++;
+					seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				} while (seconds < BENCH_SECONDS);
+
+				msPerFrame[simd] = seconds * 1000 / nFrames;
+			}
+
+			std::printf("%4ux%-4u -> %4ux%-4u %-8s %u threads: C %7.2f ms/frame, AVX2 %7.2f ms/frame (%6.1f fps), %4.1fx\n",
+				sizes[i][0], sizes[i][1], sizes[i][2], sizes[i][3], MSDK_SCALE_AREA == nFilter ? "area" : "bilinear",
+				nUsedThreads, msPerFrame[0], msPerFrame[1], 1000 / msPerFrame[1], msPerFrame[0] / msPerFrame[1]);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,139 @@
+// Aggregate throughput and CPU load of 1 to 32 streams encoded in one process, each on its own session against
+// all sessions joined to that of the first stream (what qsv -jobs file -scaling -join compares for a job file).
+// Every stream encodes the same generated 320x240 clip with the completion thread; the mock encoder is used
+// unless -hw is given, with a fixed time per frame so that the runs measure the host side only. Independent mock
+// sessions each complete their frames on a thread of their own, joined ones on the scheduler thread of the first.
+//
+// session_bench [-hw] [max streams] [mock latency us]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "stream_runner.h"
+
+#define BENCH_WIDTH 320
+#define BENCH_HEIGHT 240
+#define BENCH_FRAMES 100
+#define BENCH_BITRATE 2000
+#define BENCH_DEFAULT_STREAMS 32
+#define BENCH_DEFAULT_LATENCY 2000
+
+struct sRunResult
+{
+	mfxF64 dFps;
+	mfxF64 dCpuLoad;
+};
+
+static bool GenerateInput(const std::string& file)
+{
+	FILE* f = fopen(file.c_str(), "wb");
+	if (!f)
+	{
+		return false;
+	}
+
+	std::vector<mfxU8> frame(BENCH_WIDTH * BENCH_HEIGHT * 3 / 2);
+	for (mfxU32 i = 0; i < BENCH_FRAMES; i++)
+	{
+		for (size_t j = 0; j < frame.size(); j++)
+		{
+			frame[j] = (mfxU8)(j * 3 + i);
+		}
+		fwrite(&frame[0], 1, frame.size(), f);
+	}
+
+	return 0 == fclose(f);
+}
+
+static mfxStatus RunStreams(const std::vector<sInputParams>& streams, bool bJoin, sRunResult* pResult)
+{
+	CStreamRunner runner;
+
+	mfxStatus sts = runner.Init(streams, false, "", bJoin);
+	MSDK_CHECK_STATUS(sts, "runner.Init failed");
+
+	sts = runner.Run();
+	MSDK_CHECK_STATUS(sts, "runner.Run failed");
+
+	mfxF64 dTime = MSDK_MAX(runner.GetElapsedTime(), 1e-9);
+	pResult->dFps = runner.GetFramesEncoded() / dTime;
+	pResult->dCpuLoad = 100 * runner.GetCpuTime() / dTime;
+
+	runner.Close();
+	return MFX_ERR_NONE;
+}
+
+int main(int argc, char** argv)
+{
+	bool bHardware = argc > 1 && 0 == strcmp(argv[1], "-hw");
+	int nArg = bHardware ? 2 : 1;
+	mfxU32 nMaxStreams = argc > nArg ? (mfxU32)atoi(argv[nArg]) : BENCH_DEFAULT_STREAMS;
+	mfxU32 nLatency = argc > nArg + 1 ? (mfxU32)atoi(argv[nArg + 1]) : BENCH_DEFAULT_LATENCY;
+
+	std::string input = "session_bench.yuv";
+	if (!GenerateInput(input))
+	{
+		std::fprintf(stderr, "cannot create %s\n", input.c_str());
+		return 1;
+	}
+
+	std::vector<sInputParams> streams(nMaxStreams);
+	for (mfxU32 i = 0; i < nMaxStreams; i++)
+	{
+		sInputParams& params = streams[i];
+		params = sInputParams();
+		params.nWidth = BENCH_WIDTH;
+		params.nHeight = BENCH_HEIGHT;
+		params.nBitRate = BENCH_BITRATE;
+		params.dFrameRate = 30;
+		params.FileInputFourCC = MFX_FOURCC_I420;
+		params.InputFiles.push_back(input);
+		params.dstFileBuff = "session_bench_" + std::to_string(i) + ".h264";
+		params.bCompletionThread = true;
+		params.bUseMockEncoder = !bHardware;
+		params.MockParams.nLatency = nLatency;
+	}
+
+	std::vector<mfxU32> counts;
+	for (mfxU32 n = 1; n < nMaxStreams; n *= 2)
+	{
+		counts.push_back(n);
+	}
+	counts.push_back(nMaxStreams);
+
+	std::vector<sRunResult> independent(counts.size()), joined(counts.size());
+	int nResult = 0;
+	for (size_t i = 0; i < counts.size() && !nResult; i++)
+	{
+		std::vector<sInputParams> run(streams.begin(), streams.begin() + counts[i]);
+		if (MFX_ERR_NONE != RunStreams(run, false, &independent[i]) || MFX_ERR_NONE != RunStreams(run, true, &joined[i]))
+		{
+			std::fprintf(stderr, "encoding %u streams failed\n", counts[i]);
+			nResult = 1;
+		}
+	}
+
+	if (!nResult)
+	{
+		std::printf("%s, %ux%u, %u frames per stream\n", bHardware ? "hardware" : "mock encoder", BENCH_WIDTH, BENCH_HEIGHT,
+			BENCH_FRAMES);
+		std::printf(" streams  independent fps  CPU %%  joined fps  CPU %%  joined/independent fps\n");
+		for (size_t i = 0; i < counts.size(); i++)
+		{
+			std::printf("%8u %16.1f %6.1f %11.1f %6.1f %23.2f\n", counts[i], independent[i].dFps, independent[i].dCpuLoad,
+				joined[i].dFps, joined[i].dCpuLoad, independent[i].dFps > 0 ? joined[i].dFps / independent[i].dFps : 0);
+		}
+	}
+
+	remove(input.c_str());
+	for (mfxU32 i = 0; i < nMaxStreams; i++)
+	{
+		remove(streams[i].dstFileBuff.c_str());
+	}
+
+	return nResult;
+}
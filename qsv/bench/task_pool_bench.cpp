@@ -0,0 +1,170 @@
+// Acquire/release cost of CEncTaskPool at pool sizes 4 to 64: GetFreeTask + SubmitTask on the encoding
+// side and the completion of the oldest task, against an encoder whose sync points are always done. A
+// completion includes the stage clock reads and the bitstream buffer recycling of the real pool.
+// For reference it also runs the bare index logic of the pool before the ring, a scan for a null sync
+// point in GetFreeTask and an O(n) search for the next task in flight on completion; its cost grows with
+// the pool size while that of the ring does not.
+//
+// task_pool_bench [tasks per pool size]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "pipeline_encode.h"
+
+#define BENCH_DEFAULT_TASKS 5000000
+
+// completes every frame at once, so that only the bookkeeping of the pool is measured
+class CNullEncoderBackend : public CEncoderBackend
+{
+public:
+	virtual mfxStatus InitSession(mfxInitParam) { return MFX_ERR_NONE; }
+	virtual mfxStatus QueryIMPL(mfxIMPL* pImpl) { *pImpl = MFX_IMPL_SOFTWARE; return MFX_ERR_NONE; }
+	virtual mfxStatus QueryVersion(mfxVersion* pVersion) { pVersion->Version = 0; return MFX_ERR_NONE; }
+	virtual mfxStatus SyncOperation(mfxSyncPoint, mfxU32) { return MFX_ERR_NONE; }
+	virtual mfxStatus JoinSession(CEncoderBackend*) { return MFX_ERR_UNSUPPORTED; }
+	virtual mfxStatus DisjoinSession() { return MFX_ERR_NONE; }
+	virtual void CloseSession() {}
+
+	virtual mfxStatus Query(mfxVideoParam*, mfxVideoParam*) { return MFX_ERR_NONE; }
+	virtual mfxStatus QueryIOSurf(mfxVideoParam*, mfxFrameAllocRequest*) { return MFX_ERR_NONE; }
+	virtual mfxStatus Init(mfxVideoParam*) { return MFX_ERR_NONE; }
+	virtual mfxStatus Close() { return MFX_ERR_NONE; }
+	virtual mfxStatus GetVideoParam(mfxVideoParam*) { return MFX_ERR_NONE; }
+	virtual mfxStatus EncodeFrameAsync(mfxEncodeCtrl*, mfxFrameSurface1*, mfxBitstream*, mfxSyncPoint*) { return MFX_ERR_NONE; }
+};
+
+// the index logic of the pool before the ring
+class CScanTaskPool
+{
+public:
+	CScanTaskPool(mfxU32 nPoolSize) : m_SyncPoints(nPoolSize, (mfxSyncPoint)NULL), m_nStart(0) {}
+
+	mfxSyncPoint* GetFreeTask()
+	{
+		mfxU32 nPoolSize = (mfxU32)m_SyncPoints.size();
+		for (mfxU32 off = 0; off < nPoolSize; off++)
+		{
+			if (!m_SyncPoints[(m_nStart + off) % nPoolSize])
+			{
+				return &m_SyncPoints[(m_nStart + off) % nPoolSize];
+			}
+		}
+		return NULL;
+	}
+
+	void SynchronizeFirstTask()
+	{
+		mfxU32 nPoolSize = (mfxU32)m_SyncPoints.size();
+		m_SyncPoints[m_nStart] = NULL;
+		for (mfxU32 i = 0; i < nPoolSize; i++)
+		{
+			m_nStart = (m_nStart + 1) % nPoolSize;
+			if (m_SyncPoints[m_nStart])
+			{
+				break;
+			}
+		}
+	}
+
+private:
+	std::vector<mfxSyncPoint> m_SyncPoints;
+	mfxU32 m_nStart;
+};
+
+static double ElapsedNs(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double RunScan(mfxU32 nPoolSize, long nTasks)
+{
+	static int dummy;
+	CScanTaskPool pool(nPoolSize);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (long i = 0; i < nTasks; i++)
+	{
+		mfxSyncPoint* pTask = pool.GetFreeTask();
+		if (!pTask)
+		{
+			pool.SynchronizeFirstTask();
+			pTask = pool.GetFreeTask();
+		}
+		*pTask = (mfxSyncPoint)&dummy;
+	}
+	return ElapsedNs(start) / nTasks;
+}
+
+// -1 if the pool fails
+static double RunRing(mfxU32 nPoolSize, long nTasks, bool bCompletionThread)
+{
+	static int dummy;
+	CNullEncoderBackend encoder;
+	CBitstreamPool bitstreamPool;
+	CEncTaskPool pool;
+
+	if (MFX_ERR_NONE != bitstreamPool.Init(4096) ||
+		MFX_ERR_NONE != pool.Init(&encoder, NULL, nPoolSize, &bitstreamPool, NULL, bCompletionThread))
+	{
+		return -1;
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (long i = 0; i < nTasks; i++)
+	{
+		sTask* pTask = NULL;
+		mfxStatus sts = pool.GetFreeTask(&pTask);
+		if (MFX_ERR_NOT_FOUND == sts)
+		{
+			sts = pool.SynchronizeFirstTask();
+			// the completion thread may have emptied the pool meanwhile
+			MSDK_IGNORE_MFX_STS(sts, MFX_ERR_NOT_FOUND);
+			if (MFX_ERR_NONE == sts)
+			{
+				sts = pool.GetFreeTask(&pTask);
+			}
+		}
+		if (MFX_ERR_NONE != sts)
+		{
+			return -1;
+		}
+
+		pTask->EncSyncP = (mfxSyncPoint)&dummy;
+		if (MFX_ERR_NONE != pool.SubmitTask(pTask))
+		{
+			return -1;
+		}
+	}
+	while (MFX_ERR_NONE == pool.SynchronizeFirstTask());
+	double ns = ElapsedNs(start) / nTasks;
+
+	pool.Close();
+	bitstreamPool.Close();
+	return ns;
+}
+
+int main(int argc, char** argv)
+{
+	long nTasks = argc > 1 ? atol(argv[1]) : BENCH_DEFAULT_TASKS;
+	const mfxU32 sizes[] = { 4, 8, 16, 32, 64 };
+
+	std::printf("%ld tasks per pool size, ns per task\n", nTasks);
+	std::printf("  pool   scan index logic   CEncTaskPool   CEncTaskPool + completion thread\n");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		double scan = RunScan(sizes[i], nTasks);
+		double ring = RunRing(sizes[i], nTasks, false);
+		double threaded = RunRing(sizes[i], nTasks, true);
+		if (ring < 0 || threaded < 0)
+		{
+			std::fprintf(stderr, "CEncTaskPool failed at pool size %u\n", sizes[i]);
+			return 1;
+		}
+		std::printf("  %4u %18.1f %14.1f %34.1f\n", sizes[i], scan, ring, threaded);
+	}
+
+	return 0;
+}
@@ -0,0 +1,233 @@
+// Contention microbenchmark of the futex based MSDKMutex / MSDKEvent of thread_linux.cpp against the same
+// operations on a pthread mutex and condition variable, the path they replaced.
+
+#include <chrono>
+#include <cstdio>
+
+#include "thread_defs.h"
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <pthread.h>
+#include <time.h>
+#endif
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double ElapsedNs(bench_clock::time_point start)
+{
+	return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+// pthread_cond counterparts with the MSDK* interface the benchmarks use
+class CCondMutex
+{
+public:
+	CCondMutex() { pthread_mutex_init(&m_mutex, NULL); }
+	~CCondMutex() { pthread_mutex_destroy(&m_mutex); }
+
+	mfxStatus Lock() { pthread_mutex_lock(&m_mutex); return MFX_ERR_NONE; }
+	mfxStatus Unlock() { pthread_mutex_unlock(&m_mutex); return MFX_ERR_NONE; }
+
+private:
+	pthread_mutex_t m_mutex;
+};
+
+class CCondEvent
+{
+public:
+	CCondEvent(mfxStatus& sts, bool manual, bool state) :
+		m_manual(manual),
+		m_state(state)
+	{
+		pthread_mutex_init(&m_mutex, NULL);
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&m_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		sts = MFX_ERR_NONE;
+	}
+	~CCondEvent()
+	{
+		pthread_cond_destroy(&m_cond);
+		pthread_mutex_destroy(&m_mutex);
+	}
+
+	mfxStatus Signal()
+	{
+		pthread_mutex_lock(&m_mutex);
+		m_state = true;
+		if (m_manual) pthread_cond_broadcast(&m_cond);
+		else pthread_cond_signal(&m_cond);
+		pthread_mutex_unlock(&m_mutex);
+		return MFX_ERR_NONE;
+	}
+	mfxStatus Wait()
+	{
+		pthread_mutex_lock(&m_mutex);
+		while (!m_state) pthread_cond_wait(&m_cond, &m_mutex);
+		if (!m_manual) m_state = false;
+		pthread_mutex_unlock(&m_mutex);
+		return MFX_ERR_NONE;
+	}
+	mfxStatus TimedWait(mfxU32 msec)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += msec / 1000;
+		deadline.tv_nsec += (msec % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock(&m_mutex);
+		int res = 0;
+		while (!m_state && ETIMEDOUT != res) res = pthread_cond_timedwait(&m_cond, &m_mutex, &deadline);
+		mfxStatus sts = m_state ? MFX_ERR_NONE : MFX_TASK_WORKING;
+		if (m_state && !m_manual) m_state = false;
+		pthread_mutex_unlock(&m_mutex);
+		return sts;
+	}
+
+private:
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_cond;
+	bool m_manual;
+	bool m_state;
+};
+
+#endif
+
+#define BENCH_UNCONTENDED_OPS 5000000
+#define BENCH_PING_PONG_ROUNDS 100000
+#define BENCH_CONTENDED_THREADS 4
+#define BENCH_CONTENDED_OPS 200000
+#define BENCH_TIMED_WAITS 200
+
+template <class TMutex, class TEvent>
+struct sBench
+{
+	static TMutex* pMutex;
+	static TEvent* pPing;
+	static TEvent* pPong;
+	static volatile long nCounter;
+
+	static unsigned int MFX_STDCALL Echo(void*)
+	{
+		for (int i = 0; i < BENCH_PING_PONG_ROUNDS; i++)
+		{
+			pPing->Wait();
+			pPong->Signal();
+		}
+		return 0;
+	}
+
+	static unsigned int MFX_STDCALL Hammer(void*)
+	{
+		for (int i = 0; i < BENCH_CONTENDED_OPS; i++)
+		{
+			pMutex->Lock();
+			nCounter++;
+			pMutex->Unlock();
+		}
+		return 0;
+	}
+
+	static void Run(const char* name)
+	{
+		mfxStatus sts = MFX_ERR_NONE;
+		TMutex mutex;
+		pMutex = &mutex;
+
+		std::printf("%s\n", name);
+
+		bench_clock::time_point start = bench_clock::now();
+		for (int i = 0; i < BENCH_UNCONTENDED_OPS; i++)
+		{
+			mutex.Lock();
+			nCounter++;
+			mutex.Unlock();
+		}
+		std::printf("  uncontended Lock/Unlock     %8.1f ns\n", ElapsedNs(start) / BENCH_UNCONTENDED_OPS);
+
+		{
+			TEvent event(sts, false, false);
+			start = bench_clock::now();
+			for (int i = 0; i < BENCH_UNCONTENDED_OPS; i++)
+			{
+				event.Signal();
+				event.Wait();
+			}
+			std::printf("  uncontended Signal/Wait     %8.1f ns\n", ElapsedNs(start) / BENCH_UNCONTENDED_OPS);
+		}
+
+		{
+			TEvent ping(sts, false, false), pong(sts, false, false);
+			pPing = &ping;
+			pPong = &pong;
+			MSDKThread echo(sts, Echo, NULL);
+			start = bench_clock::now();
+			for (int i = 0; i < BENCH_PING_PONG_ROUNDS; i++)
+			{
+				ping.Signal();
+				pong.Wait();
+			}
+			double ns = ElapsedNs(start);
+			echo.Wait();
+			std::printf("  event ping-pong round trip  %8.2f us\n", ns / BENCH_PING_PONG_ROUNDS / 1000);
+		}
+
+		{
+			MSDKThread* pThreads[BENCH_CONTENDED_THREADS];
+			start = bench_clock::now();
+			for (int i = 0; i < BENCH_CONTENDED_THREADS; i++) pThreads[i] = new MSDKThread(sts, Hammer, NULL);
+			for (int i = 0; i < BENCH_CONTENDED_THREADS; i++)
+			{
+				pThreads[i]->Wait();
+				delete pThreads[i];
+			}
+			std::printf("  %d threads on one mutex      %8.1f ns per op\n", BENCH_CONTENDED_THREADS,
+				ElapsedNs(start) / (BENCH_CONTENDED_THREADS * BENCH_CONTENDED_OPS));
+		}
+
+		{
+			TEvent event(sts, true, false);
+			int nTimedOut = 0;
+			start = bench_clock::now();
+			for (int i = 0; i < BENCH_TIMED_WAITS; i++)
+			{
+				nTimedOut += MFX_TASK_WORKING == event.TimedWait(1);
+			}
+			std::printf("  TimedWait(1) on timeout     %8.2f ms (%d/%d timed out)\n", ElapsedNs(start) / BENCH_TIMED_WAITS / 1000000,
+				nTimedOut, BENCH_TIMED_WAITS);
+		}
+	}
+};
+
+template <class TMutex, class TEvent> TMutex* sBench<TMutex, TEvent>::pMutex = NULL;
+template <class TMutex, class TEvent> TEvent* sBench<TMutex, TEvent>::pPing = NULL;
+template <class TMutex, class TEvent> TEvent* sBench<TMutex, TEvent>::pPong = NULL;
+template <class TMutex, class TEvent> volatile long sBench<TMutex, TEvent>::nCounter = 0;
+
+static unsigned int MFX_STDCALL Nop(void*)
+{
+	return 0;
+}
+
+int main()
+{
+	// glibc takes a single thread fast path in its mutexes until the first thread starts
+	mfxStatus sts = MFX_ERR_NONE;
+	MSDKThread warmUp(sts, Nop, NULL);
+	warmUp.Wait();
+
+	sBench<MSDKMutex, MSDKEvent>::Run("futex (thread_defs.h)");
+#if !defined(_WIN32) && !defined(_WIN64)
+	sBench<CCondMutex, CCondEvent>::Run("pthread mutex + cond");
+#endif
+	return 0;
+}
@@ -0,0 +1,229 @@
+#include "bitstream_pool.h"
+
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+
+CBitstreamPool::CBitstreamPool()
+{
+	m_nNominalSize = 0;
+	m_nAllocatedBytes = 0;
+	m_nPeakBytes = 0;
+	m_nSampledBytes = 0;
+	m_nSamples = 0;
+	m_nExtends = 0;
+	m_nShrinks = 0;
+}
+
+CBitstreamPool::~CBitstreamPool()
+{
+	Close();
+}
+
+mfxStatus CBitstreamPool::Init(mfxU32 nNominalSize)
+{
+	MSDK_CHECK_ERROR(nNominalSize, 0, MFX_ERR_UNDEFINED_BEHAVIOR);
+
+	AutomaticMutex lock(m_Mutex);
+
+	if (nNominalSize != m_nNominalSize)
+	{
+		ClearFreeList();
+		m_nNominalSize = nNominalSize;
+	}
+
+	return MFX_ERR_NONE;
+}
+
+void CBitstreamPool::Close()
+{
+	AutomaticMutex lock(m_Mutex);
+
+	ClearFreeList();
+
+	m_nNominalSize = 0;
+	m_nAllocatedBytes = 0;
+	m_nPeakBytes = 0;
+	m_nSampledBytes = 0;
+	m_nSamples = 0;
+	m_nExtends = 0;
+	m_nShrinks = 0;
+}
+
+// m_Mutex must be held
+mfxU8* CBitstreamPool::AllocBuffer(mfxU32 nSize)
+{
+	mfxU8* pData = new mfxU8[nSize];
+	if (pData)
+	{
+		m_nAllocatedBytes += nSize;
+		m_nPeakBytes = MSDK_MAX(m_nPeakBytes, m_nAllocatedBytes);
+	}
+	return pData;
+}
+
+// m_Mutex must be held
+void CBitstreamPool::FreeBuffer(mfxU8* pData, mfxU32 nSize)
+{
+	if (!pData)
+	{
+		return;
+	}
+
+	// nominal buffers are kept for the next task, anything else goes back to the heap
+	if (nSize == m_nNominalSize)
+	{
+		m_FreeList.push_back(pData);
+		return;
+	}
+
+	delete[] pData;
+	m_nAllocatedBytes -= nSize;
+}
+
+// m_Mutex must be held
+void CBitstreamPool::ClearFreeList()
+{
+	for (size_t i = 0; i < m_FreeList.size(); i++)
+	{
+		delete[] m_FreeList[i];
+		m_nAllocatedBytes -= m_nNominalSize;
+	}
+	m_FreeList.clear();
+}
+
+mfxStatus CBitstreamPool::Acquire(mfxBitstream* pBS)
+{
+	MSDK_CHECK_POINTER(pBS, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_ERROR(m_nNominalSize, 0, MFX_ERR_NOT_INITIALIZED);
+
+	Release(pBS);
+
+	AutomaticMutex lock(m_Mutex);
+
+	if (!m_FreeList.empty())
+	{
+		pBS->Data = m_FreeList.back();
+		m_FreeList.pop_back();
+	}
+	else
+	{
+		pBS->Data = AllocBuffer(m_nNominalSize);
+		MSDK_CHECK_POINTER(pBS->Data, MFX_ERR_MEMORY_ALLOC);
+	}
+
+	pBS->MaxLength = m_nNominalSize;
+	pBS->DataOffset = 0;
+	pBS->DataLength = 0;
+
+	return MFX_ERR_NONE;
+}
+
+void CBitstreamPool::Release(mfxBitstream* pBS)
+{
+	MSDK_CHECK_POINTER(pBS);
+
+	AutomaticMutex lock(m_Mutex);
+
+	FreeBuffer(pBS->Data, pBS->MaxLength);
+
+	pBS->Data = NULL;
+	pBS->MaxLength = 0;
+	pBS->DataOffset = 0;
+	pBS->DataLength = 0;
+}
+
+mfxStatus CBitstreamPool::Extend(mfxBitstream* pBS, mfxU32 nSize)
+{
+	MSDK_CHECK_POINTER(pBS, MFX_ERR_NULL_PTR);
+
+	AutomaticMutex lock(m_Mutex);
+
+	// grow geometrically so that a run of growing frames costs a logarithmic number of copies
+	mfxU32 nNewSize = MSDK_MAX(pBS->MaxLength, m_nNominalSize);
+	do
+	{
+		nNewSize *= 2;
+	} while (nNewSize < nSize);
+
+	mfxU8* pData = AllocBuffer(nNewSize);
+	MSDK_CHECK_POINTER(pData, MFX_ERR_MEMORY_ALLOC);
+
+	if (pBS->Data)
+	{
+		memcpy(pData, pBS->Data + pBS->DataOffset, pBS->DataLength);
+	}
+	FreeBuffer(pBS->Data, pBS->MaxLength);
+
+	pBS->Data = pData;
+	pBS->DataOffset = 0;
+	pBS->MaxLength = nNewSize;
+
+	m_nExtends++;
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CBitstreamPool::Recycle(mfxBitstream* pBS, mfxU32 nCodedSize, mfxU32* pnSmallFrames)
+{
+	MSDK_CHECK_POINTER(pBS, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(pnSmallFrames, MFX_ERR_NULL_PTR);
+
+	bool bShrink = false;
+	{
+		AutomaticMutex lock(m_Mutex);
+
+		m_nSampledBytes += m_nAllocatedBytes;
+		m_nSamples++;
+
+		if (pBS->MaxLength > m_nNominalSize)
+		{
+			if (nCodedSize > m_nNominalSize)
+			{
+				*pnSmallFrames = 0;
+			}
+			else if (++*pnSmallFrames >= MSDK_BITSTREAM_SHRINK_FRAMES)
+			{
+				bShrink = true;
+				m_nShrinks++;
+			}
+		}
+		else
+		{
+			// the buffer was swapped for a nominal one elsewhere, e.g. by an asynchronous writer
+			*pnSmallFrames = 0;
+		}
+	}
+
+	if (bShrink)
+	{
+		*pnSmallFrames = 0;
+		return Acquire(pBS);
+	}
+
+	return MFX_ERR_NONE;
+}
+
+void CBitstreamPool::GetAllocatedBytes(mfxU64* pnAllocated, mfxU64* pnPeak)
+{
+	AutomaticMutex lock(m_Mutex);
+
+	*pnAllocated = m_nAllocatedBytes;
+	*pnPeak = m_nPeakBytes;
+}
+
+void CBitstreamPool::PrintStatistics()
+{
+	AutomaticMutex lock(m_Mutex);
+
+	if (!m_nSamples)
+	{
+		return;
+	}
+
+	std::cout << "Bitstream pool: " << m_nNominalSize / 1024 << " KB nominal buffer, "
+		<< m_nExtends << " extends, " << m_nShrinks << " shrinks, "
+		<< std::fixed << std::setprecision(2) << (mfxF64)m_nPeakBytes / (1024 * 1024) << " MB peak, "
+		<< (mfxF64)m_nSampledBytes / m_nSamples / (1024 * 1024) << " MB average" << std::endl;
+	std::cout.unsetf(std::ios::floatfield);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+
+#include "mfxstructures.h"
+
+#include "thread_defs.h"
+#include "utils.h"
+
+// number of consecutive frames that fit into the nominal size before an enlarged buffer is given back
+#define MSDK_BITSTREAM_SHRINK_FRAMES 30
+
+// Shared pool of output bitstream buffers.
+// Buffers are sized from the encoder's coded picture buffer rather than the raw frame size. A buffer the
+// encoder overflows grows geometrically, and it is swapped back to a nominal one once frames fit again,
+// so a single spike does not pin memory for the rest of the run.
+class CBitstreamPool
+{
+public:
+	CBitstreamPool();
+	virtual ~CBitstreamPool();
+
+	// cached buffers are dropped when the nominal size changes, statistics are kept
+	virtual mfxStatus Init(mfxU32 nNominalSize);
+	virtual void Close();
+
+	// gives pBS an empty buffer of the nominal size
+	virtual mfxStatus Acquire(mfxBitstream* pBS);
+	// takes the buffer of pBS back
+	virtual void Release(mfxBitstream* pBS);
+	// grows the buffer of pBS to at least nSize bytes, keeping its data
+	virtual mfxStatus Extend(mfxBitstream* pBS, mfxU32 nSize);
+	// to be called once the data in pBS is consumed; nCodedSize is the size of the frame the encoder wrote
+	// into it before the writer took it, *pnSmallFrames counts frames since the last overflow
+	virtual mfxStatus Recycle(mfxBitstream* pBS, mfxU32 nCodedSize, mfxU32* pnSmallFrames);
+
+	mfxU32 GetNominalSize() const { return m_nNominalSize; }
+	// currently allocated and peak bytes, cached buffers included
+	virtual void GetAllocatedBytes(mfxU64* pnAllocated, mfxU64* pnPeak);
+
+	virtual void PrintStatistics();
+
+protected:
+	mfxU8* AllocBuffer(mfxU32 nSize);
+	void FreeBuffer(mfxU8* pData, mfxU32 nSize);
+	void ClearFreeList();
+
+	mfxU32 m_nNominalSize;
+	std::vector<mfxU8*> m_FreeList; // buffers of the nominal size nobody holds
+
+	MSDKMutex m_Mutex;
+
+	// statistics
+	mfxU64 m_nAllocatedBytes; // currently allocated, including cached buffers
+	mfxU64 m_nPeakBytes;
+	mfxU64 m_nSampledBytes;   // sum of m_nAllocatedBytes over all recycled frames
+	mfxU32 m_nSamples;
+	mfxU32 m_nExtends;
+	mfxU32 m_nShrinks;
+
+private:
+	CBitstreamPool(const CBitstreamPool&);
+	void operator=(const CBitstreamPool&);
+};
@@ -0,0 +1,425 @@
+#include "chunked_encoder.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+// bytes copied at a time while joining pieces
+#define MSDK_CHUNK_COPY_SIZE (4 * 1024 * 1024)
+
+// filler data NAL unit: start code, header, 0xFF bytes and the trailing bits
+static const mfxU8 FILLER_START_CODE[] = { 0, 0, 0, 1 };
+#define MSDK_CHUNK_FILLER_HEADER 0x0C
+#define MSDK_CHUNK_FILLER_BYTE 0xFF
+#define MSDK_CHUNK_FILLER_TRAILING_BITS 0x80
+#define MSDK_CHUNK_MIN_FILLER_SIZE (sizeof(FILLER_START_CODE) + 2)
+
+static std::string GetPieceName(const std::string& dstFile, size_t nChunk)
+{
+	std::ostringstream name;
+	name << dstFile << ".part" << nChunk;
+	return name.str();
+}
+
+// initial delay of the pieces after the first
+static mfxU16 GetJointDelayInKB(mfxU16 nKbps)
+{
+	return (mfxU16)MSDK_MAX(GetStrictHrdBufferSizeInKB(nKbps) / MSDK_CHUNK_JOINT_DELAY_SHARE, 1);
+}
+
+// nOutput 0 is the main output, the others are rungs
+static void SetInitialDelay(sInputParams* pChunk, size_t nOutput, mfxU16 nInitialDelayInKB)
+{
+	if (nOutput)
+	{
+		pChunk->Ladder[nOutput - 1].nInitialDelayInKB = nInitialDelayInKB;
+	}
+	else
+	{
+		pChunk->nInitialDelayInKB = nInitialDelayInKB;
+	}
+}
+
+static mfxF64 GetBitsPerFrame(const sHrdTrace& trace)
+{
+	return trace.dFrameRate > 0 ? trace.nBitRate / trace.dFrameRate : 0;
+}
+
+// removes the frames of trace from a CBR coded picture buffer holding *pdFullness bits before the first of them, and
+// leaves the fullness before the frame after them; false with the frame in *pnFrame if the buffer underflows or overflows
+static bool PlayFrames(const sHrdTrace& trace, mfxF64* pdFullness, size_t* pnFrame)
+{
+	// below one bit is rounding
+	const mfxF64 dTolerance = 1;
+	mfxF64 dBitsPerFrame = GetBitsPerFrame(trace);
+
+	for (size_t i = 0; i < trace.FrameSizes.size(); i++)
+	{
+		mfxF64 dBits = trace.FrameSizes[i] * 8.0;
+		if (*pdFullness > trace.nBufferSize + dTolerance || dBits > *pdFullness + dTolerance)
+		{
+			*pnFrame = i;
+			return false;
+		}
+
+		*pdFullness += dBitsPerFrame - dBits;
+	}
+
+	return true;
+}
+
+static bool WriteFiller(FILE* f, mfxU64 nSize, std::vector<mfxU8>* pBuffer)
+{
+	if (nSize < MSDK_CHUNK_MIN_FILLER_SIZE)
+	{
+		return false;
+	}
+
+	std::vector<mfxU8>& buffer = *pBuffer;
+	memset(&buffer[0], MSDK_CHUNK_FILLER_BYTE, buffer.size());
+	memcpy(&buffer[0], FILLER_START_CODE, sizeof(FILLER_START_CODE));
+	buffer[sizeof(FILLER_START_CODE)] = MSDK_CHUNK_FILLER_HEADER;
+
+	// the 0xFF bytes need no emulation prevention
+	mfxU64 nLeft = nSize - 1;
+	while (nLeft)
+	{
+		size_t nWrite = (size_t)MSDK_MIN(nLeft, (mfxU64)buffer.size());
+		if (nWrite != fwrite(&buffer[0], 1, nWrite, f))
+		{
+			return false;
+		}
+		nLeft -= nWrite;
+
+		// the header is only at the start
+		memset(&buffer[0], MSDK_CHUNK_FILLER_BYTE, sizeof(FILLER_START_CODE) + 1);
+	}
+
+	return EOF != fputc(MSDK_CHUNK_FILLER_TRAILING_BITS, f);
+}
+
+CChunkedEncoder::CChunkedEncoder()
+{
+	m_bUseArenaAllocator = false;
+}
+
+CChunkedEncoder::~CChunkedEncoder()
+{
+	Close();
+}
+
+mfxStatus CChunkedEncoder::Init(const sInputParams& params)
+{
+	MSDK_CHECK_ERROR(params.nChunks, 0, MFX_ERR_UNDEFINED_BEHAVIOR);
+
+	Close();
+
+	// the range ends where the input ends, unless params ends it earlier
+	CSmplYUVReader reader;
+	mfxStatus sts = reader.Init(params.InputFiles, params.FileInputFourCC);
+	MSDK_CHECK_STATUS(sts, "reader.Init failed");
+
+	mfxU32 nInputFrames = reader.GetFrameCount(params.nWidth, params.nHeight);
+	reader.Close();
+
+	MSDK_CHECK_ERROR(nInputFrames > params.nFirstFrame, false, MFX_ERR_MORE_DATA);
+	mfxU32 nFrames = nInputFrames - params.nFirstFrame;
+	if (params.nFrameCount)
+	{
+		nFrames = MSDK_MIN(nFrames, params.nFrameCount);
+	}
+
+	mfxU16 nGopSize = params.nGopSize;
+	if (!nGopSize)
+	{
+		nGopSize = (mfxU16)MSDK_MAX(floor(params.dFrameRate * MSDK_CHUNK_GOP_DURATION + 0.5), 1);
+	}
+
+	// whole GOPs per range, so that each of them starts with an IDR frame
+	mfxU32 nChunkFrames = (nFrames + params.nChunks - 1) / params.nChunks;
+	nChunkFrames = (nChunkFrames + nGopSize - 1) / nGopSize * nGopSize;
+
+	m_Outputs.resize(1 + params.Ladder.size());
+	m_Outputs[0].dstFile = params.dstFileBuff;
+	for (size_t i = 0; i < params.Ladder.size(); i++)
+	{
+		m_Outputs[i + 1].dstFile = params.Ladder[i].dstFile;
+	}
+
+	for (mfxU32 nFirst = 0; nFirst < nFrames; nFirst += nChunkFrames)
+	{
+		sInputParams chunk = params;
+		chunk.nFirstFrame = params.nFirstFrame + nFirst;
+		chunk.nFrameCount = MSDK_MIN(nChunkFrames, nFrames - nFirst);
+		chunk.nGopSize = nGopSize;
+		chunk.bStrictHrd = true;
+		chunk.nChunks = 0;
+		if (nFirst)
+		{
+			chunk.nInitialDelayInKB = GetJointDelayInKB(chunk.nBitRate);
+			for (size_t i = 0; i < chunk.Ladder.size(); i++)
+			{
+				chunk.Ladder[i].nInitialDelayInKB = GetJointDelayInKB(chunk.Ladder[i].nBitRate);
+			}
+		}
+		// the runner reports on all chunks together
+		chunk.reportFile.clear();
+		chunk.traceFile.clear();
+
+		chunk.dstFileBuff = GetPieceName(params.dstFileBuff, m_Chunks.size());
+		m_Outputs[0].Pieces.push_back(chunk.dstFileBuff);
+		for (size_t i = 0; i < chunk.Ladder.size(); i++)
+		{
+			chunk.Ladder[i].dstFile = GetPieceName(params.Ladder[i].dstFile, m_Chunks.size());
+			m_Outputs[i + 1].Pieces.push_back(chunk.Ladder[i].dstFile);
+		}
+		for (size_t i = 0; i < m_Outputs.size(); i++)
+		{
+			m_Outputs[i].Padding.push_back(0);
+		}
+
+		std::cout << "Chunk " << m_Chunks.size() + 1 << ": frames " << chunk.nFirstFrame << " to "
+			<< chunk.nFirstFrame + chunk.nFrameCount - 1 << std::endl;
+		m_Chunks.push_back(chunk);
+	}
+
+	// every chunk in a session of its own, so that they spread over all engines of the device
+	m_pRunner.reset(new CStreamRunner());
+	MSDK_CHECK_POINTER(m_pRunner.get(), MFX_ERR_MEMORY_ALLOC);
+
+	m_bUseArenaAllocator = params.bUseArenaAllocator;
+	sts = m_pRunner->Init(m_Chunks, m_bUseArenaAllocator, params.reportFile);
+	MSDK_CHECK_STATUS(sts, "m_pRunner->Init failed");
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CChunkedEncoder::Run()
+{
+	MSDK_CHECK_POINTER(m_pRunner.get(), MFX_ERR_NOT_INITIALIZED);
+
+	mfxStatus sts = m_pRunner->Run();
+	MSDK_CHECK_STATUS(sts, "m_pRunner->Run failed");
+
+	m_Traces.resize(m_Chunks.size());
+	for (size_t i = 0; i < m_Chunks.size(); i++)
+	{
+		m_Traces[i] = m_pRunner->GetHrdTraces((mfxU32)i);
+	}
+
+	m_pRunner->Close();
+
+	sts = MatchBuffers();
+	MSDK_CHECK_STATUS(sts, "MatchBuffers failed");
+
+	for (size_t i = 0; i < m_Outputs.size(); i++)
+	{
+		sts = JoinPieces(&m_Outputs[i]);
+		MSDK_CHECK_STATUS(sts, "JoinPieces failed");
+	}
+
+	return MFX_ERR_NONE;
+}
+
+void CChunkedEncoder::Close()
+{
+	if (m_pRunner.get())
+	{
+		m_pRunner->Close();
+		m_pRunner.reset();
+	}
+
+	for (size_t i = 0; i < m_Outputs.size(); i++)
+	{
+		RemovePieces(&m_Outputs[i]);
+	}
+	m_Outputs.clear();
+	m_Chunks.clear();
+	m_Traces.clear();
+}
+
+mfxStatus CChunkedEncoder::EncodeChunk(size_t nChunk)
+{
+	std::vector<sInputParams> chunks(1, m_Chunks[nChunk]);
+
+	CStreamRunner runner;
+	mfxStatus sts = runner.Init(chunks, m_bUseArenaAllocator, "");
+	MSDK_CHECK_STATUS(sts, "runner.Init failed");
+
+	sts = runner.Run();
+	MSDK_CHECK_STATUS(sts, "runner.Run failed");
+
+	m_Traces[nChunk] = runner.GetHrdTraces(0);
+	runner.Close();
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CChunkedEncoder::MatchBuffers()
+{
+	// of every output, bits in the coded picture buffer before the next frame is removed
+	std::vector<mfxF64> fullness(m_Outputs.size());
+
+	for (size_t i = 0; i < m_Chunks.size(); i++)
+	{
+		// every output of a chunk was encoded with strict HRD
+		if (m_Traces[i].size() != m_Outputs.size())
+		{
+			return MFX_ERR_UNDEFINED_BEHAVIOR;
+		}
+
+		if (!i)
+		{
+			for (size_t j = 0; j < m_Outputs.size(); j++)
+			{
+				fullness[j] = (mfxF64)m_Traces[i][j].nInitialDelay;
+			}
+		}
+		else
+		{
+			// filler data can only take bits out of the buffer, a piece that finds less than it was encoded for has to
+			// be encoded with what it finds
+			bool bEncodeAgain = false;
+			for (size_t j = 0; j < m_Outputs.size(); j++)
+			{
+				if (fullness[j] < m_Traces[i][j].nInitialDelay)
+				{
+					mfxU16 nInitialDelayInKB = (mfxU16)MSDK_MIN(floor(fullness[j] / 8000), 0xFFFF);
+					if (!nInitialDelayInKB)
+					{
+						std::cout << "ERROR: the coded picture buffer of " << m_Outputs[j].dstFile << " is empty at chunk " << i + 1
+							<< std::endl;
+						return MFX_ERR_UNDEFINED_BEHAVIOR;
+					}
+
+					SetInitialDelay(&m_Chunks[i], j, nInitialDelayInKB);
+					bEncodeAgain = true;
+				}
+			}
+
+			if (bEncodeAgain)
+			{
+				std::cout << "Chunk " << i + 1 << ": the coded picture buffer holds less than the chunk was encoded for, encoding it again"
+					<< std::endl;
+
+				mfxStatus sts = EncodeChunk(i);
+				MSDK_CHECK_STATUS(sts, "EncodeChunk failed");
+				if (m_Traces[i].size() != m_Outputs.size())
+				{
+					return MFX_ERR_UNDEFINED_BEHAVIOR;
+				}
+			}
+
+			// the filler data goes with the last frame of the previous piece, it has to fit into the buffer as well
+			for (size_t j = 0; j < m_Outputs.size(); j++)
+			{
+				mfxF64 dExcess = fullness[j] - m_Traces[i][j].nInitialDelay;
+				mfxU64 nPadding = dExcess > 0 ? (mfxU64)(dExcess / 8) : 0;
+				if (nPadding < MSDK_CHUNK_MIN_FILLER_SIZE)
+				{
+					nPadding = 0;
+				}
+
+				m_Outputs[j].Padding[i - 1] = nPadding;
+				fullness[j] -= nPadding * 8.0;
+
+				if (dExcess < 0 || fullness[j] < GetBitsPerFrame(m_Traces[i - 1][j]))
+				{
+					std::cout << "ERROR: the coded picture buffer of " << m_Outputs[j].dstFile << " does not hold the initial delay of chunk "
+						<< i + 1 << std::endl;
+					return MFX_ERR_UNDEFINED_BEHAVIOR;
+				}
+			}
+		}
+
+		for (size_t j = 0; j < m_Outputs.size(); j++)
+		{
+			size_t nFrame = 0;
+			if (!PlayFrames(m_Traces[i][j], &fullness[j], &nFrame))
+			{
+				std::cout << "ERROR: the coded picture buffer of " << m_Outputs[j].dstFile << " underflows or overflows at frame "
+					<< nFrame << " of chunk " << i + 1 << std::endl;
+				return MFX_ERR_UNDEFINED_BEHAVIOR;
+			}
+		}
+	}
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CChunkedEncoder::JoinPieces(sOutput* pOutput)
+{
+	FILE* fDst = fopen(pOutput->dstFile.c_str(), "wb");
+	MSDK_CHECK_POINTER(fDst, MFX_ERR_NULL_PTR);
+
+	m_Buffer.resize(MSDK_CHUNK_COPY_SIZE);
+
+	mfxStatus sts = MFX_ERR_NONE;
+	mfxU64 nBytes = 0;
+	mfxU64 nFillerBytes = 0;
+
+	// Annex B needs no container, the pieces are concatenated as they are
+	for (size_t i = 0; i < pOutput->Pieces.size() && MFX_ERR_NONE == sts; i++)
+	{
+		FILE* fPiece = fopen(pOutput->Pieces[i].c_str(), "rb");
+		if (!fPiece)
+		{
+			sts = MFX_ERR_NULL_PTR;
+			break;
+		}
+
+		for (;;)
+		{
+			size_t nRead = fread(&m_Buffer[0], 1, m_Buffer.size(), fPiece);
+			if (nRead != fwrite(&m_Buffer[0], 1, nRead, fDst))
+			{
+				sts = MFX_ERR_UNDEFINED_BEHAVIOR;
+				break;
+			}
+			nBytes += nRead;
+
+			if (nRead < m_Buffer.size())
+			{
+				if (ferror(fPiece))
+				{
+					sts = MFX_ERR_UNDEFINED_BEHAVIOR;
+				}
+				break;
+			}
+		}
+
+		fclose(fPiece);
+
+		if (MFX_ERR_NONE == sts && pOutput->Padding[i])
+		{
+			if (!WriteFiller(fDst, pOutput->Padding[i], &m_Buffer))
+			{
+				sts = MFX_ERR_UNDEFINED_BEHAVIOR;
+			}
+			nFillerBytes += pOutput->Padding[i];
+		}
+	}
+
+	if (fclose(fDst) && MFX_ERR_NONE == sts)
+	{
+		sts = MFX_ERR_UNDEFINED_BEHAVIOR;
+	}
+	MSDK_CHECK_STATUS(sts, "joining " + pOutput->dstFile + " failed");
+
+	std::cout << "Joined " << pOutput->Pieces.size() << " pieces into " << pOutput->dstFile << ", " << nBytes + nFillerBytes << " bytes, "
+		<< nFillerBytes << " of them filler data at the joints" << std::endl;
+	RemovePieces(pOutput);
+
+	return MFX_ERR_NONE;
+}
+
+void CChunkedEncoder::RemovePieces(sOutput* pOutput)
+{
+	for (size_t i = 0; i < pOutput->Pieces.size(); i++)
+	{
+		remove(pOutput->Pieces[i].c_str());
+	}
+	pOutput->Pieces.clear();
+}
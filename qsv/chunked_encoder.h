@@ -0,0 +1,66 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "pipeline_encode.h"
+#include "stream_runner.h"
+
+// seconds from one IDR frame to the next when the stream does not set a GOP size
+#define MSDK_CHUNK_GOP_DURATION 2
+// the pieces after the first start with this part of the coded picture buffer full, so that the previous piece
+// rarely ends with less
+#define MSDK_CHUNK_JOINT_DELAY_SHARE 4
+
+// Encodes one long input with several sessions at once. The input is split into ranges of whole GOPs, every
+// range is encoded by a stream of a CStreamRunner into a piece file next to the output, and the pieces are
+// joined in order once all streams are done. Every piece starts with an IDR frame and a buffering period SEI,
+// so that the joined Annex B stream decodes like one encoded in a single session.
+// The rate control of a piece assumes that the coded picture buffer holds its initial delay at the first frame,
+// a decoder finds whatever the previous pieces left. The coded frame sizes are played through the buffer across
+// the joints: a previous piece that leaves more gets filler data at its end, a piece that finds less is encoded
+// again with that as its initial delay. A buffer that still underflows or overflows fails the run.
+class CChunkedEncoder
+{
+public:
+	CChunkedEncoder();
+	virtual ~CChunkedEncoder();
+
+	// splits the frames params selects into params.nChunks ranges, fewer if the input is short
+	virtual mfxStatus Init(const sInputParams& params);
+	// encodes all ranges, matches the coded picture buffer at every joint and joins the pieces into the outputs
+	// of params
+	virtual mfxStatus Run();
+	// removes the pieces that were not joined
+	virtual void Close();
+
+	mfxU32 GetChunkCount() const { return (mfxU32)m_Chunks.size(); }
+
+protected:
+	// the main output or a rung with the pieces it is joined from
+	struct sOutput
+	{
+		std::string dstFile;
+		std::vector<std::string> Pieces;
+		std::vector<mfxU64> Padding; // filler data bytes appended to every piece
+	};
+
+	// encodes the range of nChunk again, on its own
+	mfxStatus EncodeChunk(size_t nChunk);
+	// pads or encodes pieces again until every piece starts with the buffer fullness it was encoded for
+	mfxStatus MatchBuffers();
+	mfxStatus JoinPieces(sOutput* pOutput);
+	void RemovePieces(sOutput* pOutput);
+
+	std::vector<sInputParams> m_Chunks;
+	std::vector<sOutput> m_Outputs;
+	std::vector<std::vector<sHrdTrace> > m_Traces; // of every chunk, one per output
+	bool m_bUseArenaAllocator;
+	std::auto_ptr<CStreamRunner> m_pRunner;
+	std::vector<mfxU8> m_Buffer; // for copying pieces
+
+private:
+	CChunkedEncoder(const CChunkedEncoder&);
+	void operator=(const CChunkedEncoder&);
+};
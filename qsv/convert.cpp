@@ -0,0 +1,134 @@
+#include "convert.h"
+
+#if defined(MSDK_X86_SIMD)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(MSDK_X86_SIMD)
+static void GetCpuId(int info[4], int leaf, int subleaf)
+{
+#if defined(_MSC_VER)
+	__cpuidex(info, leaf, subleaf);
+#else
+	unsigned int regs[4] = {};
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+	for (int i = 0; i < 4; i++)
+	{
+		info[i] = (int)regs[i];
+	}
+#endif
+}
+
+static unsigned long long GetXCR0()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	unsigned int eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+#endif
+
+bool CpuSupportsSSE2()
+{
+#if defined(MSDK_X86_SIMD)
+	int info[4];
+	GetCpuId(info, 1, 0);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	return false;
+#endif
+}
+
+bool CpuSupportsAVX2()
+{
+#if defined(MSDK_X86_SIMD)
+	int info[4];
+	GetCpuId(info, 0, 0);
+	if (info[0] < 7)
+	{
+		return false;
+	}
+
+	// the OS has to save YMM registers on context switch (OSXSAVE + XCR0 bits 1 and 2)
+	GetCpuId(info, 1, 0);
+	if (!(info[2] & (1 << 27)) || (GetXCR0() & 0x6) != 0x6)
+	{
+		return false;
+	}
+
+	GetCpuId(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return false;
+#endif
+}
+
+void InterleaveUV_C(mfxU8* pUV, const mfxU8* pU, const mfxU8* pV, mfxU32 nWidth)
+{
+	for (mfxU32 i = 0; i < nWidth; i++)
+	{
+		pUV[2 * i] = pU[i];
+		pUV[2 * i + 1] = pV[i];
+	}
+}
+
+#if defined(MSDK_X86_SIMD)
+void InterleaveUV_SSE2(mfxU8* pUV, const mfxU8* pU, const mfxU8* pV, mfxU32 nWidth)
+{
+	mfxU32 i = 0;
+
+	for (; i + 16 <= nWidth; i += 16)
+	{
+		__m128i u = _mm_loadu_si128((const __m128i*)(pU + i));
+		__m128i v = _mm_loadu_si128((const __m128i*)(pV + i));
+
+		_mm_storeu_si128((__m128i*)(pUV + 2 * i), _mm_unpacklo_epi8(u, v));
+		_mm_storeu_si128((__m128i*)(pUV + 2 * i + 16), _mm_unpackhi_epi8(u, v));
+	}
+
+	InterleaveUV_C(pUV + 2 * i, pU + i, pV + i, nWidth - i);
+}
+
+MSDK_TARGET_AVX2 void InterleaveUV_AVX2(mfxU8* pUV, const mfxU8* pU, const mfxU8* pV, mfxU32 nWidth)
+{
+	mfxU32 i = 0;
+
+	for (; i + 32 <= nWidth; i += 32)
+	{
+		__m256i u = _mm256_loadu_si256((const __m256i*)(pU + i));
+		__m256i v = _mm256_loadu_si256((const __m256i*)(pV + i));
+
+		// unpack works within 128-bit lanes, the permutes put the halves back in order
+		__m256i lo = _mm256_unpacklo_epi8(u, v);
+		__m256i hi = _mm256_unpackhi_epi8(u, v);
+
+		_mm256_storeu_si256((__m256i*)(pUV + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i*)(pUV + 2 * i + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	InterleaveUV_SSE2(pUV + 2 * i, pU + i, pV + i, nWidth - i);
+}
+#endif
+
+InterleaveUVFunc GetInterleaveUVFunc()
+{
+#if defined(MSDK_X86_SIMD)
+	if (CpuSupportsAVX2())
+	{
+		return InterleaveUV_AVX2;
+	}
+	if (CpuSupportsSSE2())
+	{
+		return InterleaveUV_SSE2;
+	}
+#endif
+	return InterleaveUV_C;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "mfxdefs.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define MSDK_X86_SIMD
+#endif
+
+// GCC and clang only emit AVX2 code for functions that ask for it, MSVC always does
+#if defined(MSDK_X86_SIMD) && (defined(__GNUC__) || defined(__clang__))
+#define MSDK_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define MSDK_TARGET_AVX2
+#endif
+
+bool CpuSupportsSSE2();
+bool CpuSupportsAVX2();
+
+// interleaves one row of planar U and V samples into an NV12 UV row (U0 V0 U1 V1 ...)
+typedef void (*InterleaveUVFunc)(mfxU8* pUV, const mfxU8* pU, const mfxU8* pV, mfxU32 nWidth);
+
+void InterleaveUV_C(mfxU8* pUV, const mfxU8* pU, const mfxU8* pV, mfxU32 nWidth);
+#if defined(MSDK_X86_SIMD)
+void InterleaveUV_SSE2(mfxU8* pUV, const mfxU8* pU, const mfxU8* pV, mfxU32 nWidth);
+void InterleaveUV_AVX2(mfxU8* pUV, const mfxU8* pU, const mfxU8* pV, mfxU32 nWidth);
+#endif
+
+// returns the fastest implementation supported by the running CPU
+InterleaveUVFunc GetInterleaveUVFunc();
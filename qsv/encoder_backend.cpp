@@ -0,0 +1,96 @@
+#include "encoder_backend.h"
+
+#include <iostream>
+
+CMfxEncoderBackend::CMfxEncoderBackend()
+{
+}
+
+CMfxEncoderBackend::~CMfxEncoderBackend()
+{
+	CloseSession();
+}
+
+mfxStatus CMfxEncoderBackend::InitSession(mfxInitParam par)
+{
+	CloseSession();
+
+	mfxStatus sts = m_mfxSession.InitEx(par);
+	MSDK_CHECK_STATUS(sts, "m_mfxSession.InitEx failed");
+
+	m_pmfxENC.reset(new MFXVideoENCODE(m_mfxSession));
+	MSDK_CHECK_POINTER(m_pmfxENC.get(), MFX_ERR_MEMORY_ALLOC);
+
+	// warnings such as MFX_WRN_PARTIAL_ACCELERATION go to the caller
+	return sts;
+}
+
+mfxStatus CMfxEncoderBackend::QueryIMPL(mfxIMPL* pImpl)
+{
+	return m_mfxSession.QueryIMPL(pImpl);
+}
+
+mfxStatus CMfxEncoderBackend::QueryVersion(mfxVersion* pVersion)
+{
+	return m_mfxSession.QueryVersion(pVersion);
+}
+
+mfxStatus CMfxEncoderBackend::SyncOperation(mfxSyncPoint syncp, mfxU32 wait)
+{
+	return m_mfxSession.SyncOperation(syncp, wait);
+}
+
+mfxStatus CMfxEncoderBackend::JoinSession(CEncoderBackend* pChild)
+{
+	CMfxEncoderBackend* pMfxChild = dynamic_cast<CMfxEncoderBackend*>(pChild);
+	MSDK_CHECK_POINTER(pMfxChild, MFX_ERR_UNSUPPORTED);
+
+	return m_mfxSession.JoinSession(pMfxChild->GetSession());
+}
+
+mfxStatus CMfxEncoderBackend::DisjoinSession()
+{
+	return m_mfxSession.DisjoinSession();
+}
+
+void CMfxEncoderBackend::CloseSession()
+{
+	// the encoder has to go before its session
+	m_pmfxENC.reset();
+	m_mfxSession.Close();
+}
+
+mfxStatus CMfxEncoderBackend::Query(mfxVideoParam* in, mfxVideoParam* out)
+{
+	MSDK_CHECK_POINTER(m_pmfxENC.get(), MFX_ERR_NOT_INITIALIZED);
+	return m_pmfxENC->Query(in, out);
+}
+
+mfxStatus CMfxEncoderBackend::QueryIOSurf(mfxVideoParam* par, mfxFrameAllocRequest* request)
+{
+	MSDK_CHECK_POINTER(m_pmfxENC.get(), MFX_ERR_NOT_INITIALIZED);
+	return m_pmfxENC->QueryIOSurf(par, request);
+}
+
+mfxStatus CMfxEncoderBackend::Init(mfxVideoParam* par)
+{
+	MSDK_CHECK_POINTER(m_pmfxENC.get(), MFX_ERR_NOT_INITIALIZED);
+	return m_pmfxENC->Init(par);
+}
+
+mfxStatus CMfxEncoderBackend::Close()
+{
+	MSDK_CHECK_POINTER(m_pmfxENC.get(), MFX_ERR_NOT_INITIALIZED);
+	return m_pmfxENC->Close();
+}
+
+mfxStatus CMfxEncoderBackend::GetVideoParam(mfxVideoParam* par)
+{
+	MSDK_CHECK_POINTER(m_pmfxENC.get(), MFX_ERR_NOT_INITIALIZED);
+	return m_pmfxENC->GetVideoParam(par);
+}
+
+mfxStatus CMfxEncoderBackend::EncodeFrameAsync(mfxEncodeCtrl* ctrl, mfxFrameSurface1* surface, mfxBitstream* bs, mfxSyncPoint* syncp)
+{
+	return m_pmfxENC->EncodeFrameAsync(ctrl, surface, bs, syncp);
+}
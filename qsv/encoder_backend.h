@@ -0,0 +1,70 @@
+#pragma once
+
+#include <memory>
+
+#include "mfxvideo++.h"
+
+#include "utils.h"
+
+// A session with a single encoder, the only way the pipeline talks to the media SDK.
+// Methods follow MFXVideoSession and MFXVideoENCODE, so that other implementations (see
+// mock_encoder.h) can stand in for the hardware.
+class CEncoderBackend
+{
+public:
+	virtual ~CEncoderBackend() {}
+
+	// session, returns the warnings of MFXInitEx
+	virtual mfxStatus InitSession(mfxInitParam par) = 0;
+	virtual mfxStatus QueryIMPL(mfxIMPL* pImpl) = 0;
+	virtual mfxStatus QueryVersion(mfxVersion* pVersion) = 0;
+	virtual mfxStatus SyncOperation(mfxSyncPoint syncp, mfxU32 wait) = 0;
+	// makes pChild share the scheduler of this session, like MFXJoinSession; the child has to be
+	// disjoined before either session is closed
+	virtual mfxStatus JoinSession(CEncoderBackend* pChild) = 0;
+	virtual mfxStatus DisjoinSession() = 0;
+	// closes the encoder as well
+	virtual void CloseSession() = 0;
+
+	// encoder
+	virtual mfxStatus Query(mfxVideoParam* in, mfxVideoParam* out) = 0;
+	virtual mfxStatus QueryIOSurf(mfxVideoParam* par, mfxFrameAllocRequest* request) = 0;
+	virtual mfxStatus Init(mfxVideoParam* par) = 0;
+	virtual mfxStatus Close() = 0;
+	virtual mfxStatus GetVideoParam(mfxVideoParam* par) = 0;
+	virtual mfxStatus EncodeFrameAsync(mfxEncodeCtrl* ctrl, mfxFrameSurface1* surface, mfxBitstream* bs, mfxSyncPoint* syncp) = 0;
+};
+
+// the media SDK itself
+class CMfxEncoderBackend : public CEncoderBackend
+{
+public:
+	CMfxEncoderBackend();
+	virtual ~CMfxEncoderBackend();
+
+	virtual mfxStatus InitSession(mfxInitParam par);
+	virtual mfxStatus QueryIMPL(mfxIMPL* pImpl);
+	virtual mfxStatus QueryVersion(mfxVersion* pVersion);
+	virtual mfxStatus SyncOperation(mfxSyncPoint syncp, mfxU32 wait);
+	// pChild must be a CMfxEncoderBackend as well
+	virtual mfxStatus JoinSession(CEncoderBackend* pChild);
+	virtual mfxStatus DisjoinSession();
+	virtual void CloseSession();
+
+	virtual mfxStatus Query(mfxVideoParam* in, mfxVideoParam* out);
+	virtual mfxStatus QueryIOSurf(mfxVideoParam* par, mfxFrameAllocRequest* request);
+	virtual mfxStatus Init(mfxVideoParam* par);
+	virtual mfxStatus Close();
+	virtual mfxStatus GetVideoParam(mfxVideoParam* par);
+	virtual mfxStatus EncodeFrameAsync(mfxEncodeCtrl* ctrl, mfxFrameSurface1* surface, mfxBitstream* bs, mfxSyncPoint* syncp);
+
+	MFXVideoSession& GetSession() { return m_mfxSession; }
+
+protected:
+	MFXVideoSession m_mfxSession;
+	std::auto_ptr<MFXVideoENCODE> m_pmfxENC; // exists while the session is open
+
+private:
+	CMfxEncoderBackend(const CMfxEncoderBackend&);
+	void operator=(const CMfxEncoderBackend&);
+};
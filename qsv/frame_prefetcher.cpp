@@ -0,0 +1,184 @@
+#include "frame_prefetcher.h"
+
+#include <iostream>
+
+#include "trace.h"
+
+// how often the producer checks for a stop request while waiting for a surface
+#define MSDK_PREFETCH_SURFACE_WAIT 100
+
+CFramePrefetcher::CFramePrefetcher()
+{
+	m_pReader = NULL;
+	m_pSurfacePool = NULL;
+	m_pLatency = NULL;
+	m_nRingHead = 0;
+	m_nRingCount = 0;
+	m_nFrameOrder = 0;
+	m_ReaderStatus = MFX_ERR_NONE;
+	m_bStop = false;
+}
+
+CFramePrefetcher::~CFramePrefetcher()
+{
+	Close();
+}
+
+mfxStatus CFramePrefetcher::Init(CSmplYUVReader* pReader, CSurfacePool* pSurfacePool, mfxU32 nDepth)
+{
+	MSDK_CHECK_POINTER(pReader, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(pSurfacePool, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_ERROR(nDepth, 0, MFX_ERR_UNDEFINED_BEHAVIOR);
+
+	Close();
+
+	m_pReader = pReader;
+	m_pSurfacePool = pSurfacePool;
+	m_Ring.assign(nDepth, NULL);
+	m_nRingHead = 0;
+	m_nRingCount = 0;
+	m_ReaderStatus = MFX_ERR_NONE;
+	m_bStop = false;
+
+	mfxStatus sts = MFX_ERR_NONE;
+
+	m_pFrameReady.reset(new MSDKEvent(sts, false, false));
+	MSDK_CHECK_STATUS(sts, "MSDKEvent failed");
+
+	m_pSpaceAvailable.reset(new MSDKEvent(sts, false, false));
+	MSDK_CHECK_STATUS(sts, "MSDKEvent failed");
+
+	m_pThread.reset(new MSDKThread(sts, ThreadRoutine, this));
+	MSDK_CHECK_STATUS(sts, "MSDKThread failed");
+
+	return MFX_ERR_NONE;
+}
+
+void CFramePrefetcher::Close()
+{
+	if (m_pThread.get())
+	{
+		m_bStop = true;
+		m_pSpaceAvailable->Signal();
+		m_pThread->Wait();
+		m_pThread.reset();
+	}
+
+	m_pFrameReady.reset();
+	m_pSpaceAvailable.reset();
+
+	// frames still queued go back to the pool unused
+	for (mfxU32 i = 0; i < m_nRingCount; i++)
+	{
+		m_pSurfacePool->Release(m_Ring[(m_nRingHead + i) % m_Ring.size()]);
+	}
+
+	m_Ring.clear();
+	m_nRingHead = 0;
+	m_nRingCount = 0;
+	m_pSurfacePool = NULL;
+}
+
+mfxStatus CFramePrefetcher::GetFrame(mfxFrameSurface1** ppSurface, mfxU32 nTimeout)
+{
+	MSDK_CHECK_POINTER(ppSurface, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(m_pThread.get(), MFX_ERR_NOT_INITIALIZED);
+
+	for (;;)
+	{
+		{
+			AutomaticMutex lock(m_Mutex);
+
+			if (m_nRingCount)
+			{
+				*ppSurface = m_Ring[m_nRingHead];
+				m_nRingHead = (m_nRingHead + 1) % m_Ring.size();
+				m_nRingCount--;
+
+				m_pSpaceAvailable->Signal();
+				return MFX_ERR_NONE;
+			}
+
+			if (MFX_ERR_NONE != m_ReaderStatus)
+			{
+				return m_ReaderStatus;
+			}
+		}
+
+		if (MFX_ERR_NONE != m_pFrameReady->TimedWait(nTimeout))
+		{
+			return MFX_WRN_IN_EXECUTION;
+		}
+	}
+}
+
+unsigned int MFX_STDCALL CFramePrefetcher::ThreadRoutine(void* pArg)
+{
+	static_cast<CFramePrefetcher*>(pArg)->ProduceFrames();
+	return 0;
+}
+
+mfxFrameSurface1* CFramePrefetcher::AcquireSurface()
+{
+	// wait for room in the ring first, a surface taken too early would only sit idle
+	while (!m_bStop)
+	{
+		{
+			AutomaticMutex lock(m_Mutex);
+			if (m_nRingCount < m_Ring.size())
+			{
+				break;
+			}
+		}
+
+		m_pSpaceAvailable->TimedWait(MSDK_PREFETCH_SURFACE_WAIT);
+	}
+
+	mfxFrameSurface1* pSurface = NULL;
+	while (!m_bStop && !pSurface)
+	{
+		m_pSurfacePool->Acquire(&pSurface, MSDK_PREFETCH_SURFACE_WAIT);
+	}
+
+	return pSurface;
+}
+
+void CFramePrefetcher::ProduceFrames()
+{
+	msdk_trace_set_thread_name("prefetch");
+
+	while (!m_bStop)
+	{
+		mfxFrameSurface1* pSurface = AcquireSurface();
+		if (!pSurface)
+		{
+			break;
+		}
+
+		pSurface->Info.FrameId.ViewId = 0;
+		mfxStatus sts = m_pReader->LoadNextFrame(pSurface);
+
+		AutomaticMutex lock(m_Mutex);
+
+		if (MFX_ERR_NONE != sts)
+		{
+			m_pSurfacePool->Release(pSurface);
+			m_ReaderStatus = sts;
+			m_pFrameReady->Signal();
+			break;
+		}
+
+		// frameorder required for reflist, dbp, and decrefpicmarking operations
+		pSurface->Data.FrameOrder = m_nFrameOrder++;
+
+		// the time the frame waits in the ring counts towards its latency
+		if (m_pLatency)
+		{
+			m_pLatency->Start(pSurface->Data.FrameOrder);
+		}
+
+		m_Ring[(m_nRingHead + m_nRingCount) % m_Ring.size()] = pSurface;
+		m_nRingCount++;
+		m_pFrameReady->Signal();
+	}
+}
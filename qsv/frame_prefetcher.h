@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "mfxstructures.h"
+
+#include "stage_timings.h"
+#include "surface_pool.h"
+#include "thread_defs.h"
+#include "utils.h"
+
+// Loads and converts input frames on a separate thread so that file I/O overlaps with encoding.
+// Filled surfaces are queued in a bounded ring of nDepth entries; the encoding loop only picks them up.
+class CFramePrefetcher
+{
+public:
+	CFramePrefetcher();
+	virtual ~CFramePrefetcher();
+
+	virtual mfxStatus Init(CSmplYUVReader* pReader, CSurfacePool* pSurfacePool, mfxU32 nDepth);
+	virtual void Close();
+	// frame order of the next frame loaded
+	void SetFirstFrameOrder(mfxU32 nFrameOrder) { m_nFrameOrder = nFrameOrder; }
+	// starts the latency of every frame loaded, NULL for none
+	void SetFrameLatency(CFrameLatency* pLatency) { m_pLatency = pLatency; }
+
+	// waits up to nTimeout ms for the next frame, returns MFX_WRN_IN_EXECUTION on timeout and
+	// the reader status (MFX_ERR_MORE_DATA at the end of input) once all frames were handed out
+	virtual mfxStatus GetFrame(mfxFrameSurface1** ppSurface, mfxU32 nTimeout);
+
+protected:
+	static unsigned int MFX_STDCALL ThreadRoutine(void* pArg);
+	void ProduceFrames();
+	mfxFrameSurface1* AcquireSurface();
+
+	CSmplYUVReader* m_pReader;
+	CSurfacePool* m_pSurfacePool;
+	CFrameLatency* m_pLatency;
+
+	std::vector<mfxFrameSurface1*> m_Ring;
+	mfxU32 m_nRingHead;
+	mfxU32 m_nRingCount;
+
+	mfxU32 m_nFrameOrder;
+	mfxStatus m_ReaderStatus;
+	std::atomic<bool> m_bStop;
+
+	MSDKMutex m_Mutex;
+	std::auto_ptr<MSDKEvent> m_pFrameReady;
+	std::auto_ptr<MSDKEvent> m_pSpaceAvailable;
+	std::auto_ptr<MSDKThread> m_pThread;
+
+private:
+	CFramePrefetcher(const CFramePrefetcher&);
+	void operator=(const CFramePrefetcher&);
+};
@@ -0,0 +1,562 @@
+#include "mock_encoder.h"
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#include "trace.h"
+
+static const mfxU8 MOCK_START_CODE[] = { 0, 0, 0, 1 };
+// filler data NAL unit, so that the output still parses as an elementary stream
+#define MSDK_MOCK_NAL_HEADER 0x0C
+#define MSDK_MOCK_FILLER 0xFF
+#define MSDK_MOCK_TRAILING_BITS 0x80
+
+// scheduler thread wake up resolution, shorter waits are spun out with MSDK_SLEEP(0)
+#define MSDK_MOCK_MIN_WAIT 1
+
+CMockScheduler::CMockScheduler()
+{
+	m_bStop = false;
+}
+
+CMockScheduler::~CMockScheduler()
+{
+	if (m_pThread.get())
+	{
+		m_bStop = true;
+		m_pJobSubmitted->Signal();
+		m_pThread->Wait();
+	}
+}
+
+mfxStatus CMockScheduler::Attach(CMockEncoderBackend* pEncoder)
+{
+	MSDK_CHECK_POINTER(pEncoder, MFX_ERR_NULL_PTR);
+
+	AutomaticMutex lock(m_Mutex);
+
+	if (!m_pThread.get())
+	{
+		mfxStatus sts = MFX_ERR_NONE;
+		m_pJobSubmitted.reset(new MSDKEvent(sts, false, false));
+		MSDK_CHECK_STATUS(sts, "MSDKEvent failed");
+		m_pThread.reset(new MSDKThread(sts, ThreadRoutine, this));
+		MSDK_CHECK_STATUS(sts, "MSDKThread failed");
+	}
+
+	m_Encoders.push_back(pEncoder);
+
+	return MFX_ERR_NONE;
+}
+
+void CMockScheduler::Detach(CMockEncoderBackend* pEncoder)
+{
+	AutomaticMutex lock(m_Mutex);
+
+	for (size_t i = 0; i < m_Encoders.size(); i++)
+	{
+		if (m_Encoders[i] == pEncoder)
+		{
+			m_Encoders.erase(m_Encoders.begin() + i);
+			break;
+		}
+	}
+}
+
+void CMockScheduler::JobSubmitted()
+{
+	m_pJobSubmitted->Signal();
+}
+
+unsigned int MFX_STDCALL CMockScheduler::ThreadRoutine(void* pArg)
+{
+	msdk_trace_set_thread_name("mock scheduler");
+
+	static_cast<CMockScheduler*>(pArg)->Run();
+
+	return 0;
+}
+
+void CMockScheduler::Run()
+{
+	msdk_tick nFrequency = CTimer::GetFrequency();
+
+	while (!m_bStop)
+	{
+		msdk_tick nNext = 0;
+		{
+			AutomaticMutex lock(m_Mutex);
+
+			msdk_tick nNow = msdk_time_get_tick();
+			for (size_t i = 0; i < m_Encoders.size(); i++)
+			{
+				msdk_tick nDue = m_Encoders[i]->ProcessJobs(nNow);
+				if (nDue)
+				{
+					nNext = nNext ? MSDK_MIN(nNext, nDue) : nDue;
+				}
+			}
+		}
+
+		if (!nNext)
+		{
+			m_pJobSubmitted->Wait();
+			continue;
+		}
+
+		// a submission ends the wait, the new job may be due before those of the other encoders
+		msdk_tick nRemaining = nNext - msdk_time_get_tick();
+		mfxU32 nWait = nRemaining > 0 ? (mfxU32)(nRemaining * 1000 / nFrequency) : 0;
+
+		if (nWait >= MSDK_MOCK_MIN_WAIT)
+		{
+			m_pJobSubmitted->TimedWait(nWait);
+		}
+		else
+		{
+			MSDK_SLEEP(0);
+		}
+	}
+}
+
+CMockEncoderBackend::CMockEncoderBackend(const sMockEncoderParams& params)
+{
+	m_MockParams = params;
+	MSDK_ZERO_MEMORY(m_mfxParams);
+	m_bSessionOpen = false;
+	m_bInited = false;
+	m_bJoined = false;
+
+	m_nNextId = 1;
+	m_nFrameSize = 0;
+	m_bHrd = false;
+	m_dBitsPerFrame = 0;
+	m_dBufferSize = 0;
+	m_dFullness = 0;
+	m_nFrameCount = 0;
+	m_nDeviceFree = 0;
+	m_nRandom = 1;
+}
+
+CMockEncoderBackend::~CMockEncoderBackend()
+{
+	CloseSession();
+}
+
+mfxStatus CMockEncoderBackend::InitSession(mfxInitParam)
+{
+	CloseSession();
+
+	m_pScheduler.reset(new CMockScheduler());
+	MSDK_CHECK_POINTER(m_pScheduler.get(), MFX_ERR_MEMORY_ALLOC);
+	m_bJoined = false;
+	m_bSessionOpen = true;
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CMockEncoderBackend::QueryIMPL(mfxIMPL* pImpl)
+{
+	MSDK_CHECK_POINTER(pImpl, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_ERROR(m_bSessionOpen, false, MFX_ERR_NOT_INITIALIZED);
+
+	*pImpl = MFX_IMPL_SOFTWARE;
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CMockEncoderBackend::QueryVersion(mfxVersion* pVersion)
+{
+	MSDK_CHECK_POINTER(pVersion, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_ERROR(m_bSessionOpen, false, MFX_ERR_NOT_INITIALIZED);
+
+	pVersion->Major = 1;
+	pVersion->Minor = 0;
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CMockEncoderBackend::JoinSession(CEncoderBackend* pChild)
+{
+	CMockEncoderBackend* pMockChild = dynamic_cast<CMockEncoderBackend*>(pChild);
+	MSDK_CHECK_POINTER(pMockChild, MFX_ERR_UNSUPPORTED);
+	MSDK_CHECK_ERROR(m_bSessionOpen, false, MFX_ERR_NOT_INITIALIZED);
+	MSDK_CHECK_ERROR(pMockChild->m_bSessionOpen, false, MFX_ERR_NOT_INITIALIZED);
+	// the jobs of an initialized encoder are guarded by the lock of its current scheduler
+	MSDK_CHECK_ERROR(pMockChild->m_bInited, true, MFX_ERR_UNDEFINED_BEHAVIOR);
+	MSDK_CHECK_ERROR(pMockChild->m_bJoined, true, MFX_ERR_UNDEFINED_BEHAVIOR);
+
+	pMockChild->m_pScheduler = m_pScheduler;
+	pMockChild->m_bJoined = true;
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CMockEncoderBackend::DisjoinSession()
+{
+	MSDK_CHECK_ERROR(m_bSessionOpen, false, MFX_ERR_NOT_INITIALIZED);
+	MSDK_CHECK_ERROR(m_bJoined, false, MFX_ERR_UNDEFINED_BEHAVIOR);
+	MSDK_CHECK_ERROR(m_bInited, true, MFX_ERR_UNDEFINED_BEHAVIOR);
+
+	m_pScheduler.reset(new CMockScheduler());
+	MSDK_CHECK_POINTER(m_pScheduler.get(), MFX_ERR_MEMORY_ALLOC);
+	m_bJoined = false;
+
+	return MFX_ERR_NONE;
+}
+
+void CMockEncoderBackend::CloseSession()
+{
+	Close();
+	// the thread of a shared scheduler stops with the last session using it
+	m_pScheduler.reset();
+	m_bJoined = false;
+	m_bSessionOpen = false;
+}
+
+mfxStatus CMockEncoderBackend::Query(mfxVideoParam* in, mfxVideoParam* out)
+{
+	MSDK_CHECK_POINTER(out, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_ERROR(m_bSessionOpen, false, MFX_ERR_NOT_INITIALIZED);
+
+	// every configuration is supported
+	if (in && in != out)
+	{
+		mfxExtBuffer** ppExtParam = out->ExtParam;
+		mfxU16 nNumExtParam = out->NumExtParam;
+
+		*out = *in;
+		out->ExtParam = ppExtParam;
+		out->NumExtParam = nNumExtParam;
+	}
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CMockEncoderBackend::QueryIOSurf(mfxVideoParam* par, mfxFrameAllocRequest* request)
+{
+	MSDK_CHECK_POINTER(par, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(request, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_ERROR(m_bSessionOpen, false, MFX_ERR_NOT_INITIALIZED);
+
+	MSDK_ZERO_MEMORY(*request);
+	request->Info = par->mfx.FrameInfo;
+	request->Type = MFX_MEMTYPE_EXTERNAL_FRAME | MFX_MEMTYPE_FROM_ENCODE | MFX_MEMTYPE_SYSTEM_MEMORY;
+	// one frame on the device and every other one queued
+	request->NumFrameMin = (mfxU16)(MSDK_MAX(par->AsyncDepth, 1) + 1);
+	request->NumFrameSuggested = request->NumFrameMin;
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CMockEncoderBackend::Init(mfxVideoParam* par)
+{
+	MSDK_CHECK_POINTER(par, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_ERROR(m_bSessionOpen, false, MFX_ERR_NOT_INITIALIZED);
+	MSDK_CHECK_ERROR(m_bInited, true, MFX_ERR_UNDEFINED_BEHAVIOR);
+
+	mfxFrameInfo& info = par->mfx.FrameInfo;
+	if (!info.Width || !info.Height)
+	{
+		return MFX_ERR_INVALID_VIDEO_PARAM;
+	}
+
+	m_mfxParams = *par;
+	m_mfxParams.ExtParam = NULL;
+	m_mfxParams.NumExtParam = 0;
+	m_mfxParams.AsyncDepth = MSDK_MAX(m_mfxParams.AsyncDepth, 1);
+
+	mfxF64 dFrameRate = (info.FrameRateExtN && info.FrameRateExtD) ? (mfxF64)info.FrameRateExtN / info.FrameRateExtD : 30;
+	mfxU32 nMultiplier = MSDK_MAX(par->mfx.BRCParamMultiplier, 1);
+	mfxU32 nKbps = par->mfx.TargetKbps * nMultiplier;
+
+	m_nFrameSize = m_MockParams.nFrameSize;
+	if (!m_nFrameSize)
+	{
+		m_nFrameSize = nKbps ? (mfxU32)(nKbps * 1000 / 8 / dFrameRate) : info.Width * info.Height / 8;
+	}
+	m_nFrameSize = MSDK_MAX(m_nFrameSize, sizeof(MOCK_START_CODE) + 2);
+
+	// room for a key frame in the coded picture buffer, at least the one the application asked for
+	mfxU32 nBufferSizeInKB = MSDK_MAX((m_nFrameSize * MSDK_MOCK_KEY_FRAME_FACTOR + 999) / 1000, par->mfx.BufferSizeInKB * nMultiplier);
+	mfxU32 nInitialDelayInKB = MSDK_MIN(par->mfx.InitialDelayInKB * nMultiplier, nBufferSizeInKB);
+	m_mfxParams.mfx.BRCParamMultiplier = (mfxU16)(nBufferSizeInKB / 0xFFFF + 1);
+	m_mfxParams.mfx.BufferSizeInKB = (mfxU16)((nBufferSizeInKB + m_mfxParams.mfx.BRCParamMultiplier - 1) / m_mfxParams.mfx.BRCParamMultiplier);
+	m_mfxParams.mfx.InitialDelayInKB = (mfxU16)(nInitialDelayInKB / m_mfxParams.mfx.BRCParamMultiplier);
+	m_mfxParams.mfx.TargetKbps = (mfxU16)(nKbps / m_mfxParams.mfx.BRCParamMultiplier);
+	m_mfxParams.mfx.MaxKbps = (mfxU16)(par->mfx.MaxKbps * nMultiplier / m_mfxParams.mfx.BRCParamMultiplier);
+
+	// the buffer the application sees, after the rounding to the multiplier
+	mfxF64 dKBBits = 8000.0 * m_mfxParams.mfx.BRCParamMultiplier;
+	m_bHrd = MFX_RATECONTROL_CBR == par->mfx.RateControlMethod && m_mfxParams.mfx.InitialDelayInKB && nKbps;
+	m_dBitsPerFrame = m_mfxParams.mfx.TargetKbps * m_mfxParams.mfx.BRCParamMultiplier * 1000.0 / dFrameRate;
+	m_dBufferSize = m_mfxParams.mfx.BufferSizeInKB * dKBBits;
+	m_dFullness = m_mfxParams.mfx.InitialDelayInKB * dKBBits;
+
+	m_nFrameCount = 0;
+	m_nDeviceFree = 0;
+
+	mfxStatus sts = MFX_ERR_NONE;
+	m_pJobDone.reset(new MSDKEvent(sts, false, false));
+	MSDK_CHECK_STATUS(sts, "MSDKEvent failed");
+	sts = m_pScheduler->Attach(this);
+	MSDK_CHECK_STATUS(sts, "m_pScheduler->Attach failed");
+
+	m_bInited = true;
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CMockEncoderBackend::Close()
+{
+	if (!m_bInited)
+	{
+		return MFX_ERR_NOT_INITIALIZED;
+	}
+
+	m_pScheduler->Detach(this);
+
+	AutomaticMutex lock(m_pScheduler->GetMutex());
+
+	// a closed encoder does not hold on to any surface
+	for (size_t i = 0; i < m_Jobs.size(); i++)
+	{
+		if (!m_Jobs[i].bUnlocked)
+		{
+			msdk_atomic_dec16(&m_Jobs[i].pSurface->Data.Locked);
+		}
+	}
+	m_Jobs.clear();
+
+	m_bInited = false;
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CMockEncoderBackend::GetVideoParam(mfxVideoParam* par)
+{
+	MSDK_CHECK_POINTER(par, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_ERROR(m_bInited, false, MFX_ERR_NOT_INITIALIZED);
+
+	par->mfx = m_mfxParams.mfx;
+	par->AsyncDepth = m_mfxParams.AsyncDepth;
+	par->IOPattern = m_mfxParams.IOPattern;
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CMockEncoderBackend::EncodeFrameAsync(mfxEncodeCtrl* ctrl, mfxFrameSurface1* surface, mfxBitstream* bs, mfxSyncPoint* syncp)
+{
+	MSDK_CHECK_POINTER(bs, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(syncp, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_ERROR(m_bInited, false, MFX_ERR_NOT_INITIALIZED);
+
+	*syncp = NULL;
+
+	// frames are not buffered, nothing is left to drain
+	if (!surface)
+	{
+		return MFX_ERR_MORE_DATA;
+	}
+
+	AutomaticMutex lock(m_pScheduler->GetMutex());
+
+	if (m_MockParams.nBusyRate && Random(100) < m_MockParams.nBusyRate)
+	{
+		return MFX_WRN_DEVICE_BUSY;
+	}
+
+	mfxU32 nInFlight = 0;
+	for (size_t i = 0; i < m_Jobs.size(); i++)
+	{
+		nInFlight += m_Jobs[i].bSynced ? 0 : 1;
+	}
+	if (nInFlight >= m_mfxParams.AsyncDepth)
+	{
+		return MFX_WRN_DEVICE_BUSY;
+	}
+
+	mfxU16 nGopSize = m_mfxParams.mfx.GopPicSize ? m_mfxParams.mfx.GopPicSize : MSDK_MOCK_GOP_SIZE;
+	bool bKeyFrame = (0 == m_nFrameCount % nGopSize) || (ctrl && (ctrl->FrameType & MFX_FRAMETYPE_IDR));
+
+	sMockJob job;
+	job.nId = m_nNextId++;
+	job.pSurface = surface;
+	job.pBS = bs;
+	job.nSize = GetFrameSize(bKeyFrame, nGopSize);
+	job.nFrameType = bKeyFrame ? (mfxU16)(MFX_FRAMETYPE_I | MFX_FRAMETYPE_REF | MFX_FRAMETYPE_IDR) : (mfxU16)(MFX_FRAMETYPE_P | MFX_FRAMETYPE_REF);
+	job.nTimeStamp = surface->Data.TimeStamp;
+	job.nFrameOrder = surface->Data.FrameOrder;
+	job.bDone = false;
+	job.bUnlocked = false;
+	job.bSynced = false;
+
+	if (bs->MaxLength < bs->DataOffset + bs->DataLength + job.nSize)
+	{
+		return MFX_ERR_NOT_ENOUGH_BUFFER;
+	}
+
+	msdk_tick nFrequency = CTimer::GetFrequency();
+	msdk_tick nNow = msdk_time_get_tick();
+
+	job.nDone = MSDK_MAX(nNow, m_nDeviceFree) + (msdk_tick)m_MockParams.nLatency * nFrequency / 1000000;
+	job.nUnlock = job.nDone + (msdk_tick)m_MockParams.nHoldTime * nFrequency / 1000000;
+	m_nDeviceFree = job.nDone;
+
+	if (m_bHrd)
+	{
+		m_dFullness += m_dBitsPerFrame - job.nSize * 8.0;
+	}
+
+	msdk_atomic_inc16(&surface->Data.Locked);
+	m_Jobs.push_back(job);
+	m_nFrameCount++;
+
+	*syncp = (mfxSyncPoint)job.nId;
+
+	m_pScheduler->JobSubmitted();
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CMockEncoderBackend::SyncOperation(mfxSyncPoint syncp, mfxU32 wait)
+{
+	MSDK_CHECK_POINTER(syncp, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_ERROR(m_bInited, false, MFX_ERR_NOT_INITIALIZED);
+
+	size_t nId = (size_t)syncp;
+
+	CTimer t;
+	t.Start();
+
+	for (;;)
+	{
+		{
+			AutomaticMutex lock(m_pScheduler->GetMutex());
+
+			std::deque<sMockJob>::iterator it = m_Jobs.begin();
+			while (it != m_Jobs.end() && it->nId != nId)
+			{
+				++it;
+			}
+
+			if (it == m_Jobs.end() || it->bSynced)
+			{
+				return MFX_ERR_INVALID_HANDLE;
+			}
+
+			if (it->bDone)
+			{
+				it->bSynced = true;
+				if (it->bUnlocked)
+				{
+					m_Jobs.erase(it);
+				}
+				return MFX_ERR_NONE;
+			}
+		}
+
+		if (t.GetTime() * 1000 >= wait)
+		{
+			return MFX_WRN_IN_EXECUTION;
+		}
+
+		m_pJobDone->TimedWait(MSDK_MOCK_MIN_WAIT);
+	}
+}
+
+msdk_tick CMockEncoderBackend::ProcessJobs(msdk_tick nNow)
+{
+	msdk_tick nNext = 0;
+	bool bCompleted = false;
+
+	for (std::deque<sMockJob>::iterator it = m_Jobs.begin(); it != m_Jobs.end();)
+	{
+		if (!it->bDone)
+		{
+			if (it->nDone > nNow)
+			{
+				nNext = nNext ? MSDK_MIN(nNext, it->nDone) : it->nDone;
+				++it;
+				continue;
+			}
+
+			mfxU8* pData = it->pBS->Data + it->pBS->DataOffset + it->pBS->DataLength;
+			memcpy(pData, MOCK_START_CODE, sizeof(MOCK_START_CODE));
+			pData[sizeof(MOCK_START_CODE)] = MSDK_MOCK_NAL_HEADER;
+			memset(pData + sizeof(MOCK_START_CODE) + 1, MSDK_MOCK_FILLER, it->nSize - sizeof(MOCK_START_CODE) - 2);
+			pData[it->nSize - 1] = MSDK_MOCK_TRAILING_BITS;
+
+			it->pBS->DataLength += it->nSize;
+			it->pBS->TimeStamp = it->nTimeStamp;
+			it->pBS->FrameType = it->nFrameType;
+			SetEncodedFrameOrder(it->pBS, it->nFrameOrder);
+			it->bDone = true;
+			bCompleted = true;
+		}
+
+		if (!it->bUnlocked)
+		{
+			if (it->nUnlock > nNow)
+			{
+				nNext = nNext ? MSDK_MIN(nNext, it->nUnlock) : it->nUnlock;
+				++it;
+				continue;
+			}
+
+			msdk_atomic_dec16(&it->pSurface->Data.Locked);
+			it->bUnlocked = true;
+		}
+
+		it = it->bSynced ? m_Jobs.erase(it) : it + 1;
+	}
+
+	if (bCompleted)
+	{
+		m_pJobDone->Signal();
+	}
+
+	return nNext;
+}
+
+mfxU32 CMockEncoderBackend::GetFrameSize(bool bKeyFrame, mfxU16 nGopSize)
+{
+	if (!m_bHrd)
+	{
+		return bKeyFrame ? m_nFrameSize * MSDK_MOCK_KEY_FRAME_FACTOR : m_nFrameSize;
+	}
+
+	// a GOP spends what arrives during it
+	mfxF64 dBits = m_dBitsPerFrame;
+	if (nGopSize > MSDK_MOCK_KEY_FRAME_FACTOR)
+	{
+		mfxF64 dKeyFrame = m_dBitsPerFrame * MSDK_MOCK_KEY_FRAME_FACTOR;
+		dBits = bKeyFrame ? dKeyFrame : (m_dBitsPerFrame * nGopSize - dKeyFrame) / (nGopSize - 1);
+	}
+
+	// no more than the buffer holds, and enough that what arrives until the next frame still fits
+	mfxF64 dMin = sizeof(MOCK_START_CODE) + 2;
+	mfxU32 nSize = (mfxU32)MSDK_MAX(dBits / 8, dMin);
+	nSize = (mfxU32)MSDK_MIN((mfxF64)nSize, floor(m_dFullness / 8));
+	nSize = (mfxU32)MSDK_MAX((mfxF64)nSize, ceil((m_dFullness + m_dBitsPerFrame - m_dBufferSize) / 8));
+	return (mfxU32)MSDK_MAX((mfxF64)nSize, dMin);
+}
+
+mfxU32 CMockEncoderBackend::Random(mfxU32 nRange)
+{
+	// deterministic, so that runs with the same parameters are comparable
+	m_nRandom = m_nRandom * 1103515245 + 12345;
+	return (m_nRandom >> 16) % nRange;
+}
+
+void CMockEncoderBackend::SetEncodedFrameOrder(mfxBitstream* pBS, mfxU32 nFrameOrder)
+{
+	for (mfxU16 i = 0; i < pBS->NumExtParam; i++)
+	{
+		if (pBS->ExtParam[i] && MFX_EXTBUFF_ENCODED_FRAME_INFO == pBS->ExtParam[i]->BufferId)
+		{
+			((mfxExtAVCEncodedFrameInfo*)pBS->ExtParam[i])->FrameOrder = nFrameOrder;
+		}
+	}
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "atomic_defs.h"
+#include "encoder_backend.h"
+#include "thread_defs.h"
+
+// key frames come out this many times larger than the others
+#define MSDK_MOCK_KEY_FRAME_FACTOR 4
+// key frame interval when the parameters leave GopPicSize to the encoder
+#define MSDK_MOCK_GOP_SIZE 30
+
+struct sMockEncoderParams
+{
+	mfxU32 nLatency;   // us the device spends on a frame, frames are processed one after another
+	mfxU32 nFrameSize; // bytes of a non-key frame, 0 derives it from the target bitrate
+	mfxU32 nBusyRate;  // percent of EncodeFrameAsync calls answered with MFX_WRN_DEVICE_BUSY
+	mfxU32 nHoldTime;  // us an input surface stays locked after its frame was encoded
+};
+
+class CMockEncoderBackend;
+
+// The host side of a media SDK scheduler: one thread that completes the frames of every encoder attached
+// to it. Each mock session has its own, JoinSession makes the child use the one of the parent instead.
+class CMockScheduler
+{
+public:
+	CMockScheduler();
+	~CMockScheduler();
+
+	// the thread starts with the first encoder
+	mfxStatus Attach(CMockEncoderBackend* pEncoder);
+	// once Detach returned the thread does not touch pEncoder any more
+	void Detach(CMockEncoderBackend* pEncoder);
+	// guards the jobs of all attached encoders
+	MSDKMutex& GetMutex() { return m_Mutex; }
+	void JobSubmitted();
+
+protected:
+	static unsigned int MFX_STDCALL ThreadRoutine(void* pArg);
+	void Run();
+
+	std::vector<CMockEncoderBackend*> m_Encoders;
+	MSDKMutex m_Mutex;
+	std::auto_ptr<MSDKEvent> m_pJobSubmitted;
+	std::auto_ptr<MSDKThread> m_pThread;
+	std::atomic<bool> m_bStop;
+
+private:
+	CMockScheduler(const CMockScheduler&);
+	void operator=(const CMockScheduler&);
+};
+
+// Encoder backend without a device, for measuring the host side of the pipeline.
+// The device "encodes" submitted frames in order, nLatency us each, and keeps the input surface locked
+// for another nHoldTime us, like a reference frame; the scheduler thread fills the bitstream with dummy
+// payload once a frame is due. With an initial delay the frame sizes follow a CBR coded picture buffer that
+// neither underflows nor overflows, key frames taking from the P frames of their GOP. Every encoder has a device of its own, joined or not, so that joining
+// changes only how many threads and locks the host spends on the streams.
+// Frames are not reordered, so there is nothing to drain at the end of the input.
+class CMockEncoderBackend : public CEncoderBackend
+{
+	friend class CMockScheduler;
+
+public:
+	CMockEncoderBackend(const sMockEncoderParams& params);
+	virtual ~CMockEncoderBackend();
+
+	virtual mfxStatus InitSession(mfxInitParam par);
+	virtual mfxStatus QueryIMPL(mfxIMPL* pImpl);
+	virtual mfxStatus QueryVersion(mfxVersion* pVersion);
+	virtual mfxStatus SyncOperation(mfxSyncPoint syncp, mfxU32 wait);
+	// pChild must be a CMockEncoderBackend as well, with its encoder not initialized yet
+	virtual mfxStatus JoinSession(CEncoderBackend* pChild);
+	virtual mfxStatus DisjoinSession();
+	virtual void CloseSession();
+
+	virtual mfxStatus Query(mfxVideoParam* in, mfxVideoParam* out);
+	virtual mfxStatus QueryIOSurf(mfxVideoParam* par, mfxFrameAllocRequest* request);
+	virtual mfxStatus Init(mfxVideoParam* par);
+	virtual mfxStatus Close();
+	virtual mfxStatus GetVideoParam(mfxVideoParam* par);
+	virtual mfxStatus EncodeFrameAsync(mfxEncodeCtrl* ctrl, mfxFrameSurface1* surface, mfxBitstream* bs, mfxSyncPoint* syncp);
+
+protected:
+	struct sMockJob
+	{
+		size_t nId;
+		mfxFrameSurface1* pSurface;
+		mfxBitstream* pBS;
+		mfxU32 nSize;
+		mfxU16 nFrameType;
+		mfxU64 nTimeStamp;
+		mfxU32 nFrameOrder;
+		msdk_tick nDone;   // when the device finishes the frame
+		msdk_tick nUnlock; // when the surface is unlocked
+		bool bDone;
+		bool bUnlocked;
+		bool bSynced;
+	};
+
+	// completes the frames and unlocks the surfaces that are due, returns the next due time or 0
+	msdk_tick ProcessJobs(msdk_tick nNow);
+	// bytes of the next frame, within the bounds of the CBR buffer model
+	mfxU32 GetFrameSize(bool bKeyFrame, mfxU16 nGopSize);
+	mfxU32 Random(mfxU32 nRange);
+	// fills mfxExtAVCEncodedFrameInfo if the application attached one to pBS, as the hardware encoder does
+	static void SetEncodedFrameOrder(mfxBitstream* pBS, mfxU32 nFrameOrder);
+
+	sMockEncoderParams m_MockParams;
+	mfxVideoParam m_mfxParams;
+	bool m_bSessionOpen;
+	bool m_bInited;
+	bool m_bJoined;
+
+	std::deque<sMockJob> m_Jobs; // in submission order, dropped once synchronized and unlocked
+	size_t m_nNextId;
+	mfxU32 m_nFrameSize; // of a non-key frame
+	bool m_bHrd; // the application set an initial delay, frames are sized to keep the buffer in bounds
+	mfxF64 m_dBitsPerFrame; // arriving in the buffer from one frame to the next
+	mfxF64 m_dBufferSize; // bits
+	mfxF64 m_dFullness; // bits in the buffer before the next frame is removed
+	mfxU32 m_nFrameCount;
+	msdk_tick m_nDeviceFree; // when the device is done with everything submitted
+	mfxU32 m_nRandom;
+
+	std::shared_ptr<CMockScheduler> m_pScheduler; // exists while the session is open
+	std::auto_ptr<MSDKEvent> m_pJobDone;
+
+private:
+	CMockEncoderBackend(const CMockEncoderBackend&);
+	void operator=(const CMockEncoderBackend&);
+};
@@ -0,0 +1,115 @@
+#include "packet_queue.h"
+
+#include <iostream>
+
+CPacketQueue::CPacketQueue(CBitstreamPool* pBitstreamPool, PacketCallback pCallback, void* pContext, mfxU32 nMaxPending)
+{
+	m_pBitstreamPool = pBitstreamPool;
+	m_pCallback = pCallback;
+	m_pContext = pContext;
+	m_nMaxPending = MSDK_MAX(nMaxPending, 1);
+}
+
+CPacketQueue::~CPacketQueue()
+{
+	Close();
+}
+
+mfxStatus CPacketQueue::Init(const std::string&)
+{
+	MSDK_CHECK_POINTER(m_pBitstreamPool, MFX_ERR_NULL_PTR);
+
+	Close();
+
+	m_bInited = true;
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CPacketQueue::WriteNextFrame(mfxBitstream *pMfxBitstream, mfxU32)
+{
+	MSDK_CHECK_ERROR(m_bInited, false, MFX_ERR_NOT_INITIALIZED);
+	MSDK_CHECK_POINTER(pMfxBitstream, MFX_ERR_NULL_PTR);
+
+	m_nProcessedFramesNum++;
+	m_nProcessedBytes += pMfxBitstream->DataLength;
+
+	if (!pMfxBitstream->DataLength)
+	{
+		return MFX_ERR_NONE;
+	}
+
+	sEncodedPacket packet;
+	packet.pData = pMfxBitstream->Data + pMfxBitstream->DataOffset;
+	packet.nSize = pMfxBitstream->DataLength;
+	packet.nTimeStamp = pMfxBitstream->TimeStamp;
+	packet.nDecodeTimeStamp = pMfxBitstream->DecodeTimeStamp;
+	packet.nFrameType = pMfxBitstream->FrameType;
+	packet.Buffer = *pMfxBitstream;
+
+	if (m_pCallback)
+	{
+		m_pCallback(&packet, m_pContext);
+		pMfxBitstream->DataLength = 0;
+		return MFX_ERR_NONE;
+	}
+
+	{
+		AutomaticMutex lock(m_Mutex);
+		m_Queue.push_back(packet);
+	}
+
+	// the payload belongs to the queue now, the task continues with a fresh buffer
+	pMfxBitstream->Data = NULL;
+	pMfxBitstream->MaxLength = 0;
+
+	mfxStatus sts = m_pBitstreamPool->Acquire(pMfxBitstream);
+	MSDK_CHECK_STATUS(sts, "m_pBitstreamPool->Acquire failed");
+
+	return MFX_ERR_NONE;
+}
+
+void CPacketQueue::Close()
+{
+	AutomaticMutex lock(m_Mutex);
+
+	while (!m_Queue.empty())
+	{
+		m_pBitstreamPool->Release(&m_Queue.front().Buffer);
+		m_Queue.pop_front();
+	}
+
+	m_bInited = false;
+}
+
+mfxStatus CPacketQueue::Pop(sEncodedPacket* pPacket)
+{
+	MSDK_CHECK_POINTER(pPacket, MFX_ERR_NULL_PTR);
+
+	AutomaticMutex lock(m_Mutex);
+
+	if (m_Queue.empty())
+	{
+		return MFX_ERR_MORE_DATA;
+	}
+
+	*pPacket = m_Queue.front();
+	m_Queue.pop_front();
+
+	return MFX_ERR_NONE;
+}
+
+void CPacketQueue::Release(sEncodedPacket* pPacket)
+{
+	if (pPacket && pPacket->Buffer.Data)
+	{
+		m_pBitstreamPool->Release(&pPacket->Buffer);
+		pPacket->pData = NULL;
+		pPacket->nSize = 0;
+	}
+}
+
+bool CPacketQueue::IsFull()
+{
+	AutomaticMutex lock(m_Mutex);
+	return m_Queue.size() >= m_nMaxPending;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <deque>
+#include <string>
+
+#include "mfxstructures.h"
+
+#include "bitstream_pool.h"
+#include "thread_defs.h"
+#include "utils.h"
+
+// default number of packets that may wait for the application before submission is pushed back
+#define MSDK_PACKET_QUEUE_DEPTH 120
+
+// an encoded frame in Annex B
+struct sEncodedPacket
+{
+	const mfxU8* pData;
+	mfxU32 nSize;
+	mfxU64 nTimeStamp; // of the input frame
+	mfxI64 nDecodeTimeStamp;
+	mfxU16 nFrameType; // MFX_FRAMETYPE_*
+	mfxBitstream Buffer; // holds pData, packets from Pop give it back with Release
+};
+
+// called on the thread that completes the frame, the packet is valid until it returns
+typedef void (*PacketCallback)(const sEncodedPacket* pPacket, void* pContext);
+
+// Hands encoded frames to the application instead of writing them to a file.
+// Without a callback payloads are queued with their buffers, the task goes on with an empty buffer from the
+// bitstream pool, and Pop hands the packets out in encoding order. With a callback every frame goes to it as
+// soon as it is complete and nothing is queued.
+class CPacketQueue : public CSmplBitstreamWriter
+{
+public:
+	CPacketQueue(CBitstreamPool* pBitstreamPool, PacketCallback pCallback, void* pContext, mfxU32 nMaxPending);
+	virtual ~CPacketQueue();
+
+	// there is no file, strFileName is ignored
+	virtual mfxStatus Init(const std::string& strFileName);
+	virtual mfxStatus WriteNextFrame(mfxBitstream *pMfxBitstream, mfxU32 nFrameOrder);
+	// gives the buffers of packets nobody popped back
+	virtual void Close();
+
+	// oldest packet, MFX_ERR_MORE_DATA if none is queued
+	virtual mfxStatus Pop(sEncodedPacket* pPacket);
+	virtual void Release(sEncodedPacket* pPacket);
+
+	// the application does not keep up, no more frames should be submitted until it pops some
+	bool IsFull();
+
+protected:
+	CBitstreamPool* m_pBitstreamPool;
+	PacketCallback m_pCallback;
+	void* m_pContext;
+	mfxU32 m_nMaxPending;
+
+	std::deque<sEncodedPacket> m_Queue;
+	MSDKMutex m_Mutex;
+
+private:
+	CPacketQueue(const CPacketQueue&);
+	void operator=(const CPacketQueue&);
+};
@@ -1,17 +1,56 @@
 #include "pipeline_encode.h"
 
+#include <cstdlib>
 #include <cstring>
+#include <iomanip>
+#include <new>
 #include <iostream>
+#if defined(_WIN32) || defined(_WIN64)
 #include <windows.h>
+#endif
 
 #include "sysmem_allocator.h"
 
+static void* AllocAligned(size_t nSize, size_t nAlignment)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	return _aligned_malloc(nSize, nAlignment);
+#else
+	void* ptr = NULL;
+	return posix_memalign(&ptr, nAlignment, nSize) ? NULL : ptr;
+#endif
+}
+
+// whether surfaces allocated for one frame info fit an encoder set up with the other
+static bool IsSameSurfaceLayout(const mfxFrameInfo& a, const mfxFrameInfo& b)
+{
+	return a.Width == b.Width && a.Height == b.Height && a.FourCC == b.FourCC && a.ChromaFormat == b.ChromaFormat &&
+		a.CropX == b.CropX && a.CropY == b.CropY && a.CropW == b.CropW && a.CropH == b.CropH;
+}
+
+static void FreeAligned(void* ptr)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
 CEncTaskPool::CEncTaskPool()
 {
-	m_pTasks = NULL;
-	m_pmfxSession = NULL;
-	m_nTaskBufferStart = 0;
+	m_pSlots = NULL;
+	m_pEncoder = NULL;
+	m_pSurfacePool = NULL;
+	m_pTimings = NULL;
+	m_pLatency = NULL;
+	m_pFrameSizes = NULL;
 	m_nPoolSize = 0;
+	m_nHead = 0;
+	m_nTail = 0;
+	m_CompletionStatus = MFX_ERR_NONE;
+	m_bStop = false;
+	m_nCompletedTasks = 0;
 }
 
 CEncTaskPool::~CEncTaskPool()
@@ -19,147 +58,324 @@ CEncTaskPool::~CEncTaskPool()
 	Close();
 }
 
-mfxStatus CEncTaskPool::Init(MFXVideoSession* pmfxSession, CSmplBitstreamWriter* pWriter, mfxU32 nPoolSize, mfxU32 nBufferSize)
+mfxStatus CEncTaskPool::Init(CEncoderBackend* pEncoder, CSmplBitstreamWriter* pWriter, mfxU32 nPoolSize, CBitstreamPool* pBitstreamPool,
+	CSurfacePool* pSurfacePool, bool bCompletionThread)
 {
-	MSDK_CHECK_POINTER(pmfxSession, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(pEncoder, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(pBitstreamPool, MFX_ERR_NULL_PTR);
 
 	MSDK_CHECK_ERROR(nPoolSize, 0, MFX_ERR_UNDEFINED_BEHAVIOR);
-	MSDK_CHECK_ERROR(nBufferSize, 0, MFX_ERR_UNDEFINED_BEHAVIOR);
 
-	m_pmfxSession = pmfxSession;
-	m_nPoolSize = nPoolSize;
+	m_pEncoder = pEncoder;
+	m_pSurfacePool = pSurfacePool;
 
-	m_pTasks = new sTask[m_nPoolSize];
-	if (!m_pTasks) {
+	m_pSlots = (sTaskSlot*)AllocAligned(nPoolSize * sizeof(sTaskSlot), MSDK_CACHE_LINE_SIZE);
+	if (!m_pSlots) {
 		return MFX_ERR_MEMORY_ALLOC;
 	}
 
+	m_nPoolSize = nPoolSize;
+	for (mfxU32 i = 0; i < m_nPoolSize; i++)
+	{
+		new (&m_pSlots[i].Task) sTask();
+	}
+
+	m_nHead = 0;
+	m_nTail = 0;
+	m_CompletionStatus = MFX_ERR_NONE;
+	m_bStop = false;
+
 	mfxStatus sts = MFX_ERR_NONE;
 
 	for (mfxU32 i = 0; i < m_nPoolSize; i++)
 	{
-		sts = m_pTasks[i].Init(nBufferSize, pWriter);
-		MSDK_CHECK_STATUS(sts, "m_pTasks[i].Init failed");
+		sts = m_pSlots[i].Task.Init(pBitstreamPool, pWriter);
+		MSDK_CHECK_STATUS(sts, "m_pSlots[i].Task.Init failed");
+		m_pSlots[i].Task.nTaskIndex = i;
+	}
+
+	if (bCompletionThread)
+	{
+		m_pTaskSubmitted.reset(new MSDKEvent(sts, false, false));
+		MSDK_CHECK_STATUS(sts, "MSDKEvent failed");
+
+		m_pTaskCompleted.reset(new MSDKEvent(sts, false, false));
+		MSDK_CHECK_STATUS(sts, "MSDKEvent failed");
+
+		m_pCompletionThread.reset(new MSDKThread(sts, CompletionThreadRoutine, this));
+		MSDK_CHECK_STATUS(sts, "MSDKThread failed");
 	}
 
 	return MFX_ERR_NONE;
 }
 
-mfxStatus CEncTaskPool::SynchronizeFirstTask()
+mfxStatus CEncTaskPool::CompleteTask(sTask* pTask, mfxU32 nWaitTime)
 {
-	MSDK_CHECK_POINTER(m_pTasks, MFX_ERR_NOT_INITIALIZED);
-	MSDK_CHECK_POINTER(m_pmfxSession, MFX_ERR_NOT_INITIALIZED);
+	msdk_tick nStart = msdk_time_get_tick();
+	CTraceSpan syncSpan("sync", pTask->nFrameOrder, pTask->nTaskIndex);
 
-	mfxStatus sts = MFX_ERR_NONE;
-	bool bGpuHang = false;
+	mfxStatus sts = m_pEncoder->SyncOperation(pTask->EncSyncP, nWaitTime);
+	MSDK_CHECK_STATUS(sts, "SyncOperation failed");
+	if (MFX_WRN_IN_EXECUTION == sts)
+	{
+		return sts;
+	}
 
-	// non-null sync point indicates that task is in execution
-	if (NULL != m_pTasks[m_nTaskBufferStart].EncSyncP)
+	syncSpan.End();
+
+	if (m_pTimings)
 	{
-		sts = m_pmfxSession->SyncOperation(m_pTasks[m_nTaskBufferStart].EncSyncP, MSDK_WAIT_INTERVAL);
-		MSDK_CHECK_STATUS_NO_RET(sts, "SyncOperation failed");
+		m_pTimings->RecordSince(MSDK_STAGE_SYNC, nStart);
+	}
 
-		if (MFX_ERR_NONE == sts)
-		{
-			sts = m_pTasks[m_nTaskBufferStart].WriteBitstream();
-			MSDK_CHECK_STATUS(sts, "m_pTasks[m_nTaskBufferStart].WriteBitstream failed");
+	// the writer may take the bitstream buffer
+	mfxU32 nFrameOrder = pTask->GetEncodedFrameOrder();
+	mfxU32 nCodedSize = pTask->mfxBS.DataLength;
 
-			sts = m_pTasks[m_nTaskBufferStart].Reset();
-			MSDK_CHECK_STATUS(sts, "m_pTasks[m_nTaskBufferStart].Reset failed");
+	// the input surface of this frame is no longer needed for a replay
+	if (m_pSurfacePool)
+	{
+		m_pSurfacePool->Complete(nFrameOrder);
+	}
 
-			// move task buffer start to the next executing task
-			// the first transform frame to the right with non zero sync point
-			for (mfxU32 i = 0; i < m_nPoolSize; i++)
-			{
-				m_nTaskBufferStart = (m_nTaskBufferStart + 1) % m_nPoolSize;
-				if (NULL != m_pTasks[m_nTaskBufferStart].EncSyncP)
-				{
-					break;
-				}
-			}
-		}
+	nStart = msdk_time_get_tick();
+	CTraceSpan writeSpan("write", pTask->nFrameOrder, pTask->nTaskIndex);
+
+	sts = pTask->WriteBitstream(nFrameOrder);
+	MSDK_CHECK_STATUS(sts, "WriteBitstream failed");
+
+	writeSpan.End();
+
+	if (m_pTimings)
+	{
+		m_pTimings->RecordSince(MSDK_STAGE_WRITE, nStart);
 	}
-	else
+	if (m_pLatency)
 	{
-		sts = MFX_ERR_NOT_FOUND; // no tasks left in task buffer
+		m_pLatency->Stop(nFrameOrder, m_pTimings);
+	}
+	if (m_pFrameSizes)
+	{
+		m_pFrameSizes->push_back(nCodedSize);
 	}
-	return bGpuHang ? MFX_ERR_GPU_HANG : sts;
-}
 
-mfxU32 CEncTaskPool::GetFreeTaskIndex()
-{
-	mfxU32 off = 0;
+	sts = pTask->Reset(nCodedSize);
+	MSDK_CHECK_STATUS(sts, "Reset failed");
 
-	if (m_pTasks)
+	m_nCompletedTasks++;
+
+	// the encoder may have unlocked input surfaces of this or earlier frames
+	if (m_pSurfacePool)
 	{
-		for (off = 0; off < m_nPoolSize; off++)
-		{
-			if (NULL == m_pTasks[(m_nTaskBufferStart + off) % m_nPoolSize].EncSyncP)
-			{
-				break;
-			}
-		}
+		m_pSurfacePool->Recycle();
 	}
 
-	if (off >= m_nPoolSize)
-		return m_nPoolSize;
-
-	return (m_nTaskBufferStart + off) % m_nPoolSize;
+	return sts;
 }
 
 mfxStatus CEncTaskPool::GetFreeTask(sTask **ppTask)
 {
 	MSDK_CHECK_POINTER(ppTask, MFX_ERR_NULL_PTR);
-	MSDK_CHECK_POINTER(m_pTasks, MFX_ERR_NOT_INITIALIZED);
+	MSDK_CHECK_POINTER(m_pSlots, MFX_ERR_NOT_INITIALIZED);
+
+	mfxStatus sts = m_CompletionStatus.load();
+	MSDK_CHECK_STATUS(sts, "completion thread failed");
 
-	mfxU32 index = GetFreeTaskIndex();
+	mfxU32 nTail = m_nTail.load(std::memory_order_relaxed);
+	mfxU32 nHead = m_nHead.load(std::memory_order_acquire);
 
-	if (index >= m_nPoolSize)
+	// every task is in flight
+	if ((nTail + 2 * m_nPoolSize - nHead) % (2 * m_nPoolSize) == m_nPoolSize)
 	{
 		return MFX_ERR_NOT_FOUND;
 	}
 
-	// return the address of the task
-	*ppTask = &m_pTasks[index];
+	*ppTask = GetTask(nTail);
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CEncTaskPool::SubmitTask(sTask* pTask)
+{
+	MSDK_CHECK_POINTER(pTask, MFX_ERR_NULL_PTR);
+
+	mfxU32 nTail = m_nTail.load(std::memory_order_relaxed);
+	MSDK_CHECK_ERROR(pTask == GetTask(nTail), false, MFX_ERR_UNDEFINED_BEHAVIOR);
+
+	// publishes the sync point and bitstream to the consumer
+	m_nTail.store(NextPosition(nTail), std::memory_order_release);
+
+	if (m_pCompletionThread.get())
+	{
+		m_pTaskSubmitted->Signal();
+	}
 
 	return MFX_ERR_NONE;
 }
 
+mfxStatus CEncTaskPool::SynchronizeFirstTask(mfxU32 nWaitTime)
+{
+	MSDK_CHECK_POINTER(m_pSlots, MFX_ERR_NOT_INITIALIZED);
+	MSDK_CHECK_POINTER(m_pEncoder, MFX_ERR_NOT_INITIALIZED);
+
+	mfxU32 nHead = m_nHead.load(std::memory_order_acquire);
+
+	if (nHead == m_nTail.load(std::memory_order_acquire))
+	{
+		return MFX_ERR_NOT_FOUND; // no tasks left in task buffer
+	}
+
+	mfxStatus sts = MFX_ERR_NONE;
+
+	if (m_pCompletionThread.get() && !nWaitTime)
+	{
+		sts = m_CompletionStatus.load();
+		MSDK_CHECK_STATUS(sts, "completion thread failed");
+
+		return nHead == m_nHead.load(std::memory_order_acquire) ? MFX_WRN_IN_EXECUTION : MFX_ERR_NONE;
+	}
+
+	if (m_pCompletionThread.get())
+	{
+		CTraceSpan waitSpan("wait completion", GetTask(nHead)->nFrameOrder, GetTask(nHead)->nTaskIndex);
+
+		// wait until the completion thread is done with the oldest task
+		while (nHead == m_nHead.load(std::memory_order_acquire))
+		{
+			sts = m_CompletionStatus.load();
+			MSDK_CHECK_STATUS(sts, "completion thread failed");
+
+			m_pTaskCompleted->Wait();
+		}
+
+		return MFX_ERR_NONE;
+	}
+
+	sts = CompleteTask(GetTask(nHead), nWaitTime);
+	MSDK_CHECK_STATUS(sts, "CompleteTask failed");
+	if (MFX_WRN_IN_EXECUTION == sts)
+	{
+		return sts;
+	}
+
+	m_nHead.store(NextPosition(nHead), std::memory_order_release);
+
+	return sts;
+}
+
+unsigned int MFX_STDCALL CEncTaskPool::CompletionThreadRoutine(void* pArg)
+{
+	static_cast<CEncTaskPool*>(pArg)->CompleteTasks();
+	return 0;
+}
+
+void CEncTaskPool::CompleteTasks()
+{
+	msdk_trace_set_thread_name("completion");
+
+	while (!m_bStop)
+	{
+		mfxU32 nHead = m_nHead.load(std::memory_order_relaxed);
+
+		// after an error tasks stay untouched until ClearTasks
+		if (nHead == m_nTail.load(std::memory_order_acquire) || MFX_ERR_NONE != m_CompletionStatus)
+		{
+			m_pTaskSubmitted->Wait();
+			continue;
+		}
+
+		mfxStatus sts = CompleteTask(GetTask(nHead), MSDK_WAIT_INTERVAL);
+		if (MFX_WRN_IN_EXECUTION == sts)
+		{
+			continue; // still encoding after the longest wait we expect, keep waiting
+		}
+
+		if (MFX_ERR_NONE == sts)
+		{
+			m_nHead.store(NextPosition(nHead), std::memory_order_release);
+		}
+		else
+		{
+			m_CompletionStatus = sts;
+		}
+
+		m_pTaskCompleted->Signal();
+	}
+}
+
 void CEncTaskPool::Close()
 {
-	if (m_pTasks)
+	if (m_pCompletionThread.get())
+	{
+		m_bStop = true;
+		m_pTaskSubmitted->Signal();
+		m_pCompletionThread->Wait();
+		m_pCompletionThread.reset();
+	}
+
+	m_pTaskSubmitted.reset();
+	m_pTaskCompleted.reset();
+
+	if (m_pSlots)
 	{
 		for (mfxU32 i = 0; i < m_nPoolSize; i++)
 		{
-			m_pTasks[i].Close();
+			m_pSlots[i].Task.Close();
+			m_pSlots[i].Task.~sTask();
 		}
-	}
 
-	MSDK_SAFE_DELETE_ARRAY(m_pTasks);
+		FreeAligned(m_pSlots);
+		m_pSlots = NULL;
+	}
 
-	m_pmfxSession = NULL;
-	m_nTaskBufferStart = 0;
+	m_pEncoder = NULL;
+	m_pSurfacePool = NULL;
 	m_nPoolSize = 0;
+	m_nHead = 0;
+	m_nTail = 0;
+	m_CompletionStatus = MFX_ERR_NONE;
+	m_bStop = false;
 }
 
 void CEncTaskPool::ClearTasks()
 {
-	for (size_t i = 0; i < m_nPoolSize; i++)
+	for (mfxU32 i = 0; i < m_nPoolSize; i++)
 	{
-		m_pTasks[i].Reset();
+		m_pSlots[i].Task.Reset(m_pSlots[i].Task.mfxBS.DataLength);
 	}
-	m_nTaskBufferStart = 0;
+	m_nHead = 0;
+	m_nTail = 0;
+	m_CompletionStatus = MFX_ERR_NONE;
 }
 
 sTask::sTask()
 	: EncSyncP(0)
 	, pWriter(NULL)
+	, pBitstreamPool(NULL)
+	, nSmallFrames(0)
+	, nTaskIndex(0)
+	, nFrameOrder(MSDK_TRACE_NONE)
 {
 	MSDK_ZERO_MEMORY(mfxBS);
+	MSDK_ZERO_MEMORY(EncodedFrameInfo);
+	EncodedFrameInfo.Header.BufferId = MFX_EXTBUFF_ENCODED_FRAME_INFO;
+	EncodedFrameInfo.Header.BufferSz = sizeof(EncodedFrameInfo);
+	EncodedFrameInfo.FrameOrder = MSDK_TRACE_NONE;
+	pBSExtParams[0] = &EncodedFrameInfo.Header;
+	mfxBS.ExtParam = pBSExtParams;
+	mfxBS.NumExtParam = 1;
+}
+
+mfxU32 sTask::GetEncodedFrameOrder() const
+{
+	// an encoder that does not fill the buffer codes frames in submission order
+	return MSDK_TRACE_NONE != EncodedFrameInfo.FrameOrder ? EncodedFrameInfo.FrameOrder : nFrameOrder;
 }
 
-mfxStatus sTask::Init(mfxU32 nBufferSize, CSmplBitstreamWriter *pwriter)
+mfxStatus sTask::Init(CBitstreamPool *pbitstreamPool, CSmplBitstreamWriter *pwriter)
 {
+	MSDK_CHECK_POINTER(pbitstreamPool, MFX_ERR_NULL_PTR);
+
 	Close();
 
 	pWriter = pwriter;
@@ -167,52 +383,85 @@ mfxStatus sTask::Init(mfxU32 nBufferSize, CSmplBitstreamWriter *pwriter)
 	mfxStatus sts = Reset();
 	MSDK_CHECK_STATUS(sts, "Reset failed");
 
-	sts = InitMfxBitstream(&mfxBS, nBufferSize);
-	MSDK_CHECK_STATUS_SAFE(sts, "InitMfxBitstream failed", WipeMfxBitstream(&mfxBS));
+	pBitstreamPool = pbitstreamPool;
+	sts = pBitstreamPool->Acquire(&mfxBS);
+	MSDK_CHECK_STATUS(sts, "pBitstreamPool->Acquire failed");
 
 	return sts;
 }
 
 mfxStatus sTask::Close()
 {
-	WipeMfxBitstream(&mfxBS);
+	if (pBitstreamPool)
+	{
+		pBitstreamPool->Release(&mfxBS);
+		pBitstreamPool = NULL;
+	}
 	EncSyncP = 0;
+	nSmallFrames = 0;
 
 	return MFX_ERR_NONE;
 }
 
-mfxStatus sTask::WriteBitstream()
+mfxStatus sTask::WriteBitstream(mfxU32 nFrameOrder)
 {
 	if (pWriter)
-		return pWriter->WriteNextFrame(&mfxBS);
+		return pWriter->WriteNextFrame(&mfxBS, nFrameOrder);
 	else
 		return MFX_ERR_NONE;
 }
 
-mfxStatus sTask::Reset()
+mfxStatus sTask::Reset(mfxU32 nCodedSize)
 {
 	// mark sync point as free
 	EncSyncP = NULL;
 
+	// give an enlarged buffer back once frames fit into the nominal size again
+	if (pBitstreamPool)
+	{
+		mfxStatus sts = pBitstreamPool->Recycle(&mfxBS, nCodedSize, &nSmallFrames);
+		MSDK_CHECK_STATUS(sts, "pBitstreamPool->Recycle failed");
+	}
+
 	// prepare bit stream
 	mfxBS.DataOffset = 0;
 	mfxBS.DataLength = 0;
+	EncodedFrameInfo.FrameOrder = MSDK_TRACE_NONE;
 
 	return MFX_ERR_NONE;
 }
 
 CEncodingPipeline::CEncodingPipeline()
 {
-	m_pmfxENC = NULL;
+	m_pEncoder = NULL;
+	m_bJoinedSession = false;
 	m_pMFXAllocator = NULL;
+	m_pArenaAllocator = NULL;
+	m_bUseArenaAllocator = false;
+	m_bSharedAllocator = false;
+	m_dFrameAllocTime = 0;
+	m_nFrameAllocPageFaults = 0;
 	m_pEncSurfaces = NULL;
 	m_InputFourCC = 0;
+	m_bPushMode = false;
+	m_pPacketQueue = NULL;
+	m_pShmAllocator = NULL;
+	m_bShmInput = false;
+	m_nShmReleased = 0;
 
+	m_nFirstFrame = 0;
 	m_nFramesRead = 0;
+	m_nPrefetchDepth = 0;
+	m_bCompletionThread = false;
+	m_bLowLatency = false;
+	m_nDeviceBusyRetries = 0;
 
 	m_FileWriter = nullptr;
 
 	MSDK_ZERO_MEMORY(m_mfxEncParams);
+	m_bStrictHrd = false;
+	MSDK_ZERO_MEMORY(m_CodingOption);
+	m_pEncExtParams[0] = NULL;
 
 	MSDK_ZERO_MEMORY(m_EncResponse);
 
@@ -224,12 +473,39 @@ CEncodingPipeline::~CEncodingPipeline()
 	Close();
 }
 
-mfxStatus CEncodingPipeline::InitFileWriter(CSmplBitstreamWriter **ppWriter, const std::string& filename)
+CEncodingPipeline::sRung::sRung()
+{
+	pEncoder = NULL;
+	bJoinedSession = false;
+	nBitRate = 0;
+	nWidth = 0;
+	nHeight = 0;
+	nInitialDelayInKB = 0;
+	bScaled = false;
+	pWriter = NULL;
+	nDeviceBusyRetries = 0;
+	pPendingSurface = NULL;
+	pSurfaces = NULL;
+
+	MSDK_ZERO_MEMORY(EncParams);
+	MSDK_ZERO_MEMORY(Response);
+}
+
+mfxStatus CEncodingPipeline::InitFileWriter(CSmplBitstreamWriter **ppWriter, const std::string& filename, CBitstreamPool* pBitstreamPool,
+	sInputParams* pParams)
 {
 	MSDK_CHECK_ERROR(ppWriter, NULL, MFX_ERR_NULL_PTR);
 
 	MSDK_SAFE_DELETE(*ppWriter);
-	*ppWriter = new CSmplBitstreamWriter;
+	if (pParams->bAsyncWriter)
+	{
+		// payloads are handed over with their buffers, so a couple of GOPs can queue up behind a slow volume
+		*ppWriter = new CAsyncBitstreamWriter(pBitstreamPool, pParams->nWriterDurability, MSDK_ASYNC_WRITE_QUEUE_DEPTH);
+	}
+	else
+	{
+		*ppWriter = new CSmplBitstreamWriter;
+	}
 	MSDK_CHECK_POINTER(*ppWriter, MFX_ERR_MEMORY_ALLOC);
 	mfxStatus sts = (*ppWriter)->Init(filename);
 	MSDK_CHECK_STATUS(sts, " failed");
@@ -243,6 +519,7 @@ void CEncodingPipeline::FreeFileWriter()
 		m_FileWriter->Close();
 	}
 	MSDK_SAFE_DELETE(m_FileWriter);
+	m_pPacketQueue = NULL;
 }
 
 mfxStatus CEncodingPipeline::Init(sInputParams *pParams) {
@@ -252,97 +529,564 @@ mfxStatus CEncodingPipeline::Init(sInputParams *pParams) {
 
 	m_InputFourCC = MFX_FOURCC_NV12;
 
-	mfxInitParam initPar;
-	mfxVersion version;     // real API version with which library is initialized
+	if (pParams->bUseMockEncoder)
+	{
+		m_pEncoder = new CMockEncoderBackend(pParams->MockParams);
+	}
+	else
+	{
+		m_pEncoder = new CMfxEncoderBackend();
+	}
+	MSDK_CHECK_POINTER(m_pEncoder, MFX_ERR_MEMORY_ALLOC);
 
-	MSDK_ZERO_MEMORY(initPar);
+	m_bShmInput = !pParams->shmName.empty();
+	m_bPushMode = pParams->InputFiles.empty() && !m_bShmInput;
+	if (m_bShmInput)
+	{
+		// the producer writes into frames of our own allocator, from the first frame of its stream on
+		if (pParams->pSharedAllocator || pParams->nFirstFrame || pParams->nFrameCount)
+		{
+			std::cerr << "ERROR: shared memory input takes neither a shared allocator nor a frame range" << std::endl;
+			return MFX_ERR_UNSUPPORTED;
+		}
+	}
+	else if (!m_bPushMode)
+	{
+		// prepare input file reader
+		sts = m_FileReader.Init(pParams->InputFiles, pParams->FileInputFourCC, false, pParams->bUseMemoryMap);
+		MSDK_CHECK_STATUS(sts, "m_FileReader.Init failed");
 
-	// we set version to 1.0 and later we will query actual version of the library which will got leaded
-	initPar.Version.Major = 1;
-	initPar.Version.Minor = 0;
+		if (pParams->nFirstFrame || pParams->nFrameCount)
+		{
+			sts = m_FileReader.SetFrameRange(pParams->nWidth, pParams->nHeight, pParams->nFirstFrame, pParams->nFrameCount);
+			MSDK_CHECK_STATUS(sts, "m_FileReader.SetFrameRange failed");
+		}
+	}
+	m_nFirstFrame = pParams->nFirstFrame;
+	m_Prefetcher.SetFirstFrameOrder(m_nFirstFrame);
+	m_Prefetcher.SetFrameLatency(&m_Latency);
 
-	initPar.GPUCopy = 0;
+	m_FileReader.SetStageTimings(&m_Timings);
+	m_TaskPool.SetStageTimings(&m_Timings);
 
-	// Init session - hw only
-	// try searching on all display adapters
-	initPar.Implementation = MFX_IMPL_HARDWARE_ANY;
+	if (!pParams->reportFile.empty())
+	{
+		sts = m_Report.Init(pParams->reportFile, pParams->nReportInterval);
+		MSDK_CHECK_STATUS(sts, "m_Report.Init failed");
+	}
 
-	// Library should pick first available compatible adapter during InitEx call with MFX_IMPL_HARDWARE_ANY
-	sts = m_mfxSession.InitEx(initPar);
+	m_sTraceFile = pParams->traceFile;
+	if (!m_sTraceFile.empty())
+	{
+		msdk_trace_start();
+	}
 
-	MSDK_CHECK_STATUS(sts, "m_mfxSession.InitEx failed");
+	m_bLowLatency = pParams->bLowLatency;
+	// frames waiting in the prefetch ring add to the latency
+	m_nPrefetchDepth = (m_bPushMode || m_bShmInput || m_bLowLatency) ? 0 : pParams->nPrefetchDepth;
+	m_bCompletionThread = pParams->bCompletionThread;
+	m_bUseArenaAllocator = pParams->bUseArenaAllocator;
 
-	sts = MFXQueryVersion(m_mfxSession, &version); // get real API version of the loaded library
-	MSDK_CHECK_STATUS(sts, "MFXQueryVersion failed");
+	if (m_bPushMode && pParams->dstFileBuff.empty())
+	{
+		m_pPacketQueue = new CPacketQueue(&m_BitstreamPool, pParams->pPacketCallback, pParams->pPacketContext,
+			MSDK_PACKET_QUEUE_DEPTH);
+		MSDK_CHECK_POINTER(m_pPacketQueue, MFX_ERR_MEMORY_ALLOC);
+		m_FileWriter = m_pPacketQueue;
 
-	// create encoder
-	m_pmfxENC = new MFXVideoENCODE(m_mfxSession);
-	MSDK_CHECK_POINTER(m_pmfxENC, MFX_ERR_MEMORY_ALLOC);
+		sts = m_FileWriter->Init(pParams->dstFileBuff);
+		MSDK_CHECK_STATUS(sts, "m_FileWriter->Init failed");
+	}
+	else
+	{
+		sts = InitFileWriter(&m_FileWriter, pParams->dstFileBuff, &m_BitstreamPool, pParams);
+		MSDK_CHECK_STATUS(sts, "InitFileWriter failed");
+	}
 
-	// prepare input file reader
-	sts = m_FileReader.Init(pParams->InputFiles, pParams->FileInputFourCC);
-	MSDK_CHECK_STATUS(sts, "m_FileReader.Init failed");
+	// the latency of a frame ends once its bitstream is written, which an async writer does after the task completed
+	if (!m_FileWriter->SetFrameLatency(&m_Latency, &m_Timings))
+	{
+		m_TaskPool.SetFrameLatency(&m_Latency);
+	}
 
-	sts = InitFileWriter(&m_FileWriter, pParams->dstFileBuff);
-	MSDK_CHECK_STATUS(sts, "InitFileWriter failed");
+	if (pParams->pSharedAllocator)
+	{
+		m_pMFXAllocator = pParams->pSharedAllocator;
+		m_bSharedAllocator = true;
+	}
+	else
+	{
+		if (m_bShmInput)
+		{
+			m_pShmAllocator = new ShmBufferAllocator(&m_ShmRing, pParams->shmName);
+			MSDK_CHECK_POINTER(m_pShmAllocator, MFX_ERR_MEMORY_ALLOC);
+		}
 
-	// create and init frame allocator
-	sts = CreateAllocator();
-	MSDK_CHECK_STATUS(sts, "CreateAllocator failed");
+		// create and init frame allocator
+		sts = CreateAllocator();
+		MSDK_CHECK_STATUS(sts, "CreateAllocator failed");
+	}
 
 	sts = InitMfxEncParams(pParams);
 	MSDK_CHECK_STATUS(sts, "InitMfxEncParams failed");
 
+	// probes the encoder with the parameters it is going to get
+	sts = CreateSession(pParams, m_pEncoder, m_mfxEncParams);
+	MSDK_CHECK_STATUS(sts, "CreateSession failed");
+
+	if (pParams->pParentSession)
+	{
+		sts = pParams->pParentSession->JoinSession(m_pEncoder);
+		MSDK_CHECK_STATUS(sts, "JoinSession failed");
+		m_bJoinedSession = true;
+	}
+
+	sts = InitRungs(pParams);
+	MSDK_CHECK_STATUS(sts, "InitRungs failed");
+
 	sts = ResetMFXComponents(pParams);
 	MSDK_CHECK_STATUS(sts, "ResetMFXComponents failed");
 
+	if (m_bPushMode)
+	{
+		// as many application frames in flight as there are surfaces of our own
+		sts = m_UserSurfacePool.Init(m_mfxEncParams.mfx.FrameInfo, m_EncResponse.NumFrameActual, pParams->pUserFrameRelease,
+			pParams->pUserFrameContext);
+		MSDK_CHECK_STATUS(sts, "m_UserSurfacePool.Init failed");
+	}
+
 	return MFX_ERR_NONE;
 }
 
-void CEncodingPipeline::Close()
+mfxStatus CEncodingPipeline::CreateSession(sInputParams* pParams, CEncoderBackend* pEncoder, const mfxVideoParam& encParams)
 {
-	if (m_FileWriter) {
-		std::cout << "Frame number: " << m_FileWriter->m_nProcessedFramesNum << std::endl;
+	MSDK_CHECK_POINTER(pEncoder, MFX_ERR_NOT_INITIALIZED);
+
+	std::vector<mfxIMPL> implementations = pParams->Implementations;
+	if (implementations.empty())
+	{
+		// any display adapter, the library picks the first compatible one
+		implementations.push_back(MFX_IMPL_HARDWARE_ANY);
 	}
 
-	MSDK_SAFE_DELETE(m_pmfxENC);
+	mfxInitParam initPar;
+	MSDK_ZERO_MEMORY(initPar);
 
-	DeleteFrames();
+	// we set version to 1.0 and later we will query actual version of the library which will got leaded
+	initPar.Version.Major = 1;
+	initPar.Version.Minor = 0;
 
-	m_TaskPool.Close();
-	m_mfxSession.Close();
+	initPar.GPUCopy = 0;
 
-	m_FileReader.Close();
-	FreeFileWriter();
+	mfxStatus sts = MFX_ERR_NOT_FOUND;
 
-	// allocator if used as external for MediaSDK must be deleted after SDK components
-	DeleteAllocator();
+	for (size_t i = 0; i < implementations.size(); i++)
+	{
+		bool bLast = i + 1 == implementations.size();
+		initPar.Implementation = implementations[i];
+
+		CTimer t;
+		t.Start();
+
+		// opens the session and creates the encoder
+		sts = pEncoder->InitSession(initPar);
+		if (sts >= MFX_ERR_NONE && MFX_WRN_PARTIAL_ACCELERATION != sts)
+		{
+			// the session can be fully accelerated while the encoder with these parameters is not
+			mfxVideoParam par = encParams;
+			sts = pEncoder->Query(&par, &par);
+		}
+
+		mfxF64 dTime = t.GetTime();
+
+		if (sts < MFX_ERR_NONE || (MFX_WRN_PARTIAL_ACCELERATION == sts && !bLast))
+		{
+			std::cout << "Implementation " << ImplementationToString(implementations[i]) << ": "
+				<< (sts < MFX_ERR_NONE ? "failed with " : "partial acceleration, ") << "status " << sts
+				<< (bLast ? "" : ", trying the next one") << std::endl;
+			pEncoder->CloseSession();
+			continue;
+		}
+
+		if (MFX_WRN_PARTIAL_ACCELERATION == sts)
+		{
+			std::cout << "WARNING: partial acceleration, no other implementation to fall back to" << std::endl;
+		}
+
+		mfxIMPL impl = 0;
+		sts = pEncoder->QueryIMPL(&impl);
+		MSDK_CHECK_STATUS(sts, "pEncoder->QueryIMPL failed");
+
+		mfxVersion version; // real API version with which library is initialized
+		sts = pEncoder->QueryVersion(&version);
+		MSDK_CHECK_STATUS(sts, "pEncoder->QueryVersion failed");
+
+		std::cout << "Implementation: " << ImplementationToString(impl) << " (requested "
+			<< ImplementationToString(implementations[i]) << "), API " << version.Major << "." << version.Minor
+			<< ", session created in " << std::fixed << std::setprecision(2) << dTime * 1000 << " ms" << std::endl;
+		std::cout.unsetf(std::ios::floatfield);
+
+		return MFX_ERR_NONE;
+	}
+
+	std::cout << "No implementation could be initialized" << std::endl;
+
+	return sts;
 }
 
-mfxStatus CEncodingPipeline::CreateAllocator()
+mfxStatus CEncodingPipeline::InitRungs(sInputParams* pParams)
 {
 	mfxStatus sts = MFX_ERR_NONE;
 
-	// create system memory allocator
-	m_pMFXAllocator = new SysMemFrameAllocator;
-	MSDK_CHECK_POINTER(m_pMFXAllocator, MFX_ERR_MEMORY_ALLOC);
+	// all encoders of the ladder run on one scheduler, the one of the main session or of the session it joined
+	CEncoderBackend* pParentSession = pParams->pParentSession ? pParams->pParentSession : m_pEncoder;
 
-	// initialize memory allocator
-	sts = m_pMFXAllocator->Init();
-	MSDK_CHECK_STATUS(sts, "m_pMFXAllocator->Init failed");
+	for (size_t i = 0; i < pParams->Ladder.size(); i++)
+	{
+		sRung* pRung = new sRung;
+		MSDK_CHECK_POINTER(pRung, MFX_ERR_MEMORY_ALLOC);
+		m_Rungs.push_back(pRung);
+
+		pRung->nBitRate = pParams->Ladder[i].nBitRate;
+		pRung->nWidth = pParams->Ladder[i].nWidth;
+		pRung->nHeight = pParams->Ladder[i].nHeight;
+		pRung->nInitialDelayInKB = pParams->Ladder[i].nInitialDelayInKB;
+		InitRungEncParams(pRung);
+
+		if (pParams->bUseMockEncoder)
+		{
+			pRung->pEncoder = new CMockEncoderBackend(pParams->MockParams);
+		}
+		else
+		{
+			pRung->pEncoder = new CMfxEncoderBackend();
+		}
+		MSDK_CHECK_POINTER(pRung->pEncoder, MFX_ERR_MEMORY_ALLOC);
+
+		sts = InitFileWriter(&pRung->pWriter, pParams->Ladder[i].dstFile, &pRung->BitstreamPool, pParams);
+		MSDK_CHECK_STATUS(sts, "InitFileWriter failed");
+
+		std::cout << "Rung " << i + 1 << ": " << pRung->EncParams.mfx.FrameInfo.CropW << "x" << pRung->EncParams.mfx.FrameInfo.CropH
+			<< ", " << pRung->nBitRate << " Kbps to " << pParams->Ladder[i].dstFile << std::endl;
+
+		sts = CreateSession(pParams, pRung->pEncoder, pRung->EncParams);
+		MSDK_CHECK_STATUS(sts, "CreateSession failed");
+
+		sts = pParentSession->JoinSession(pRung->pEncoder);
+		MSDK_CHECK_STATUS(sts, "JoinSession failed");
+		pRung->bJoinedSession = true;
+
+		pRung->TaskPool.SetStageTimings(&pRung->Timings);
+	}
+
+	// one scaler for all rungs, they are scaled one after another
+	for (size_t i = 0; i < m_Rungs.size(); i++)
+	{
+		if (m_Rungs[i]->bScaled)
+		{
+			sts = m_Scaler.Init(pParams->nScaleFilter, pParams->nScaleThreads);
+			MSDK_CHECK_STATUS(sts, "m_Scaler.Init failed");
+
+			std::cout << "Scaler: " << (MSDK_SCALE_AREA == pParams->nScaleFilter ? "area" : "bilinear") << " filter, "
+				<< m_Scaler.GetThreadCount() << " threads" << std::endl;
+			break;
+		}
+	}
 
 	return MFX_ERR_NONE;
 }
 
-void CEncodingPipeline::DeleteAllocator()
+void CEncodingPipeline::InitRungEncParams(sRung* pRung)
 {
-	// delete allocator
-	MSDK_SAFE_DELETE(m_pMFXAllocator);
+	// the same frames and GOP as the main encoder, so that all of them can share the input surfaces
+	pRung->EncParams = m_mfxEncParams;
+	pRung->EncParams.mfx.TargetKbps = pRung->nBitRate;
+	if (m_bStrictHrd)
+	{
+		SetStrictHrdBuffer(&pRung->EncParams.mfx, pRung->nInitialDelayInKB);
+	}
+
+	// any other size gets frames of its own from the scaler
+	if (pRung->nWidth && pRung->nHeight)
+	{
+		mfxFrameInfo& info = pRung->EncParams.mfx.FrameInfo;
+		info.Width = MSDK_ALIGN16(pRung->nWidth);
+		info.Height = (MFX_PICSTRUCT_PROGRESSIVE == info.PicStruct) ? MSDK_ALIGN16(pRung->nHeight) : MSDK_ALIGN32(pRung->nHeight);
+		info.CropW = pRung->nWidth;
+		info.CropH = pRung->nHeight;
+	}
+
+	pRung->bScaled = pRung->EncParams.mfx.FrameInfo.CropW != m_mfxEncParams.mfx.FrameInfo.CropW ||
+		pRung->EncParams.mfx.FrameInfo.CropH != m_mfxEncParams.mfx.FrameInfo.CropH;
 }
 
-mfxStatus CEncodingPipeline::InitMfxEncParams(sInputParams *pInParams)
+void CEncodingPipeline::CloseRungs()
 {
-	m_mfxEncParams.mfx.CodecId = MFX_CODEC_AVC;
+	for (size_t i = 0; i < m_Rungs.size(); i++)
+	{
+		sRung* pRung = m_Rungs[i];
+
+		pRung->TaskPool.Close();
+		pRung->SurfacePool.Close();
+
+		if (pRung->pWriter)
+		{
+			pRung->pWriter->Close();
+		}
+		MSDK_SAFE_DELETE(pRung->pWriter);
+
+		pRung->BitstreamPool.Close();
+
+		if (pRung->pEncoder)
+		{
+			pRung->pEncoder->Close();
+
+			if (pRung->bJoinedSession)
+			{
+				mfxStatus sts = pRung->pEncoder->DisjoinSession();
+				MSDK_CHECK_STATUS_NO_RET(sts, "pRung->pEncoder->DisjoinSession failed");
+			}
+			pRung->pEncoder->CloseSession();
+		}
+		MSDK_SAFE_DELETE(pRung->pEncoder);
+
+		DeleteRungFrames(pRung);
+		delete pRung;
+	}
+	m_Rungs.clear();
+
+	m_Scaler.Close();
+}
+
+void CEncodingPipeline::Close()
+{
+	if (m_pEncoder)
+	{
+		if (m_FileWriter) {
+			m_FileWriter->Flush();
+			std::cout << "Frame number: " << m_FileWriter->m_nProcessedFramesNum << std::endl;
+			m_FileWriter->PrintStatistics();
+		}
+
+		for (size_t i = 0; i < m_Rungs.size(); i++)
+		{
+			if (m_Rungs[i]->pWriter)
+			{
+				m_Rungs[i]->pWriter->Flush();
+				std::cout << "Rung " << i + 1 << " frame number: " << m_Rungs[i]->pWriter->m_nProcessedFramesNum << std::endl;
+				m_Rungs[i]->pWriter->PrintStatistics();
+			}
+		}
+
+		if (m_Report.IsEnabled())
+		{
+			WriteReport(true);
+		}
+
+		m_FileReader.PrintStatistics();
+		m_SurfacePool.PrintStatistics();
+		m_BitstreamPool.PrintStatistics();
+		PrintMemoryStatistics();
+		m_Timings.PrintStatistics();
+	}
+
+	// the sessions of the rungs are children of the main one
+	CloseRungs();
+
+	// stops the completion thread before the surfaces it recycles go away
+	m_TaskPool.Close();
+	if (m_pPacketQueue)
+	{
+		// packets nobody polled hold buffers of the pool
+		m_pPacketQueue->Close();
+	}
+	m_BitstreamPool.Close();
+
+	if (m_pEncoder)
+	{
+		m_pEncoder->Close();
+	}
+
+	m_Prefetcher.Close();
+	m_SurfacePool.Close();
+	// with the encoder closed nothing reads application frames any more
+	m_UserSurfacePool.Close();
+	DeleteFrames();
+
+	if (m_pEncoder)
+	{
+		// with the encoder closed there is no task left that would need the parent's scheduler
+		if (m_bJoinedSession)
+		{
+			mfxStatus sts = m_pEncoder->DisjoinSession();
+			MSDK_CHECK_STATUS_NO_RET(sts, "m_pEncoder->DisjoinSession failed");
+			m_bJoinedSession = false;
+		}
+		m_pEncoder->CloseSession();
+	}
+	MSDK_SAFE_DELETE(m_pEncoder);
+
+	m_FileReader.Close();
+	FreeFileWriter();
+	m_Timings.Reset();
+	m_HrdTrace = sHrdTrace();
+	m_Report.Close();
+	m_nDeviceBusyRetries = 0;
+
+	// allocator if used as external for MediaSDK must be deleted after SDK components
+	DeleteAllocator();
+	// after the frames in it were freed; a producer still waiting for a slot gives up
+	m_ShmRing.Close();
+	m_bShmInput = false;
+	m_nShmReleased = 0;
+
+	// every thread that recorded spans is gone by now
+	if (!m_sTraceFile.empty())
+	{
+		msdk_trace_stop();
+
+		mfxStatus sts = msdk_trace_write(m_sTraceFile);
+		MSDK_CHECK_STATUS_NO_RET(sts, "msdk_trace_write failed");
+		m_sTraceFile.clear();
+	}
+}
+
+mfxStatus CEncodingPipeline::CreateAllocator()
+{
+	mfxStatus sts = MFX_ERR_NONE;
+
+	// create system memory allocator
+	SysMemFrameAllocator* pAllocator = new SysMemFrameAllocator;
+	MSDK_CHECK_POINTER(pAllocator, MFX_ERR_MEMORY_ALLOC);
+	m_pMFXAllocator = pAllocator;
+
+	if (m_pShmAllocator)
+	{
+		// the other frames are few, they come from calloc rather than the arenas
+		pAllocator->SetBufferAllocator(m_pShmAllocator);
+	}
+	else if (m_bUseArenaAllocator)
+	{
+		m_pArenaAllocator = new ArenaBufferAllocator;
+		MSDK_CHECK_POINTER(m_pArenaAllocator, MFX_ERR_MEMORY_ALLOC);
+
+		pAllocator->SetBufferAllocator(m_pArenaAllocator);
+	}
+
+	// initialize memory allocator
+	sts = m_pMFXAllocator->Init();
+	MSDK_CHECK_STATUS(sts, "m_pMFXAllocator->Init failed");
+
+	return MFX_ERR_NONE;
+}
+
+void CEncodingPipeline::DeleteAllocator()
+{
+	if (m_bSharedAllocator)
+	{
+		m_pMFXAllocator = NULL;
+		m_bSharedAllocator = false;
+		return;
+	}
+
+	// delete allocator
+	MSDK_SAFE_DELETE(m_pMFXAllocator);
+	// the frame allocator does not own an external buffer allocator
+	MSDK_SAFE_DELETE(m_pArenaAllocator);
+	MSDK_SAFE_DELETE(m_pShmAllocator);
+}
+
+void CEncodingPipeline::PrintMemoryStatistics()
+{
+	if (m_pArenaAllocator)
+	{
+		m_pArenaAllocator->PrintStatistics();
+	}
+
+	mfxU64 nPageFaults = 0, nResidentBytes = 0;
+	GetProcessMemoryCounters(&nPageFaults, &nResidentBytes);
+
+	std::cout << "Frame allocation: " << std::fixed << std::setprecision(2) << m_dFrameAllocTime * 1000 << " ms, "
+		<< m_nFrameAllocPageFaults << " page faults; process: " << nPageFaults << " page faults, "
+		<< (mfxF64)nResidentBytes / (1024 * 1024) << " MB resident" << std::endl;
+	std::cout.unsetf(std::ios::floatfield);
+}
+
+void CEncodingPipeline::GetHrdTraces(std::vector<sHrdTrace>* pTraces)
+{
+	pTraces->clear();
+
+	if (m_bStrictHrd)
+	{
+		pTraces->push_back(m_HrdTrace);
+		for (size_t i = 0; i < m_Rungs.size(); i++)
+		{
+			pTraces->push_back(m_Rungs[i]->HrdTrace);
+		}
+	}
+}
+
+void CEncodingPipeline::CollectStatistics(sRunStatistics* pStats)
+{
+	MSDK_ZERO_MEMORY(*pStats);
+
+	// counters of other threads are atomic or read under the lock of their pool
+	pStats->nFramesRead = (m_bPushMode || m_bShmInput) ? m_nFramesRead : m_FileReader.GetFramesLoaded();
+	pStats->nFramesEncoded = m_TaskPool.GetCompletedTasks();
+	pStats->nBytesIn = m_FileReader.GetBytesLoaded();
+	if (m_FileWriter)
+	{
+		pStats->nFramesWritten = m_FileWriter->m_nProcessedFramesNum;
+		pStats->nBytesOut = m_FileWriter->m_nProcessedBytes;
+	}
+
+	pStats->nSurfacePoolSize = m_SurfacePool.GetPoolSize();
+	pStats->nSurfacesInUse = m_SurfacePool.GetSurfacesInUse();
+	pStats->nTaskPoolSize = m_TaskPool.GetPoolSize();
+	pStats->nTasksInFlight = m_TaskPool.GetTasksInFlight();
+	pStats->nDeviceBusyRetries = m_nDeviceBusyRetries;
+
+	mfxU64 nPageFaults = 0;
+	GetProcessMemoryCounters(&nPageFaults, &pStats->nResidentBytes);
+	m_BitstreamPool.GetAllocatedBytes(&pStats->nBitstreamPoolBytes, &pStats->nBitstreamPoolPeakBytes);
+
+	// frame counts are those of the main output, bytes and retries of all outputs of the ladder
+	for (size_t i = 0; i < m_Rungs.size(); i++)
+	{
+		if (m_Rungs[i]->pWriter)
+		{
+			pStats->nBytesOut += m_Rungs[i]->pWriter->m_nProcessedBytes;
+		}
+		pStats->nDeviceBusyRetries += m_Rungs[i]->nDeviceBusyRetries;
+
+		mfxU64 nBytes = 0, nPeakBytes = 0;
+		m_Rungs[i]->BitstreamPool.GetAllocatedBytes(&nBytes, &nPeakBytes);
+		pStats->nBitstreamPoolBytes += nBytes;
+		pStats->nBitstreamPoolPeakBytes += nPeakBytes;
+	}
+	if (m_pArenaAllocator)
+	{
+		pStats->nArenaMappedBytes = m_pArenaAllocator->GetMappedBytes();
+	}
+}
+
+void CEncodingPipeline::WriteReport(bool bFinal)
+{
+	sRunStatistics stats;
+	CollectStatistics(&stats);
+
+	// the completion thread and the prefetch thread keep recording meanwhile
+	CStageTimings timings;
+	m_Timings.Snapshot(&timings);
+
+	// a report that cannot be written must not stop the encoding
+	mfxStatus sts = m_Report.Write(stats, timings, bFinal);
+	MSDK_CHECK_STATUS_NO_RET(sts, "m_Report.Write failed");
+}
+
+mfxStatus CEncodingPipeline::InitMfxEncParams(sInputParams *pInParams)
+{
+	m_mfxEncParams.mfx.CodecId = MFX_CODEC_AVC;
 	m_mfxEncParams.mfx.TargetUsage = MFX_TARGETUSAGE_BALANCED; // trade-off between quality and speed
 	m_mfxEncParams.mfx.RateControlMethod = MFX_RATECONTROL_CBR;
 	m_mfxEncParams.mfx.GopRefDist = 0;
@@ -396,41 +1140,260 @@ mfxStatus CEncodingPipeline::InitMfxEncParams(sInputParams *pInParams)
 
 	m_mfxEncParams.AsyncDepth = 4;
 
+	if (pInParams->nGopSize)
+	{
+		// every I frame is an IDR frame that no other frame references across, so the stream can be cut at any of them
+		m_mfxEncParams.mfx.GopPicSize = pInParams->nGopSize;
+		m_mfxEncParams.mfx.IdrInterval = 0;
+		m_mfxEncParams.mfx.GopOptFlag = MFX_GOP_CLOSED | MFX_GOP_STRICT;
+	}
+
+	m_bStrictHrd = pInParams->bStrictHrd;
+	if (m_bStrictHrd || pInParams->bLowLatency)
+	{
+		MSDK_ZERO_MEMORY(m_CodingOption);
+		m_CodingOption.Header.BufferId = MFX_EXTBUFF_CODING_OPTION;
+		m_CodingOption.Header.BufferSz = sizeof(m_CodingOption);
+
+		m_pEncExtParams[0] = &m_CodingOption.Header;
+		m_mfxEncParams.ExtParam = m_pEncExtParams;
+		m_mfxEncParams.NumExtParam = 1;
+	}
+
+	if (m_bStrictHrd)
+	{
+		SetStrictHrdBuffer(&m_mfxEncParams.mfx, pInParams->nInitialDelayInKB);
+
+		// buffering period and picture timing SEI let a decoder check the buffer from any IDR frame on
+		m_CodingOption.NalHrdConformance = MFX_CODINGOPTION_ON;
+		m_CodingOption.VuiNalHrdParameters = MFX_CODINGOPTION_ON;
+		m_CodingOption.PicTimingSEI = MFX_CODINGOPTION_ON;
+	}
+
+	if (pInParams->bLowLatency)
+	{
+		// frames are coded in display order from one reference, CBR rate control does not look ahead, and the
+		// encoder works on one frame at a time
+		m_mfxEncParams.mfx.GopRefDist = 1;
+		m_mfxEncParams.mfx.NumRefFrame = 1;
+		m_mfxEncParams.AsyncDepth = 1;
+
+		// a decoder may output every frame as soon as it is decoded
+		m_CodingOption.MaxDecFrameBuffering = 1;
+	}
+
+	return MFX_ERR_NONE;
+}
+
+void CEncodingPipeline::SetStrictHrdBuffer(mfxInfoMFX* pMfx, mfxU16 nInitialDelayInKB)
+{
+	// CChunkedEncoder starts a piece with the fullness the previous one leaves, see sHrdTrace
+	pMfx->MaxKbps = pMfx->TargetKbps;
+	pMfx->BufferSizeInKB = GetStrictHrdBufferSizeInKB(pMfx->TargetKbps);
+	pMfx->InitialDelayInKB = nInitialDelayInKB ? MSDK_MIN(nInitialDelayInKB, pMfx->BufferSizeInKB) :
+		(mfxU16)MSDK_MAX(pMfx->BufferSizeInKB / 2, 1);
+}
+
+mfxStatus CEncodingPipeline::InitHrdTrace(CEncoderBackend* pEncoder, sHrdTrace* pTrace)
+{
+	mfxVideoParam par;
+	MSDK_ZERO_MEMORY(par);
+
+	mfxStatus sts = pEncoder->GetVideoParam(&par);
+	MSDK_CHECK_STATUS(sts, "pEncoder->GetVideoParam failed");
+
+	mfxU64 nMultiplier = MSDK_MAX(par.mfx.BRCParamMultiplier, 1);
+	mfxFrameInfo& info = par.mfx.FrameInfo;
+
+	pTrace->nBitRate = par.mfx.TargetKbps * nMultiplier * 1000;
+	pTrace->nBufferSize = par.mfx.BufferSizeInKB * nMultiplier * 8000;
+	pTrace->nInitialDelay = par.mfx.InitialDelayInKB * nMultiplier * 8000;
+	pTrace->dFrameRate = info.FrameRateExtD ? (mfxF64)info.FrameRateExtN / info.FrameRateExtD : 0;
+
 	return MFX_ERR_NONE;
 }
 
 mfxStatus CEncodingPipeline::ResetMFXComponents(sInputParams* pParams)
 {
 	MSDK_CHECK_POINTER(pParams, MFX_ERR_NULL_PTR);
-	MSDK_CHECK_POINTER(m_pmfxENC, MFX_ERR_NOT_INITIALIZED);
+	MSDK_CHECK_POINTER(m_pEncoder, MFX_ERR_NOT_INITIALIZED);
 
 	mfxStatus sts = MFX_ERR_NONE;
 
-	sts = m_pmfxENC->Close();
+	sts = m_pEncoder->Close();
 	MSDK_IGNORE_MFX_STS(sts, MFX_ERR_NOT_INITIALIZED);
-	MSDK_CHECK_STATUS(sts, "m_pmfxENC->Close failed");
+	MSDK_CHECK_STATUS(sts, "m_pEncoder->Close failed");
+
+	m_TaskPool.Close();
+
+	for (size_t i = 0; i < m_Rungs.size(); i++)
+	{
+		sts = m_Rungs[i]->pEncoder->Close();
+		MSDK_IGNORE_MFX_STS(sts, MFX_ERR_NOT_INITIALIZED);
+		MSDK_CHECK_STATUS(sts, "pRung->pEncoder->Close failed");
+
+		m_Rungs[i]->TaskPool.Close();
+		m_Rungs[i]->SurfacePool.Close();
+		m_Rungs[i]->pPendingSurface = NULL;
+	}
 
 	// free allocated frames
+	m_Prefetcher.Close();
+	m_SurfacePool.Close();
+	m_ReplayQueue.clear();
+	m_Latency.Reset();
+	// the frames in flight are dropped, application frames go back once nothing pins them
+	m_UserSurfacePool.ResetLocks();
 	DeleteFrames();
 
-	m_TaskPool.Close();
+	mfxU64 nPageFaultsBefore = 0, nPageFaultsAfter = 0, nResidentBytes = 0;
+	GetProcessMemoryCounters(&nPageFaultsBefore, &nResidentBytes);
+
+	CTimer allocTimer;
+	allocTimer.Start();
 
 	sts = AllocFrames();
 	MSDK_CHECK_STATUS(sts, "AllocFrames failed");
 
-	sts = m_pmfxENC->Init(&m_mfxEncParams);
+	m_dFrameAllocTime += allocTimer.GetTime();
+	GetProcessMemoryCounters(&nPageFaultsAfter, &nResidentBytes);
+	m_nFrameAllocPageFaults += nPageFaultsAfter - nPageFaultsBefore;
+
+	sts = m_pEncoder->Init(&m_mfxEncParams);
+	if (MFX_WRN_PARTIAL_ACCELERATION == sts)
+	{
+		std::cout << "WARNING: partial acceleration" << std::endl;
+		MSDK_IGNORE_MFX_STS(sts, MFX_WRN_PARTIAL_ACCELERATION);
+	}
+
+	MSDK_CHECK_STATUS(sts, "m_pEncoder->Init failed");
+
+	sts = m_BitstreamPool.Init(GetEncodedFrameBufferSize(m_pEncoder));
+	MSDK_CHECK_STATUS(sts, "m_BitstreamPool.Init failed");
+
+	sts = m_SurfacePool.Init(m_pEncSurfaces, m_EncResponse.NumFrameActual);
+	MSDK_CHECK_STATUS(sts, "m_SurfacePool.Init failed");
+
+	sts = m_TaskPool.Init(m_pEncoder, m_FileWriter, m_mfxEncParams.AsyncDepth, &m_BitstreamPool, &m_SurfacePool, m_bCompletionThread);
+	MSDK_CHECK_STATUS(sts, "m_TaskPool.Init failed");
+
+	if (m_bStrictHrd)
+	{
+		sts = InitHrdTrace(m_pEncoder, &m_HrdTrace);
+		MSDK_CHECK_STATUS(sts, "InitHrdTrace failed");
+		m_TaskPool.SetFrameSizes(&m_HrdTrace.FrameSizes);
+	}
+
+	for (size_t i = 0; i < m_Rungs.size(); i++)
+	{
+		sRung* pRung = m_Rungs[i];
+
+		sts = pRung->pEncoder->Init(&pRung->EncParams);
+		if (MFX_WRN_PARTIAL_ACCELERATION == sts)
+		{
+			std::cout << "WARNING: partial acceleration of rung " << i + 1 << std::endl;
+			MSDK_IGNORE_MFX_STS(sts, MFX_WRN_PARTIAL_ACCELERATION);
+		}
+		MSDK_CHECK_STATUS(sts, "pRung->pEncoder->Init failed");
+
+		sts = pRung->BitstreamPool.Init(GetEncodedFrameBufferSize(pRung->pEncoder));
+		MSDK_CHECK_STATUS(sts, "pRung->BitstreamPool.Init failed");
+
+		if (pRung->bScaled)
+		{
+			sts = pRung->SurfacePool.Init(pRung->pSurfaces, pRung->Response.NumFrameActual);
+			MSDK_CHECK_STATUS(sts, "pRung->SurfacePool.Init failed");
+		}
+
+		// completed tasks of every encoder at the source size end one hold on the shared surface of their frame
+		sts = pRung->TaskPool.Init(pRung->pEncoder, pRung->pWriter, pRung->EncParams.AsyncDepth, &pRung->BitstreamPool,
+			pRung->bScaled ? &pRung->SurfacePool : &m_SurfacePool, m_bCompletionThread);
+		MSDK_CHECK_STATUS(sts, "pRung->TaskPool.Init failed");
+
+		if (m_bStrictHrd)
+		{
+			sts = InitHrdTrace(pRung->pEncoder, &pRung->HrdTrace);
+			MSDK_CHECK_STATUS(sts, "InitHrdTrace failed");
+			pRung->TaskPool.SetFrameSizes(&pRung->HrdTrace.FrameSizes);
+		}
+	}
+
+	if (m_nPrefetchDepth)
+	{
+		sts = m_Prefetcher.Init(&m_FileReader, &m_SurfacePool, m_nPrefetchDepth);
+		MSDK_CHECK_STATUS(sts, "m_Prefetcher.Init failed");
+	}
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CEncodingPipeline::RecoverMFXComponents(sInputParams* pParams)
+{
+	MSDK_CHECK_POINTER(pParams, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(m_pEncoder, MFX_ERR_NOT_INITIALIZED);
+
+	mfxFrameInfo frameInfo = m_mfxEncParams.mfx.FrameInfo;
+	mfxU16 nAsyncDepth = m_mfxEncParams.AsyncDepth;
+
+	mfxStatus sts = InitMfxEncParams(pParams);
+	MSDK_CHECK_STATUS(sts, "InitMfxEncParams failed");
+
+	for (size_t i = 0; i < m_Rungs.size(); i++)
+	{
+		InitRungEncParams(m_Rungs[i]);
+	}
+
+	// every rung has written a different number of the frames in flight, replaying them would duplicate some
+	if (!m_Rungs.empty())
+	{
+		std::cout << "WARNING: ladder encoding cannot replay frames, frames in flight are dropped" << std::endl;
+		return ResetMFXComponents(pParams);
+	}
+
+	// surfaces and task buffers only fit if the encoder is set up the same way again
+	if (!IsSameSurfaceLayout(frameInfo, m_mfxEncParams.mfx.FrameInfo) || nAsyncDepth != m_mfxEncParams.AsyncDepth)
+	{
+		std::cout << "WARNING: encoding parameters changed, frames in flight are dropped" << std::endl;
+		return ResetMFXComponents(pParams);
+	}
+
+	CTimer t;
+	t.Start();
+
+	sts = m_pEncoder->Close();
+	MSDK_IGNORE_MFX_STS(sts, MFX_ERR_NOT_INITIALIZED);
+	MSDK_CHECK_STATUS(sts, "m_pEncoder->Close failed");
+
+	// finished tasks release their frames, bitstream buffers stay cached in the bitstream pool
+	m_TaskPool.Close();
+
+	// frames without a written bitstream are encoded again before any new input
+	std::vector<mfxFrameSurface1*> inFlight;
+	m_SurfacePool.ResetLocks(&inFlight);
+	m_UserSurfacePool.ResetLocks();
+	for (size_t i = 0; i < inFlight.size(); i++)
+	{
+		// application frames stay with us until they were encoded again
+		m_UserSurfacePool.Pin(inFlight[i]);
+	}
+	m_ReplayQueue.insert(m_ReplayQueue.begin(), inFlight.begin(), inFlight.end());
+
+	sts = m_pEncoder->Init(&m_mfxEncParams);
 	if (MFX_WRN_PARTIAL_ACCELERATION == sts)
 	{
 		std::cout << "WARNING: partial acceleration" << std::endl;
 		MSDK_IGNORE_MFX_STS(sts, MFX_WRN_PARTIAL_ACCELERATION);
 	}
 
-	MSDK_CHECK_STATUS(sts, "m_pmfxENC->Init failed");
+	MSDK_CHECK_STATUS(sts, "m_pEncoder->Init failed");
 
-	mfxU32 nEncodedDataBufferSize = m_mfxEncParams.mfx.FrameInfo.Width * m_mfxEncParams.mfx.FrameInfo.Height * 4;
-	sts = m_TaskPool.Init(&m_mfxSession, m_FileWriter, m_mfxEncParams.AsyncDepth, nEncodedDataBufferSize);
+	sts = m_TaskPool.Init(m_pEncoder, m_FileWriter, m_mfxEncParams.AsyncDepth, &m_BitstreamPool, &m_SurfacePool, m_bCompletionThread);
 	MSDK_CHECK_STATUS(sts, "m_TaskPool.Init failed");
 
+	std::cout << "Encoder recovered in " << std::fixed << std::setprecision(2) << t.GetTime() * 1000 << " ms, "
+		<< m_ReplayQueue.size() << " frames to replay" << std::endl;
+	std::cout.unsetf(std::ios::floatfield);
+
 	return MFX_ERR_NONE;
 }
 
@@ -461,8 +1424,41 @@ mfxStatus CEncodingPipeline::AllocFrames()
 	if (EncRequest.NumFrameSuggested < m_mfxEncParams.AsyncDepth)
 		return MFX_ERR_MEMORY_ALLOC;
 
+	// all encoders of the ladder take the same frames in the same order, so they lock the same surfaces at
+	// about the same time and the largest request covers them all
+	for (size_t i = 0; i < m_Rungs.size(); i++)
+	{
+		sRung* pRung = m_Rungs[i];
+		mfxFrameAllocRequest RungRequest;
+		MSDK_ZERO_MEMORY(RungRequest);
+
+		if (pRung->bScaled)
+		{
+			sts = AllocRungFrames(pRung);
+			MSDK_CHECK_STATUS(sts, "AllocRungFrames failed");
+			continue;
+		}
+
+		sts = pRung->pEncoder->Query(&pRung->EncParams, &pRung->EncParams);
+		MSDK_CHECK_STATUS(sts, "Query (for rung encoder) failed");
+
+		sts = pRung->pEncoder->QueryIOSurf(&pRung->EncParams, &RungRequest);
+		MSDK_CHECK_STATUS(sts, "QueryIOSurf (for rung encoder) failed");
+
+		EncRequest.NumFrameSuggested = MSDK_MAX(EncRequest.NumFrameSuggested, RungRequest.NumFrameSuggested);
+	}
+
 	// The number of surfaces shared by vpp output and encode input.
-	nEncSurfNum = EncRequest.NumFrameSuggested;
+	// Frames waiting in the prefetch ring need surfaces of their own.
+	nEncSurfNum = EncRequest.NumFrameSuggested + (mfxU16)m_nPrefetchDepth;
+
+	if (m_pShmAllocator)
+	{
+		// every input surface is a slot of the ring, the extra ones let the producer write ahead of the encoder
+		nEncSurfNum += MSDK_SHM_RING_AHEAD;
+		sts = m_pShmAllocator->ReserveSlots(nEncSurfNum);
+		MSDK_CHECK_STATUS(sts, "m_pShmAllocator->ReserveSlots failed");
+	}
 
 	// prepare allocation requests
 	EncRequest.NumFrameSuggested = EncRequest.NumFrameMin = nEncSurfNum;
@@ -486,97 +1482,172 @@ mfxStatus CEncodingPipeline::AllocFrames()
 		MSDK_CHECK_STATUS(sts, "m_pMFXAllocator->Lock failed");
 	}
 
-	return MFX_ERR_NONE;
-}
-
-void CEncodingPipeline::DeleteFrames()
-{
-	// delete surfaces array
-	MSDK_SAFE_DELETE_ARRAY(m_pEncSurfaces);
-
-	// delete frames
-	if (m_pMFXAllocator)
+	if (m_pShmAllocator)
 	{
-		m_pMFXAllocator->Free(m_pMFXAllocator->pthis, &m_EncResponse);
+		// producers may attach from now on, frame n goes to m_pEncSurfaces[n % NumFrameActual]
+		sts = m_ShmRing.Publish(m_pEncSurfaces, m_EncResponse.NumFrameActual);
+		MSDK_CHECK_STATUS(sts, "m_ShmRing.Publish failed");
 	}
+
+	return MFX_ERR_NONE;
 }
 
-mfxStatus CEncodingPipeline::Run()
+mfxStatus CEncodingPipeline::AllocRungFrames(sRung* pRung)
 {
-	MSDK_CHECK_POINTER(m_pmfxENC, MFX_ERR_NOT_INITIALIZED);
+	mfxFrameAllocRequest EncRequest;
+	MSDK_ZERO_MEMORY(EncRequest);
 
-	mfxStatus sts = MFX_ERR_NONE;
+	mfxStatus sts = pRung->pEncoder->Query(&pRung->EncParams, &pRung->EncParams);
+	MSDK_CHECK_STATUS(sts, "Query (for rung encoder) failed");
 
-	mfxFrameSurface1* pSurf = NULL; // dispatching pointer
+	sts = pRung->pEncoder->QueryIOSurf(&pRung->EncParams, &EncRequest);
+	MSDK_CHECK_STATUS(sts, "QueryIOSurf (for rung encoder) failed");
 
-	sTask *pCurrentTask = NULL; // a pointer to the current task
-	mfxU16 nEncSurfIdx = 0;     // index of free surface for encoder input (vpp output)
+	if (EncRequest.NumFrameSuggested < pRung->EncParams.AsyncDepth)
+		return MFX_ERR_MEMORY_ALLOC;
 
-									  // Since in sample we support just 2 views
-									  // we will change this value between 0 and 1 in case of MVC
-	mfxU16 currViewNum = 0;
+	// the scaler fills them right before submission, there is nothing to prefetch
+	EncRequest.NumFrameMin = EncRequest.NumFrameSuggested;
+	MSDK_MEMCPY_VAR(EncRequest.Info, &(pRung->EncParams.mfx.FrameInfo), sizeof(mfxFrameInfo));
 
-	mfxU32 nFramesProcessed = 0;
+	sts = m_pMFXAllocator->Alloc(m_pMFXAllocator->pthis, &EncRequest, &pRung->Response);
+	MSDK_CHECK_STATUS(sts, "m_pMFXAllocator->Alloc failed");
+
+	pRung->pSurfaces = new mfxFrameSurface1[pRung->Response.NumFrameActual];
+	MSDK_CHECK_POINTER(pRung->pSurfaces, MFX_ERR_MEMORY_ALLOC);
+
+	for (int i = 0; i < pRung->Response.NumFrameActual; i++)
+	{
+		memset(&(pRung->pSurfaces[i]), 0, sizeof(mfxFrameSurface1));
+		MSDK_MEMCPY_VAR(pRung->pSurfaces[i].Info, &(pRung->EncParams.mfx.FrameInfo), sizeof(mfxFrameInfo));
+
+		// the scaler writes straight into the frames of the allocator
+		sts = m_pMFXAllocator->Lock(m_pMFXAllocator->pthis, pRung->Response.mids[i], &(pRung->pSurfaces[i].Data));
+		MSDK_CHECK_STATUS(sts, "m_pMFXAllocator->Lock failed");
+	}
+
+	return MFX_ERR_NONE;
+}
+
+void CEncodingPipeline::DeleteRungFrames(sRung* pRung)
+{
+	MSDK_SAFE_DELETE_ARRAY(pRung->pSurfaces);
+
+	if (m_pMFXAllocator && pRung->Response.NumFrameActual)
+	{
+		m_pMFXAllocator->Free(m_pMFXAllocator->pthis, &pRung->Response);
+	}
+	MSDK_ZERO_MEMORY(pRung->Response);
+}
+
+void CEncodingPipeline::DeleteFrames()
+{
+	for (size_t i = 0; i < m_Rungs.size(); i++)
+	{
+		DeleteRungFrames(m_Rungs[i]);
+	}
+
+	// the reader must not hand planes back to surfaces that are gone
+	m_FileReader.RestoreSurfaces();
+
+	// delete surfaces array
+	MSDK_SAFE_DELETE_ARRAY(m_pEncSurfaces);
+
+	// delete frames
+	if (m_pMFXAllocator)
+	{
+		m_pMFXAllocator->Free(m_pMFXAllocator->pthis, &m_EncResponse);
+	}
+}
+
+mfxStatus CEncodingPipeline::Run()
+{
+	MSDK_CHECK_POINTER(m_pEncoder, MFX_ERR_NOT_INITIALIZED);
+	// there is no input to read in push mode
+	MSDK_CHECK_ERROR(m_bPushMode, true, MFX_ERR_UNDEFINED_BEHAVIOR);
+
+	mfxStatus sts = MFX_ERR_NONE;
+
+	mfxFrameSurface1* pSurf = NULL; // dispatching pointer
+
+									  // Since in sample we support just 2 views
+									  // we will change this value between 0 and 1 in case of MVC
+	mfxU16 currViewNum = 0;
+
+	mfxU32 nFramesProcessed = 0;
 
 	bool skipLoadingNextFrame = false;
 
 	sts = MFX_ERR_NONE;
 
+	msdk_trace_set_thread_name("encode");
+
 	// main loop, preprocessing and encoding
 	while (MFX_ERR_NONE <= sts || MFX_ERR_MORE_DATA == sts)
 	{
-		// get a pointer to a free task (bit stream and sync point for encoder)
-		sts = GetFreeTask(&pCurrentTask);
-		MSDK_BREAK_ON_ERROR(sts);
-
-		// find free surface for encoder input
-		
-		nEncSurfIdx = GetFreeSurface(m_pEncSurfaces, m_EncResponse.NumFrameActual);
-		MSDK_CHECK_ERROR(nEncSurfIdx, MSDK_INVALID_SURF_IDX, MFX_ERR_MEMORY_ALLOC);
+		bool bReplay = !m_ReplayQueue.empty();
 
-		// point pSurf to encoder surface
-		pSurf = &m_pEncSurfaces[nEncSurfIdx];
-		
-		if (!skipLoadingNextFrame)
+		if (bReplay)
 		{
-			pSurf->Info.FrameId.ViewId = currViewNum;
-
-			sts = LoadNextFrame(pSurf);
-
+			// frames that were in flight when the device was lost, their surfaces were kept intact
+			pSurf = m_ReplayQueue.front();
+			m_ReplayQueue.pop_front();
+		}
+		else if (m_nPrefetchDepth)
+		{
+			// the surface was already loaded by the prefetch thread
+			sts = GetPrefetchedFrame(&pSurf);
 			MSDK_BREAK_ON_ERROR(sts);
 		}
-
-		for (;;)
+		else if (m_bShmInput)
 		{
-			sts = InitEncFrameParams(pCurrentTask);
-			MSDK_CHECK_STATUS(sts, "ENCODE: InitEncFrameParams failed");
+			// the producer wrote the frame straight into the surface
+			sts = GetShmFrame(&pSurf);
+			MSDK_BREAK_ON_ERROR(sts);
+		}
+		else
+		{
+			// find free surface for encoder input
+			sts = GetFreeSurface(&pSurf);
+			MSDK_CHECK_STATUS(sts, "GetFreeSurface failed");
 
-			// at this point surface for encoder contains either a frame from file or a frame processed by vpp
-			sts = m_pmfxENC->EncodeFrameAsync(&m_encCtrl, &m_pEncSurfaces[nEncSurfIdx], &pCurrentTask->mfxBS, &pCurrentTask->EncSyncP);
+			if (!skipLoadingNextFrame)
+			{
+				pSurf->Info.FrameId.ViewId = currViewNum;
 
-//			std::cout << "Sync: " << pCurrentTask->EncSyncP << std::endl;
+				sts = LoadNextFrame(pSurf);
 
-			if (MFX_ERR_NONE < sts && !pCurrentTask->EncSyncP) // repeat the call if warning and no output
-			{
-				if (MFX_WRN_DEVICE_BUSY == sts)
-					MSDK_SLEEP(1); // wait if device is busy
-			}
-			else if (MFX_ERR_NONE < sts && pCurrentTask->EncSyncP)
-			{
-				sts = MFX_ERR_NONE; // ignore warnings if output is available
-				break;
-			}
-			else if (MFX_ERR_NOT_ENOUGH_BUFFER == sts)
-			{
-				sts = AllocateSufficientBuffer(&pCurrentTask->mfxBS);
-				MSDK_CHECK_STATUS(sts, "AllocateSufficientBuffer failed");
+				if (MFX_ERR_NONE != sts)
+				{
+					m_SurfacePool.Release(pSurf);
+					break;
+				}
 			}
-			else
+		}
+
+		// the timestamp comes back with the bitstream of the frame, holds and latencies go by the frame order
+		if (!bReplay)
+		{
+			pSurf->Data.TimeStamp = (mfxU64)pSurf->Data.FrameOrder * 90000 * m_mfxEncParams.mfx.FrameInfo.FrameRateExtD /
+				MSDK_MAX(m_mfxEncParams.mfx.FrameInfo.FrameRateExtN, 1);
+		}
+
+		sts = EncodeSurface(pSurf);
+
+		if (m_bLowLatency && MFX_ERR_NONE <= sts)
+		{
+			// nothing is gained by waiting, the bitstream of the frame is written before the next one is read
+			do
 			{
-				// get next surface and new task for 2nd bitstream in ViewOutput mode
-				MSDK_IGNORE_MFX_STS(sts, MFX_ERR_MORE_BITSTREAM);
-				break;
-			}
+				sts = SynchronizeFirstTasks();
+			} while (MFX_ERR_NONE == sts);
+			MSDK_IGNORE_MFX_STS(sts, MFX_ERR_NOT_FOUND);
+			MSDK_CHECK_STATUS(sts, "SynchronizeFirstTasks failed");
+		}
+
+		if (m_Report.IsDue())
+		{
+			WriteReport(false);
 		}
 
 		nFramesProcessed++;
@@ -585,118 +1656,735 @@ mfxStatus CEncodingPipeline::Run()
 	// means that the input file has ended, need to go to buffering loops
 	MSDK_IGNORE_MFX_STS(sts, MFX_ERR_MORE_DATA);
 	// exit in case of other errors
-	MSDK_CHECK_STATUS(sts, "m_pmfxENC->EncodeFrameAsync failed");
+	MSDK_CHECK_STATUS(sts, "m_pEncoder->EncodeFrameAsync failed");
 
-	// loop to get buffered frames from encoder
-	while (MFX_ERR_NONE <= sts)
+	sts = Flush(m_pEncoder, &m_TaskPool, &m_BitstreamPool, &m_nDeviceBusyRetries);
+	MSDK_CHECK_STATUS(sts, "Flush failed");
+
+	for (size_t i = 0; i < m_Rungs.size(); i++)
+	{
+		sts = Flush(m_Rungs[i]->pEncoder, &m_Rungs[i]->TaskPool, &m_Rungs[i]->BitstreamPool, &m_Rungs[i]->nDeviceBusyRetries);
+		MSDK_CHECK_STATUS(sts, "Flush failed");
+
+		// no task of the rung is left to record into its timings
+		m_Timings.Merge(m_Rungs[i]->Timings);
+		m_Rungs[i]->Timings.Reset();
+	}
+
+	return sts;
+}
+
+mfxStatus CEncodingPipeline::EncodeSurface(mfxFrameSurface1* pSurf)
+{
+	// one hold per encoder of the surface, it is reused once the last of them wrote the frame
+	mfxU32 nHolds = 1;
+	m_SurfacePool.Hold(pSurf);
+	for (size_t i = 0; i < m_Rungs.size(); i++)
 	{
-		// get a free task (bit stream and sync point for encoder)
-		sts = GetFreeTask(&pCurrentTask);
-		MSDK_BREAK_ON_ERROR(sts);
+		if (!m_Rungs[i]->bScaled)
+		{
+			m_SurfacePool.Hold(pSurf);
+			nHolds++;
+		}
+	}
 
-		for (;;)
+	mfxStatus sts = SubmitSurface(m_pEncoder, &m_TaskPool, &m_BitstreamPool, pSurf, &m_nDeviceBusyRetries);
+	if (MFX_WRN_DEVICE_BUSY == sts)
+	{
+		// push mode: no encoder has the frame, the caller gets it back
+		for (mfxU32 i = 0; i < nHolds; i++)
 		{
-			std::cout << "Getting buffered frames" << std::endl;
-			sts = m_pmfxENC->EncodeFrameAsync(&m_encCtrl, NULL, &pCurrentTask->mfxBS, &pCurrentTask->EncSyncP);
+			m_SurfacePool.Complete(pSurf->Data.FrameOrder);
+		}
+		return sts;
+	}
 
-			if (MFX_ERR_NONE < sts && !pCurrentTask->EncSyncP) // repeat the call if warning and no output
-			{
-				if (MFX_WRN_DEVICE_BUSY == sts)
-					MSDK_SLEEP(1); // wait if device is busy
-			}
-			else if (MFX_ERR_NONE < sts && pCurrentTask->EncSyncP)
-			{
-				sts = MFX_ERR_NONE; // ignore warnings if output is available
-				break;
-			}
-			else if (MFX_ERR_NOT_ENOUGH_BUFFER == sts)
-			{
-				sts = AllocateSufficientBuffer(&pCurrentTask->mfxBS);
-				MSDK_CHECK_STATUS(sts, "AllocateSufficientBuffer failed");
-			}
-			else
-			{
-				// get new task for 2nd bitstream in ViewOutput mode
-				MSDK_IGNORE_MFX_STS(sts, MFX_ERR_MORE_BITSTREAM);
-				break;
-			}
+	for (size_t i = 0; i < m_Rungs.size() && (MFX_ERR_NONE <= sts || MFX_ERR_MORE_DATA == sts); i++)
+	{
+		if (m_Rungs[i]->bScaled)
+		{
+			sts = SubmitScaledFrame(m_Rungs[i], pSurf);
+		}
+		else
+		{
+			sts = SubmitRungSurface(m_Rungs[i], pSurf);
 		}
-		MSDK_BREAK_ON_ERROR(sts);
 	}
 
-	// loop to get buffered frames from encoder
-	while (MFX_ERR_NONE <= sts)
+	// the encoders hold their own locks on the surface from now on; slots of the ring go back to the producer in
+	// frame order instead, see ReleaseShmFrames
+	if (!m_UserSurfacePool.Unpin(pSurf) && !m_bShmInput)
+	{
+		m_SurfacePool.Release(pSurf);
+	}
+
+	return sts;
+}
+
+mfxStatus CEncodingPipeline::SubmitFrame(const mfxU8* const* ppPlanes, const mfxU32* pPitches, mfxU64 nTimeStamp)
+{
+	MSDK_CHECK_POINTER(ppPlanes, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(pPitches, MFX_ERR_NULL_PTR);
+
+	mfxStatus sts = PrepareSubmission();
+	if (MFX_ERR_NONE != sts)
+	{
+		return sts;
+	}
+
+	mfxFrameSurface1* pSurf = m_SurfacePool.TryAcquire();
+	if (!pSurf)
+	{
+		return MFX_WRN_DEVICE_BUSY;
+	}
+
+	msdk_tick nStart = msdk_time_get_tick();
+
+	sts = CopyFrame(pSurf, ppPlanes, pPitches);
+	if (MFX_ERR_NONE != sts)
+	{
+		m_SurfacePool.Release(pSurf);
+		MSDK_CHECK_STATUS(sts, "CopyFrame failed");
+	}
+
+	m_Timings.RecordSince(MSDK_STAGE_READ, nStart);
+
+	return EncodePushedSurface(pSurf, nTimeStamp);
+}
+
+mfxStatus CEncodingPipeline::SubmitUserFrame(const sUserFrame& frame)
+{
+	mfxStatus sts = PrepareSubmission();
+	if (MFX_ERR_NONE != sts)
+	{
+		return sts;
+	}
+
+	// pinned until the encoders hold their own locks
+	mfxFrameSurface1* pSurf = NULL;
+	sts = m_UserSurfacePool.Wrap(frame, &pSurf);
+	if (MFX_WRN_DEVICE_BUSY == sts)
+	{
+		return sts;
+	}
+	MSDK_CHECK_STATUS(sts, "m_UserSurfacePool.Wrap failed");
+
+	return EncodePushedSurface(pSurf, frame.nTimeStamp);
+}
+
+mfxStatus CEncodingPipeline::PrepareSubmission()
+{
+	MSDK_CHECK_POINTER(m_pEncoder, MFX_ERR_NOT_INITIALIZED);
+	MSDK_CHECK_ERROR(m_bPushMode, false, MFX_ERR_UNDEFINED_BEHAVIOR);
+
+	mfxStatus sts = CompleteReadyTasks();
+	MSDK_CHECK_STATUS(sts, "CompleteReadyTasks failed");
+
+	// backpressure: a task to encode into and room for its packet, or the caller comes back later
+	if (m_pPacketQueue && m_pPacketQueue->IsFull())
 	{
-		// get a free task (bit stream and sync point for encoder)
-		sts = GetFreeTask(&pCurrentTask);
-		MSDK_BREAK_ON_ERROR(sts);
+		return MFX_WRN_DEVICE_BUSY;
+	}
 
-		for (;;)
+	sTask* pTask = NULL;
+	sts = m_TaskPool.GetFreeTask(&pTask);
+	if (MFX_ERR_NOT_FOUND == sts)
+	{
+		return MFX_WRN_DEVICE_BUSY;
+	}
+	MSDK_CHECK_STATUS(sts, "m_TaskPool.GetFreeTask failed");
+
+	// every rung takes the frame as well, none of them may wait for its encoder
+	for (size_t i = 0; i < m_Rungs.size(); i++)
+	{
+		sts = PrepareRung(m_Rungs[i]);
+		if (MFX_WRN_DEVICE_BUSY == sts)
 		{
-			sts = m_pmfxENC->EncodeFrameAsync(&m_encCtrl, NULL, &pCurrentTask->mfxBS, &pCurrentTask->EncSyncP);
+			return sts;
+		}
+		MSDK_CHECK_STATUS(sts, "PrepareRung failed");
+	}
 
-			if (MFX_ERR_NONE < sts && !pCurrentTask->EncSyncP) // repeat the call if warning and no output
-			{
-				if (MFX_WRN_DEVICE_BUSY == sts)
-					MSDK_SLEEP(1); // wait if device is busy
-			}
-			else if (MFX_ERR_NONE < sts && pCurrentTask->EncSyncP)
-			{
-				sts = MFX_ERR_NONE; // ignore warnings if output is available
-				break;
-			}
-			else if (MFX_ERR_NOT_ENOUGH_BUFFER == sts)
+	if (!m_ReplayQueue.empty())
+	{
+		sts = ReplayNextSurface();
+		MSDK_CHECK_STATUS(sts, "ReplayNextSurface failed");
+
+		return MFX_WRN_DEVICE_BUSY;
+	}
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CEncodingPipeline::PrepareRung(sRung* pRung)
+{
+	sTask* pTask = NULL;
+	mfxStatus sts = pRung->TaskPool.GetFreeTask(&pTask);
+
+	// the frame the rung was too busy for goes before any new one
+	if (MFX_ERR_NONE == sts && pRung->pPendingSurface)
+	{
+		sts = SubmitSurface(pRung->pEncoder, &pRung->TaskPool, &pRung->BitstreamPool, pRung->pPendingSurface,
+			&pRung->nDeviceBusyRetries);
+		if (MFX_WRN_DEVICE_BUSY == sts)
+		{
+			return sts;
+		}
+		MSDK_IGNORE_MFX_STS(sts, MFX_ERR_MORE_DATA);
+		MSDK_CHECK_STATUS(sts, "SubmitSurface failed");
+		pRung->pPendingSurface = NULL;
+
+		sts = pRung->TaskPool.GetFreeTask(&pTask);
+	}
+
+	if (MFX_ERR_NOT_FOUND == sts)
+	{
+		return MFX_WRN_DEVICE_BUSY;
+	}
+	MSDK_CHECK_STATUS(sts, "pRung->TaskPool.GetFreeTask failed");
+
+	// only tasks of the rung itself free its surfaces, GetFreeRungSurface would wait for them
+	if (pRung->bScaled && !pRung->SurfacePool.HasFreeSurface())
+	{
+		return MFX_WRN_DEVICE_BUSY;
+	}
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CEncodingPipeline::ReplayNextSurface()
+{
+	// frames that were in flight when the device was lost go before any new one
+	mfxFrameSurface1* pSurf = m_ReplayQueue.front();
+	m_ReplayQueue.pop_front();
+
+	mfxStatus sts = EncodeSurface(pSurf);
+	if (MFX_WRN_DEVICE_BUSY == sts)
+	{
+		// still first in line
+		m_ReplayQueue.push_front(pSurf);
+		return sts;
+	}
+	MSDK_IGNORE_MFX_STS(sts, MFX_ERR_MORE_DATA);
+	MSDK_CHECK_STATUS(sts, "EncodeSurface failed");
+
+	return sts;
+}
+
+mfxStatus CEncodingPipeline::EncodePushedSurface(mfxFrameSurface1* pSurf, mfxU64 nTimeStamp)
+{
+	pSurf->Data.FrameOrder = m_nFirstFrame + m_nFramesRead;
+	pSurf->Data.TimeStamp = nTimeStamp;
+	m_nFramesRead++;
+
+	// the frame was copied or wrapped, either way it is in its surface now
+	m_Latency.Start(pSurf->Data.FrameOrder);
+
+	mfxStatus sts = EncodeSurface(pSurf);
+	if (MFX_WRN_DEVICE_BUSY == sts)
+	{
+		// not taken, the application submits the frame again
+		m_Latency.Cancel(pSurf->Data.FrameOrder);
+		m_nFramesRead--;
+		if (!m_UserSurfacePool.Unwrap(pSurf))
+		{
+			m_SurfacePool.Release(pSurf);
+		}
+		return sts;
+	}
+	// the encoder took the frame without output yet
+	MSDK_IGNORE_MFX_STS(sts, MFX_ERR_MORE_DATA);
+	MSDK_CHECK_STATUS(sts, "EncodeSurface failed");
+
+	if (m_Report.IsDue())
+	{
+		WriteReport(false);
+	}
+
+	return sts;
+}
+
+mfxStatus CEncodingPipeline::CopyFrame(mfxFrameSurface1* pSurf, const mfxU8* const* ppPlanes, const mfxU32* pPitches)
+{
+	MSDK_CHECK_POINTER(ppPlanes[0], MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(ppPlanes[1], MFX_ERR_NULL_PTR);
+
+	mfxFrameInfo& info = pSurf->Info;
+	mfxFrameData& data = pSurf->Data;
+
+	MSDK_CHECK_ERROR(pPitches[0] < info.CropW || pPitches[1] < info.CropW, true, MFX_ERR_UNDEFINED_BEHAVIOR);
+
+	for (mfxU32 y = 0; y < info.CropH; y++)
+	{
+		memcpy(data.Y + (info.CropY + y) * data.Pitch + info.CropX, ppPlanes[0] + y * pPitches[0], info.CropW);
+	}
+
+	for (mfxU32 y = 0; y < info.CropH / 2u; y++)
+	{
+		memcpy(data.UV + (info.CropY / 2 + y) * data.Pitch + info.CropX, ppPlanes[1] + y * pPitches[1], info.CropW);
+	}
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CEncodingPipeline::PollPacket(sEncodedPacket* pPacket)
+{
+	MSDK_CHECK_POINTER(pPacket, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(m_pPacketQueue, MFX_ERR_NOT_INITIALIZED);
+
+	mfxStatus sts = CompleteReadyTasks();
+	MSDK_CHECK_STATUS(sts, "CompleteReadyTasks failed");
+
+	return m_pPacketQueue->Pop(pPacket);
+}
+
+void CEncodingPipeline::ReleasePacket(sEncodedPacket* pPacket)
+{
+	if (m_pPacketQueue)
+	{
+		m_pPacketQueue->Release(pPacket);
+	}
+}
+
+mfxStatus CEncodingPipeline::EndOfStream()
+{
+	MSDK_CHECK_POINTER(m_pEncoder, MFX_ERR_NOT_INITIALIZED);
+	MSDK_CHECK_ERROR(m_bPushMode, false, MFX_ERR_UNDEFINED_BEHAVIOR);
+
+	mfxStatus sts = MFX_ERR_NONE;
+
+	// frames still waiting for a replay or for a busy rung; unlike a submission this waits for the encoders
+	while (!m_ReplayQueue.empty())
+	{
+		sts = ReplayNextSurface();
+		if (MFX_WRN_DEVICE_BUSY == sts)
+		{
+			MSDK_SLEEP(1);
+			sts = MFX_ERR_NONE;
+		}
+		MSDK_CHECK_STATUS(sts, "ReplayNextSurface failed");
+	}
+
+	for (size_t i = 0; i < m_Rungs.size(); i++)
+	{
+		while (m_Rungs[i]->pPendingSurface)
+		{
+			sts = PrepareRung(m_Rungs[i]);
+			if (MFX_WRN_DEVICE_BUSY == sts)
 			{
-				sts = AllocateSufficientBuffer(&pCurrentTask->mfxBS);
-				MSDK_CHECK_STATUS(sts, "AllocateSufficientBuffer failed");
+				MSDK_SLEEP(1);
+				sts = CompleteReadyTasks();
 			}
-			else
+			MSDK_CHECK_STATUS(sts, "PrepareRung failed");
+		}
+	}
+
+	sts = Flush(m_pEncoder, &m_TaskPool, &m_BitstreamPool, &m_nDeviceBusyRetries);
+	MSDK_CHECK_STATUS(sts, "Flush failed");
+
+	for (size_t i = 0; i < m_Rungs.size(); i++)
+	{
+		sts = Flush(m_Rungs[i]->pEncoder, &m_Rungs[i]->TaskPool, &m_Rungs[i]->BitstreamPool, &m_Rungs[i]->nDeviceBusyRetries);
+		MSDK_CHECK_STATUS(sts, "Flush failed");
+
+		m_Timings.Merge(m_Rungs[i]->Timings);
+		m_Rungs[i]->Timings.Reset();
+	}
+
+	m_UserSurfacePool.Recycle();
+
+	return sts;
+}
+
+mfxStatus CEncodingPipeline::CompleteReadyTasks()
+{
+	mfxStatus sts = MFX_ERR_NONE;
+
+	// nothing else completes the tasks of the rungs in push mode
+	for (size_t i = 0; i <= m_Rungs.size() && MFX_ERR_NONE == sts; i++)
+	{
+		CEncTaskPool* pTaskPool = i ? &m_Rungs[i - 1]->TaskPool : &m_TaskPool;
+		do
+		{
+			sts = pTaskPool->SynchronizeFirstTask(0);
+		} while (MFX_ERR_NONE == sts);
+
+		MSDK_IGNORE_MFX_STS(sts, MFX_ERR_NOT_FOUND);
+		MSDK_IGNORE_MFX_STS(sts, MFX_WRN_IN_EXECUTION);
+	}
+	MSDK_CHECK_STATUS(sts, "SynchronizeFirstTask failed");
+
+	m_UserSurfacePool.Recycle();
+
+	return sts;
+}
+
+mfxStatus CEncodingPipeline::SubmitSurface(CEncoderBackend* pEncoder, CEncTaskPool* pTaskPool, CBitstreamPool* pBitstreamPool,
+	mfxFrameSurface1* pSurf, mfxU32* pnBusyRetries)
+{
+	sTask *pCurrentTask = NULL; // a pointer to the current task
+
+	// get a pointer to a free task (bit stream and sync point for encoder)
+	mfxStatus sts = GetFreeTask(pTaskPool, &pCurrentTask);
+	MSDK_CHECK_STATUS(sts, "GetFreeTask failed");
+
+	pCurrentTask->nFrameOrder = pSurf ? pSurf->Data.FrameOrder : MSDK_TRACE_NONE;
+
+	msdk_tick nEncodeStart = msdk_time_get_tick();
+	CTraceSpan submitSpan("submit", pCurrentTask->nFrameOrder, pCurrentTask->nTaskIndex);
+
+	for (;;)
+	{
+		if (pSurf)
+		{
+			sts = InitEncFrameParams(pCurrentTask);
+			MSDK_CHECK_STATUS(sts, "ENCODE: InitEncFrameParams failed");
+		}
+
+		// at this point surface for encoder contains either a frame from file or a frame processed by vpp
+		sts = pEncoder->EncodeFrameAsync(&m_encCtrl, pSurf, &pCurrentTask->mfxBS, &pCurrentTask->EncSyncP);
+
+		if (MFX_ERR_NONE < sts && !pCurrentTask->EncSyncP) // repeat the call if warning and no output
+		{
+			if (MFX_WRN_DEVICE_BUSY == sts)
 			{
-				// get new task for 2nd bitstream in ViewOutput mode
-				MSDK_IGNORE_MFX_STS(sts, MFX_ERR_MORE_BITSTREAM);
-				break;
+				(*pnBusyRetries)++;
+				// a submission in push mode does not wait, the caller comes back later
+				if (m_bPushMode && pSurf)
+				{
+					break;
+				}
+				CTraceSpan busySpan("busy retry", pCurrentTask->nFrameOrder, pCurrentTask->nTaskIndex);
+				MSDK_SLEEP(1); // wait if device is busy
 			}
 		}
-		MSDK_BREAK_ON_ERROR(sts);
+		else if (MFX_ERR_NONE < sts && pCurrentTask->EncSyncP)
+		{
+			sts = MFX_ERR_NONE; // ignore warnings if output is available
+			break;
+		}
+		else if (MFX_ERR_NOT_ENOUGH_BUFFER == sts)
+		{
+			sts = AllocateSufficientBuffer(pEncoder, pBitstreamPool, &pCurrentTask->mfxBS);
+			MSDK_CHECK_STATUS(sts, "AllocateSufficientBuffer failed");
+		}
+		else
+		{
+			// get next surface and new task for 2nd bitstream in ViewOutput mode
+			MSDK_IGNORE_MFX_STS(sts, MFX_ERR_MORE_BITSTREAM);
+			break;
+		}
+	}
+
+	m_Timings.RecordSince(MSDK_STAGE_ENCODE, nEncodeStart);
+	submitSpan.End();
+
+	if (MFX_ERR_NONE == sts && pCurrentTask->EncSyncP)
+	{
+		sts = pTaskPool->SubmitTask(pCurrentTask);
+		MSDK_CHECK_STATUS(sts, "pTaskPool->SubmitTask failed");
+	}
+
+	return sts;
+}
+
+mfxStatus CEncodingPipeline::SubmitScaledFrame(sRung* pRung, mfxFrameSurface1* pSurf)
+{
+	mfxFrameSurface1* pScaled = NULL;
+
+	mfxStatus sts = GetFreeRungSurface(pRung, &pScaled);
+	MSDK_CHECK_STATUS(sts, "GetFreeRungSurface failed");
+
+	msdk_tick nStart = msdk_time_get_tick();
+
+	sts = m_Scaler.Scale(pSurf, pScaled);
+	if (MFX_ERR_NONE != sts)
+	{
+		pRung->SurfacePool.Release(pScaled);
+		MSDK_CHECK_STATUS(sts, "m_Scaler.Scale failed");
+	}
+
+	m_Timings.RecordSince(MSDK_STAGE_SCALE, nStart);
+
+	pScaled->Data.FrameOrder = pSurf->Data.FrameOrder;
+	pScaled->Data.TimeStamp = pSurf->Data.TimeStamp;
+
+	pRung->SurfacePool.Hold(pScaled);
+
+	sts = SubmitRungSurface(pRung, pScaled);
+
+	pRung->SurfacePool.Release(pScaled);
+
+	return sts;
+}
+
+mfxStatus CEncodingPipeline::SubmitRungSurface(sRung* pRung, mfxFrameSurface1* pSurf)
+{
+	mfxStatus sts = SubmitSurface(pRung->pEncoder, &pRung->TaskPool, &pRung->BitstreamPool, pSurf, &pRung->nDeviceBusyRetries);
+	if (MFX_WRN_DEVICE_BUSY == sts)
+	{
+		// the main encoder has the frame already, its hold keeps the surface until PrepareRung submits it
+		pRung->pPendingSurface = pSurf;
+		sts = MFX_ERR_NONE;
+	}
+
+	return sts;
+}
+
+mfxStatus CEncodingPipeline::GetFreeRungSurface(sRung* pRung, mfxFrameSurface1** ppSurf)
+{
+	CTimer t;
+	t.Start();
+
+	mfxStatus sts = MFX_ERR_NONE;
+
+	// only tasks of the rung itself hold its surfaces
+	*ppSurf = pRung->SurfacePool.TryAcquire();
+	while (!*ppSurf)
+	{
+		sts = pRung->TaskPool.SynchronizeFirstTask();
+		if (MFX_ERR_NOT_FOUND == sts)
+		{
+			break;
+		}
+		MSDK_CHECK_STATUS(sts, "pRung->TaskPool.SynchronizeFirstTask failed");
+
+		*ppSurf = pRung->SurfacePool.TryAcquire();
+	}
+
+	if (!*ppSurf)
+	{
+		sts = pRung->SurfacePool.Acquire(ppSurf, MSDK_SURFACE_WAIT_INTERVAL);
+		if (MFX_ERR_NONE != sts)
+		{
+			std::cerr << "ERROR: No free surfaces in pool of a rung (during long period)" << std::endl;
+			return MFX_ERR_MEMORY_ALLOC;
+		}
+	}
+
+	m_Timings.Record(MSDK_STAGE_SURFACE_WAIT, t.GetDelta());
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CEncodingPipeline::Flush(CEncoderBackend* pEncoder, CEncTaskPool* pTaskPool, CBitstreamPool* pBitstreamPool, mfxU32* pnBusyRetries)
+{
+	mfxStatus sts = MFX_ERR_NONE;
+
+	// loop to get buffered frames from encoder
+	while (MFX_ERR_NONE <= sts)
+	{
+		std::cout << "Getting buffered frames" << std::endl;
+		sts = SubmitSurface(pEncoder, pTaskPool, pBitstreamPool, NULL, pnBusyRetries);
 	}
 
 	// MFX_ERR_MORE_DATA is the correct status to exit buffering loop with
 	// indicates that there are no more buffered frames
 	MSDK_IGNORE_MFX_STS(sts, MFX_ERR_MORE_DATA);
 	// exit in case of other errors
-	MSDK_CHECK_STATUS(sts, "m_pmfxENC->EncodeFrameAsync failed");
+	MSDK_CHECK_STATUS(sts, "pEncoder->EncodeFrameAsync failed");
 
 	// synchronize all tasks that are left in task pool
 	while (MFX_ERR_NONE == sts)
 	{
-		sts = m_TaskPool.SynchronizeFirstTask();
+		sts = pTaskPool->SynchronizeFirstTask();
 	}
 
 	// MFX_ERR_NOT_FOUND is the correct status to exit the loop with
 	// EncodeFrameAsync and SyncOperation don't return this status
 	MSDK_IGNORE_MFX_STS(sts, MFX_ERR_NOT_FOUND);
 	// report any errors that occurred in asynchronous part
-	MSDK_CHECK_STATUS(sts, "m_TaskPool.SynchronizeFirstTask failed");
+	MSDK_CHECK_STATUS(sts, "pTaskPool->SynchronizeFirstTask failed");
 	return sts;
 }
 
-mfxStatus CEncodingPipeline::GetFreeTask(sTask **ppTask)
+mfxStatus CEncodingPipeline::SynchronizeFirstTasks()
+{
+	mfxStatus sts = m_TaskPool.SynchronizeFirstTask();
+	bool bFound = MFX_ERR_NOT_FOUND != sts;
+	MSDK_IGNORE_MFX_STS(sts, MFX_ERR_NOT_FOUND);
+	MSDK_CHECK_STATUS(sts, "m_TaskPool.SynchronizeFirstTask failed");
+
+	for (size_t i = 0; i < m_Rungs.size(); i++)
+	{
+		sts = m_Rungs[i]->TaskPool.SynchronizeFirstTask();
+		bFound = bFound || MFX_ERR_NOT_FOUND != sts;
+		MSDK_IGNORE_MFX_STS(sts, MFX_ERR_NOT_FOUND);
+		MSDK_CHECK_STATUS(sts, "pRung->TaskPool.SynchronizeFirstTask failed");
+	}
+
+	return bFound ? MFX_ERR_NONE : MFX_ERR_NOT_FOUND;
+}
+
+mfxStatus CEncodingPipeline::GetFreeTask(CEncTaskPool* pTaskPool, sTask **ppTask)
 {
 	mfxStatus sts = MFX_ERR_NONE;
 
-	sts = m_TaskPool.GetFreeTask(ppTask);
+	sts = pTaskPool->GetFreeTask(ppTask);
 	if (MFX_ERR_NOT_FOUND == sts)
 	{
-		sts = m_TaskPool.SynchronizeFirstTask();
-		MSDK_CHECK_STATUS(sts, "m_TaskPool.SynchronizeFirstTask failed");
+		sts = pTaskPool->SynchronizeFirstTask();
+		// the completion thread may have emptied the pool since GetFreeTask found it full
+		MSDK_IGNORE_MFX_STS(sts, MFX_ERR_NOT_FOUND);
+		MSDK_CHECK_STATUS(sts, "pTaskPool->SynchronizeFirstTask failed");
 
 		// try again
-		sts = m_TaskPool.GetFreeTask(ppTask);
+		sts = pTaskPool->GetFreeTask(ppTask);
+	}
+
+	return sts;
+}
+
+mfxStatus CEncodingPipeline::GetFreeSurface(mfxFrameSurface1** ppSurf)
+{
+	CTimer t;
+	t.Start();
+
+	*ppSurf = m_SurfacePool.TryAcquire();
+	if (*ppSurf)
+	{
+		m_Timings.Record(MSDK_STAGE_SURFACE_WAIT, t.GetDelta());
+		return MFX_ERR_NONE;
+	}
+
+	mfxStatus sts = MFX_ERR_NONE;
+
+	// surfaces are held by tasks in flight, completing the oldest one is the quickest way to get one back
+	while (!*ppSurf)
+	{
+		sts = SynchronizeFirstTasks();
+		if (MFX_ERR_NOT_FOUND == sts)
+		{
+			break;
+		}
+		MSDK_CHECK_STATUS(sts, "SynchronizeFirstTasks failed");
+
+		*ppSurf = m_SurfacePool.TryAcquire();
+	}
+
+	if (*ppSurf)
+	{
+		m_Timings.Record(MSDK_STAGE_SURFACE_WAIT, t.GetDelta());
+		m_SurfacePool.RecordWait(t.GetTime());
+		return MFX_ERR_NONE;
+	}
+
+	// nothing left to synchronize, the encoder still holds surfaces internally
+	sts = m_SurfacePool.Acquire(ppSurf, MSDK_SURFACE_WAIT_INTERVAL);
+	if (MFX_ERR_NONE != sts)
+	{
+		std::cerr << "ERROR: No free surfaces in pool (during long period)" << std::endl;
+		return MFX_ERR_MEMORY_ALLOC;
+	}
+
+	m_Timings.Record(MSDK_STAGE_SURFACE_WAIT, t.GetDelta());
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CEncodingPipeline::GetPrefetchedFrame(mfxFrameSurface1** ppSurf)
+{
+	msdk_tick nStart = msdk_time_get_tick();
+	mfxStatus sts = MFX_ERR_NONE;
+
+	for (;;)
+	{
+		sts = m_Prefetcher.GetFrame(ppSurf, MSDK_PREFETCH_WAIT_INTERVAL);
+		if (MFX_WRN_IN_EXECUTION != sts)
+		{
+			break;
+		}
+
+		// the prefetch thread may be starved of surfaces locked by tasks still in flight
+		sts = SynchronizeFirstTasks();
+		MSDK_IGNORE_MFX_STS(sts, MFX_ERR_NOT_FOUND);
+		MSDK_CHECK_STATUS(sts, "SynchronizeFirstTasks failed");
+	}
+
+	if (MFX_ERR_NONE == sts)
+	{
+		m_Timings.RecordSince(MSDK_STAGE_SURFACE_WAIT, nStart);
+		m_nFramesRead++;
 	}
 
 	return sts;
 }
 
+mfxStatus CEncodingPipeline::GetShmFrame(mfxFrameSurface1** ppSurf)
+{
+	msdk_tick nStart = msdk_time_get_tick();
+	mfxU32 nSlots = m_EncResponse.NumFrameActual;
+	mfxStatus sts = MFX_ERR_NONE;
+
+	for (;;)
+	{
+		ReleaseShmFrames();
+
+		if (m_nFramesRead - m_nShmReleased >= nSlots)
+		{
+			// the producer waits for the slot of this frame, which tasks still in flight lock
+			sts = SynchronizeFirstTasks();
+			if (MFX_ERR_NOT_FOUND == sts)
+			{
+				// no task left, the encoder still locks the surface internally
+				MSDK_SLEEP(1);
+				sts = MFX_ERR_NONE;
+			}
+			MSDK_CHECK_STATUS(sts, "SynchronizeFirstTasks failed");
+			continue;
+		}
+
+		sts = m_ShmRing.WaitFrame(m_nFramesRead, MSDK_SHM_WAIT_INTERVAL);
+		if (MFX_WRN_IN_EXECUTION != sts)
+		{
+			break;
+		}
+
+		// a live producer is slower than the encoder, write what is done meanwhile
+		sts = CompleteReadyTasks();
+		MSDK_CHECK_STATUS(sts, "CompleteReadyTasks failed");
+	}
+	if (MFX_ERR_NONE != sts)
+	{
+		return sts;
+	}
+
+	*ppSurf = &m_pEncSurfaces[m_nFramesRead % nSlots];
+	(*ppSurf)->Data.FrameOrder = m_nFirstFrame + m_nFramesRead;
+	m_nFramesRead++;
+
+	// the producer has written the frame
+	m_Latency.Start((*ppSurf)->Data.FrameOrder);
+
+	m_Timings.RecordSince(MSDK_STAGE_READ, nStart);
+
+	return MFX_ERR_NONE;
+}
+
+void CEncodingPipeline::ReleaseShmFrames()
+{
+	// frames waiting for a replay keep their slots, the recovery dropped the locks on them
+	if (!m_ReplayQueue.empty())
+	{
+		return;
+	}
+
+	mfxU32 nSlots = m_EncResponse.NumFrameActual;
+	mfxU32 nReleased = m_nShmReleased;
+
+	// the producer writes the slots round robin, a frame still locked keeps the later ones as well
+	while (nReleased != m_nFramesRead && !m_pEncSurfaces[nReleased % nSlots].Data.Locked)
+	{
+		nReleased++;
+	}
+
+	if (nReleased != m_nShmReleased)
+	{
+		m_nShmReleased = nReleased;
+		m_ShmRing.ReleaseFrames(nReleased);
+	}
+}
+
 mfxStatus CEncodingPipeline::LoadNextFrame(mfxFrameSurface1* pSurf)
 {
 	mfxStatus sts = MFX_ERR_NONE;
@@ -704,9 +2392,14 @@ mfxStatus CEncodingPipeline::LoadNextFrame(mfxFrameSurface1* pSurf)
 	sts = m_FileReader.LoadNextFrame(pSurf);
 
 	// frameorder required for reflist, dbp, and decrefpicmarking operations
-	if (pSurf) pSurf->Data.FrameOrder = m_nFramesRead;
+	if (pSurf) pSurf->Data.FrameOrder = m_nFirstFrame + m_nFramesRead;
 	m_nFramesRead++;
 
+	if (MFX_ERR_NONE == sts && pSurf)
+	{
+		m_Latency.Start(pSurf->Data.FrameOrder);
+	}
+
 	return sts;
 }
 
@@ -717,21 +2410,51 @@ mfxStatus CEncodingPipeline::InitEncFrameParams(sTask* pTask)
 	return MFX_ERR_NONE;
 }
 
-mfxStatus CEncodingPipeline::AllocateSufficientBuffer(mfxBitstream* pBS)
+mfxStatus CEncodingPipeline::AllocateSufficientBuffer(CEncoderBackend* pEncoder, CBitstreamPool* pBitstreamPool, mfxBitstream* pBS)
 {
 	MSDK_CHECK_POINTER(pBS, MFX_ERR_NULL_PTR);
-	MSDK_CHECK_POINTER(GetFirstEncoder(), MFX_ERR_NOT_INITIALIZED);
+	MSDK_CHECK_POINTER(pEncoder, MFX_ERR_NOT_INITIALIZED);
 
 	mfxVideoParam par;
 	MSDK_ZERO_MEMORY(par);
 
 	// find out the required buffer size
-	mfxStatus sts = GetFirstEncoder()->GetVideoParam(&par);
-	MSDK_CHECK_STATUS(sts, "GetFirstEncoder failed");
+	mfxStatus sts = pEncoder->GetVideoParam(&par);
+	MSDK_CHECK_STATUS(sts, "pEncoder->GetVideoParam failed");
 
 	// reallocate bigger buffer for output
-	sts = ExtendMfxBitstream(pBS, par.mfx.BufferSizeInKB * 1000);
-	MSDK_CHECK_STATUS_SAFE(sts, "ExtendMfxBitstream failed", WipeMfxBitstream(pBS));
+	sts = pBitstreamPool->Extend(pBS, par.mfx.BufferSizeInKB * 1000 * MSDK_MAX(par.mfx.BRCParamMultiplier, 1));
+	MSDK_CHECK_STATUS(sts, "pBitstreamPool->Extend failed");
 
 	return MFX_ERR_NONE;
+}
+
+mfxU32 CEncodingPipeline::GetEncodedFrameBufferSize(CEncoderBackend* pEncoder)
+{
+	mfxU32 nRawFrameSize = m_mfxEncParams.mfx.FrameInfo.Width * m_mfxEncParams.mfx.FrameInfo.Height * 3 / 2;
+
+	mfxVideoParam par;
+	MSDK_ZERO_MEMORY(par);
+
+	mfxStatus sts = pEncoder->GetVideoParam(&par);
+	if (MFX_ERR_NONE != sts)
+	{
+		return nRawFrameSize;
+	}
+
+	mfxU32 nMultiplier = MSDK_MAX(par.mfx.BRCParamMultiplier, 1);
+
+	// no coded frame is larger than the coded picture buffer
+	if (par.mfx.BufferSizeInKB)
+	{
+		return par.mfx.BufferSizeInKB * 1000 * nMultiplier;
+	}
+
+	// otherwise one second worth of bitrate, the buffer is extended on demand anyway
+	if (MFX_RATECONTROL_CQP != par.mfx.RateControlMethod && par.mfx.TargetKbps)
+	{
+		return MSDK_MIN(par.mfx.TargetKbps * 1000 / 8 * nMultiplier, nRawFrameSize);
+	}
+
+	return nRawFrameSize;
 }
\ No newline at end of file
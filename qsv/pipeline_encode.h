@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
 #include <list>
 #include <vector>
 
@@ -8,7 +10,23 @@
 #include "mfxvideo.h"
 #include "mfxvideo++.h"
 
+#include "arena_allocator.h"
+#include "async_writer.h"
 #include "base_allocator.h"
+#include "bitstream_pool.h"
+#include "encoder_backend.h"
+#include "frame_prefetcher.h"
+#include "mock_encoder.h"
+#include "packet_queue.h"
+#include "run_report.h"
+#include "scaler.h"
+#include "shm_allocator.h"
+#include "shm_frame_ring.h"
+#include "stage_timings.h"
+#include "surface_pool.h"
+#include "thread_defs.h"
+#include "trace.h"
+#include "user_surface_pool.h"
 #include "utils.h"
 
 struct sTask
@@ -16,34 +34,128 @@ struct sTask
 	mfxBitstream mfxBS;
 	mfxSyncPoint EncSyncP;
 	CSmplBitstreamWriter *pWriter;
+	CBitstreamPool *pBitstreamPool;
+	mfxU32 nSmallFrames; // frames since mfxBS last overflowed the nominal size
+	mfxU32 nTaskIndex; // position in the task pool
+	mfxU32 nFrameOrder; // of the input frame submitted with the task, MSDK_TRACE_NONE when draining
+	mfxExtAVCEncodedFrameInfo EncodedFrameInfo; // attached to mfxBS, the encoder reports the frame it wrote
+	mfxExtBuffer* pBSExtParams[1];
 
 	sTask();
-	mfxStatus WriteBitstream();
-	mfxStatus Reset();
-	mfxStatus Init(mfxU32 nBufferSize, CSmplBitstreamWriter *pWriter = NULL);
+	// the frame whose bitstream is in mfxBS; it differs from nFrameOrder when the encoder reorders frames
+	mfxU32 GetEncodedFrameOrder() const;
+	mfxStatus WriteBitstream(mfxU32 nFrameOrder);
+	// nCodedSize is the size of the frame that was in mfxBS, it decides whether an enlarged buffer shrinks
+	mfxStatus Reset(mfxU32 nCodedSize = 0);
+	mfxStatus Init(CBitstreamPool *pBitstreamPool, CSmplBitstreamWriter *pWriter = NULL);
 	mfxStatus Close();
 };
 
+// keeps data written by different threads on separate cache lines
+#define MSDK_CACHE_LINE_SIZE 64
+
+// Tasks are handed out and completed in submission order through a single-producer/single-consumer
+// ring: GetFreeTask and SubmitTask advance the tail on the encoding thread, SynchronizeFirstTask or
+// the completion thread advance the head. Neither side takes a lock.
+// In completion thread mode submitted tasks are synchronized, written and recycled on a separate
+// thread, so the submitting side only waits when every task is in flight.
 class CEncTaskPool
 {
 public:
 	CEncTaskPool();
 	virtual ~CEncTaskPool();
 
-	virtual mfxStatus Init(MFXVideoSession* pmfxSession, CSmplBitstreamWriter* pWriter, mfxU32 nPoolSize, mfxU32 nBufferSize);
+	virtual mfxStatus Init(CEncoderBackend* pEncoder, CSmplBitstreamWriter* pWriter, mfxU32 nPoolSize, CBitstreamPool* pBitstreamPool,
+		CSurfacePool* pSurfacePool = NULL, bool bCompletionThread = false);
 	virtual mfxStatus GetFreeTask(sTask **ppTask);
-	virtual mfxStatus SynchronizeFirstTask();
+	// hands the task returned by the last GetFreeTask over for completion, it must have a valid sync point
+	virtual mfxStatus SubmitTask(sTask* pTask);
+	// completes the oldest task, MFX_WRN_IN_EXECUTION if it is not done within nWaitTime ms;
+	// MFX_ERR_NOT_FOUND if no task is in flight
+	virtual mfxStatus SynchronizeFirstTask(mfxU32 nWaitTime = MSDK_WAIT_INTERVAL);
 
 	virtual void Close();
+	// must not be called while the completion thread is busy with a task
 	virtual void ClearTasks();
+	// sync and write times of every completed task go to pTimings, NULL stops recording
+	void SetStageTimings(CStageTimings* pTimings) { m_pTimings = pTimings; }
+	// stops the frame of every written bitstream in pLatency, recorded into the stage timings; NULL stops
+	void SetFrameLatency(CFrameLatency* pLatency) { m_pLatency = pLatency; }
+	// appends the coded size of every written frame to pFrameSizes, NULL stops
+	void SetFrameSizes(std::vector<mfxU32>* pFrameSizes) { m_pFrameSizes = pFrameSizes; }
+
+	mfxU32 GetPoolSize() const { return m_nPoolSize; }
+	// submitted tasks that were not completed yet
+	mfxU32 GetTasksInFlight() const { return m_nPoolSize ? (m_nTail + 2 * m_nPoolSize - m_nHead) % (2 * m_nPoolSize) : 0; }
+	// tasks synchronized and written since the pool was created
+	mfxU32 GetCompletedTasks() const { return m_nCompletedTasks; }
 protected:
-	sTask* m_pTasks;
+	struct sTaskSlot
+	{
+		sTask Task;
+		mfxU8 Pad[MSDK_CACHE_LINE_SIZE - sizeof(sTask) % MSDK_CACHE_LINE_SIZE];
+	};
+
+	sTaskSlot* m_pSlots; // cache line aligned
 	mfxU32 m_nPoolSize;
-	mfxU32 m_nTaskBufferStart;
 
-	MFXVideoSession* m_pmfxSession;
+	// ring positions run over [0, 2 * m_nPoolSize) so that a full ring differs from an empty one
+	mfxU8 m_HeadPad[MSDK_CACHE_LINE_SIZE];
+	std::atomic<mfxU32> m_nHead; // oldest submitted task, written by the consumer only
+	mfxU8 m_TailPad[MSDK_CACHE_LINE_SIZE];
+	std::atomic<mfxU32> m_nTail; // next task to submit, written by the producer only
+	mfxU8 m_EndPad[MSDK_CACHE_LINE_SIZE];
+
+	CEncoderBackend* m_pEncoder;
+	CSurfacePool* m_pSurfacePool; // recycled whenever a task completes
+	CStageTimings* m_pTimings;
+	CFrameLatency* m_pLatency;
+	std::vector<mfxU32>* m_pFrameSizes;
+
+	mfxU32 NextPosition(mfxU32 nPos) const { return (nPos + 1) % (2 * m_nPoolSize); }
+	sTask* GetTask(mfxU32 nPos) { return &m_pSlots[nPos % m_nPoolSize].Task; }
+	mfxStatus CompleteTask(sTask* pTask, mfxU32 nWaitTime);
+
+	// completion thread mode
+	static unsigned int MFX_STDCALL CompletionThreadRoutine(void* pArg);
+	void CompleteTasks();
+
+	std::auto_ptr<MSDKThread> m_pCompletionThread;
+	std::auto_ptr<MSDKEvent> m_pTaskSubmitted;
+	std::auto_ptr<MSDKEvent> m_pTaskCompleted;
+	std::atomic<mfxStatus> m_CompletionStatus; // first error seen by the completion thread
+	std::atomic<bool> m_bStop;
+
+	std::atomic<mfxU32> m_nCompletedTasks;
+};
+
+// an extra output of the ladder mode, encoded from the same input frames as the main one
+struct sLadderRung
+{
+	mfxU16 nBitRate;
+	std::string dstFile;
+	mfxU16 nWidth; // encoded picture size, 0 keeps the source size
+	mfxU16 nHeight;
+	mfxU16 nInitialDelayInKB; // strict HRD only, 0 is half the coded picture buffer
+};
+
+// coded picture buffer of strict HRD mode: one second of nKbps
+inline mfxU16 GetStrictHrdBufferSizeInKB(mfxU16 nKbps)
+{
+	return (mfxU16)MSDK_MAX(nKbps / 8, 1);
+}
 
-	virtual mfxU32 GetFreeTaskIndex();
+// the coded picture buffer an encoder in strict HRD mode settled on and the size of every frame it wrote, in
+// decoding order; enough to follow the buffer fullness a decoder sees
+struct sHrdTrace
+{
+	mfxU64 nBitRate; // bits per second, constant
+	mfxU64 nBufferSize; // bits
+	mfxU64 nInitialDelay; // bits in the buffer when the first frame is removed
+	mfxF64 dFrameRate;
+	std::vector<mfxU32> FrameSizes; // bytes
+
+	sHrdTrace() : nBitRate(0), nBufferSize(0), nInitialDelay(0), dFrameRate(0) {}
 };
 
 struct sInputParams
@@ -53,8 +165,37 @@ struct sInputParams
 	mfxF64 dFrameRate;
 	mfxU16 nBitRate;
 	mfxU32 FileInputFourCC;
-	std::list<std::string> InputFiles;
-	std::string dstFileBuff;
+	std::list<std::string> InputFiles; // none for push mode, see CEncodingPipeline::SubmitFrame
+	std::string dstFileBuff; // none in push mode hands encoded frames to PollPacket or pPacketCallback
+	bool bUseMemoryMap; // map input files instead of reading them with stdio
+	mfxU32 nPrefetchDepth; // number of frames loaded ahead on a separate thread, 0 loads inline
+	bool bCompletionThread; // synchronize and write tasks on a separate thread
+	bool bAsyncWriter; // write the output file on a separate thread
+	bool bUseArenaAllocator; // carve frames from large-page arenas instead of calloc
+	MFXFrameAllocator* pSharedAllocator; // frame allocator shared with other pipelines, not owned, NULL creates one
+	CEncoderBackend* pParentSession; // session to join, so that both share one scheduler; it must stay open until this pipeline is closed
+	mfxU16 nWriterDurability; // MSDK_DURABILITY_*, asynchronous writer only
+	std::string reportFile; // JSON run report, none if empty
+	std::string traceFile; // Chrome trace of the run, none if empty
+	mfxU32 nReportInterval; // seconds between reports while running, 0 writes the final report only
+	std::vector<mfxIMPL> Implementations; // tried in order, empty tries hardware on any display adapter
+	bool bUseMockEncoder; // encode with CMockEncoderBackend instead of the media SDK
+	sMockEncoderParams MockParams;
+	std::vector<sLadderRung> Ladder; // outputs encoded in addition to dstFileBuff, every frame is read and converted once for all
+	mfxU16 nScaleFilter; // MSDK_SCALE_*, for rungs of another size
+	mfxU32 nScaleThreads; // threads scaling a frame in stripes, 0 uses every CPU
+	mfxU32 nFirstFrame; // first input frame to encode, frame orders and timestamps count on from it
+	mfxU32 nFrameCount; // frames to encode from nFirstFrame on, 0 encodes up to the end of the input
+	mfxU16 nGopSize; // frames from one IDR frame to the next, 0 leaves it to the encoder
+	bool bStrictHrd; // CBR with a fixed coded picture buffer and initial delay, signalled in buffering period SEI at every IDR
+	mfxU16 nInitialDelayInKB; // strict HRD only: coded picture buffer fullness when decoding starts, 0 is half the buffer
+	mfxU32 nChunks; // pieces the input is split into at IDR frames and encoded in parallel by CChunkedEncoder
+	PacketCallback pPacketCallback; // push mode without dstFileBuff: gets every encoded frame instead of PollPacket
+	void* pPacketContext; // passed to pPacketCallback
+	UserFrameReleaseCallback pUserFrameRelease; // push mode: gets every frame of SubmitUserFrame back once it is encoded
+	void* pUserFrameContext; // passed to pUserFrameRelease
+	std::string shmName; // reads the frames from the shared memory ring of that name instead of InputFiles, see CShmFrameRing
+	bool bLowLatency; // live streaming preset: no B-frames or lookahead, one frame in flight, written before the next is read
 };
 
 class CEncodingPipeline
@@ -68,44 +209,193 @@ public:
 	void Close();
 	mfxStatus ResetMFXComponents(sInputParams* pParams);
 
+	// frames synchronized since Init by the main encoder, may be called from any thread while running
+	mfxU32 GetFramesEncoded() const { return m_TaskPool.GetCompletedTasks(); }
+	void CollectStatistics(sRunStatistics* pStats);
+	// strict HRD mode: the buffer and frame sizes of the main encoder followed by those of every rung, once Run returned
+	void GetHrdTraces(std::vector<sHrdTrace>* pTraces);
+	const CStageTimings& GetStageTimings() const { return m_Timings; }
+	// the session, valid from Init till Close
+	CEncoderBackend* GetFirstEncoder() { return m_pEncoder; }
+	// after a device loss: re-initializes only the encoder when the allocations still fit and replays
+	// the frames that were in flight, falls back to ResetMFXComponents otherwise
+	mfxStatus RecoverMFXComponents(sInputParams* pParams);
+
+	// Push mode, sInputParams::InputFiles empty: the application submits frames instead of Run reading them.
+	// Neither SubmitFrame nor PollPacket wait for the encoder, completed frames are collected whenever either
+	// is called. The main encoder and every rung must be able to take a frame for a submission to succeed; a rung
+	// too busy for a frame the main encoder took gets it again before the next one is accepted.
+
+	// copies an NV12 picture of the source size, ppPlanes[0] luma and ppPlanes[1] interleaved chroma, into a free
+	// input surface and encodes it; nTimeStamp comes back with its packet. MFX_WRN_DEVICE_BUSY if every surface or
+	// task is in use, the encoder is busy or too many packets wait to be polled: the frame was not taken and is to be
+	// submitted again after polling packets
+	mfxStatus SubmitFrame(const mfxU8* const* ppPlanes, const mfxU32* pPitches, mfxU64 nTimeStamp);
+	// encodes an application frame in place instead of copying it, with the same backpressure as SubmitFrame;
+	// the buffers must stay untouched until the frame comes back to sInputParams::pUserFrameRelease, which is
+	// called from SubmitUserFrame, SubmitFrame, PollPacket, EndOfStream or Close
+	mfxStatus SubmitUserFrame(const sUserFrame& frame);
+	// next encoded frame, MFX_ERR_MORE_DATA if none is complete yet; its buffer is valid until ReleasePacket
+	mfxStatus PollPacket(sEncodedPacket* pPacket);
+	// every polled packet must be released before Close
+	void ReleasePacket(sEncodedPacket* pPacket);
+	// after the last frame: encodes the frames the encoder still buffers and waits for all of them,
+	// their packets remain to be polled
+	mfxStatus EndOfStream();
+
 private:
 	mfxStatus InitEncFrameParams(sTask* pTask);
 
 	mfxStatus CreateAllocator();
 	void DeleteAllocator();
+	void PrintMemoryStatistics();
+	void WriteReport(bool bFinal);
 
 	mfxStatus InitMfxEncParams(sInputParams *pParams);
-	mfxStatus InitFileWriter(CSmplBitstreamWriter **ppWriter, const std::string& filename);
+	// one second of TargetKbps as coded picture buffer, nInitialDelayInKB full when decoding starts, 0 is half full
+	void SetStrictHrdBuffer(mfxInfoMFX* pMfx, mfxU16 nInitialDelayInKB);
+	// the coded picture buffer pEncoder settled on, for pTrace
+	mfxStatus InitHrdTrace(CEncoderBackend* pEncoder, sHrdTrace* pTrace);
+	// opens the first implementation in pParams->Implementations that fully accelerates pEncoder with encParams
+	mfxStatus CreateSession(sInputParams* pParams, CEncoderBackend* pEncoder, const mfxVideoParam& encParams);
+	mfxStatus InitFileWriter(CSmplBitstreamWriter **ppWriter, const std::string& filename, CBitstreamPool* pBitstreamPool,
+		sInputParams* pParams);
 	void FreeFileWriter();
 
+	// encoder, output and parameters of one rung of the ladder; at the source size it encodes the input surfaces of
+	// the main encoder, at another size scaled copies in surfaces of its own
+	struct sRung
+	{
+		CEncoderBackend* pEncoder; // owns the session
+		bool bJoinedSession;
+		mfxU16 nBitRate;
+		mfxU16 nWidth; // 0 is the source size
+		mfxU16 nHeight;
+		mfxU16 nInitialDelayInKB;
+		bool bScaled;
+		mfxVideoParam EncParams;
+		CSmplBitstreamWriter* pWriter;
+		CBitstreamPool BitstreamPool;
+		CEncTaskPool TaskPool;
+		CStageTimings Timings; // sync and write, merged into m_Timings at the end of Run
+		sHrdTrace HrdTrace; // strict HRD mode only
+		mfxU32 nDeviceBusyRetries;
+		// push mode: a frame the main encoder took while the encoder of the rung was busy
+		mfxFrameSurface1* pPendingSurface;
+
+		// scaled rungs only
+		mfxFrameSurface1* pSurfaces;
+		mfxFrameAllocResponse Response;
+		CSurfacePool SurfacePool;
+
+		sRung();
+	};
+
+	mfxStatus InitRungs(sInputParams* pParams);
+	// derives the parameters of the rung from m_mfxEncParams
+	void InitRungEncParams(sRung* pRung);
+	void CloseRungs();
+	mfxStatus AllocRungFrames(sRung* pRung);
+	void DeleteRungFrames(sRung* pRung);
+	// scales pSurf into a surface of the rung and submits that one
+	mfxStatus SubmitScaledFrame(sRung* pRung, mfxFrameSurface1* pSurf);
+	mfxStatus GetFreeRungSurface(sRung* pRung, mfxFrameSurface1** ppSurf);
+	// submits pSurf to the encoder of the rung, in push mode a busy encoder leaves it pending
+	mfxStatus SubmitRungSurface(sRung* pRung, mfxFrameSurface1* pSurf);
+	// push mode: submits the pending frame of the rung and checks that it has a free task and surface for the
+	// next one, MFX_WRN_DEVICE_BUSY otherwise
+	mfxStatus PrepareRung(sRung* pRung);
+
 	mfxStatus AllocFrames();
 	void DeleteFrames();
 
-	virtual mfxStatus AllocateSufficientBuffer(mfxBitstream* pBS);
+	virtual mfxStatus AllocateSufficientBuffer(CEncoderBackend* pEncoder, CBitstreamPool* pBitstreamPool, mfxBitstream* pBS);
+	// nominal output buffer size, from the coded picture buffer size pEncoder settled on
+	mfxU32 GetEncodedFrameBufferSize(CEncoderBackend* pEncoder);
 	mfxStatus LoadNextFrame(mfxFrameSurface1* pSurf);
+	mfxStatus GetPrefetchedFrame(mfxFrameSurface1** ppSurf);
+	mfxStatus GetFreeSurface(mfxFrameSurface1** ppSurf);
+	// the input surface of the next frame of the shared memory ring once the producer wrote it
+	mfxStatus GetShmFrame(mfxFrameSurface1** ppSurf);
+	// gives the producer back the slots of the frames the encoders are done with, in frame order
+	void ReleaseShmFrames();
 
-	mfxStatus GetFreeTask(sTask **ppTask);
-	MFXVideoSession& GetFirstSession() { return m_mfxSession; }
-	MFXVideoENCODE* GetFirstEncoder() { return m_pmfxENC; }
+	mfxStatus GetFreeTask(CEncTaskPool* pTaskPool, sTask **ppTask);
+	// submits pSurf to the main encoder and to every rung; MFX_WRN_DEVICE_BUSY in push mode if the main encoder
+	// did not take it, the surface is then as it was before the call
+	mfxStatus EncodeSurface(mfxFrameSurface1* pSurf);
+	// completes the tasks of the main encoder and of the rungs that are done, without waiting for the others,
+	// and gives application frames the encoders are done with back
+	mfxStatus CompleteReadyTasks();
+	// collects completed frames and checks that a frame can be submitted without waiting, MFX_WRN_DEVICE_BUSY
+	// otherwise; a frame in flight at a device loss is encoded again first, which takes the turn of the new frame
+	mfxStatus PrepareSubmission();
+	mfxStatus ReplayNextSurface();
+	// encodes a surface that was filled in push mode
+	mfxStatus EncodePushedSurface(mfxFrameSurface1* pSurf, mfxU64 nTimeStamp);
+	mfxStatus CopyFrame(mfxFrameSurface1* pSurf, const mfxU8* const* ppPlanes, const mfxU32* pPitches);
+	// submits pSurf to pEncoder in a task of pTaskPool, NULL drains a buffered frame;
+	// MFX_ERR_MORE_DATA means the encoder took the frame without output, or has nothing left to drain;
+	// in push mode MFX_WRN_DEVICE_BUSY means it did not take the frame, the other modes wait for it
+	mfxStatus SubmitSurface(CEncoderBackend* pEncoder, CEncTaskPool* pTaskPool, CBitstreamPool* pBitstreamPool,
+		mfxFrameSurface1* pSurf, mfxU32* pnBusyRetries);
+	// drains pEncoder and completes every task of pTaskPool
+	mfxStatus Flush(CEncoderBackend* pEncoder, CEncTaskPool* pTaskPool, CBitstreamPool* pBitstreamPool, mfxU32* pnBusyRetries);
+	// completes the oldest task of the main encoder and of every rung, as a surface is free only once all of them
+	// are done with it; MFX_ERR_NOT_FOUND if no encoder has a task in flight
+	mfxStatus SynchronizeFirstTasks();
 
 private:
 	CSmplBitstreamWriter *m_FileWriter;
 	CSmplYUVReader m_FileReader;
+	CSurfacePool m_SurfacePool;
+	CBitstreamPool m_BitstreamPool;
+	CFramePrefetcher m_Prefetcher;
 	CEncTaskPool m_TaskPool;
+	CStageTimings m_Timings; // per frame durations of every stage, over all resets
+	CFrameLatency m_Latency; // of the frames of the main encoder
+	CRunReport m_Report;
+	std::string m_sTraceFile;
+	mfxU32 m_nDeviceBusyRetries;
 
-	MFXVideoSession m_mfxSession;
-	MFXVideoENCODE* m_pmfxENC;
+	CEncoderBackend* m_pEncoder; // owns the session
+	bool m_bJoinedSession; // m_pEncoder is a child of sInputParams::pParentSession
+	std::vector<sRung*> m_Rungs; // share the input surfaces, every surface is held once per encoder at the source size
+	CFrameScaler m_Scaler; // for rungs of another size
 
 	mfxVideoParam m_mfxEncParams;
+	bool m_bStrictHrd;
+	sHrdTrace m_HrdTrace; // of the main encoder, strict HRD mode only
+	mfxExtCodingOption m_CodingOption; // HRD signalling of strict HRD mode, for the main encoder and every rung
+	mfxExtBuffer* m_pEncExtParams[1];
 
 	MFXFrameAllocator* m_pMFXAllocator;
+	ArenaBufferAllocator* m_pArenaAllocator; // buffer allocator behind m_pMFXAllocator, NULL when it uses calloc
+	bool m_bSharedAllocator; // m_pMFXAllocator belongs to the caller
+	bool m_bUseArenaAllocator;
+
+	// frame allocation cost over all resets, to compare buffer allocators
+	mfxF64 m_dFrameAllocTime;
+	mfxU64 m_nFrameAllocPageFaults;
 
 	mfxFrameSurface1* m_pEncSurfaces; // frames array for encoder input (vpp output)
+	std::deque<mfxFrameSurface1*> m_ReplayQueue; // frames to encode again after a recovery
 	mfxFrameAllocResponse m_EncResponse;  // memory allocation response for encoder
 
 	mfxU32 m_InputFourCC;
+	bool m_bPushMode; // frames come from SubmitFrame
+	CPacketQueue* m_pPacketQueue; // m_FileWriter in push mode without an output file
+	CUserSurfacePool m_UserSurfacePool; // application frames encoded in place, push mode only
+	CShmFrameRing m_ShmRing; // the input surfaces are its slots, shared memory input only
+	ShmBufferAllocator* m_pShmAllocator; // buffer allocator behind m_pMFXAllocator placing the input surfaces in m_ShmRing
+	bool m_bShmInput;
+	mfxU32 m_nShmReleased; // frames whose slots went back to the producer
 	
+	mfxU32 m_nFirstFrame; // frame order of the first frame read
 	mfxU32 m_nFramesRead;
+	mfxU32 m_nPrefetchDepth;
+	bool m_bCompletionThread;
+	bool m_bLowLatency;
 
 	mfxEncodeCtrl m_encCtrl;
 };
\ No newline at end of file
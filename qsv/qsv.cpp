@@ -1,24 +1,488 @@
+#include <cctype>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <vector>
 
+#include "chunked_encoder.h"
 #include "pipeline_encode.h"
+#include "shm_frame_ring.h"
+#include "stream_runner.h"
 
-int main(int argc, char** argv)
+static void PrintUsage(const char* name)
 {
-	if (argc != 6) {
-		std::cerr << "Usage: " << argv[0] << " input_file_name output_file_name width height bitrate" << std::endl;
-		return -1;
+	std::cerr << "Usage: " << name << " input_file_name output_file_name width height bitrate [options]" << std::endl;
+	std::cerr << "       " << name << " -jobs file [-scaling] [-join] [-arena] [-report file]" << std::endl;
+	std::cerr << "       " << name << " -shm_produce name input_file_name [-nv12] [-fps n]" << std::endl;
+	std::cerr << "  input_file_name shm:name reads the frames from the shared memory ring name, which a producer" << std::endl;
+	std::cerr << "           in another process writes into; the encoder creates it and ends with the producer's stream" << std::endl;
+	std::cerr << "Options:" << std::endl;
+	std::cerr << "  -nv12    input file is NV12 (default is I420)" << std::endl;
+	std::cerr << "  -mmap    map the input file into memory instead of reading it with stdio" << std::endl;
+	std::cerr << "  -prefetch depth  load up to depth frames ahead on a separate thread" << std::endl;
+	std::cerr << "  -sync_thread  synchronize and write encoded frames on a separate thread" << std::endl;
+	std::cerr << "  -async_write  write the output file on a separate thread" << std::endl;
+	std::cerr << "  -durability none|periodic|close  when the async writer flushes data to stable storage" << std::endl;
+	std::cerr << "  -arena   allocate frames from large-page arenas instead of calloc" << std::endl;
+	std::cerr << "  -report file  write a JSON run report to file at the end of the run" << std::endl;
+	std::cerr << "  -report_interval sec  also rewrite the report every sec seconds while running" << std::endl;
+	std::cerr << "  -trace file  write a Chrome trace of per frame spans to file (open in ui.perfetto.dev)" << std::endl;
+	std::cerr << "  -impl name[,name...]  implementations to try in order: sw, hw, hw2, hw3, hw4, hw_any, auto, auto_any" << std::endl;
+	std::cerr << "           (default hw_any), partially accelerated ones fall back to the next" << std::endl;
+	std::cerr << "  -rung bitrate file [WxH]  also encode the input at bitrate to file, scaled to WxH if given; may be repeated" << std::endl;
+	std::cerr << "           for an ABR ladder, every frame is read and converted once and shared by the encoders of all rungs" << std::endl;
+	std::cerr << "  -scale_filter bilinear|area  filter scaling the frames of rungs of another size (default bilinear)" << std::endl;
+	std::cerr << "  -scale_threads n  threads scaling a frame in horizontal stripes (default every CPU)" << std::endl;
+	std::cerr << "  -range first count  encode count frames from frame first on, count 0 up to the end of the input" << std::endl;
+	std::cerr << "  -gop n   frames from one IDR frame to the next, every I frame is an IDR frame and GOPs are closed" << std::endl;
+	std::cerr << "  -hrd     fixed CBR buffer of one second, half full at start, with buffering period SEI at every IDR frame" << std::endl;
+	std::cerr << "  -chunks n  split the input into n ranges of whole GOPs (-gop, default " << MSDK_CHUNK_GOP_DURATION
+		<< " s), encode them in parallel sessions" << std::endl;
+	std::cerr << "           and join the pieces in order; implies -hrd, every piece is padded or encoded again until the" << std::endl;
+	std::cerr << "           coded picture buffer holds at every joint what the next piece starts with" << std::endl;
+	std::cerr << "  -low_latency  live streaming: no B-frames or lookahead, one frame in the encoder, every frame written" << std::endl;
+	std::cerr << "           before the next is read; -prefetch is ignored" << std::endl;
+	std::cerr << "  -mock    encode with a mock encoder instead of the hardware" << std::endl;
+	std::cerr << "  -mock_latency us  time the mock encoder spends on a frame" << std::endl;
+	std::cerr << "  -mock_size bytes  size of a non-key frame from the mock encoder (default from bitrate)" << std::endl;
+	std::cerr << "  -mock_busy percent  share of submissions the mock encoder rejects with MFX_WRN_DEVICE_BUSY" << std::endl;
+	std::cerr << "  -mock_hold us  time the mock encoder keeps an encoded input surface locked" << std::endl;
+	std::cerr << "Multiple streams:" << std::endl;
+	std::cerr << "  -jobs file  encode the streams listed in file in parallel, one per line in the form of a single stream command line" << std::endl;
+	std::cerr << "           (without the program name), empty lines and lines starting with # are skipped" << std::endl;
+	std::cerr << "  -scaling  run the first 1, 2, ... N streams one after another and compare the aggregate fps" << std::endl;
+	std::cerr << "  -join    join the sessions of all streams to the first one, so that they share one scheduler;" << std::endl;
+	std::cerr << "           with -scaling every stream count runs with independent and with joined sessions" << std::endl;
+	std::cerr << "  -arena   frames of all streams come from one arena allocator" << std::endl;
+	std::cerr << "  -report file  write the combined JSON run report to file" << std::endl;
+	std::cerr << "Shared memory producer:" << std::endl;
+	std::cerr << "  -shm_produce name  write the frames of input_file_name into the ring of an encoder reading shm:name," << std::endl;
+	std::cerr << "           the way a decoder in another process would; the frame size is that of the encoder" << std::endl;
+	std::cerr << "  -fps n   write n frames per second like a live source instead of as fast as the encoder takes them" << std::endl;
+}
+
+// args: input_file_name output_file_name width height bitrate [options]
+static bool ParseStreamParams(const std::vector<std::string>& args, sInputParams* pParams)
+{
+	if (args.size() < 5) {
+		return false;
 	}
 
-	sInputParams params{};
-	params.nWidth = std::stoi(argv[3]);
-	params.nHeight = std::stoi(argv[4]);
-	params.nBitRate = std::stoi(argv[5]);
+	sInputParams& params = *pParams;
+	params = sInputParams();
+	params.nWidth = std::stoi(args[2]);
+	params.nHeight = std::stoi(args[3]);
+	params.nBitRate = std::stoi(args[4]);
 	params.FileInputFourCC = MFX_FOURCC_I420;
-	params.InputFiles = { argv[1] };
-	params.dstFileBuff = { argv[2] };
+	params.InputFiles = { args[0] };
+	if (0 == args[0].compare(0, 4, "shm:")) {
+		params.shmName = args[0].substr(4);
+		params.InputFiles.clear();
+	}
+	params.dstFileBuff = { args[1] };
 	params.dFrameRate = 30;
 
+	for (size_t i = 5; i < args.size(); i++)
+	{
+		const std::string& option = args[i];
+		if (option == "-nv12") {
+			params.FileInputFourCC = MFX_FOURCC_NV12;
+		}
+		else if (option == "-mmap") {
+			params.bUseMemoryMap = true;
+		}
+		else if (option == "-prefetch" && i + 1 < args.size()) {
+			params.nPrefetchDepth = std::stoi(args[++i]);
+		}
+		else if (option == "-sync_thread") {
+			params.bCompletionThread = true;
+		}
+		else if (option == "-async_write") {
+			params.bAsyncWriter = true;
+		}
+		else if (option == "-arena") {
+			params.bUseArenaAllocator = true;
+		}
+		else if (option == "-report" && i + 1 < args.size()) {
+			params.reportFile = args[++i];
+		}
+		else if (option == "-report_interval" && i + 1 < args.size()) {
+			params.nReportInterval = std::stoi(args[++i]);
+		}
+		else if (option == "-trace" && i + 1 < args.size()) {
+			params.traceFile = args[++i];
+		}
+		else if (option == "-impl" && i + 1 < args.size()) {
+			const std::string& list = args[++i];
+			for (size_t pos = 0; pos <= list.size();) {
+				size_t end = list.find(',', pos);
+				if (end == std::string::npos) {
+					end = list.size();
+				}
+				mfxIMPL impl = 0;
+				if (MFX_ERR_NONE != StringToImplementation(list.substr(pos, end - pos), &impl)) {
+					std::cerr << "Unknown implementation: " << list.substr(pos, end - pos) << std::endl;
+					return false;
+				}
+				params.Implementations.push_back(impl);
+				pos = end + 1;
+			}
+		}
+		else if (option == "-rung" && i + 2 < args.size()) {
+			sLadderRung rung;
+			rung.nBitRate = std::stoi(args[++i]);
+			rung.dstFile = args[++i];
+			rung.nWidth = rung.nHeight = 0;
+			rung.nInitialDelayInKB = 0;
+			if (i + 1 < args.size() && std::isdigit((unsigned char)args[i + 1][0])) {
+				const std::string& size = args[++i];
+				size_t x = size.find('x');
+				if (x == std::string::npos) {
+					std::cerr << "Invalid rung size: " << size << std::endl;
+					return false;
+				}
+				rung.nWidth = std::stoi(size.substr(0, x));
+				rung.nHeight = std::stoi(size.substr(x + 1));
+			}
+			params.Ladder.push_back(rung);
+		}
+		else if (option == "-scale_filter" && i + 1 < args.size()) {
+			const std::string& filter = args[++i];
+			if (filter == "bilinear") {
+				params.nScaleFilter = MSDK_SCALE_BILINEAR;
+			}
+			else if (filter == "area") {
+				params.nScaleFilter = MSDK_SCALE_AREA;
+			}
+			else {
+				std::cerr << "Unknown scale filter: " << filter << std::endl;
+				return false;
+			}
+		}
+		else if (option == "-scale_threads" && i + 1 < args.size()) {
+			params.nScaleThreads = std::stoi(args[++i]);
+		}
+		else if (option == "-range" && i + 2 < args.size()) {
+			params.nFirstFrame = std::stoi(args[++i]);
+			params.nFrameCount = std::stoi(args[++i]);
+		}
+		else if (option == "-gop" && i + 1 < args.size()) {
+			params.nGopSize = std::stoi(args[++i]);
+		}
+		else if (option == "-hrd") {
+			params.bStrictHrd = true;
+		}
+		else if (option == "-chunks" && i + 1 < args.size()) {
+			params.nChunks = std::stoi(args[++i]);
+		}
+		else if (option == "-low_latency") {
+			params.bLowLatency = true;
+		}
+		else if (option == "-mock") {
+			params.bUseMockEncoder = true;
+		}
+		else if (option == "-mock_latency" && i + 1 < args.size()) {
+			params.MockParams.nLatency = std::stoi(args[++i]);
+		}
+		else if (option == "-mock_size" && i + 1 < args.size()) {
+			params.MockParams.nFrameSize = std::stoi(args[++i]);
+		}
+		else if (option == "-mock_busy" && i + 1 < args.size()) {
+			params.MockParams.nBusyRate = std::stoi(args[++i]);
+		}
+		else if (option == "-mock_hold" && i + 1 < args.size()) {
+			params.MockParams.nHoldTime = std::stoi(args[++i]);
+		}
+		else if (option == "-durability" && i + 1 < args.size()) {
+			const std::string& policy = args[++i];
+			if (policy == "none") {
+				params.nWriterDurability = MSDK_DURABILITY_NONE;
+			}
+			else if (policy == "periodic") {
+				params.nWriterDurability = MSDK_DURABILITY_PERIODIC;
+			}
+			else if (policy == "close") {
+				params.nWriterDurability = MSDK_DURABILITY_ON_CLOSE;
+			}
+			else {
+				std::cerr << "Unknown durability policy: " << policy << std::endl;
+				return false;
+			}
+		}
+		else {
+			std::cerr << "Unknown option: " << option << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool ReadJobFile(const std::string& name, std::vector<sInputParams>* pStreams)
+{
+	std::ifstream file(name);
+	if (!file) {
+		std::cerr << "Cannot open the job file " << name << std::endl;
+		return false;
+	}
+
+	std::string line;
+	for (mfxU32 nLine = 1; std::getline(file, line); nLine++)
+	{
+		std::istringstream tokens(line);
+		std::vector<std::string> args;
+		for (std::string arg; tokens >> arg;) {
+			args.push_back(arg);
+		}
+
+		if (args.empty() || '#' == args[0][0]) {
+			continue;
+		}
+
+		sInputParams params;
+		if (!ParseStreamParams(args, &params)) {
+			std::cerr << name << ":" << nLine << ": invalid stream" << std::endl;
+			return false;
+		}
+		if (params.nChunks) {
+			std::cerr << name << ":" << nLine << ": -chunks is not supported in job files" << std::endl;
+			return false;
+		}
+		if (!params.shmName.empty()) {
+			std::cerr << name << ":" << nLine << ": shared memory input is not supported in job files" << std::endl;
+			return false;
+		}
+		pStreams->push_back(params);
+	}
+
+	if (pStreams->empty()) {
+		std::cerr << "No streams in " << name << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+struct sScalingPoint
+{
+	mfxF64 dFps;     // aggregate
+	mfxF64 dCpuLoad; // percent of one core
+};
+
+static int RunStreams(const std::vector<std::string>& args)
+{
+	std::vector<sInputParams> streams;
+	bool bScaling = false;
+	bool bUseArenaAllocator = false;
+	bool bJoinSessions = false;
+	std::string reportFile;
+
+	for (size_t i = 0; i < args.size(); i++)
+	{
+		if (args[i] == "-jobs" && i + 1 < args.size()) {
+			if (!ReadJobFile(args[++i], &streams)) {
+				return -1;
+			}
+		}
+		else if (args[i] == "-scaling") {
+			bScaling = true;
+		}
+		else if (args[i] == "-arena") {
+			bUseArenaAllocator = true;
+		}
+		else if (args[i] == "-join") {
+			bJoinSessions = true;
+		}
+		else if (args[i] == "-report" && i + 1 < args.size()) {
+			reportFile = args[++i];
+		}
+		else {
+			std::cerr << "Unknown option: " << args[i] << std::endl;
+			return -1;
+		}
+	}
+
+	if (streams.empty()) {
+		std::cerr << "-jobs is missing" << std::endl;
+		return -1;
+	}
+
+	// aggregate fps and CPU load by stream count, only the full count without -scaling;
+	// with -scaling -join every count runs with independent sessions first, then joined
+	std::vector<sScalingPoint> independent, joined;
+
+	for (size_t nStreams = bScaling ? 1 : streams.size(); nStreams <= streams.size(); nStreams++)
+	{
+		std::vector<sInputParams> run(streams.begin(), streams.begin() + nStreams);
+
+		for (int join = (bScaling || !bJoinSessions) ? 0 : 1; join <= (bJoinSessions ? 1 : 0); join++)
+		{
+			std::auto_ptr<CStreamRunner> pRunner(new CStreamRunner());
+			MSDK_CHECK_POINTER(pRunner.get(), MFX_ERR_MEMORY_ALLOC);
+
+			// with -scaling the report is that of the last run, which has all the streams
+			mfxStatus sts = pRunner->Init(run, bUseArenaAllocator, reportFile, 1 == join);
+			MSDK_CHECK_STATUS(sts, "pRunner->Init failed");
+
+			std::cout << "Processing " << nStreams << (join ? " joined" : "") << " streams" << std::endl;
+
+			sts = pRunner->Run();
+			MSDK_CHECK_STATUS(sts, "pRunner->Run failed");
+
+			mfxF64 dTime = MSDK_MAX(pRunner->GetElapsedTime(), 1e-9);
+			sScalingPoint point = { pRunner->GetFramesEncoded() / dTime, 100 * pRunner->GetCpuTime() / dTime };
+			(join ? joined : independent).push_back(point);
+		}
+	}
+
+	if (bScaling && bJoinSessions) {
+		std::cout << "Independent vs joined sessions:" << std::endl;
+		std::cout << " streams  independent fps  CPU %  joined fps  CPU %  joined/independent fps" << std::endl;
+		std::cout << std::fixed << std::setprecision(1);
+		for (size_t i = 0; i < joined.size(); i++)
+		{
+			std::cout << std::setw(8) << i + 1 << std::setw(17) << independent[i].dFps << std::setw(7) << independent[i].dCpuLoad
+				<< std::setw(12) << joined[i].dFps << std::setw(7) << joined[i].dCpuLoad
+				<< std::setprecision(2) << std::setw(24) << (independent[i].dFps > 0 ? joined[i].dFps / independent[i].dFps : 0)
+				<< std::setprecision(1) << std::endl;
+		}
+		std::cout.unsetf(std::ios::floatfield);
+	}
+	else if (bScaling) {
+		// per stream fps relative to a single stream shows what each added stream costs the others
+		std::cout << "Scaling:" << std::endl;
+		std::cout << " streams  aggregate fps  fps per stream  vs 1 stream  CPU %" << std::endl;
+		std::cout << std::fixed << std::setprecision(1);
+		for (size_t i = 0; i < independent.size(); i++)
+		{
+			mfxF64 dPerStream = independent[i].dFps / (i + 1);
+			std::cout << std::setw(8) << i + 1 << std::setw(15) << independent[i].dFps << std::setw(16) << dPerStream
+				<< std::setw(12) << (independent[0].dFps > 0 ? 100 * dPerStream / independent[0].dFps : 0) << "%"
+				<< std::setw(7) << independent[i].dCpuLoad << std::endl;
+		}
+		std::cout.unsetf(std::ios::floatfield);
+	}
+
+	std::cout << "Processing finished" << std::endl;
+
+	return 0;
+}
+
+static int RunChunks(const sInputParams& params)
+{
+	std::auto_ptr<CChunkedEncoder> pEncoder(new CChunkedEncoder());
+	MSDK_CHECK_POINTER(pEncoder.get(), MFX_ERR_MEMORY_ALLOC);
+
+	mfxStatus sts = pEncoder->Init(params);
+	MSDK_CHECK_STATUS(sts, "pEncoder->Init failed");
+
+	std::cout << "Processing " << pEncoder->GetChunkCount() << " chunks" << std::endl;
+
+	sts = pEncoder->Run();
+	MSDK_CHECK_STATUS(sts, "pEncoder->Run failed");
+
+	pEncoder->Close();
+
+	std::cout << "Processing finished" << std::endl;
+
+	return 0;
+}
+
+// args: -shm_produce name input_file_name [options]
+static int RunShmProducer(const std::vector<std::string>& args)
+{
+	if (args.size() < 3) {
+		std::cerr << "-shm_produce needs a ring name and an input file" << std::endl;
+		return -1;
+	}
+
+	mfxU32 nFourCC = MFX_FOURCC_I420;
+	mfxF64 dFrameRate = 0;
+	for (size_t i = 3; i < args.size(); i++)
+	{
+		if (args[i] == "-nv12") {
+			nFourCC = MFX_FOURCC_NV12;
+		}
+		else if (args[i] == "-fps" && i + 1 < args.size()) {
+			dFrameRate = std::stod(args[++i]);
+		}
+		else {
+			std::cerr << "Unknown option: " << args[i] << std::endl;
+			return -1;
+		}
+	}
+
+	CSmplYUVReader reader;
+	mfxStatus sts = reader.Init({ args[2] }, nFourCC);
+	MSDK_CHECK_STATUS(sts, "reader.Init failed");
+
+	CShmFrameRing ring;
+	sts = ring.Open(args[1], MSDK_SHM_OPEN_WAIT_INTERVAL);
+	MSDK_CHECK_STATUS(sts, "ring.Open failed");
+
+	std::cout << "Producing into " << args[1] << std::endl;
+
+	msdk_tick nStart = msdk_time_get_tick();
+	mfxU32 nFrames = 0;
+	for (;;)
+	{
+		mfxFrameSurface1 surface;
+		do {
+			sts = ring.WaitSlot(&surface, MSDK_SHM_WAIT_INTERVAL);
+		} while (MFX_WRN_IN_EXECUTION == sts);
+		if (MFX_ERR_ABORTED == sts) {
+			std::cout << "The encoder closed the ring" << std::endl;
+			break;
+		}
+		MSDK_CHECK_STATUS(sts, "ring.WaitSlot failed");
+
+		// the reader converts I420 straight into the slot
+		sts = reader.LoadNextFrame(&surface);
+		if (MFX_ERR_NONE != sts) {
+			break;
+		}
+		ring.PublishFrame();
+		nFrames++;
+
+		if (dFrameRate > 0) {
+			mfxF64 dDue = nFrames / dFrameRate - CTimer::ConvertToSeconds(msdk_time_get_tick() - nStart);
+			if (dDue > 0) {
+				MSDK_SLEEP((mfxU32)(dDue * 1000));
+			}
+		}
+	}
+
+	ring.EndOfStream();
+	ring.Close();
+
+	std::cout << "Produced " << nFrames << " frames" << std::endl;
+
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<std::string> args(argv + 1, argv + argc);
+
+	if (!args.empty() && args[0] == "-jobs") {
+		return RunStreams(args);
+	}
+	if (!args.empty() && args[0] == "-shm_produce") {
+		return RunShmProducer(args);
+	}
+
+	sInputParams params;
+	if (!ParseStreamParams(args, &params)) {
+		PrintUsage(argv[0]);
+		return -1;
+	}
+
+	if (params.nChunks) {
+		return RunChunks(params);
+	}
+
 	std::auto_ptr<CEncodingPipeline> pPipeline;
 	pPipeline.reset(new CEncodingPipeline());
 
@@ -36,8 +500,8 @@ int main(int argc, char** argv)
 		{
 			std::cout << "ERROR: Hardware device was lost or returned an unexpected error. Recovering..." << std::endl;
 
-			sts = pPipeline->ResetMFXComponents(&params);
-			MSDK_CHECK_STATUS(sts, "pPipeline->ResetMFXComponents failed");
+			sts = pPipeline->RecoverMFXComponents(&params);
+			MSDK_CHECK_STATUS(sts, "pPipeline->RecoverMFXComponents failed");
 			continue;
 		}
 		else
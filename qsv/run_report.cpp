@@ -0,0 +1,130 @@
+#include "run_report.h"
+
+#include <cstdio>
+#include <iomanip>
+#include <sstream>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#endif
+
+CRunReport::CRunReport()
+{
+	m_nInterval = 0;
+	m_nStart = 0;
+	m_nLastReport = 0;
+	m_nLastFramesEncoded = 0;
+}
+
+CRunReport::~CRunReport()
+{
+	Close();
+}
+
+mfxStatus CRunReport::Init(const std::string& strFileName, mfxU32 nInterval)
+{
+	MSDK_CHECK_ERROR(strFileName.empty(), true, MFX_ERR_NULL_PTR);
+
+	Close();
+
+	m_sFile = strFileName;
+	m_nInterval = (msdk_tick)nInterval * CTimer::GetFrequency();
+	m_nStart = msdk_time_get_tick();
+	m_nLastReport = m_nStart;
+	m_nLastFramesEncoded = 0;
+
+	return MFX_ERR_NONE;
+}
+
+void CRunReport::Close()
+{
+	m_sFile.clear();
+	m_nInterval = 0;
+}
+
+static void WriteStage(std::ostringstream& json, const CLatencyHistogram& stage)
+{
+	json << "{\"count\": " << stage.GetCount()
+		<< ", \"p50\": " << stage.GetPercentile(50) / 1e6
+		<< ", \"p95\": " << stage.GetPercentile(95) / 1e6
+		<< ", \"p99\": " << stage.GetPercentile(99) / 1e6
+		<< ", \"max\": " << stage.GetMax() / 1e6
+		<< ", \"total\": " << stage.GetTotal() / 1e6 << "}";
+}
+
+mfxStatus CRunReport::Write(const sRunStatistics& stats, const CStageTimings& timings, bool bFinal)
+{
+	MSDK_CHECK_ERROR(IsEnabled(), false, MFX_ERR_NOT_INITIALIZED);
+
+	msdk_tick nNow = msdk_time_get_tick();
+	mfxF64 dElapsed = MSDK_GET_TIME(nNow, m_nStart, CTimer::GetFrequency());
+	mfxF64 dSinceLast = MSDK_GET_TIME(nNow, m_nLastReport, CTimer::GetFrequency());
+
+	mfxF64 dAverageFps = dElapsed > 0 ? stats.nFramesEncoded / dElapsed : 0;
+	mfxF64 dCurrentFps = dSinceLast > 0 ? (stats.nFramesEncoded - m_nLastFramesEncoded) / dSinceLast : 0;
+
+	std::ostringstream json;
+	json << std::fixed << std::setprecision(3);
+
+	json << "{\n";
+	json << "  \"final\": " << (bFinal ? "true" : "false") << ",\n";
+	json << "  \"elapsed_s\": " << dElapsed << ",\n";
+	json << "  \"frames\": {\"read\": " << stats.nFramesRead << ", \"encoded\": " << stats.nFramesEncoded
+		<< ", \"written\": " << stats.nFramesWritten << "},\n";
+	json << "  \"fps\": {\"average\": " << dAverageFps << ", \"current\": " << dCurrentFps << "},\n";
+	json << "  \"bytes\": {\"in\": " << stats.nBytesIn << ", \"out\": " << stats.nBytesOut << "},\n";
+
+	// per frame durations in ms
+	json << "  \"stages_ms\": {";
+	for (mfxU32 i = 0; i < MSDK_STAGE_COUNT; i++)
+	{
+		std::string name = CStageTimings::GetStageName(i);
+		for (size_t c = 0; c < name.size(); c++)
+		{
+			if (' ' == name[c]) name[c] = '_';
+		}
+
+		json << (i ? ",\n    " : "\n    ") << "\"" << name << "\": ";
+		WriteStage(json, timings.GetStage(i));
+	}
+	json << "\n  },\n";
+
+	json << "  \"surface_pool\": {\"size\": " << stats.nSurfacePoolSize << ", \"in_use\": " << stats.nSurfacesInUse << "},\n";
+	json << "  \"task_pool\": {\"size\": " << stats.nTaskPoolSize << ", \"in_flight\": " << stats.nTasksInFlight << "},\n";
+	json << "  \"device_busy_retries\": " << stats.nDeviceBusyRetries << ",\n";
+	json << "  \"memory\": {\"resident_bytes\": " << stats.nResidentBytes
+		<< ", \"bitstream_pool_bytes\": " << stats.nBitstreamPoolBytes
+		<< ", \"bitstream_pool_peak_bytes\": " << stats.nBitstreamPoolPeakBytes
+		<< ", \"arena_mapped_bytes\": " << stats.nArenaMappedBytes << "}\n";
+	json << "}\n";
+
+	m_nLastReport = nNow;
+	m_nLastFramesEncoded = stats.nFramesEncoded;
+
+	// written next to the report and moved over it
+	std::string strTemp = m_sFile + ".tmp";
+	std::string strJson = json.str();
+
+	FILE* pFile = fopen(strTemp.c_str(), "wb");
+	MSDK_CHECK_POINTER(pFile, MFX_ERR_NULL_PTR);
+
+	bool bWritten = strJson.size() == fwrite(strJson.data(), 1, strJson.size(), pFile);
+	bWritten = (0 == fclose(pFile)) && bWritten;
+	if (!bWritten)
+	{
+		remove(strTemp.c_str());
+		return MFX_ERR_UNDEFINED_BEHAVIOR;
+	}
+
+#if defined(_WIN32) || defined(_WIN64)
+	if (!MoveFileExA(strTemp.c_str(), m_sFile.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+	if (rename(strTemp.c_str(), m_sFile.c_str()))
+#endif
+	{
+		remove(strTemp.c_str());
+		return MFX_ERR_UNDEFINED_BEHAVIOR;
+	}
+
+	return MFX_ERR_NONE;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+
+#include "mfxstructures.h"
+
+#include "stage_timings.h"
+#include "utils.h"
+
+// counters a report is made of, collected by the pipeline
+struct sRunStatistics
+{
+	mfxU32 nFramesRead;
+	mfxU32 nFramesEncoded;     // synchronized
+	mfxU32 nFramesWritten;     // handed to the bitstream writer
+	mfxU64 nBytesIn;
+	mfxU64 nBytesOut;
+
+	mfxU32 nSurfacePoolSize;
+	mfxU32 nSurfacesInUse;
+	mfxU32 nTaskPoolSize;
+	mfxU32 nTasksInFlight;
+	mfxU32 nDeviceBusyRetries; // EncodeFrameAsync calls repeated after MFX_WRN_DEVICE_BUSY
+
+	mfxU64 nResidentBytes;
+	mfxU64 nBitstreamPoolBytes;
+	mfxU64 nBitstreamPoolPeakBytes;
+	mfxU64 nArenaMappedBytes;  // 0 without the arena allocator
+};
+
+// Machine readable run report for schedulers.
+// The report is a single JSON object that is replaced as a whole every nInterval seconds while running
+// and once more at the end ("final": true), so a reader polling the file never sees a partial one.
+class CRunReport
+{
+public:
+	CRunReport();
+	virtual ~CRunReport();
+
+	// nInterval is in seconds, 0 writes the final report only
+	virtual mfxStatus Init(const std::string& strFileName, mfxU32 nInterval);
+	virtual void Close();
+
+	bool IsEnabled() const { return !m_sFile.empty(); }
+	// a periodic report is due, cheap enough to be polled once per frame
+	bool IsDue() const { return m_nInterval && msdk_time_get_tick() - m_nLastReport >= m_nInterval; }
+
+	virtual mfxStatus Write(const sRunStatistics& stats, const CStageTimings& timings, bool bFinal);
+
+protected:
+	std::string m_sFile;
+	msdk_tick m_nInterval; // 0 - final report only
+	msdk_tick m_nStart;
+
+	// instantaneous fps is measured since the previous report
+	msdk_tick m_nLastReport;
+	mfxU32 m_nLastFramesEncoded;
+
+private:
+	CRunReport(const CRunReport&);
+	void operator=(const CRunReport&);
+};
@@ -0,0 +1,501 @@
+#include "scaler.h"
+
+#include <cmath>
+#include <iostream>
+
+#if defined(MSDK_X86_SIMD)
+#include <immintrin.h>
+#endif
+
+#include "trace.h"
+#include "utils.h"
+
+void ScaleRowVert_C(mfxU16* pDst, const mfxU8* const* ppSrc, const mfxU16* pWeights, mfxU32 nTaps, mfxU32 nWidth)
+{
+	for (mfxU32 i = 0; i < nWidth; i++)
+	{
+		mfxU32 nSum = 0;
+		for (mfxU32 t = 0; t < nTaps; t++)
+		{
+			nSum += ppSrc[t][i] * pWeights[t];
+		}
+		pDst[i] = (mfxU16)nSum;
+	}
+}
+
+void ScaleRowHorz_C(mfxU8* pDst, const mfxU16* pSrc, const mfxI32* pIndex, const mfxI32* pWeights, mfxU32 nTaps,
+	mfxU32 nWidth, mfxU32 nStep)
+{
+	for (mfxU32 i = 0; i < nWidth; i++)
+	{
+		mfxU32 nSum = 0;
+		for (mfxU32 t = 0; t < nTaps; t++)
+		{
+			nSum += pSrc[pIndex[i] + t * nStep] * pWeights[t * nWidth + i];
+		}
+		pDst[i] = (mfxU8)((nSum + (1 << 15)) >> 16);
+	}
+}
+
+void ScaleRowDown2_C(mfxU8* pDst, const mfxU8* pSrc0, const mfxU8* pSrc1, mfxU32 nWidth, mfxU32 nStep)
+{
+	for (mfxU32 i = 0; i < nWidth; i++)
+	{
+		// sample i of a channel pair: nStep 2 keeps U and V apart
+		mfxU32 j = (i / nStep) * 2 * nStep + i % nStep;
+		pDst[i] = (mfxU8)((pSrc0[j] + pSrc0[j + nStep] + pSrc1[j] + pSrc1[j + nStep] + 2) >> 2);
+	}
+}
+
+#if defined(MSDK_X86_SIMD)
+MSDK_TARGET_AVX2 void ScaleRowVert_AVX2(mfxU16* pDst, const mfxU8* const* ppSrc, const mfxU16* pWeights, mfxU32 nTaps, mfxU32 nWidth)
+{
+	mfxU32 i = 0;
+
+	// weights add up to 256, so the 16 bit products and their sum cannot overflow
+	for (; i + 16 <= nWidth; i += 16)
+	{
+		__m256i sum = _mm256_setzero_si256();
+		for (mfxU32 t = 0; t < nTaps; t++)
+		{
+			__m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(ppSrc[t] + i)));
+			sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(v, _mm256_set1_epi16((short)pWeights[t])));
+		}
+		_mm256_storeu_si256((__m256i*)(pDst + i), sum);
+	}
+
+	for (; i < nWidth; i++)
+	{
+		mfxU32 nSum = 0;
+		for (mfxU32 t = 0; t < nTaps; t++)
+		{
+			nSum += ppSrc[t][i] * pWeights[t];
+		}
+		pDst[i] = (mfxU16)nSum;
+	}
+}
+
+// 8 samples of a horizontal filter as 32 bit sums, before rounding
+MSDK_TARGET_AVX2 static inline __m256i ScaleHorz8_AVX2(const mfxU16* pSrc, const mfxI32* pIndex, const mfxI32* pWeights,
+	mfxU32 nTaps, mfxU32 nWidth, mfxU32 nStep)
+{
+	const __m256i lowMask = _mm256_set1_epi32(0xFFFF);
+	__m256i index = _mm256_loadu_si256((const __m256i*)pIndex);
+	__m256i sum = _mm256_setzero_si256();
+
+	for (mfxU32 t = 0; t < nTaps; t++)
+	{
+		// a 32 bit gather at a 16 bit sample picks up the next one too, the mask drops it
+		__m256i v = _mm256_i32gather_epi32((const int*)pSrc, _mm256_add_epi32(index, _mm256_set1_epi32(t * nStep)), 2);
+		__m256i w = _mm256_loadu_si256((const __m256i*)(pWeights + t * nWidth));
+		sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(_mm256_and_si256(v, lowMask), w));
+	}
+
+	return _mm256_srli_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(1 << 15)), 16);
+}
+
+MSDK_TARGET_AVX2 void ScaleRowHorz_AVX2(mfxU8* pDst, const mfxU16* pSrc, const mfxI32* pIndex, const mfxI32* pWeights, mfxU32 nTaps,
+	mfxU32 nWidth, mfxU32 nStep)
+{
+	mfxU32 i = 0;
+
+	for (; i + 16 <= nWidth; i += 16)
+	{
+		__m256i lo = ScaleHorz8_AVX2(pSrc, pIndex + i, pWeights + i, nTaps, nWidth, nStep);
+		__m256i hi = ScaleHorz8_AVX2(pSrc, pIndex + i + 8, pWeights + i + 8, nTaps, nWidth, nStep);
+
+		// packs work within 128-bit lanes, the permutes put the quarters back in order
+		__m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+		__m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0xD8);
+		_mm_storeu_si128((__m128i*)(pDst + i), _mm256_castsi256_si128(bytes));
+	}
+
+	for (; i < nWidth; i++)
+	{
+		mfxU32 nSum = 0;
+		for (mfxU32 t = 0; t < nTaps; t++)
+		{
+			nSum += pSrc[pIndex[i] + t * nStep] * pWeights[t * nWidth + i];
+		}
+		pDst[i] = (mfxU8)((nSum + (1 << 15)) >> 16);
+	}
+}
+
+MSDK_TARGET_AVX2 void ScaleRowDown2_AVX2(mfxU8* pDst, const mfxU8* pSrc0, const mfxU8* pSrc1, mfxU32 nWidth, mfxU32 nStep)
+{
+	const __m256i ones = _mm256_set1_epi8(1);
+	const __m256i two = _mm256_set1_epi16(2);
+	// U0 V0 U1 V1 -> U0 U1 V0 V1, so that the samples to add are neighbours as in luma
+	const __m256i pairs = _mm256_setr_epi8(0, 2, 1, 3, 4, 6, 5, 7, 8, 10, 9, 11, 12, 14, 13, 15,
+		0, 2, 1, 3, 4, 6, 5, 7, 8, 10, 9, 11, 12, 14, 13, 15);
+
+	mfxU32 i = 0;
+
+	for (; i + 32 <= nWidth; i += 32)
+	{
+		__m256i a0 = _mm256_loadu_si256((const __m256i*)(pSrc0 + 2 * i));
+		__m256i b0 = _mm256_loadu_si256((const __m256i*)(pSrc0 + 2 * i + 32));
+		__m256i a1 = _mm256_loadu_si256((const __m256i*)(pSrc1 + 2 * i));
+		__m256i b1 = _mm256_loadu_si256((const __m256i*)(pSrc1 + 2 * i + 32));
+
+		if (2 == nStep)
+		{
+			a0 = _mm256_shuffle_epi8(a0, pairs);
+			b0 = _mm256_shuffle_epi8(b0, pairs);
+			a1 = _mm256_shuffle_epi8(a1, pairs);
+			b1 = _mm256_shuffle_epi8(b1, pairs);
+		}
+
+		__m256i a = _mm256_add_epi16(_mm256_maddubs_epi16(a0, ones), _mm256_maddubs_epi16(a1, ones));
+		__m256i b = _mm256_add_epi16(_mm256_maddubs_epi16(b0, ones), _mm256_maddubs_epi16(b1, ones));
+		a = _mm256_srli_epi16(_mm256_add_epi16(a, two), 2);
+		b = _mm256_srli_epi16(_mm256_add_epi16(b, two), 2);
+
+		_mm256_storeu_si256((__m256i*)(pDst + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8));
+	}
+
+	ScaleRowDown2_C(pDst + i, pSrc0 + 2 * i, pSrc1 + 2 * i, nWidth - i, nStep);
+}
+#endif
+
+CFrameScaler::CFrameScaler()
+{
+	m_nFilter = MSDK_SCALE_BILINEAR;
+	m_pRowVert = ScaleRowVert_C;
+	m_pRowHorz = ScaleRowHorz_C;
+	m_pRowDown2 = ScaleRowDown2_C;
+	m_bStop = false;
+	m_pConfig = NULL;
+	m_pSrc = NULL;
+	m_pDst = NULL;
+	m_nStripes = 0;
+}
+
+CFrameScaler::~CFrameScaler()
+{
+	Close();
+}
+
+mfxStatus CFrameScaler::Init(mfxU16 nFilter, mfxU32 nThreads, bool bUseSimd)
+{
+	MSDK_CHECK_ERROR(nFilter > MSDK_SCALE_AREA, true, MFX_ERR_UNSUPPORTED);
+
+	Close();
+
+	m_nFilter = nFilter;
+
+	m_pRowVert = ScaleRowVert_C;
+	m_pRowHorz = ScaleRowHorz_C;
+	m_pRowDown2 = ScaleRowDown2_C;
+#if defined(MSDK_X86_SIMD)
+	if (bUseSimd && CpuSupportsAVX2())
+	{
+		m_pRowVert = ScaleRowVert_AVX2;
+		m_pRowHorz = ScaleRowHorz_AVX2;
+		m_pRowDown2 = ScaleRowDown2_AVX2;
+	}
+#endif
+
+	if (!nThreads)
+	{
+		nThreads = GetCpuCount();
+	}
+
+	m_bStop = false;
+	mfxStatus sts = MFX_ERR_NONE;
+
+	// the calling thread scales the first stripe itself
+	for (mfxU32 i = 1; i < nThreads; i++)
+	{
+		sWorker* pWorker = new sWorker;
+		MSDK_CHECK_POINTER(pWorker, MFX_ERR_MEMORY_ALLOC);
+		m_Workers.push_back(pWorker);
+
+		pWorker->pScaler = this;
+		pWorker->nStripe = i;
+
+		pWorker->pStart.reset(new MSDKEvent(sts, false, false));
+		MSDK_CHECK_STATUS(sts, "MSDKEvent failed");
+
+		pWorker->pDone.reset(new MSDKEvent(sts, false, false));
+		MSDK_CHECK_STATUS(sts, "MSDKEvent failed");
+
+		pWorker->pThread.reset(new MSDKThread(sts, WorkerRoutine, pWorker));
+		MSDK_CHECK_STATUS(sts, "MSDKThread failed");
+	}
+
+	return MFX_ERR_NONE;
+}
+
+void CFrameScaler::Close()
+{
+	m_bStop = true;
+
+	for (size_t i = 0; i < m_Workers.size(); i++)
+	{
+		if (m_Workers[i]->pThread.get())
+		{
+			m_Workers[i]->pStart->Signal();
+			m_Workers[i]->pThread->Wait();
+		}
+		delete m_Workers[i];
+	}
+	m_Workers.clear();
+
+	for (size_t i = 0; i < m_Configs.size(); i++)
+	{
+		delete m_Configs[i];
+	}
+	m_Configs.clear();
+}
+
+unsigned int MFX_STDCALL CFrameScaler::WorkerRoutine(void* pArg)
+{
+	sWorker* pWorker = (sWorker*)pArg;
+	CFrameScaler* pScaler = pWorker->pScaler;
+
+	msdk_trace_set_thread_name("scale");
+
+	for (;;)
+	{
+		pWorker->pStart->Wait();
+		if (pScaler->m_bStop)
+		{
+			break;
+		}
+
+		pScaler->ScaleStripe(pWorker->nStripe, &pWorker->Row);
+		pWorker->pDone->Signal();
+	}
+
+	return 0;
+}
+
+mfxStatus CFrameScaler::Scale(const mfxFrameSurface1* pSrc, mfxFrameSurface1* pDst)
+{
+	MSDK_CHECK_POINTER(pSrc, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(pDst, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(pSrc->Data.Y, MFX_ERR_LOCK_MEMORY);
+	MSDK_CHECK_POINTER(pDst->Data.Y, MFX_ERR_LOCK_MEMORY);
+	MSDK_CHECK_ERROR(pSrc->Info.FourCC != MFX_FOURCC_NV12 || pDst->Info.FourCC != MFX_FOURCC_NV12, true, MFX_ERR_UNSUPPORTED);
+
+	m_pConfig = GetConfig(pSrc->Info, pDst->Info);
+	MSDK_CHECK_POINTER(m_pConfig, MFX_ERR_MEMORY_ALLOC);
+
+	m_pSrc = pSrc;
+	m_pDst = pDst;
+
+	// stripes start on even rows, so that each one has the chroma rows of its luma rows
+	m_nStripes = MSDK_MIN(GetThreadCount(), (mfxU32)(m_pConfig->nDstHeight + 1) / 2);
+
+	for (mfxU32 i = 1; i < m_nStripes; i++)
+	{
+		m_Workers[i - 1]->pStart->Signal();
+	}
+
+	ScaleStripe(0, &m_Row);
+
+	for (mfxU32 i = 1; i < m_nStripes; i++)
+	{
+		m_Workers[i - 1]->pDone->Wait();
+	}
+
+	return MFX_ERR_NONE;
+}
+
+const CFrameScaler::sScaleConfig* CFrameScaler::GetConfig(const mfxFrameInfo& src, const mfxFrameInfo& dst)
+{
+	for (size_t i = 0; i < m_Configs.size(); i++)
+	{
+		const sScaleConfig* pConfig = m_Configs[i];
+		if (pConfig->nSrcWidth == src.CropW && pConfig->nSrcHeight == src.CropH &&
+			pConfig->nDstWidth == dst.CropW && pConfig->nDstHeight == dst.CropH)
+		{
+			return pConfig;
+		}
+	}
+
+	sScaleConfig* pConfig = new sScaleConfig;
+	if (!pConfig)
+	{
+		return NULL;
+	}
+
+	pConfig->nSrcWidth = src.CropW;
+	pConfig->nSrcHeight = src.CropH;
+	pConfig->nDstWidth = dst.CropW;
+	pConfig->nDstHeight = dst.CropH;
+
+	// centered bilinear taps and the box are the same at exactly half the size
+	pConfig->bDown2 = !(src.CropW % 2) && !(src.CropH % 2) && dst.CropW == src.CropW / 2 && dst.CropH == src.CropH / 2;
+
+	InitFilter(&pConfig->LumaX, src.CropW, dst.CropW);
+	InitFilter(&pConfig->LumaY, src.CropH, dst.CropH);
+	InitFilter(&pConfig->ChromaX, (src.CropW + 1) / 2, (dst.CropW + 1) / 2);
+	InitFilter(&pConfig->ChromaY, (src.CropH + 1) / 2, (dst.CropH + 1) / 2);
+
+	SpreadTaps(pConfig->LumaX, 1, &pConfig->LumaXIndex, &pConfig->LumaXWeights);
+	SpreadTaps(pConfig->ChromaX, 2, &pConfig->ChromaXIndex, &pConfig->ChromaXWeights);
+
+	m_Configs.push_back(pConfig);
+
+	return pConfig;
+}
+
+void CFrameScaler::InitFilter(sFilter* pFilter, mfxU32 nSrc, mfxU32 nDst)
+{
+	std::vector<std::vector<std::pair<mfxI32, mfxU16> > > taps(nDst);
+	mfxF64 dRatio = (mfxF64)nSrc / nDst;
+	mfxU32 nTaps = 1;
+
+	for (mfxU32 i = 0; i < nDst; i++)
+	{
+		if (MSDK_SCALE_AREA == m_nFilter)
+		{
+			// every source sample weighs with the share of the footprint it covers,
+			// the weights are differences of rounded positions so that they add up to 256 exactly
+			mfxF64 dStart = i * dRatio;
+			mfxF64 dEnd = MSDK_MIN((i + 1) * dRatio, (mfxF64)nSrc);
+			mfxI32 nPrev = 0;
+
+			for (mfxI32 s = (mfxI32)dStart; s < (mfxI32)nSrc && s < dEnd; s++)
+			{
+				mfxF64 dCovered = MSDK_MIN(dEnd, (mfxF64)s + 1) - dStart;
+				mfxI32 nPos = (mfxI32)floor(dCovered / (dEnd - dStart) * 256 + 0.5);
+				if (nPos > nPrev)
+				{
+					taps[i].push_back(std::make_pair(s, (mfxU16)(nPos - nPrev)));
+				}
+				nPrev = nPos;
+			}
+		}
+		else
+		{
+			// the source position of the center of the destination sample
+			mfxF64 dCenter = (i + 0.5) * dRatio - 0.5;
+			mfxI32 s = (mfxI32)floor(dCenter);
+			mfxI32 nFraction = (mfxI32)floor((dCenter - s) * 256 + 0.5);
+
+			if (s < 0)
+			{
+				s = 0;
+				nFraction = 0;
+			}
+			if (s >= (mfxI32)nSrc - 1)
+			{
+				s = nSrc - 1;
+				nFraction = 0;
+			}
+
+			if (nFraction < 256)
+			{
+				taps[i].push_back(std::make_pair(s, (mfxU16)(256 - nFraction)));
+			}
+			if (nFraction > 0)
+			{
+				taps[i].push_back(std::make_pair(s + 1, (mfxU16)nFraction));
+			}
+		}
+
+		nTaps = MSDK_MAX(nTaps, (mfxU32)taps[i].size());
+	}
+
+	// the same number of taps everywhere, unused ones weigh 0
+	pFilter->nTaps = nTaps;
+	pFilter->Index.assign(nDst, 0);
+	pFilter->Weights.assign(nDst * nTaps, 0);
+
+	for (mfxU32 i = 0; i < nDst; i++)
+	{
+		mfxI32 nFirst = MSDK_MIN(taps[i][0].first, (mfxI32)(nSrc - nTaps));
+		pFilter->Index[i] = nFirst;
+
+		for (size_t t = 0; t < taps[i].size(); t++)
+		{
+			pFilter->Weights[i * nTaps + taps[i][t].first - nFirst] = taps[i][t].second;
+		}
+	}
+}
+
+void CFrameScaler::SpreadTaps(const sFilter& filter, mfxU32 nStep, std::vector<mfxI32>* pIndex, std::vector<mfxI32>* pWeights)
+{
+	mfxU32 nWidth = (mfxU32)filter.Index.size() * nStep;
+
+	pIndex->resize(nWidth);
+	pWeights->resize(filter.nTaps * nWidth);
+
+	for (mfxU32 i = 0; i < nWidth; i++)
+	{
+		(*pIndex)[i] = filter.Index[i / nStep] * nStep + i % nStep;
+
+		for (mfxU32 t = 0; t < filter.nTaps; t++)
+		{
+			(*pWeights)[t * nWidth + i] = filter.Weights[(i / nStep) * filter.nTaps + t];
+		}
+	}
+}
+
+void CFrameScaler::ScaleStripe(mfxU32 nStripe, std::vector<mfxU16>* pRow)
+{
+	const sScaleConfig& config = *m_pConfig;
+	const mfxFrameData& src = m_pSrc->Data;
+	mfxFrameData& dst = m_pDst->Data;
+	mfxU32 nSrcPitch = src.PitchLow + ((mfxU32)src.PitchHigh << 16);
+	mfxU32 nDstPitch = dst.PitchLow + ((mfxU32)dst.PitchHigh << 16);
+
+	mfxU32 nChromaHeight = (config.nDstHeight + 1) / 2;
+	mfxU32 nFirstChromaRow = nChromaHeight * nStripe / m_nStripes;
+	mfxU32 nLastChromaRow = nChromaHeight * (nStripe + 1) / m_nStripes;
+	mfxU32 nFirstRow = 2 * nFirstChromaRow;
+	mfxU32 nLastRow = MSDK_MIN(2 * nLastChromaRow, (mfxU32)config.nDstHeight);
+
+	CTraceSpan span("scale", MSDK_TRACE_NONE, nStripe);
+
+	const mfxU8* pSrcY = src.Y + m_pSrc->Info.CropY * nSrcPitch + m_pSrc->Info.CropX;
+	const mfxU8* pSrcUV = src.UV + m_pSrc->Info.CropY / 2 * nSrcPitch + m_pSrc->Info.CropX;
+	mfxU8* pDstY = dst.Y + m_pDst->Info.CropY * nDstPitch + m_pDst->Info.CropX;
+	mfxU8* pDstUV = dst.UV + m_pDst->Info.CropY / 2 * nDstPitch + m_pDst->Info.CropX;
+
+	if (config.bDown2)
+	{
+		for (mfxU32 y = nFirstRow; y < nLastRow; y++)
+		{
+			m_pRowDown2(pDstY + y * nDstPitch, pSrcY + 2 * y * nSrcPitch, pSrcY + (2 * y + 1) * nSrcPitch, config.nDstWidth, 1);
+		}
+		for (mfxU32 y = nFirstChromaRow; y < nLastChromaRow; y++)
+		{
+			m_pRowDown2(pDstUV + y * nDstPitch, pSrcUV + 2 * y * nSrcPitch, pSrcUV + (2 * y + 1) * nSrcPitch,
+				(config.nDstWidth + 1) / 2 * 2, 2);
+		}
+		return;
+	}
+
+	ScalePlane(pSrcY, nSrcPitch, pDstY, nDstPitch, config.nSrcWidth, config.nDstWidth, nFirstRow, nLastRow, 1,
+		config.LumaY, config.LumaX.nTaps, config.LumaXIndex, config.LumaXWeights, pRow);
+	ScalePlane(pSrcUV, nSrcPitch, pDstUV, nDstPitch, (config.nSrcWidth + 1) / 2, (config.nDstWidth + 1) / 2,
+		nFirstChromaRow, nLastChromaRow, 2, config.ChromaY, config.ChromaX.nTaps, config.ChromaXIndex, config.ChromaXWeights, pRow);
+}
+
+void CFrameScaler::ScalePlane(const mfxU8* pSrc, mfxU32 nSrcPitch, mfxU8* pDst, mfxU32 nDstPitch, mfxU32 nSrcWidth, mfxU32 nDstWidth,
+	mfxU32 nFirstRow, mfxU32 nLastRow, mfxU32 nStep, const sFilter& filterY, mfxU32 nTapsX, const std::vector<mfxI32>& index,
+	const std::vector<mfxI32>& weights, std::vector<mfxU16>* pRow)
+{
+	// one spare sample for the gathers of the last taps
+	if (pRow->size() < nSrcWidth * nStep + 1)
+	{
+		pRow->resize(nSrcWidth * nStep + 1);
+	}
+
+	std::vector<const mfxU8*> rows(filterY.nTaps);
+
+	for (mfxU32 y = nFirstRow; y < nLastRow; y++)
+	{
+		for (mfxU32 t = 0; t < filterY.nTaps; t++)
+		{
+			rows[t] = pSrc + (filterY.Index[y] + t) * nSrcPitch;
+		}
+
+		m_pRowVert(&(*pRow)[0], &rows[0], &filterY.Weights[y * filterY.nTaps], filterY.nTaps, nSrcWidth * nStep);
+		m_pRowHorz(pDst + y * nDstPitch, &(*pRow)[0], &index[0], &weights[0], nTapsX, nDstWidth * nStep, nStep);
+	}
+}
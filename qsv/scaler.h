@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "mfxstructures.h"
+
+#include "convert.h"
+#include "thread_defs.h"
+
+enum
+{
+	MSDK_SCALE_BILINEAR, // 2 taps, sharp but aliases below half size
+	MSDK_SCALE_AREA,     // averages the whole footprint of an output sample
+};
+
+// Filter taps are 8 bit fractions adding up to 256, so that a vertical sum of 8 bit samples fits 16 bits.
+
+// sums nTaps rows of nWidth samples weighted by pWeights into one row of 16 bit values
+typedef void (*ScaleRowVertFunc)(mfxU16* pDst, const mfxU8* const* ppSrc, const mfxU16* pWeights, mfxU32 nTaps, mfxU32 nWidth);
+// filters a row of vertical sums horizontally into nWidth samples: sample i is the sum over t of
+// pWeights[t * nWidth + i] * pSrc[pIndex[i] + t * nStep], nStep is 1 for luma and 2 for interleaved chroma
+typedef void (*ScaleRowHorzFunc)(mfxU8* pDst, const mfxU16* pSrc, const mfxI32* pIndex, const mfxI32* pWeights, mfxU32 nTaps,
+	mfxU32 nWidth, mfxU32 nStep);
+// averages the 2x2 blocks of two rows into nWidth samples, nStep bytes apart
+typedef void (*ScaleRowDown2Func)(mfxU8* pDst, const mfxU8* pSrc0, const mfxU8* pSrc1, mfxU32 nWidth, mfxU32 nStep);
+
+void ScaleRowVert_C(mfxU16* pDst, const mfxU8* const* ppSrc, const mfxU16* pWeights, mfxU32 nTaps, mfxU32 nWidth);
+void ScaleRowHorz_C(mfxU8* pDst, const mfxU16* pSrc, const mfxI32* pIndex, const mfxI32* pWeights, mfxU32 nTaps,
+	mfxU32 nWidth, mfxU32 nStep);
+void ScaleRowDown2_C(mfxU8* pDst, const mfxU8* pSrc0, const mfxU8* pSrc1, mfxU32 nWidth, mfxU32 nStep);
+#if defined(MSDK_X86_SIMD)
+void ScaleRowVert_AVX2(mfxU16* pDst, const mfxU8* const* ppSrc, const mfxU16* pWeights, mfxU32 nTaps, mfxU32 nWidth);
+// reads up to 2 bytes past the last sample the taps address
+void ScaleRowHorz_AVX2(mfxU8* pDst, const mfxU16* pSrc, const mfxI32* pIndex, const mfxI32* pWeights, mfxU32 nTaps,
+	mfxU32 nWidth, mfxU32 nStep);
+void ScaleRowDown2_AVX2(mfxU8* pDst, const mfxU8* pSrc0, const mfxU8* pSrc1, mfxU32 nWidth, mfxU32 nStep);
+#endif
+
+// NV12 downscaler writing straight into encoder surfaces.
+// Both planes are filtered separably with MSDK_SCALE_* taps, exact halving takes a 2x2 box path that
+// both filters reduce to. The rows of the destination are split into horizontal stripes that worker
+// threads scale in parallel with the calling thread.
+class CFrameScaler
+{
+public:
+	CFrameScaler();
+	virtual ~CFrameScaler();
+
+	// nThreads includes the calling thread, 0 uses every CPU; bUseSimd false forces the C kernels
+	virtual mfxStatus Init(mfxU16 nFilter, mfxU32 nThreads, bool bUseSimd = true);
+	virtual void Close();
+
+	// scales the cropped picture of pSrc into the cropped area of pDst, both NV12 and locked;
+	// must not be called by two threads at a time
+	virtual mfxStatus Scale(const mfxFrameSurface1* pSrc, mfxFrameSurface1* pDst);
+
+	mfxU32 GetThreadCount() const { return (mfxU32)m_Workers.size() + 1; }
+
+protected:
+	// taps of one dimension of one plane
+	struct sFilter
+	{
+		mfxU32 nTaps;
+		std::vector<mfxI32> Index;   // first source sample of each destination sample
+		std::vector<mfxU16> Weights; // [destination sample * nTaps + tap]
+	};
+
+	// filters between one source and one destination size
+	struct sScaleConfig
+	{
+		mfxU16 nSrcWidth, nSrcHeight, nDstWidth, nDstHeight;
+		bool bDown2;
+		sFilter LumaX, LumaY, ChromaX, ChromaY;
+		// horizontal taps spread over the samples of a row, tap-major: [tap * row width + sample]
+		std::vector<mfxI32> LumaXIndex, LumaXWeights, ChromaXIndex, ChromaXWeights;
+	};
+
+	struct sWorker
+	{
+		CFrameScaler* pScaler;
+		mfxU32 nStripe;
+		std::vector<mfxU16> Row; // vertical sums of one source row width
+		std::auto_ptr<MSDKEvent> pStart;
+		std::auto_ptr<MSDKEvent> pDone;
+		std::auto_ptr<MSDKThread> pThread;
+	};
+
+	static unsigned int MFX_STDCALL WorkerRoutine(void* pArg);
+	const sScaleConfig* GetConfig(const mfxFrameInfo& src, const mfxFrameInfo& dst);
+	void InitFilter(sFilter* pFilter, mfxU32 nSrc, mfxU32 nDst);
+	void SpreadTaps(const sFilter& filter, mfxU32 nStep, std::vector<mfxI32>* pIndex, std::vector<mfxI32>* pWeights);
+	// scales the destination rows of one stripe of both planes
+	void ScaleStripe(mfxU32 nStripe, std::vector<mfxU16>* pRow);
+	void ScalePlane(const mfxU8* pSrc, mfxU32 nSrcPitch, mfxU8* pDst, mfxU32 nDstPitch, mfxU32 nSrcWidth, mfxU32 nDstWidth,
+		mfxU32 nFirstRow, mfxU32 nLastRow, mfxU32 nStep, const sFilter& filterY, mfxU32 nTapsX, const std::vector<mfxI32>& index,
+		const std::vector<mfxI32>& weights, std::vector<mfxU16>* pRow);
+
+	mfxU16 m_nFilter;
+	ScaleRowVertFunc m_pRowVert;
+	ScaleRowHorzFunc m_pRowHorz;
+	ScaleRowDown2Func m_pRowDown2;
+
+	std::vector<sScaleConfig*> m_Configs; // one per pair of sizes seen so far
+	std::vector<sWorker*> m_Workers;
+	std::vector<mfxU16> m_Row; // of the calling thread
+	std::atomic<bool> m_bStop;
+
+	// the frame being scaled
+	const sScaleConfig* m_pConfig;
+	const mfxFrameSurface1* m_pSrc;
+	mfxFrameSurface1* m_pDst;
+	mfxU32 m_nStripes;
+
+private:
+	CFrameScaler(const CFrameScaler&);
+	void operator=(const CFrameScaler&);
+};
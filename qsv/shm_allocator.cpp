@@ -0,0 +1,106 @@
+#include "shm_allocator.h"
+
+#include <iostream>
+
+#include "utils.h"
+
+ShmBufferAllocator::ShmBufferAllocator(CShmFrameRing* pRing, const std::string& name)
+{
+	m_pRing = pRing;
+	m_Name = name;
+	m_nReserved = 0;
+	m_nBufferSize = 0;
+}
+
+ShmBufferAllocator::~ShmBufferAllocator()
+{
+}
+
+mfxStatus ShmBufferAllocator::ReserveSlots(mfxU32 nSlots)
+{
+	AutomaticMutex lock(m_Mutex);
+
+	// a producer may already write into the slots, they cannot be resized
+	if (m_pRing->IsCreated() && nSlots != m_pRing->GetSlotCount())
+	{
+		return MFX_ERR_INCOMPATIBLE_VIDEO_PARAM;
+	}
+
+	m_nReserved = nSlots;
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus ShmBufferAllocator::AllocBuffer(mfxU32 nbytes, mfxU16 type, mfxMemId *mid)
+{
+	if (!mid)
+		return MFX_ERR_NULL_PTR;
+
+	if (0 == (type & MFX_MEMTYPE_SYSTEM_MEMORY))
+		return MFX_ERR_UNSUPPORTED;
+
+	AutomaticMutex lock(m_Mutex);
+
+	if (m_nReserved && !m_pRing->IsCreated())
+	{
+		// same layout as SysMemBufferAllocator, so that its LockBuffer finds the data
+		mfxStatus sts = m_pRing->Create(m_Name, m_nReserved, MSDK_ALIGN32(sizeof(sBuffer)) + (mfxU64)nbytes + 32);
+		MSDK_CHECK_STATUS(sts, "m_pRing->Create failed");
+
+		m_nBufferSize = nbytes;
+		m_SlotUsed.assign(m_nReserved, false);
+	}
+
+	if (m_nReserved && nbytes == m_nBufferSize)
+	{
+		for (mfxU32 i = 0; i < m_SlotUsed.size(); i++)
+		{
+			if (m_SlotUsed[i])
+			{
+				continue;
+			}
+
+			sBuffer *bs = (sBuffer *)m_pRing->GetSlot(i);
+			bs->id = ID_BUFFER;
+			bs->type = type;
+			bs->nbytes = nbytes;
+			*mid = (mfxHDL) bs;
+
+			m_SlotUsed[i] = true;
+			m_nReserved--;
+			return MFX_ERR_NONE;
+		}
+	}
+
+	return SysMemBufferAllocator::AllocBuffer(nbytes, type, mid);
+}
+
+mfxStatus ShmBufferAllocator::FreeBuffer(mfxMemId mid)
+{
+	AutomaticMutex lock(m_Mutex);
+
+	mfxI32 nSlot = FindSlot(mid);
+	if (nSlot < 0)
+	{
+		return SysMemBufferAllocator::FreeBuffer(mid);
+	}
+
+	// stays mapped for the next reservation
+	m_SlotUsed[nSlot] = false;
+
+	return MFX_ERR_NONE;
+}
+
+// m_Mutex must be held
+mfxI32 ShmBufferAllocator::FindSlot(mfxMemId mid)
+{
+	for (mfxU32 i = 0; i < m_SlotUsed.size(); i++)
+	{
+		if ((mfxU8*)mid == m_pRing->GetSlot(i))
+		{
+			return (mfxI32)i;
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "shm_frame_ring.h"
+#include "sysmem_allocator.h"
+#include "thread_defs.h"
+
+// Buffer allocator that places frames in the slots of a shared memory ring, so that a producer in another
+// process writes them in place. ReserveSlots announces how many of the next buffers go to the ring; the first
+// of them creates it with slots of its size, buffers of other sizes and those beyond the reservation come from
+// calloc. Freed slots are reused by later reservations, the ring itself lives until it is closed.
+class ShmBufferAllocator : public SysMemBufferAllocator
+{
+public:
+	// pRing is not owned and must outlive the allocator
+	ShmBufferAllocator(CShmFrameRing* pRing, const std::string& name);
+	virtual ~ShmBufferAllocator();
+
+	// the ring must end up with nSlots slots
+	virtual mfxStatus ReserveSlots(mfxU32 nSlots);
+
+	virtual mfxStatus AllocBuffer(mfxU32 nbytes, mfxU16 type, mfxMemId *mid);
+	virtual mfxStatus FreeBuffer(mfxMemId mid);
+
+protected:
+	// index of the slot holding mid, -1 if it is not in the ring
+	mfxI32 FindSlot(mfxMemId mid);
+
+	CShmFrameRing* m_pRing;
+	std::string m_Name;
+	mfxU32 m_nReserved; // buffers still to carve from the ring
+	mfxU32 m_nBufferSize; // of the buffers in the slots
+	std::vector<bool> m_SlotUsed;
+
+	MSDKMutex m_Mutex;
+
+private:
+	ShmBufferAllocator(const ShmBufferAllocator&);
+	void operator=(const ShmBufferAllocator&);
+};
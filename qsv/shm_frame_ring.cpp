@@ -0,0 +1,408 @@
+#include "shm_frame_ring.h"
+
+#include <cstring>
+#include <iostream>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+CShmFrameRing::CShmFrameRing()
+{
+	m_pHeader = NULL;
+	m_nSize = 0;
+	m_nSlotSize = 0;
+	m_fd = -1;
+	m_bCreator = false;
+}
+
+CShmFrameRing::~CShmFrameRing()
+{
+	Close();
+}
+
+mfxU8* CShmFrameRing::GetSlot(mfxU32 nSlot)
+{
+	if (!m_pHeader || nSlot >= m_pHeader->nSlots)
+	{
+		return NULL;
+	}
+
+	return (mfxU8*)m_pHeader + MSDK_SHM_RING_HEADER_SIZE + nSlot * m_nSlotSize;
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+// the words are in a shared mapping, so the waits must not be process private
+static void FutexWait(mfxU32* pWord, mfxU32 nExpected, mfxU32 nWaitTime)
+{
+	struct timespec timeout;
+	timeout.tv_sec = nWaitTime / 1000;
+	timeout.tv_nsec = (long)(nWaitTime % 1000) * 1000000;
+	syscall(SYS_futex, pWord, FUTEX_WAIT, nExpected, &timeout, NULL, 0);
+}
+
+// publishes what the caller wrote before and wakes the other side
+static void AdvanceSequence(mfxU32* pWord)
+{
+	__atomic_add_fetch(pWord, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, pWord, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static mfxU32 LoadWord(const mfxU32* pWord)
+{
+	return __atomic_load_n(pWord, __ATOMIC_ACQUIRE);
+}
+
+mfxStatus CShmFrameRing::Create(const std::string& name, mfxU32 nSlots, mfxU64 nSlotSize)
+{
+	MSDK_CHECK_ERROR(IsCreated(), true, MFX_ERR_UNDEFINED_BEHAVIOR);
+	if (!nSlots || nSlots > MSDK_SHM_RING_MAX_SLOTS)
+	{
+		std::cerr << "ERROR: a shared memory ring has 1 to " << MSDK_SHM_RING_MAX_SLOTS << " slots, not " << nSlots << std::endl;
+		return MFX_ERR_UNSUPPORTED;
+	}
+
+	long nPageSize = sysconf(_SC_PAGESIZE);
+	m_nSlotSize = (nSlotSize + nPageSize - 1) & ~(mfxU64)(nPageSize - 1);
+	m_nSize = MSDK_SHM_RING_HEADER_SIZE + nSlots * m_nSlotSize;
+
+	// a leftover of a crashed run is not reused, its producer may still write into it
+	m_fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (m_fd < 0)
+	{
+		std::cerr << "ERROR: cannot create the shared memory object " << name << ", errno " << errno << std::endl;
+		return MFX_ERR_DEVICE_FAILED;
+	}
+	m_bCreator = true;
+	m_Name = name;
+
+	if (ftruncate(m_fd, (off_t)m_nSize))
+	{
+		Close();
+		return MFX_ERR_MEMORY_ALLOC;
+	}
+
+	void* pBase = mmap(NULL, m_nSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	if (MAP_FAILED == pBase)
+	{
+		Close();
+		return MFX_ERR_MEMORY_ALLOC;
+	}
+
+	// the object comes zero filled, no magic yet
+	m_pHeader = (sShmRingHeader*)pBase;
+	m_pHeader->nVersion = MSDK_SHM_RING_VERSION;
+	m_pHeader->nSlots = nSlots;
+	m_pHeader->nSize = m_nSize;
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CShmFrameRing::Publish(const mfxFrameSurface1* pSurfaces, mfxU32 nSurfaces)
+{
+	MSDK_CHECK_POINTER(m_pHeader, MFX_ERR_NOT_INITIALIZED);
+	MSDK_CHECK_POINTER(pSurfaces, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_ERROR(nSurfaces == m_pHeader->nSlots, false, MFX_ERR_INCOMPATIBLE_VIDEO_PARAM);
+
+	const mfxU8* pBase = (const mfxU8*)m_pHeader;
+	const mfxFrameInfo& info = pSurfaces[0].Info;
+	if (MFX_FOURCC_NV12 != info.FourCC)
+	{
+		return MFX_ERR_UNSUPPORTED;
+	}
+
+	for (mfxU32 i = 0; i < nSurfaces; i++)
+	{
+		const mfxFrameData& data = pSurfaces[i].Data;
+		mfxU64 nChromaEnd = (mfxU64)(data.UV - pBase) + (mfxU64)data.Pitch * info.Height / 2;
+		if (data.Y < pBase + MSDK_SHM_RING_HEADER_SIZE || data.UV < data.Y || nChromaEnd > m_nSize)
+		{
+			std::cerr << "ERROR: input surface " << i << " is not in the shared memory ring" << std::endl;
+			return MFX_ERR_UNSUPPORTED;
+		}
+
+		m_pHeader->LumaOffsets[i] = (mfxU64)(data.Y - pBase);
+		m_pHeader->ChromaOffsets[i] = (mfxU64)(data.UV - pBase);
+	}
+
+	m_pHeader->Info = info;
+	m_pHeader->nPitch = pSurfaces[0].Data.Pitch;
+	__atomic_store_n(&m_pHeader->nMagic, MSDK_SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CShmFrameRing::WaitFrame(mfxU32 nFrame, mfxU32 nWaitTime)
+{
+	MSDK_CHECK_POINTER(m_pHeader, MFX_ERR_NOT_INITIALIZED);
+
+	CTimer t;
+	t.Start();
+
+	for (;;)
+	{
+		// read before the state it guards, a change after it ends the wait right away
+		mfxU32 nSeq = LoadWord(&m_pHeader->nProducerSeq);
+
+		if ((mfxI32)(LoadWord(&m_pHeader->nWritten) - nFrame) > 0)
+		{
+			return MFX_ERR_NONE;
+		}
+		if (LoadWord(&m_pHeader->nFlags) & MSDK_SHM_RING_END_OF_STREAM)
+		{
+			return MFX_ERR_MORE_DATA;
+		}
+		if (!IsProducerAlive())
+		{
+			std::cerr << "WARNING: the producer of the shared memory ring exited without ending the stream" << std::endl;
+			return MFX_ERR_MORE_DATA;
+		}
+
+		mfxU32 nElapsed = (mfxU32)(t.GetTime() * 1000);
+		if (nElapsed >= nWaitTime)
+		{
+			return MFX_WRN_IN_EXECUTION;
+		}
+
+		FutexWait(&m_pHeader->nProducerSeq, nSeq, MSDK_MIN(nWaitTime - nElapsed, (mfxU32)MSDK_SHM_WAIT_INTERVAL));
+	}
+}
+
+void CShmFrameRing::ReleaseFrames(mfxU32 nFrames)
+{
+	if (m_pHeader)
+	{
+		__atomic_store_n(&m_pHeader->nReleased, nFrames, __ATOMIC_RELEASE);
+		AdvanceSequence(&m_pHeader->nConsumerSeq);
+	}
+}
+
+// a producer that attached and then went away, e.g. crashed, ends the stream
+bool CShmFrameRing::IsProducerAlive()
+{
+	pid_t pid = (pid_t)LoadWord(&m_pHeader->nProducerPid);
+
+	return !pid || 0 == kill(pid, 0) || ESRCH != errno;
+}
+
+mfxStatus CShmFrameRing::Open(const std::string& name, mfxU32 nWaitTime)
+{
+	MSDK_CHECK_ERROR(IsCreated(), true, MFX_ERR_UNDEFINED_BEHAVIOR);
+
+	CTimer t;
+	t.Start();
+
+	// the consumer creates the object once it knows the frame size, and publishes it after allocating its frames
+	for (;;)
+	{
+		if (m_fd < 0)
+		{
+			m_fd = shm_open(name.c_str(), O_RDWR, 0);
+		}
+
+		struct stat st;
+		if (m_fd >= 0 && 0 == fstat(m_fd, &st) && (mfxU64)st.st_size >= MSDK_SHM_RING_HEADER_SIZE)
+		{
+			const sShmRingHeader* pHeader = (const sShmRingHeader*)mmap(NULL, MSDK_SHM_RING_HEADER_SIZE, PROT_READ, MAP_SHARED, m_fd, 0);
+			if (MAP_FAILED != (void*)pHeader)
+			{
+				bool bPublished = MSDK_SHM_RING_MAGIC == LoadWord(&pHeader->nMagic);
+				mfxU32 nVersion = pHeader->nVersion;
+				m_nSize = pHeader->nSize;
+				munmap((void*)pHeader, MSDK_SHM_RING_HEADER_SIZE);
+
+				if (bPublished && MSDK_SHM_RING_VERSION != nVersion)
+				{
+					std::cerr << "ERROR: the shared memory ring " << name << " has version " << nVersion << ", not "
+						<< MSDK_SHM_RING_VERSION << std::endl;
+					Close();
+					return MFX_ERR_UNSUPPORTED;
+				}
+				if (bPublished)
+				{
+					break;
+				}
+			}
+		}
+
+		if (t.GetTime() * 1000 >= nWaitTime)
+		{
+			std::cerr << "ERROR: the shared memory ring " << name << " was not published in time" << std::endl;
+			Close();
+			return MFX_ERR_NOT_FOUND;
+		}
+		MSDK_SLEEP(10);
+	}
+
+	void* pBase = mmap(NULL, m_nSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	if (MAP_FAILED == pBase)
+	{
+		Close();
+		return MFX_ERR_MEMORY_ALLOC;
+	}
+
+	m_pHeader = (sShmRingHeader*)pBase;
+	m_Name = name;
+	__atomic_store_n(&m_pHeader->nProducerPid, (mfxU32)getpid(), __ATOMIC_RELEASE);
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CShmFrameRing::WaitSlot(mfxFrameSurface1* pSurface, mfxU32 nWaitTime)
+{
+	MSDK_CHECK_POINTER(m_pHeader, MFX_ERR_NOT_INITIALIZED);
+	MSDK_CHECK_POINTER(pSurface, MFX_ERR_NULL_PTR);
+
+	CTimer t;
+	t.Start();
+
+	// only this side writes nWritten
+	mfxU32 nFrame = m_pHeader->nWritten;
+
+	for (;;)
+	{
+		mfxU32 nSeq = LoadWord(&m_pHeader->nConsumerSeq);
+
+		if (LoadWord(&m_pHeader->nFlags) & MSDK_SHM_RING_CLOSED)
+		{
+			return MFX_ERR_ABORTED;
+		}
+		if (nFrame - LoadWord(&m_pHeader->nReleased) < m_pHeader->nSlots)
+		{
+			break;
+		}
+
+		mfxU32 nElapsed = (mfxU32)(t.GetTime() * 1000);
+		if (nElapsed >= nWaitTime)
+		{
+			return MFX_WRN_IN_EXECUTION;
+		}
+
+		FutexWait(&m_pHeader->nConsumerSeq, nSeq, nWaitTime - nElapsed);
+	}
+
+	mfxU32 nSlot = nFrame % m_pHeader->nSlots;
+
+	memset(pSurface, 0, sizeof(mfxFrameSurface1));
+	pSurface->Info = m_pHeader->Info;
+	pSurface->Data.Y = (mfxU8*)m_pHeader + m_pHeader->LumaOffsets[nSlot];
+	pSurface->Data.UV = (mfxU8*)m_pHeader + m_pHeader->ChromaOffsets[nSlot];
+	pSurface->Data.Pitch = m_pHeader->nPitch;
+	pSurface->Data.FrameOrder = nFrame;
+
+	return MFX_ERR_NONE;
+}
+
+void CShmFrameRing::PublishFrame()
+{
+	if (m_pHeader)
+	{
+		__atomic_add_fetch(&m_pHeader->nWritten, 1, __ATOMIC_RELEASE);
+		AdvanceSequence(&m_pHeader->nProducerSeq);
+	}
+}
+
+void CShmFrameRing::EndOfStream()
+{
+	if (m_pHeader)
+	{
+		__atomic_or_fetch(&m_pHeader->nFlags, MSDK_SHM_RING_END_OF_STREAM, __ATOMIC_RELEASE);
+		AdvanceSequence(&m_pHeader->nProducerSeq);
+	}
+}
+
+void CShmFrameRing::Close()
+{
+	if (m_pHeader)
+	{
+		if (m_bCreator)
+		{
+			// a producer waiting for a slot gives up
+			__atomic_or_fetch(&m_pHeader->nFlags, MSDK_SHM_RING_CLOSED, __ATOMIC_RELEASE);
+			AdvanceSequence(&m_pHeader->nConsumerSeq);
+		}
+		munmap(m_pHeader, m_nSize);
+		m_pHeader = NULL;
+	}
+
+	if (m_fd >= 0)
+	{
+		close(m_fd);
+		m_fd = -1;
+	}
+
+	// the producer keeps its mapping
+	if (m_bCreator)
+	{
+		shm_unlink(m_Name.c_str());
+		m_bCreator = false;
+	}
+
+	m_Name.clear();
+	m_nSize = 0;
+	m_nSlotSize = 0;
+}
+
+#else
+
+// POSIX shared memory and futexes only, cross-process ingest is not available on Windows
+
+mfxStatus CShmFrameRing::Create(const std::string&, mfxU32, mfxU64)
+{
+	std::cerr << "ERROR: shared memory input is not supported on this platform" << std::endl;
+	return MFX_ERR_UNSUPPORTED;
+}
+
+mfxStatus CShmFrameRing::Publish(const mfxFrameSurface1*, mfxU32)
+{
+	return MFX_ERR_UNSUPPORTED;
+}
+
+mfxStatus CShmFrameRing::WaitFrame(mfxU32, mfxU32)
+{
+	return MFX_ERR_UNSUPPORTED;
+}
+
+void CShmFrameRing::ReleaseFrames(mfxU32)
+{
+}
+
+bool CShmFrameRing::IsProducerAlive()
+{
+	return false;
+}
+
+mfxStatus CShmFrameRing::Open(const std::string&, mfxU32)
+{
+	std::cerr << "ERROR: shared memory input is not supported on this platform" << std::endl;
+	return MFX_ERR_UNSUPPORTED;
+}
+
+mfxStatus CShmFrameRing::WaitSlot(mfxFrameSurface1*, mfxU32)
+{
+	return MFX_ERR_UNSUPPORTED;
+}
+
+void CShmFrameRing::PublishFrame()
+{
+}
+
+void CShmFrameRing::EndOfStream()
+{
+}
+
+void CShmFrameRing::Close()
+{
+}
+
+#endif
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <string>
+
+#include "mfxstructures.h"
+
+#include "utils.h"
+
+// frames the producer may write ahead of the encoder in addition to the surfaces the encoder needs
+#define MSDK_SHM_RING_AHEAD 4
+#define MSDK_SHM_RING_MAX_SLOTS 64
+// the header takes the first page, the slots start after it
+#define MSDK_SHM_RING_HEADER_SIZE 4096
+// ms between checks whether the other side is still there while waiting for it
+#define MSDK_SHM_WAIT_INTERVAL 100
+// ms a producer waits for the consumer to publish the ring
+#define MSDK_SHM_OPEN_WAIT_INTERVAL 30000
+#define MSDK_SHM_RING_MAGIC MFX_MAKEFOURCC('N','V','R','G')
+#define MSDK_SHM_RING_VERSION 1
+
+// nFlags of sShmRingHeader
+enum
+{
+	MSDK_SHM_RING_END_OF_STREAM = 1, // the producer wrote its last frame
+	MSDK_SHM_RING_CLOSED = 2,        // the consumer reads no more frames
+};
+
+// First page of the shared memory object, the frame slots follow it. The counters run on modulo 2^32, frame n
+// goes to slot n % nSlots. The futex words change with every frame or flag of their side, the other side
+// sleeps on them.
+struct sShmRingHeader
+{
+	mfxU32 nMagic; // MSDK_SHM_RING_MAGIC once the consumer published the layout
+	mfxU32 nVersion;
+	mfxU32 nSlots;
+	mfxU32 nProducerPid; // 0 until a producer attached
+	mfxU64 nSize; // of the whole mapping
+	mfxFrameInfo Info; // of every slot, the producer fills CropW x CropH from CropX, CropY on
+	mfxU16 nPitch; // of both planes
+
+	mfxU32 nWritten; // frames the producer published
+	mfxU32 nReleased; // frames whose slots the consumer gave back
+	mfxU32 nFlags; // MSDK_SHM_RING_*
+	mfxU32 nProducerSeq; // futex: next frame or end of stream
+	mfxU32 nConsumerSeq; // futex: slot given back or ring closed
+
+	mfxU64 LumaOffsets[MSDK_SHM_RING_MAX_SLOTS]; // of the planes of every slot from the start of the mapping
+	mfxU64 ChromaOffsets[MSDK_SHM_RING_MAX_SLOTS];
+};
+
+// Ring of NV12 frames in a POSIX shared memory object, for a producer in another process writing straight
+// into the input surfaces of the encoder. The consumer creates the object, its frame allocator carves the
+// surfaces out of the slots (see ShmBufferAllocator) and it publishes their layout; the producer opens the
+// object by name. Either side only blocks in a futex wait on the other's sequence word. Linux only, every
+// call fails with MFX_ERR_UNSUPPORTED elsewhere.
+class CShmFrameRing
+{
+public:
+	CShmFrameRing();
+	virtual ~CShmFrameRing();
+
+	// consumer: creates the object name of nSlots slots of nSlotSize bytes, failing if it exists
+	virtual mfxStatus Create(const std::string& name, mfxU32 nSlots, mfxU64 nSlotSize);
+	// memory of slot nSlot, valid until Close
+	mfxU8* GetSlot(mfxU32 nSlot);
+	// makes the ring visible to producers with pSurfaces[i] as slot i; their planes must lie in the mapping
+	virtual mfxStatus Publish(const mfxFrameSurface1* pSurfaces, mfxU32 nSurfaces);
+	// waits for frame nFrame; MFX_ERR_MORE_DATA if the stream ends before it or the producer exited,
+	// MFX_WRN_IN_EXECUTION if it is not written within nWaitTime ms
+	virtual mfxStatus WaitFrame(mfxU32 nFrame, mfxU32 nWaitTime);
+	// the producer may overwrite the slots of the frames before nFrames
+	virtual void ReleaseFrames(mfxU32 nFrames);
+
+	// producer: opens the object name, waiting up to nWaitTime ms for the consumer to publish it
+	virtual mfxStatus Open(const std::string& name, mfxU32 nWaitTime);
+	// points pSurface at the slot of the next frame once the consumer gave it back; MFX_ERR_ABORTED if the
+	// consumer closed the ring, MFX_WRN_IN_EXECUTION if the slot is not free within nWaitTime ms
+	virtual mfxStatus WaitSlot(mfxFrameSurface1* pSurface, mfxU32 nWaitTime);
+	// hands the frame written into the slot of the last WaitSlot to the consumer
+	virtual void PublishFrame();
+	virtual void EndOfStream();
+
+	// unmaps the ring; the consumer also marks it closed and removes the name
+	virtual void Close();
+
+	bool IsCreated() const { return NULL != m_pHeader; }
+	mfxU32 GetSlotCount() const { return m_pHeader ? m_pHeader->nSlots : 0; }
+
+protected:
+	bool IsProducerAlive();
+
+	sShmRingHeader* m_pHeader; // start of the mapping
+	mfxU64 m_nSize;
+	mfxU64 m_nSlotSize;
+	int m_fd;
+	bool m_bCreator;
+	std::string m_Name;
+
+private:
+	CShmFrameRing(const CShmFrameRing&);
+	void operator=(const CShmFrameRing&);
+};
@@ -0,0 +1,266 @@
+#include "stage_timings.h"
+
+#include <iomanip>
+#include <iostream>
+
+#include "trace.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <intrin.h>
+#endif
+
+// exact values below MSDK_HISTOGRAM_SUB_BUCKETS, then MSDK_HISTOGRAM_SUB_BUCKETS / 2 buckets per power of two
+#define MSDK_HISTOGRAM_SUB_BUCKET_BITS 7
+#define MSDK_HISTOGRAM_HALF_BUCKETS (MSDK_HISTOGRAM_SUB_BUCKETS / 2)
+#define MSDK_HISTOGRAM_BUCKETS ((64 - MSDK_HISTOGRAM_SUB_BUCKET_BITS) * MSDK_HISTOGRAM_HALF_BUCKETS + MSDK_HISTOGRAM_SUB_BUCKETS)
+
+static const char* g_StageNames[MSDK_STAGE_COUNT] =
+{
+	"read",
+	"convert",
+	"scale",
+	"surface wait",
+	"encode",
+	"sync",
+	"write",
+	"latency",
+};
+
+// nValue must not be 0
+static mfxU32 GetHighestBit(mfxU64 nValue)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	unsigned long nBit;
+	_BitScanReverse64(&nBit, nValue);
+	return nBit;
+#else
+	return 63 - __builtin_clzll(nValue);
+#endif
+}
+
+CLatencyHistogram::CLatencyHistogram()
+{
+	m_Counts.resize(MSDK_HISTOGRAM_BUCKETS, 0);
+	m_nCount = 0;
+	m_nMax = 0;
+	m_nTotal = 0;
+}
+
+// bucket b >= 1 holds values with the highest bit at b + 6, in steps of 2^b
+mfxU32 CLatencyHistogram::GetBucket(mfxU64 nValue)
+{
+	if (nValue < MSDK_HISTOGRAM_SUB_BUCKETS)
+	{
+		return (mfxU32)nValue;
+	}
+
+	mfxU32 nShift = GetHighestBit(nValue) - (MSDK_HISTOGRAM_SUB_BUCKET_BITS - 1);
+	return nShift * MSDK_HISTOGRAM_HALF_BUCKETS + (mfxU32)(nValue >> nShift);
+}
+
+mfxU64 CLatencyHistogram::GetBucketUpperBound(mfxU32 nBucket)
+{
+	if (nBucket < MSDK_HISTOGRAM_SUB_BUCKETS)
+	{
+		return nBucket;
+	}
+
+	mfxU32 nShift = nBucket / MSDK_HISTOGRAM_HALF_BUCKETS - 1;
+	mfxU64 nSubBucket = nBucket - nShift * MSDK_HISTOGRAM_HALF_BUCKETS;
+	return ((nSubBucket + 1) << nShift) - 1;
+}
+
+void CLatencyHistogram::Record(mfxU64 nNanoseconds)
+{
+	m_Counts[GetBucket(nNanoseconds)]++;
+	m_nCount++;
+	m_nTotal += nNanoseconds;
+	m_nMax = MSDK_MAX(m_nMax, nNanoseconds);
+}
+
+void CLatencyHistogram::Reset()
+{
+	m_Counts.assign(MSDK_HISTOGRAM_BUCKETS, 0);
+	m_nCount = 0;
+	m_nMax = 0;
+	m_nTotal = 0;
+}
+
+void CLatencyHistogram::Merge(const CLatencyHistogram& other)
+{
+	for (size_t i = 0; i < m_Counts.size(); i++)
+	{
+		m_Counts[i] += other.m_Counts[i];
+	}
+	m_nCount += other.m_nCount;
+	m_nMax = MSDK_MAX(m_nMax, other.m_nMax);
+	m_nTotal += other.m_nTotal;
+}
+
+mfxU64 CLatencyHistogram::GetPercentile(mfxF64 dPercentile) const
+{
+	if (!m_nCount)
+	{
+		return 0;
+	}
+
+	// rank of the sample at the percentile, 1-based
+	mfxU64 nRank = (mfxU64)(dPercentile / 100 * m_nCount + 0.5);
+	nRank = MSDK_MIN(MSDK_MAX(nRank, 1), m_nCount);
+
+	mfxU64 nSeen = 0;
+	for (mfxU32 i = 0; i < m_Counts.size(); i++)
+	{
+		nSeen += m_Counts[i];
+		if (nSeen >= nRank)
+		{
+			// a bucket never reaches beyond the largest value recorded into it
+			return MSDK_MIN(GetBucketUpperBound(i), m_nMax);
+		}
+	}
+
+	return m_nMax;
+}
+
+CStageTimings::CStageTimings()
+{
+	m_dNanosecondsPerTick = 1e9 / CTimer::GetFrequency();
+}
+
+void CStageTimings::Record(mfxU32 nStage, msdk_tick nTicks)
+{
+	AutomaticMutex lock(m_Mutex);
+
+	m_Stages[nStage].Record((mfxU64)(MSDK_MAX(nTicks, 0) * m_dNanosecondsPerTick));
+}
+
+const char* CStageTimings::GetStageName(mfxU32 nStage)
+{
+	return nStage < MSDK_STAGE_COUNT ? g_StageNames[nStage] : "";
+}
+
+void CStageTimings::Reset()
+{
+	AutomaticMutex lock(m_Mutex);
+
+	for (mfxU32 i = 0; i < MSDK_STAGE_COUNT; i++)
+	{
+		m_Stages[i].Reset();
+	}
+}
+
+void CStageTimings::Merge(const CStageTimings& other)
+{
+	AutomaticMutex lock(m_Mutex);
+
+	for (mfxU32 i = 0; i < MSDK_STAGE_COUNT; i++)
+	{
+		m_Stages[i].Merge(other.m_Stages[i]);
+	}
+}
+
+void CStageTimings::Snapshot(CStageTimings* pSnapshot)
+{
+	AutomaticMutex lock(m_Mutex);
+
+	for (mfxU32 i = 0; i < MSDK_STAGE_COUNT; i++)
+	{
+		pSnapshot->m_Stages[i] = m_Stages[i];
+	}
+}
+
+void CStageTimings::PrintStatistics()
+{
+	AutomaticMutex lock(m_Mutex);
+
+	// the latency of a frame overlaps the stages it passed through
+	mfxU32 nBusiest = MSDK_STAGE_COUNT;
+	for (mfxU32 i = 0; i < MSDK_STAGE_LATENCY; i++)
+	{
+		if (m_Stages[i].GetCount() && (MSDK_STAGE_COUNT == nBusiest || m_Stages[i].GetTotal() > m_Stages[nBusiest].GetTotal()))
+		{
+			nBusiest = i;
+		}
+	}
+
+	if (MSDK_STAGE_COUNT == nBusiest)
+	{
+		return;
+	}
+
+	std::cout << "Stage timings, ms:" << std::endl;
+	std::cout << std::left << std::setw(16) << "  stage" << std::right << std::setw(8) << "frames" << std::setw(10) << "p50"
+		<< std::setw(10) << "p95" << std::setw(10) << "p99" << std::setw(10) << "max" << std::setw(14) << "total" << std::endl;
+
+	std::cout << std::fixed << std::setprecision(3);
+	for (mfxU32 i = 0; i < MSDK_STAGE_COUNT; i++)
+	{
+		const CLatencyHistogram& stage = m_Stages[i];
+		if (!stage.GetCount())
+		{
+			continue;
+		}
+
+		std::cout << "  " << std::left << std::setw(14) << g_StageNames[i] << std::right << std::setw(8) << stage.GetCount()
+			<< std::setw(10) << stage.GetPercentile(50) / 1e6 << std::setw(10) << stage.GetPercentile(95) / 1e6
+			<< std::setw(10) << stage.GetPercentile(99) / 1e6 << std::setw(10) << stage.GetMax() / 1e6
+			<< std::setw(14) << stage.GetTotal() / 1e6 << std::endl;
+	}
+	std::cout.unsetf(std::ios::floatfield);
+
+	std::cout << "Most time spent in: " << g_StageNames[nBusiest] << std::endl;
+}
+
+CFrameLatency::CFrameLatency()
+{
+}
+
+void CFrameLatency::Start(mfxU32 nFrameOrder)
+{
+	msdk_tick nStart = msdk_time_get_tick();
+
+	AutomaticMutex lock(m_Mutex);
+
+	m_Frames.insert(std::make_pair(nFrameOrder, nStart));
+}
+
+void CFrameLatency::Stop(mfxU32 nFrameOrder, CStageTimings* pTimings)
+{
+	msdk_tick nEnd = msdk_time_get_tick();
+	msdk_tick nStart = 0;
+
+	{
+		AutomaticMutex lock(m_Mutex);
+
+		std::map<mfxU32, msdk_tick>::iterator it = m_Frames.find(nFrameOrder);
+		if (it == m_Frames.end())
+		{
+			return;
+		}
+		nStart = it->second;
+		m_Frames.erase(it);
+	}
+
+	if (pTimings)
+	{
+		pTimings->Record(MSDK_STAGE_LATENCY, nEnd - nStart);
+	}
+	if (g_bTraceEnabled)
+	{
+		msdk_trace_record("latency", nFrameOrder, MSDK_TRACE_NONE, nStart, nEnd);
+	}
+}
+
+void CFrameLatency::Cancel(mfxU32 nFrameOrder)
+{
+	AutomaticMutex lock(m_Mutex);
+
+	m_Frames.erase(nFrameOrder);
+}
+
+void CFrameLatency::Reset()
+{
+	AutomaticMutex lock(m_Mutex);
+
+	m_Frames.clear();
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include "mfxstructures.h"
+
+#include "thread_defs.h"
+#include "utils.h"
+
+// sub-buckets per power of two, bounds the relative error of a recorded value to 1/64
+#define MSDK_HISTOGRAM_SUB_BUCKETS 128
+
+// Log-linear latency histogram in the spirit of HdrHistogram: values below MSDK_HISTOGRAM_SUB_BUCKETS ns are
+// counted exactly, larger ones in buckets no wider than 1/64 of their value, so recording is a few
+// instructions and percentiles need no sorting. Not thread-safe.
+class CLatencyHistogram
+{
+public:
+	CLatencyHistogram();
+
+	void Record(mfxU64 nNanoseconds);
+	void Reset();
+	// adds the values recorded by another histogram
+	void Merge(const CLatencyHistogram& other);
+
+	mfxU64 GetCount() const { return m_nCount; }
+	mfxU64 GetMax() const { return m_nMax; }
+	mfxU64 GetTotal() const { return m_nTotal; }
+	// upper bound of the bucket holding the given percentile, 0 if nothing was recorded
+	mfxU64 GetPercentile(mfxF64 dPercentile) const;
+
+protected:
+	static mfxU32 GetBucket(mfxU64 nValue);
+	static mfxU64 GetBucketUpperBound(mfxU32 nBucket);
+
+	std::vector<mfxU64> m_Counts;
+	mfxU64 m_nCount;
+	mfxU64 m_nMax;
+	mfxU64 m_nTotal;
+};
+
+enum
+{
+	MSDK_STAGE_READ,         // reading a frame from the input file or mapping, copying a pushed one or waiting for a shared memory producer
+	MSDK_STAGE_CONVERT,      // color format conversion of the frame read
+	MSDK_STAGE_SCALE,        // downscaling the frame for a rung of another size
+	MSDK_STAGE_SURFACE_WAIT, // waiting for a free input surface or a prefetched frame
+	MSDK_STAGE_ENCODE,       // EncodeFrameAsync, including retries on a busy device
+	MSDK_STAGE_SYNC,         // SyncOperation
+	MSDK_STAGE_WRITE,        // handing the bitstream to the writer
+	MSDK_STAGE_LATENCY,      // from the frame being in its input surface till its bitstream was written, spans the others
+
+	MSDK_STAGE_COUNT
+};
+
+// Per frame durations of each pipeline stage, recorded from any thread; a report taken while others record
+// works on a Snapshot.
+class CStageTimings
+{
+public:
+	CStageTimings();
+
+	// records the time from nStart (msdk_time_get_tick) till now
+	void RecordSince(mfxU32 nStage, msdk_tick nStart) { Record(nStage, msdk_time_get_tick() - nStart); }
+	void Record(mfxU32 nStage, msdk_tick nTicks);
+
+	void Reset();
+	// other must not be recorded into meanwhile
+	void Merge(const CStageTimings& other);
+	// copies the stages as they are now into pSnapshot
+	void Snapshot(CStageTimings* pSnapshot);
+	// only while no thread records, otherwise on a Snapshot
+	const CLatencyHistogram& GetStage(mfxU32 nStage) const { return m_Stages[nStage]; }
+	static const char* GetStageName(mfxU32 nStage);
+	// p50/p95/p99/max per stage, the stage with the largest total is the one that limits throughput
+	void PrintStatistics();
+
+protected:
+	MSDKMutex m_Mutex;
+	CLatencyHistogram m_Stages[MSDK_STAGE_COUNT];
+	mfxF64 m_dNanosecondsPerTick;
+
+private:
+	CStageTimings(const CStageTimings&);
+	void operator=(const CStageTimings&);
+};
+
+// Latency of every frame from its input surface till its bitstream, see MSDK_STAGE_LATENCY. A frame is matched by
+// the frame order the encoder reports with its bitstream, so encoders may reorder frames and timestamps need not be
+// unique; frames are started wherever their surfaces are filled and stopped wherever tasks complete.
+class CFrameLatency
+{
+public:
+	CFrameLatency();
+
+	// a frame started again, e.g. replayed after a device loss, keeps its first start
+	void Start(mfxU32 nFrameOrder);
+	// records the time since the start of the frame into pTimings and the trace, if the frame was started
+	void Stop(mfxU32 nFrameOrder, CStageTimings* pTimings);
+	// forgets a started frame the encoder did not take
+	void Cancel(mfxU32 nFrameOrder);
+	// the frames in flight were dropped
+	void Reset();
+
+protected:
+	MSDKMutex m_Mutex;
+	std::map<mfxU32, msdk_tick> m_Frames; // starts, by frame order
+
+private:
+	CFrameLatency(const CFrameLatency&);
+	void operator=(const CFrameLatency&);
+};
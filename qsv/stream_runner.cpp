@@ -0,0 +1,373 @@
+#include "stream_runner.h"
+
+#include <iomanip>
+#include <iostream>
+
+#include "trace.h"
+
+CStreamRunner::CStreamRunner()
+{
+	m_pAllocator = NULL;
+	m_pArenaAllocator = NULL;
+	m_nFinished = 0;
+	m_dElapsedTime = 0;
+	m_dCpuTime = 0;
+	m_bJoinSessions = false;
+	m_nChildrenClosed = 0;
+	m_ParentStatus = MFX_ERR_NONE;
+}
+
+CStreamRunner::~CStreamRunner()
+{
+	Close();
+}
+
+mfxStatus CStreamRunner::Init(const std::vector<sInputParams>& streams, bool bUseArenaAllocator, const std::string& reportFile,
+	bool bJoinSessions)
+{
+	MSDK_CHECK_ERROR(streams.empty(), true, MFX_ERR_UNDEFINED_BEHAVIOR);
+
+	Close();
+
+	mfxStatus sts = MFX_ERR_NONE;
+	m_pStreamDone.reset(new MSDKEvent(sts, false, false));
+	MSDK_CHECK_STATUS(sts, "MSDKEvent failed");
+
+	m_bJoinSessions = bJoinSessions;
+	if (m_bJoinSessions)
+	{
+		m_pParentReady.reset(new MSDKEvent(sts, true, false));
+		MSDK_CHECK_STATUS(sts, "MSDKEvent failed");
+		m_pChildrenClosed.reset(new MSDKEvent(sts, true, false));
+		MSDK_CHECK_STATUS(sts, "MSDKEvent failed");
+	}
+
+	m_pAllocator = new SysMemFrameAllocator;
+	MSDK_CHECK_POINTER(m_pAllocator, MFX_ERR_MEMORY_ALLOC);
+
+	if (bUseArenaAllocator)
+	{
+		m_pArenaAllocator = new ArenaBufferAllocator;
+		MSDK_CHECK_POINTER(m_pArenaAllocator, MFX_ERR_MEMORY_ALLOC);
+
+		m_pAllocator->SetBufferAllocator(m_pArenaAllocator);
+	}
+
+	sts = m_pAllocator->Init();
+	MSDK_CHECK_STATUS(sts, "m_pAllocator->Init failed");
+
+	if (!reportFile.empty())
+	{
+		sts = m_Report.Init(reportFile, 0);
+		MSDK_CHECK_STATUS(sts, "m_Report.Init failed");
+	}
+
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		sStream* pStream = new sStream();
+		MSDK_CHECK_POINTER(pStream, MFX_ERR_MEMORY_ALLOC);
+		m_Streams.push_back(pStream);
+
+		pStream->Params = streams[i];
+		pStream->Params.pSharedAllocator = m_pAllocator;
+		// the allocator is shared, so is the choice of buffers behind it
+		pStream->Params.bUseArenaAllocator = false;
+		pStream->pPipeline = NULL;
+		pStream->pThread = NULL;
+		pStream->pRunner = this;
+		pStream->nIndex = (mfxU32)i;
+		pStream->Status = MFX_ERR_NONE;
+		pStream->dTime = 0;
+		MSDK_ZERO_MEMORY(pStream->Stats);
+	}
+
+	return MFX_ERR_NONE;
+}
+
+void CStreamRunner::Close()
+{
+	for (size_t i = 0; i < m_Streams.size(); i++)
+	{
+		if (m_Streams[i]->pThread)
+		{
+			m_Streams[i]->pThread->Wait();
+		}
+		MSDK_SAFE_DELETE(m_Streams[i]->pThread);
+		MSDK_SAFE_DELETE(m_Streams[i]->pPipeline);
+		delete m_Streams[i];
+	}
+	m_Streams.clear();
+
+	// after every pipeline returned its frames
+	MSDK_SAFE_DELETE(m_pAllocator);
+	MSDK_SAFE_DELETE(m_pArenaAllocator);
+
+	m_Timings.Reset();
+	m_Report.Close();
+	m_pStreamDone.reset();
+	m_pParentReady.reset();
+	m_pChildrenClosed.reset();
+	m_nFinished = 0;
+	m_nChildrenClosed = 0;
+	m_ParentStatus = MFX_ERR_NONE;
+	m_dElapsedTime = 0;
+	m_dCpuTime = 0;
+	m_bJoinSessions = false;
+}
+
+mfxU32 CStreamRunner::GetFramesEncoded() const
+{
+	mfxU32 nFrames = 0;
+
+	for (size_t i = 0; i < m_Streams.size(); i++)
+	{
+		nFrames += m_Streams[i]->pPipeline ? m_Streams[i]->pPipeline->GetFramesEncoded() : m_Streams[i]->Stats.nFramesEncoded;
+	}
+
+	return nFrames;
+}
+
+mfxStatus CStreamRunner::Run()
+{
+	MSDK_CHECK_POINTER(m_pAllocator, MFX_ERR_NOT_INITIALIZED);
+
+	mfxF64 dUserTime = 0, dKernelTime = 0;
+	GetProcessCpuTimes(&dUserTime, &dKernelTime);
+	m_dCpuTime = -(dUserTime + dKernelTime);
+
+	CTimer t;
+	t.Start();
+
+	for (size_t i = 0; i < m_Streams.size(); i++)
+	{
+		sStream* pStream = m_Streams[i];
+
+		// created here rather than on the stream thread, so that GetFramesEncoded never sees a pipeline go away
+		pStream->pPipeline = new CEncodingPipeline();
+		MSDK_CHECK_POINTER(pStream->pPipeline, MFX_ERR_MEMORY_ALLOC);
+
+		mfxStatus sts = MFX_ERR_NONE;
+		pStream->pThread = new MSDKThread(sts, StreamThreadRoutine, pStream);
+		MSDK_CHECK_STATUS(sts, "MSDKThread failed");
+	}
+
+	msdk_tick nFrequency = CTimer::GetFrequency();
+	msdk_tick nNextProgress = msdk_time_get_tick() + MSDK_STREAM_PROGRESS_INTERVAL * nFrequency;
+
+	while (m_nFinished < m_Streams.size())
+	{
+		msdk_tick nNow = msdk_time_get_tick();
+		if (nNow >= nNextProgress)
+		{
+			PrintProgress(t.GetTime());
+			nNextProgress = nNow + MSDK_STREAM_PROGRESS_INTERVAL * nFrequency;
+			continue;
+		}
+
+		m_pStreamDone->TimedWait((mfxU32)((nNextProgress - nNow) * 1000 / nFrequency) + 1);
+	}
+
+	m_dElapsedTime = t.GetTime();
+	GetProcessCpuTimes(&dUserTime, &dKernelTime);
+	m_dCpuTime += dUserTime + dKernelTime;
+
+	mfxStatus sts = MFX_ERR_NONE;
+	for (size_t i = 0; i < m_Streams.size(); i++)
+	{
+		m_Streams[i]->pThread->Wait();
+		MSDK_SAFE_DELETE(m_Streams[i]->pThread);
+
+		if (MFX_ERR_NONE == sts && m_Streams[i]->Status < MFX_ERR_NONE)
+		{
+			std::cout << "Stream " << i << " failed with status " << m_Streams[i]->Status << std::endl;
+			sts = m_Streams[i]->Status;
+		}
+	}
+
+	PrintStatistics();
+	if (m_Report.IsEnabled())
+	{
+		WriteReport();
+	}
+
+	return sts;
+}
+
+unsigned int MFX_STDCALL CStreamRunner::StreamThreadRoutine(void* pArg)
+{
+	sStream* pStream = static_cast<sStream*>(pArg);
+
+	pStream->pRunner->RunStream(pStream);
+
+	return 0;
+}
+
+void CStreamRunner::RunStream(sStream* pStream)
+{
+	msdk_trace_set_thread_name("stream");
+
+	CEncodingPipeline* pPipeline = pStream->pPipeline;
+	bool bParent = m_bJoinSessions && 0 == pStream->nIndex;
+	bool bChild = m_bJoinSessions && 0 != pStream->nIndex;
+
+	CTimer t;
+	t.Start();
+
+	mfxStatus sts = MFX_ERR_NONE;
+	if (bChild)
+	{
+		m_pParentReady->Wait();
+
+		if (m_ParentStatus < MFX_ERR_NONE)
+		{
+			std::cout << "Stream " << pStream->nIndex << " has no session to join" << std::endl;
+			sts = m_ParentStatus;
+		}
+		else
+		{
+			pStream->Params.pParentSession = m_Streams[0]->pPipeline->GetFirstEncoder();
+
+			// one join at a time
+			AutomaticMutex lock(m_Mutex);
+			sts = pPipeline->Init(&pStream->Params);
+		}
+	}
+	else
+	{
+		sts = pPipeline->Init(&pStream->Params);
+	}
+	MSDK_CHECK_STATUS_NO_RET(sts, "pPipeline->Init failed");
+
+	if (bParent)
+	{
+		m_ParentStatus = sts;
+		m_pParentReady->Signal();
+	}
+
+	while (MFX_ERR_NONE == sts)
+	{
+		sts = pPipeline->Run();
+
+		if (MFX_ERR_DEVICE_LOST == sts || MFX_ERR_DEVICE_FAILED == sts)
+		{
+			std::cout << "ERROR: Hardware device was lost or returned an unexpected error in stream " << pStream->nIndex
+				<< ". Recovering..." << std::endl;
+
+			sts = pPipeline->RecoverMFXComponents(&pStream->Params);
+			MSDK_CHECK_STATUS_NO_RET(sts, "pPipeline->RecoverMFXComponents failed");
+		}
+		else
+		{
+			MSDK_CHECK_STATUS_NO_RET(sts, "pPipeline->Run failed");
+			break;
+		}
+	}
+
+	pStream->dTime = t.GetTime();
+
+	{
+		AutomaticMutex lock(m_Mutex);
+
+		// before Close, which resets them
+		pPipeline->CollectStatistics(&pStream->Stats);
+		m_Timings.Merge(pPipeline->GetStageTimings());
+	}
+	pPipeline->GetHrdTraces(&pStream->HrdTraces);
+
+	// a child disjoins in Close, the parent session has to stay open until then
+	if (bParent && m_Streams.size() > 1)
+	{
+		m_pChildrenClosed->Wait();
+	}
+
+	pPipeline->Close();
+
+	if (bChild && ++m_nChildrenClosed == m_Streams.size() - 1)
+	{
+		m_pChildrenClosed->Signal();
+	}
+
+	pStream->Status = sts;
+
+	m_nFinished++;
+	m_pStreamDone->Signal();
+}
+
+void CStreamRunner::PrintProgress(mfxF64 dTime)
+{
+	mfxU32 nFrames = GetFramesEncoded();
+
+	std::cout << "Streams: " << m_Streams.size() - m_nFinished << " of " << m_Streams.size() << " running, "
+		<< nFrames << " frames, " << std::fixed << std::setprecision(1) << nFrames / dTime << " fps" << std::endl;
+	std::cout.unsetf(std::ios::floatfield);
+}
+
+void CStreamRunner::PrintStatistics()
+{
+	if (m_Streams.empty() || m_dElapsedTime <= 0)
+	{
+		return;
+	}
+
+	mfxU32 nFrames = 0;
+
+	std::cout << "  stream   frames    seconds        fps" << std::endl;
+	std::cout << std::fixed;
+	for (size_t i = 0; i < m_Streams.size(); i++)
+	{
+		sStream* pStream = m_Streams[i];
+		nFrames += pStream->Stats.nFramesEncoded;
+
+		std::cout << std::setw(8) << i << std::setw(9) << pStream->Stats.nFramesEncoded
+			<< std::setprecision(3) << std::setw(11) << pStream->dTime
+			<< std::setprecision(1) << std::setw(11) << (pStream->dTime > 0 ? pStream->Stats.nFramesEncoded / pStream->dTime : 0) << std::endl;
+	}
+
+	mfxF64 dFps = nFrames / m_dElapsedTime;
+
+	std::cout << "Aggregate: " << m_Streams.size() << (m_bJoinSessions ? " joined" : "") << " streams, " << nFrames << " frames in "
+		<< std::setprecision(3) << m_dElapsedTime << " s, " << std::setprecision(1) << dFps << " fps, " << dFps / m_Streams.size()
+		<< " fps per stream, CPU " << std::setprecision(2) << m_dCpuTime << " s (" << std::setprecision(0)
+		<< 100 * m_dCpuTime / m_dElapsedTime << "% of a core)" << std::endl;
+	std::cout.unsetf(std::ios::floatfield);
+
+	if (m_pArenaAllocator)
+	{
+		m_pArenaAllocator->PrintStatistics();
+	}
+	m_Timings.PrintStatistics();
+}
+
+void CStreamRunner::WriteReport()
+{
+	sRunStatistics stats;
+	MSDK_ZERO_MEMORY(stats);
+
+	for (size_t i = 0; i < m_Streams.size(); i++)
+	{
+		const sRunStatistics& s = m_Streams[i]->Stats;
+
+		stats.nFramesRead += s.nFramesRead;
+		stats.nFramesEncoded += s.nFramesEncoded;
+		stats.nFramesWritten += s.nFramesWritten;
+		stats.nBytesIn += s.nBytesIn;
+		stats.nBytesOut += s.nBytesOut;
+		stats.nSurfacePoolSize += s.nSurfacePoolSize;
+		stats.nSurfacesInUse += s.nSurfacesInUse;
+		stats.nTaskPoolSize += s.nTaskPoolSize;
+		stats.nTasksInFlight += s.nTasksInFlight;
+		stats.nDeviceBusyRetries += s.nDeviceBusyRetries;
+		stats.nBitstreamPoolBytes += s.nBitstreamPoolBytes;
+		stats.nBitstreamPoolPeakBytes += s.nBitstreamPoolPeakBytes;
+		// process wide
+		stats.nResidentBytes = MSDK_MAX(stats.nResidentBytes, s.nResidentBytes);
+	}
+
+	if (m_pArenaAllocator)
+	{
+		stats.nArenaMappedBytes = m_pArenaAllocator->GetMappedBytes();
+	}
+
+	mfxStatus sts = m_Report.Write(stats, m_Timings, true);
+	MSDK_CHECK_STATUS_NO_RET(sts, "m_Report.Write failed");
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "arena_allocator.h"
+#include "pipeline_encode.h"
+#include "run_report.h"
+#include "stage_timings.h"
+#include "sysmem_allocator.h"
+#include "thread_defs.h"
+
+// seconds between two progress lines while streams are running
+#define MSDK_STREAM_PROGRESS_INTERVAL 1
+
+// Encodes several streams in one process, each with its own CEncodingPipeline (and session) on its own thread.
+// The streams allocate their frames from one shared allocator, progress and the final figures are reported
+// for all of them together.
+// With joined sessions the session of the first stream is the parent of all others, so every stream runs on
+// the scheduler threads of one session. The parent is closed after all children.
+class CStreamRunner
+{
+public:
+	CStreamRunner();
+	virtual ~CStreamRunner();
+
+	// bUseArenaAllocator backs the shared allocator with arenas, reportFile gets the combined final report
+	virtual mfxStatus Init(const std::vector<sInputParams>& streams, bool bUseArenaAllocator, const std::string& reportFile,
+		bool bJoinSessions = false);
+	// encodes every stream to its end, returns the first error of a stream
+	virtual mfxStatus Run();
+	virtual void Close();
+
+	mfxU32 GetStreamCount() const { return (mfxU32)m_Streams.size(); }
+	mfxU32 GetFramesEncoded() const;
+	// seconds from starting the first stream until the last one finished
+	mfxF64 GetElapsedTime() const { return m_dElapsedTime; }
+	// CPU seconds of the whole process, user and kernel mode, spent in Run
+	mfxF64 GetCpuTime() const { return m_dCpuTime; }
+	// strict HRD streams, see CEncodingPipeline::GetHrdTraces; valid from Run till Close
+	const std::vector<sHrdTrace>& GetHrdTraces(mfxU32 nStream) const { return m_Streams[nStream]->HrdTraces; }
+
+protected:
+	struct sStream
+	{
+		sInputParams Params;
+		CEncodingPipeline* pPipeline;
+		MSDKThread* pThread;
+		CStreamRunner* pRunner;
+		mfxU32 nIndex;
+
+		// valid once the stream finished
+		mfxStatus Status;
+		mfxF64 dTime;
+		sRunStatistics Stats;
+		std::vector<sHrdTrace> HrdTraces;
+	};
+
+	static unsigned int MFX_STDCALL StreamThreadRoutine(void* pArg);
+	void RunStream(sStream* pStream);
+	void PrintProgress(mfxF64 dTime);
+	void PrintStatistics();
+	void WriteReport();
+
+	std::vector<sStream*> m_Streams;
+
+	SysMemFrameAllocator* m_pAllocator;
+	ArenaBufferAllocator* m_pArenaAllocator; // behind m_pAllocator, NULL when it uses calloc
+
+	MSDKMutex m_Mutex; // m_Timings, joining sessions
+	CStageTimings m_Timings; // of the finished streams
+	CRunReport m_Report;
+
+	std::auto_ptr<MSDKEvent> m_pStreamDone;
+	std::atomic<mfxU32> m_nFinished;
+	mfxF64 m_dElapsedTime;
+	mfxF64 m_dCpuTime;
+
+	bool m_bJoinSessions;
+	std::auto_ptr<MSDKEvent> m_pParentReady; // the first stream created its session, or failed to
+	std::auto_ptr<MSDKEvent> m_pChildrenClosed;
+	std::atomic<mfxU32> m_nChildrenClosed;
+	mfxStatus m_ParentStatus;
+
+private:
+	CStreamRunner(const CStreamRunner&);
+	void operator=(const CStreamRunner&);
+};
@@ -0,0 +1,270 @@
+#include "surface_pool.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+// upper bound for a wait between two polls, surfaces are usually freed by Recycle() much sooner
+#define MSDK_SURFACE_POLL_INTERVAL 1
+
+CSurfacePool::CSurfacePool()
+{
+	m_pSurfaces = NULL;
+	m_nPoolSize = 0;
+	m_nAcquired = 0;
+	m_nWaits = 0;
+	m_dWaitTime = 0;
+	m_dMaxWaitTime = 0;
+}
+
+CSurfacePool::~CSurfacePool()
+{
+	Close();
+}
+
+mfxStatus CSurfacePool::Init(mfxFrameSurface1* pSurfaces, mfxU16 nPoolSize)
+{
+	MSDK_CHECK_POINTER(pSurfaces, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_ERROR(nPoolSize, 0, MFX_ERR_UNDEFINED_BEHAVIOR);
+
+	Close();
+
+	mfxStatus sts = MFX_ERR_NONE;
+	m_pSurfaceFreed.reset(new MSDKEvent(sts, false, false));
+	MSDK_CHECK_STATUS(sts, "MSDKEvent failed");
+
+	AutomaticMutex lock(m_Mutex);
+
+	m_pSurfaces = pSurfaces;
+	m_nPoolSize = nPoolSize;
+
+	m_FreeList.reserve(nPoolSize);
+	m_Locked.reserve(nPoolSize);
+
+	// lowest index on top of the stack
+	for (mfxU16 i = nPoolSize; i > 0; i--)
+	{
+		m_FreeList.push_back(i - 1);
+	}
+
+	return MFX_ERR_NONE;
+}
+
+void CSurfacePool::Close()
+{
+	AutomaticMutex lock(m_Mutex);
+
+	m_FreeList.clear();
+	m_Locked.clear();
+	m_Held.clear();
+	m_pSurfaces = NULL;
+	m_nPoolSize = 0;
+	m_pSurfaceFreed.reset();
+}
+
+mfxFrameSurface1* CSurfacePool::PopFreeSurface()
+{
+	if (m_FreeList.empty())
+	{
+		return NULL;
+	}
+
+	mfxU16 idx = m_FreeList.back();
+	m_FreeList.pop_back();
+	m_nAcquired++;
+
+	return &m_pSurfaces[idx];
+}
+
+// moves surfaces the encoder no longer locks to the free list, m_Mutex must be held
+mfxU32 CSurfacePool::CollectUnlocked()
+{
+	mfxU32 nCollected = 0;
+
+	for (size_t i = 0; i < m_Locked.size();)
+	{
+		if (0 == m_pSurfaces[m_Locked[i]].Data.Locked)
+		{
+			m_FreeList.push_back(m_Locked[i]);
+			m_Locked[i] = m_Locked.back();
+			m_Locked.pop_back();
+			nCollected++;
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	return nCollected;
+}
+
+mfxFrameSurface1* CSurfacePool::TryAcquire()
+{
+	AutomaticMutex lock(m_Mutex);
+
+	mfxFrameSurface1* pSurface = PopFreeSurface();
+	if (!pSurface && CollectUnlocked())
+	{
+		pSurface = PopFreeSurface();
+	}
+
+	return pSurface;
+}
+
+bool CSurfacePool::HasFreeSurface()
+{
+	AutomaticMutex lock(m_Mutex);
+
+	return !m_FreeList.empty() || CollectUnlocked();
+}
+
+mfxStatus CSurfacePool::Acquire(mfxFrameSurface1** ppSurface, mfxU32 nTimeout)
+{
+	MSDK_CHECK_POINTER(ppSurface, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(m_pSurfaceFreed.get(), MFX_ERR_NOT_INITIALIZED);
+
+	*ppSurface = TryAcquire();
+	if (*ppSurface)
+	{
+		return MFX_ERR_NONE;
+	}
+
+	CTimer t;
+	t.Start();
+
+	mfxF64 dTimeout = nTimeout / 1000.;
+	mfxF64 dWaited = 0;
+
+	while (!*ppSurface && dWaited < dTimeout)
+	{
+		m_pSurfaceFreed->TimedWait(MSDK_SURFACE_POLL_INTERVAL);
+		*ppSurface = TryAcquire();
+		dWaited = t.GetTime();
+	}
+
+	RecordWait(dWaited);
+
+	return *ppSurface ? MFX_ERR_NONE : MFX_WRN_IN_EXECUTION;
+}
+
+void CSurfacePool::Release(mfxFrameSurface1* pSurface)
+{
+	AutomaticMutex lock(m_Mutex);
+
+	mfxU16 idx = (mfxU16)(pSurface - m_pSurfaces);
+
+	if (pSurface->Data.Locked)
+	{
+		m_Locked.push_back(idx);
+	}
+	else
+	{
+		m_FreeList.push_back(idx);
+		m_pSurfaceFreed->Signal();
+	}
+}
+
+void CSurfacePool::Recycle()
+{
+	AutomaticMutex lock(m_Mutex);
+
+	if (CollectUnlocked())
+	{
+		m_pSurfaceFreed->Signal();
+	}
+}
+
+void CSurfacePool::Hold(mfxFrameSurface1* pSurface)
+{
+	AutomaticMutex lock(m_Mutex);
+
+	msdk_atomic_inc16(&pSurface->Data.Locked);
+
+	sHeldFrame frame;
+	frame.pSurface = pSurface;
+	frame.nFrameOrder = pSurface->Data.FrameOrder;
+	m_Held.push_back(frame);
+}
+
+void CSurfacePool::Complete(mfxU32 nFrameOrder)
+{
+	AutomaticMutex lock(m_Mutex);
+
+	// frames come out in coding order, so the match is not necessarily the oldest one
+	std::deque<sHeldFrame>::iterator it = m_Held.begin();
+	while (it != m_Held.end() && it->nFrameOrder != nFrameOrder)
+	{
+		++it;
+	}
+
+	if (it == m_Held.end())
+	{
+		return;
+	}
+
+	msdk_atomic_dec16(&it->pSurface->Data.Locked);
+	m_Held.erase(it);
+}
+
+void CSurfacePool::ResetLocks(std::vector<mfxFrameSurface1*>* pHeld)
+{
+	AutomaticMutex lock(m_Mutex);
+
+	pHeld->clear();
+
+	for (size_t i = 0; i < m_Held.size(); i++)
+	{
+		m_Held[i].pSurface->Data.Locked = 0;
+		pHeld->push_back(m_Held[i].pSurface);
+	}
+	m_Held.clear();
+
+	for (size_t i = 0; i < m_Locked.size(); i++)
+	{
+		mfxFrameSurface1* pSurface = &m_pSurfaces[m_Locked[i]];
+
+		if (std::find(pHeld->begin(), pHeld->end(), pSurface) == pHeld->end())
+		{
+			pSurface->Data.Locked = 0;
+			m_FreeList.push_back(m_Locked[i]);
+		}
+	}
+	m_Locked.clear();
+
+	if (!m_FreeList.empty())
+	{
+		m_pSurfaceFreed->Signal();
+	}
+}
+
+mfxU32 CSurfacePool::GetSurfacesInUse()
+{
+	AutomaticMutex lock(m_Mutex);
+
+	return m_nPoolSize - (mfxU32)m_FreeList.size();
+}
+
+void CSurfacePool::RecordWait(mfxF64 dSeconds)
+{
+	AutomaticMutex lock(m_Mutex);
+
+	m_nWaits++;
+	m_dWaitTime += dSeconds;
+	m_dMaxWaitTime = MSDK_MAX(m_dMaxWaitTime, dSeconds);
+}
+
+void CSurfacePool::PrintStatistics()
+{
+	AutomaticMutex lock(m_Mutex);
+
+	if (!m_nAcquired)
+	{
+		return;
+	}
+
+	std::cout << "Surface pool: " << m_nAcquired << " surfaces acquired, " << m_nWaits << " waits, "
+		<< std::fixed << std::setprecision(2) << m_dWaitTime * 1000 << " ms waited in total, "
+		<< m_dMaxWaitTime * 1000 << " ms longest wait" << std::endl;
+	std::cout.unsetf(std::ios::floatfield);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "mfxstructures.h"
+
+#include "atomic_defs.h"
+#include "thread_defs.h"
+#include "utils.h"
+
+// Pool of encoder input surfaces with an O(1) free list.
+// Surfaces handed to the encoder are parked until it drops its lock on them; Recycle() re-polls
+// them (call it whenever a SyncOperation completes) and wakes threads blocked in Acquire().
+class CSurfacePool
+{
+public:
+	CSurfacePool();
+	virtual ~CSurfacePool();
+
+	virtual mfxStatus Init(mfxFrameSurface1* pSurfaces, mfxU16 nPoolSize);
+	virtual void Close();
+
+	// returns NULL if no surface is free right now
+	virtual mfxFrameSurface1* TryAcquire();
+	// whether TryAcquire would return a surface
+	virtual bool HasFreeSurface();
+	// waits up to nTimeout ms for a free surface, MFX_WRN_IN_EXECUTION on timeout
+	virtual mfxStatus Acquire(mfxFrameSurface1** ppSurface, mfxU32 nTimeout);
+	// gives back a surface taken with (Try)Acquire, typically right after it was submitted to the encoder
+	virtual void Release(mfxFrameSurface1* pSurface);
+	// moves surfaces the encoder has unlocked back to the free list and wakes waiters
+	virtual void Recycle();
+
+	// keeps a surface submitted to the encoder locked until the bitstream of its frame was written,
+	// so that the frame can be replayed after a device loss; Data.FrameOrder identifies the frame and
+	// must be unique among the frames in flight
+	virtual void Hold(mfxFrameSurface1* pSurface);
+	// releases a hold on the frame of a completed bitstream, a frame not held is ignored
+	virtual void Complete(mfxU32 nFrameOrder);
+	// the encoder was closed and its locks are gone: held surfaces are handed to the caller in submission
+	// order for replay, every other surface becomes free
+	virtual void ResetLocks(std::vector<mfxFrameSurface1*>* pHeld);
+
+	// accounts time a caller spent getting a surface by other means, e.g. completing a task
+	virtual void RecordWait(mfxF64 dSeconds);
+	virtual void PrintStatistics();
+
+	mfxU16 GetPoolSize() const { return m_nPoolSize; }
+	// surfaces acquired, held or still locked by the encoder
+	virtual mfxU32 GetSurfacesInUse();
+
+protected:
+	mfxFrameSurface1* PopFreeSurface();
+	mfxU32 CollectUnlocked();
+
+	mfxFrameSurface1* m_pSurfaces;
+	mfxU16 m_nPoolSize;
+
+	std::vector<mfxU16> m_FreeList; // indices of surfaces nobody holds
+	std::vector<mfxU16> m_Locked;   // indices of surfaces still locked by the encoder
+
+	struct sHeldFrame
+	{
+		mfxFrameSurface1* pSurface;
+		mfxU32 nFrameOrder;
+	};
+	std::deque<sHeldFrame> m_Held; // in submission order
+
+	MSDKMutex m_Mutex;
+	std::auto_ptr<MSDKEvent> m_pSurfaceFreed;
+
+	// statistics
+	mfxU32 m_nAcquired;
+	mfxU32 m_nWaits;
+	mfxF64 m_dWaitTime;
+	mfxF64 m_dMaxWaitTime;
+
+private:
+	CSurfacePool(const CSurfacePool&);
+	void operator=(const CSurfacePool&);
+};
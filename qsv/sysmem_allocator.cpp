@@ -20,7 +20,6 @@ or https://software.intel.com/en-us/media-client-solutions-support.
 #include "sysmem_allocator.h"
 
 #define MSDK_ALIGN32(X) (((mfxU32)((X)+31)) & (~ (mfxU32)31))
-#define ID_BUFFER MFX_MAKEFOURCC('B','U','F','F')
 #define ID_FRAME  MFX_MAKEFOURCC('F','R','M','E')
 
 #pragma warning(disable : 4100)
@@ -35,6 +34,17 @@ SysMemFrameAllocator::~SysMemFrameAllocator()
     Close();
 }
 
+void SysMemFrameAllocator::SetBufferAllocator(MFXBufferAllocator *pBufferAllocator)
+{
+    if (m_bOwnBufferAllocator)
+    {
+        delete m_pBufferAllocator;
+        m_bOwnBufferAllocator = false;
+    }
+
+    m_pBufferAllocator = pBufferAllocator;
+}
+
 mfxStatus SysMemFrameAllocator::Init()
 {
     // if buffer allocator wasn't passed from application create own
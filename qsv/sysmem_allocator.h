@@ -23,6 +23,8 @@ or https://software.intel.com/en-us/media-client-solutions-support.
 #include <stdlib.h>
 #include "base_allocator.h"
 
+#define ID_BUFFER MFX_MAKEFOURCC('B','U','F','F')
+
 struct sBuffer
 {
     mfxU32      id;
@@ -42,6 +44,8 @@ public:
     SysMemFrameAllocator();
     virtual ~SysMemFrameAllocator();
 
+    // uses an external buffer allocator instead of an own SysMemBufferAllocator, call before Init
+    virtual void SetBufferAllocator(MFXBufferAllocator *pBufferAllocator);
     virtual mfxStatus Init();
     virtual mfxStatus Close();
     virtual mfxStatus LockFrame(mfxMemId mid, mfxFrameData *ptr);
@@ -0,0 +1,191 @@
+// Checks the SIMD chroma interleave kernels against InterleaveUV_C, and the NV12 frames CSmplYUVReader makes
+// of I420 and YV12 input against the per-sample conversion the reader used before the kernels existed.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "convert.h"
+#include "utils.h"
+
+#define TEST_MAX_WIDTH 300
+// bytes after the row that a kernel must not touch
+#define TEST_GUARD 64
+#define TEST_GUARD_VALUE 0xA5
+
+static int g_nFailures = 0;
+
+static void Fail(const char* what, int nWidth, int nOffset)
+{
+	std::printf("FAILED: %s, width %d, offset %d\n", what, nWidth, nOffset);
+	g_nFailures++;
+}
+
+static void CheckKernel(const char* name, InterleaveUVFunc pFunc)
+{
+	std::vector<mfxU8> u(TEST_MAX_WIDTH + 1), v(TEST_MAX_WIDTH + 1);
+	std::vector<mfxU8> expected(2 * TEST_MAX_WIDTH + 1 + TEST_GUARD), actual(expected.size());
+
+	for (int nWidth = 0; nWidth <= TEST_MAX_WIDTH; nWidth++)
+	{
+		// unaligned rows as well, the reader passes plane pointers of any alignment
+		for (int nOffset = 0; nOffset < 2; nOffset++)
+		{
+			for (int i = 0; i < nWidth; i++)
+			{
+				u[nOffset + i] = (mfxU8)rand();
+				v[nOffset + i] = (mfxU8)rand();
+			}
+			memset(&expected[0], TEST_GUARD_VALUE, expected.size());
+			memset(&actual[0], TEST_GUARD_VALUE, actual.size());
+
+			InterleaveUV_C(&expected[nOffset], &u[nOffset], &v[nOffset], nWidth);
+			pFunc(&actual[nOffset], &u[nOffset], &v[nOffset], nWidth);
+
+			if (memcmp(&expected[0], &actual[0], expected.size()))
+			{
+				Fail(name, nWidth, nOffset);
+			}
+		}
+	}
+}
+
+// the conversion of the original reader: each chroma plane is scattered into every other byte of the UV rows
+static void ConvertReference(const std::vector<mfxU8>& frame, mfxU32 nFourCC, mfxU16 w, mfxU16 h, std::vector<mfxU8>* pNV12)
+{
+	mfxU32 nChromaW = w / 2, nChromaH = h / 2;
+	const mfxU8* pFirst = &frame[(size_t)w * h];
+	const mfxU8* pSecond = pFirst + nChromaW * nChromaH;
+	mfxU32 dstOffset[2] = { 0, 1 };
+	if (MFX_FOURCC_YV12 == nFourCC)
+	{
+		dstOffset[0] = 1;
+		dstOffset[1] = 0;
+	}
+
+	pNV12->assign((size_t)w * h + 2 * nChromaW * nChromaH, 0);
+	memcpy(&(*pNV12)[0], &frame[0], (size_t)w * h);
+	mfxU8* pUV = &(*pNV12)[(size_t)w * h];
+	for (mfxU32 i = 0; i < nChromaH; i++)
+	{
+		for (mfxU32 j = 0; j < nChromaW; j++)
+		{
+			pUV[i * w + j * 2 + dstOffset[0]] = pFirst[i * nChromaW + j];
+			pUV[i * w + j * 2 + dstOffset[1]] = pSecond[i * nChromaW + j];
+		}
+	}
+}
+
+static void CheckReader(mfxU32 nFourCC, bool bMap, mfxU16 w, mfxU16 h)
+{
+	const char* name = MFX_FOURCC_YV12 == nFourCC ? "YV12 reader" : "I420 reader";
+	std::string file = "convert_test.yuv";
+
+	mfxU32 nFrameSize = (mfxU32)w * h + 2 * (w / 2) * (h / 2);
+	std::vector<mfxU8> frame(nFrameSize);
+	for (size_t i = 0; i < frame.size(); i++)
+	{
+		frame[i] = (mfxU8)rand();
+	}
+
+	FILE* f = fopen(file.c_str(), "wb");
+	if (!f || nFrameSize != fwrite(&frame[0], 1, nFrameSize, f))
+	{
+		Fail("cannot write the input file", w, 0);
+		if (f) fclose(f);
+		return;
+	}
+	fclose(f);
+
+	std::vector<mfxU8> expected;
+	ConvertReference(frame, nFourCC, w, h, &expected);
+
+	// padded pitch, so that rows of the wrong length show up
+	mfxU16 nPitch = (mfxU16)(MSDK_ALIGN32(w) + 32);
+	std::vector<mfxU8> planes((size_t)nPitch * h * 3 / 2, TEST_GUARD_VALUE);
+	mfxFrameSurface1 surface;
+	memset(&surface, 0, sizeof(surface));
+	surface.Info.FourCC = MFX_FOURCC_NV12;
+	surface.Info.Width = (mfxU16)MSDK_ALIGN16(w);
+	surface.Info.Height = (mfxU16)MSDK_ALIGN16(h);
+	surface.Info.CropW = w;
+	surface.Info.CropH = h;
+	surface.Data.Y = &planes[0];
+	surface.Data.UV = surface.Data.Y + (size_t)nPitch * h;
+	surface.Data.V = surface.Data.UV + 1;
+	surface.Data.Pitch = nPitch;
+
+	CSmplYUVReader reader;
+	std::list<std::string> inputs(1, file);
+	if (MFX_ERR_NONE != reader.Init(inputs, nFourCC, false, bMap) || MFX_ERR_NONE != reader.LoadNextFrame(&surface))
+	{
+		Fail(name, w, 0);
+	}
+	else
+	{
+		for (mfxU32 y = 0; y < h; y++)
+		{
+			if (memcmp(surface.Data.Y + y * nPitch, &expected[y * w], w))
+			{
+				Fail(bMap ? "luma (mmap)" : "luma (stdio)", w, y);
+			}
+		}
+		for (mfxU32 y = 0; y < (mfxU32)h / 2; y++)
+		{
+			if (memcmp(surface.Data.UV + y * nPitch, &expected[(size_t)w * h + y * w], 2 * (w / 2)))
+			{
+				Fail(bMap ? "chroma (mmap)" : "chroma (stdio)", w, y);
+			}
+		}
+	}
+
+	reader.Close();
+	remove(file.c_str());
+}
+
+int main()
+{
+	srand(1);
+
+	CheckKernel("InterleaveUV_C", InterleaveUV_C);
+#if defined(MSDK_X86_SIMD)
+	if (CpuSupportsSSE2())
+	{
+		CheckKernel("InterleaveUV_SSE2", InterleaveUV_SSE2);
+	}
+	else
+	{
+		std::printf("skipped InterleaveUV_SSE2, the CPU has no SSE2\n");
+	}
+	if (CpuSupportsAVX2())
+	{
+		CheckKernel("InterleaveUV_AVX2", InterleaveUV_AVX2);
+	}
+	else
+	{
+		std::printf("skipped InterleaveUV_AVX2, the CPU has no AVX2\n");
+	}
+#endif
+
+	// chroma widths below, at and above the 16 and 32 sample blocks of the kernels
+	const mfxU16 sizes[][2] = { { 2, 2 }, { 30, 6 }, { 64, 16 }, { 98, 10 }, { 352, 288 }, { 1920, 1080 } };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		for (int bMap = 0; bMap < 2; bMap++)
+		{
+			CheckReader(MFX_FOURCC_I420, 1 == bMap, sizes[i][0], sizes[i][1]);
+			CheckReader(MFX_FOURCC_YV12, 1 == bMap, sizes[i][0], sizes[i][1]);
+		}
+	}
+
+	if (g_nFailures)
+	{
+		std::printf("%d checks failed\n", g_nFailures);
+		return 1;
+	}
+
+	std::printf("all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,258 @@
+// Checks the AVX2 scaling kernels against ScaleRowVert_C, ScaleRowHorz_C and ScaleRowDown2_C, and whole frames
+// CFrameScaler scales with the AVX2 kernels on several threads against the C kernels on one.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "scaler.h"
+#include "utils.h"
+
+#define TEST_MAX_WIDTH 300
+#define TEST_MAX_TAPS 6
+// bytes after the row that a kernel must not touch
+#define TEST_GUARD 64
+#define TEST_GUARD_VALUE 0xA5
+#define TEST_CONSTANT_VALUE 77
+
+static int g_nFailures = 0;
+
+static void Fail(const char* what, int nWidth, int nParam)
+{
+	std::printf("FAILED: %s, width %d, %d\n", what, nWidth, nParam);
+	g_nFailures++;
+}
+
+// nTaps weights adding up to 256, as the filters of the scaler do
+static void RandomWeights(mfxU32 nTaps, mfxU32* pWeights)
+{
+	mfxU32 nLeft = 256;
+	for (mfxU32 t = 0; t + 1 < nTaps; t++)
+	{
+		pWeights[t] = rand() % (nLeft + 1);
+		nLeft -= pWeights[t];
+	}
+	pWeights[nTaps - 1] = nLeft;
+}
+
+#if defined(MSDK_X86_SIMD)
+
+static void CheckRowVert()
+{
+	std::vector<std::vector<mfxU8> > src(TEST_MAX_TAPS, std::vector<mfxU8>(TEST_MAX_WIDTH));
+	std::vector<mfxU16> expected(TEST_MAX_WIDTH + TEST_GUARD), actual(expected.size());
+
+	for (mfxU32 nTaps = 1; nTaps <= TEST_MAX_TAPS; nTaps++)
+	{
+		for (mfxU32 nWidth = 0; nWidth <= TEST_MAX_WIDTH; nWidth++)
+		{
+			const mfxU8* rows[TEST_MAX_TAPS];
+			mfxU32 weights[TEST_MAX_TAPS];
+			mfxU16 weights16[TEST_MAX_TAPS];
+			RandomWeights(nTaps, weights);
+			for (mfxU32 t = 0; t < nTaps; t++)
+			{
+				for (mfxU32 i = 0; i < nWidth; i++)
+				{
+					src[t][i] = (mfxU8)rand();
+				}
+				rows[t] = &src[t][0];
+				weights16[t] = (mfxU16)weights[t];
+			}
+			memset(&expected[0], TEST_GUARD_VALUE, expected.size() * sizeof(mfxU16));
+			memset(&actual[0], TEST_GUARD_VALUE, actual.size() * sizeof(mfxU16));
+
+			ScaleRowVert_C(&expected[0], rows, weights16, nTaps, nWidth);
+			ScaleRowVert_AVX2(&actual[0], rows, weights16, nTaps, nWidth);
+
+			if (expected != actual)
+			{
+				Fail("ScaleRowVert_AVX2, taps", nWidth, nTaps);
+			}
+		}
+	}
+}
+
+static void CheckRowHorz()
+{
+	for (mfxU32 nStep = 1; nStep <= 2; nStep++)
+	{
+		for (mfxU32 nTaps = 1; nTaps <= TEST_MAX_TAPS; nTaps++)
+		{
+			for (mfxU32 nWidth = 0; nWidth <= TEST_MAX_WIDTH; nWidth += nStep)
+			{
+				// vertical sums of 8 bit samples with weights adding up to 256, and the spare sample the
+				// gathers of the AVX2 kernel may read
+				mfxU32 nSrcWidth = 2 * nWidth + nTaps * nStep;
+				std::vector<mfxU16> src(nSrcWidth + 1);
+				for (size_t i = 0; i < src.size(); i++)
+				{
+					src[i] = (mfxU16)(rand() % (255 * 256 + 1));
+				}
+
+				// any source position the taps stay within, samples of a channel pair apart
+				std::vector<mfxI32> index(nWidth), weights(nTaps * nWidth);
+				for (mfxU32 i = 0; i < nWidth; i++)
+				{
+					index[i] = (mfxI32)((rand() % (nSrcWidth / nStep - nTaps + 1)) * nStep + i % nStep);
+					mfxU32 w[TEST_MAX_TAPS];
+					RandomWeights(nTaps, w);
+					for (mfxU32 t = 0; t < nTaps; t++)
+					{
+						weights[t * nWidth + i] = (mfxI32)w[t];
+					}
+				}
+
+				std::vector<mfxU8> expected(nWidth + TEST_GUARD, TEST_GUARD_VALUE), actual(expected);
+				const mfxI32* pIndex = nWidth ? &index[0] : NULL;
+				const mfxI32* pWeights = nWidth ? &weights[0] : NULL;
+				ScaleRowHorz_C(&expected[0], &src[0], pIndex, pWeights, nTaps, nWidth, nStep);
+				ScaleRowHorz_AVX2(&actual[0], &src[0], pIndex, pWeights, nTaps, nWidth, nStep);
+
+				if (expected != actual)
+				{
+					Fail(1 == nStep ? "ScaleRowHorz_AVX2 luma, taps" : "ScaleRowHorz_AVX2 chroma, taps", nWidth, nTaps);
+				}
+			}
+		}
+	}
+}
+
+static void CheckRowDown2()
+{
+	std::vector<mfxU8> src0(2 * TEST_MAX_WIDTH), src1(src0.size());
+
+	for (mfxU32 nStep = 1; nStep <= 2; nStep++)
+	{
+		for (mfxU32 nWidth = 0; nWidth <= TEST_MAX_WIDTH; nWidth += nStep)
+		{
+			for (size_t i = 0; i < src0.size(); i++)
+			{
+				src0[i] = (mfxU8)rand();
+				src1[i] = (mfxU8)rand();
+			}
+
+			std::vector<mfxU8> expected(nWidth + TEST_GUARD, TEST_GUARD_VALUE), actual(expected);
+			ScaleRowDown2_C(&expected[0], &src0[0], &src1[0], nWidth, nStep);
+			ScaleRowDown2_AVX2(&actual[0], &src0[0], &src1[0], nWidth, nStep);
+
+			if (expected != actual)
+			{
+				Fail("ScaleRowDown2_AVX2, step", nWidth, nStep);
+			}
+		}
+	}
+}
+
+#endif
+
+struct sTestFrame
+{
+	std::vector<mfxU8> Buffer;
+	mfxFrameSurface1 Surface;
+};
+
+static void InitFrame(sTestFrame* pFrame, mfxU16 w, mfxU16 h)
+{
+	// an odd height has a chroma row for its last luma row too
+	mfxU32 nPitch = MSDK_ALIGN32(w) + 32;
+	pFrame->Buffer.assign((size_t)nPitch * (h + (h + 1) / 2), TEST_GUARD_VALUE);
+
+	mfxFrameSurface1& s = pFrame->Surface;
+	memset(&s, 0, sizeof(s));
+	s.Info.FourCC = MFX_FOURCC_NV12;
+	s.Info.Width = w;
+	s.Info.Height = h;
+	s.Info.CropW = w;
+	s.Info.CropH = h;
+	s.Data.Y = &pFrame->Buffer[0];
+	s.Data.UV = s.Data.Y + (size_t)nPitch * h;
+	s.Data.PitchLow = (mfxU16)nPitch;
+}
+
+static void CheckFrames(mfxU16 nFilter)
+{
+	const char* name = MSDK_SCALE_AREA == nFilter ? "area" : "bilinear";
+	// 2:1 takes the box path, the others the separable filters; odd sizes and upscaling as well
+	const mfxU16 sizes[][4] = { { 3840, 2160, 1920, 1080 }, { 1920, 1080, 960, 540 }, { 1920, 1080, 1280, 720 },
+		{ 1920, 1080, 640, 360 }, { 641, 361, 320, 180 }, { 100, 50, 37, 21 }, { 64, 64, 64, 64 }, { 320, 240, 400, 300 } };
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		sTestFrame src, expected, actual;
+		InitFrame(&src, sizes[i][0], sizes[i][1]);
+		InitFrame(&expected, sizes[i][2], sizes[i][3]);
+		InitFrame(&actual, sizes[i][2], sizes[i][3]);
+		for (size_t j = 0; j < src.Buffer.size(); j++)
+		{
+			src.Buffer[j] = (mfxU8)rand();
+		}
+
+		CFrameScaler reference, scaler;
+		if (MFX_ERR_NONE != reference.Init(nFilter, 1, false) || MFX_ERR_NONE != scaler.Init(nFilter, 3) ||
+			MFX_ERR_NONE != reference.Scale(&src.Surface, &expected.Surface) || MFX_ERR_NONE != scaler.Scale(&src.Surface, &actual.Surface))
+		{
+			Fail(name, sizes[i][2], sizes[i][3]);
+			continue;
+		}
+		if (expected.Buffer != actual.Buffer)
+		{
+			Fail(name, sizes[i][2], sizes[i][3]);
+		}
+
+		// a flat picture stays flat whatever the taps
+		memset(&src.Buffer[0], TEST_CONSTANT_VALUE, src.Buffer.size());
+		scaler.Scale(&src.Surface, &actual.Surface);
+		mfxU32 nPitch = actual.Surface.Data.PitchLow;
+		bool bFlat = true;
+		for (mfxU32 y = 0; y < sizes[i][3]; y++)
+		{
+			for (mfxU32 x = 0; x < sizes[i][2]; x++)
+			{
+				bFlat = bFlat && TEST_CONSTANT_VALUE == actual.Surface.Data.Y[y * nPitch + x];
+			}
+		}
+		for (mfxU32 y = 0; y < (mfxU32)(sizes[i][3] + 1) / 2; y++)
+		{
+			for (mfxU32 x = 0; x < (mfxU32)(sizes[i][2] + 1) / 2 * 2; x++)
+			{
+				bFlat = bFlat && TEST_CONSTANT_VALUE == actual.Surface.Data.UV[y * nPitch + x];
+			}
+		}
+		if (!bFlat)
+		{
+			Fail(MSDK_SCALE_AREA == nFilter ? "flat picture, area" : "flat picture, bilinear", sizes[i][2], sizes[i][3]);
+		}
+	}
+}
+
+int main()
+{
+	srand(1);
+
+#if defined(MSDK_X86_SIMD)
+	if (CpuSupportsAVX2())
+	{
+		CheckRowVert();
+		CheckRowHorz();
+		CheckRowDown2();
+	}
+	else
+	{
+		std::printf("skipped the AVX2 kernels, the CPU has no AVX2\n");
+	}
+#endif
+
+	CheckFrames(MSDK_SCALE_BILINEAR);
+	CheckFrames(MSDK_SCALE_AREA);
+
+	if (g_nFailures)
+	{
+		std::printf("%d checks failed\n", g_nFailures);
+		return 1;
+	}
+
+	std::printf("all checks passed\n");
+	return 0;
+}
@@ -56,33 +56,38 @@ struct msdkThreadHandle
 #include <sys/time.h>
 #include <sys/resource.h>
 
+// futex based, see thread_linux.cpp
 struct msdkMutexHandle
 {
-    pthread_mutex_t m_mutex;
+    msdkMutexHandle():
+        m_futex(0)
+    {}
+
+    volatile int m_futex; // 0 - unlocked, 1 - locked, 2 - locked and there may be waiters
 };
 
 struct msdkSemaphoreHandle
 {
     msdkSemaphoreHandle(mfxU32 count):
-        m_count(count)
+        m_count((int)count),
+        m_waiters(0)
     {}
 
-    mfxU32 m_count;
-    pthread_cond_t m_semaphore;
-    pthread_mutex_t m_mutex;
+    volatile int m_count;
+    volatile int m_waiters;
 };
 
 struct msdkEventHandle
 {
     msdkEventHandle(bool manual, bool state):
         m_manual(manual),
-        m_state(state)
+        m_state(state ? 1 : 0),
+        m_waiters(0)
     {}
 
     bool m_manual;
-    bool m_state;
-    pthread_cond_t m_event;
-    pthread_mutex_t m_mutex;
+    volatile int m_state;
+    volatile int m_waiters;
 };
 
 class MSDKEvent;
@@ -95,13 +100,15 @@ struct msdkThreadHandle
       m_func(func),
       m_arg(arg),
       m_event(0),
-      m_thread(0)
+      m_thread(0),
+      m_joined(false)
     {}
 
     msdk_thread_callback m_func;
     void* m_arg;
-    MSDKEvent* m_event;
+    MSDKEvent* m_event; // signaled when m_func returns
     pthread_t m_thread;
+    bool m_joined;
 };
 
 #endif // #if defined(_WIN32) || defined(_WIN64)
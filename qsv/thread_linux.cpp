@@ -0,0 +1,310 @@
+/******************************************************************************\
+Copyright (c) 2005-2018, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This sample was distributed or derived from the Intel's Media Samples package.
+The original version of this sample may be obtained from https://software.intel.com/en-us/intel-media-server-studio
+or https://software.intel.com/en-us/media-client-solutions-support.
+\**********************************************************************************/
+
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+#include "thread_defs.h"
+#include <new>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// All primitives below sleep on a single futex word, so an uncontended Lock/Unlock, Post or Signal
+// stays in user space and a wake costs one FUTEX_WAKE instead of a mutex + condition variable round trip.
+
+// number of polls of a contended word before going to sleep, covers short critical sections
+#define MSDK_FUTEX_SPIN_COUNT 100
+
+static inline int msdk_futex_wait(volatile int* addr, int val, const struct timespec* timeout)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static inline int msdk_futex_wake(volatile int* addr, int count)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static inline int msdk_cmpxchg(volatile int* addr, int expected, int desired)
+{
+    __atomic_compare_exchange_n(addr, &expected, desired, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    return expected;
+}
+
+static inline void msdk_cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline mfxU64 msdk_monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (mfxU64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// sleeps while *addr == val, returns false once the deadline (CLOCK_MONOTONIC, ns) has passed
+static bool msdk_futex_wait_until(volatile int* addr, int val, mfxU64 deadline)
+{
+    mfxU64 now = msdk_monotonic_ns();
+    if (now >= deadline) return false;
+
+    struct timespec timeout;
+    timeout.tv_sec = (deadline - now) / 1000000000;
+    timeout.tv_nsec = (deadline - now) % 1000000000;
+
+    // EINTR, EAGAIN (the word changed) and spurious wakes all go back to the caller's check
+    if (msdk_futex_wait(addr, val, &timeout) && ETIMEDOUT == errno) return false;
+    return true;
+}
+
+/* ****************************************************************************** */
+
+// three state mutex from U. Drepper, "Futexes Are Tricky": the unlocking side only enters the kernel
+// when the word says somebody may be sleeping. Not recursive, unlike a Windows critical section.
+MSDKMutex::MSDKMutex(void)
+{
+}
+
+MSDKMutex::~MSDKMutex(void)
+{
+}
+
+mfxStatus MSDKMutex::Lock(void)
+{
+    int c = msdk_cmpxchg(&m_futex, 0, 1);
+    if (0 == c) return MFX_ERR_NONE;
+
+    for (int i = 0; i < MSDK_FUTEX_SPIN_COUNT && 1 == c; i++)
+    {
+        msdk_cpu_relax();
+        c = msdk_cmpxchg(&m_futex, 0, 1);
+        if (0 == c) return MFX_ERR_NONE;
+    }
+
+    if (2 != c) c = __atomic_exchange_n(&m_futex, 2, __ATOMIC_ACQUIRE);
+    while (0 != c)
+    {
+        msdk_futex_wait(&m_futex, 2, NULL);
+        c = __atomic_exchange_n(&m_futex, 2, __ATOMIC_ACQUIRE);
+    }
+    return MFX_ERR_NONE;
+}
+
+mfxStatus MSDKMutex::Unlock(void)
+{
+    if (2 == __atomic_exchange_n(&m_futex, 0, __ATOMIC_RELEASE))
+    {
+        msdk_futex_wake(&m_futex, 1);
+    }
+    return MFX_ERR_NONE;
+}
+
+int MSDKMutex::Try(void)
+{
+    return 0 == msdk_cmpxchg(&m_futex, 0, 1);
+}
+
+/* ****************************************************************************** */
+
+MSDKSemaphore::MSDKSemaphore(mfxStatus &sts, mfxU32 count):
+    msdkSemaphoreHandle(count)
+{
+    sts = MFX_ERR_NONE;
+}
+
+MSDKSemaphore::~MSDKSemaphore(void)
+{
+}
+
+mfxStatus MSDKSemaphore::Post(void)
+{
+    __atomic_add_fetch(&m_count, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&m_waiters, __ATOMIC_SEQ_CST))
+    {
+        msdk_futex_wake(&m_count, 1);
+    }
+    return MFX_ERR_NONE;
+}
+
+mfxStatus MSDKSemaphore::Wait(void)
+{
+    for (;;)
+    {
+        int c = __atomic_load_n(&m_count, __ATOMIC_RELAXED);
+        while (c > 0)
+        {
+            if (__atomic_compare_exchange_n(&m_count, &c, c - 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return MFX_ERR_NONE;
+        }
+
+        // a Post between the check above and the sleep changes the word, so the wait returns at once
+        __atomic_add_fetch(&m_waiters, 1, __ATOMIC_SEQ_CST);
+        msdk_futex_wait(&m_count, 0, NULL);
+        __atomic_sub_fetch(&m_waiters, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* ****************************************************************************** */
+
+MSDKEvent::MSDKEvent(mfxStatus &sts, bool manual, bool state):
+    msdkEventHandle(manual, state)
+{
+    sts = MFX_ERR_NONE;
+}
+
+MSDKEvent::~MSDKEvent(void)
+{
+}
+
+mfxStatus MSDKEvent::Signal(void)
+{
+    __atomic_store_n(&m_state, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&m_waiters, __ATOMIC_SEQ_CST))
+    {
+        // an auto reset event releases a single waiter, the others find the state consumed
+        msdk_futex_wake(&m_state, m_manual ? INT_MAX : 1);
+    }
+    return MFX_ERR_NONE;
+}
+
+mfxStatus MSDKEvent::Reset(void)
+{
+    __atomic_store_n(&m_state, 0, __ATOMIC_RELEASE);
+    return MFX_ERR_NONE;
+}
+
+// takes the signaled state, an auto reset event is reset by the waiter that gets it
+static inline bool msdk_event_try_wait(msdkEventHandle* pEvent)
+{
+    if (pEvent->m_manual) return 1 == __atomic_load_n(&pEvent->m_state, __ATOMIC_ACQUIRE);
+    return 1 == msdk_cmpxchg(&pEvent->m_state, 1, 0);
+}
+
+mfxStatus MSDKEvent::Wait(void)
+{
+    while (!msdk_event_try_wait(this))
+    {
+        __atomic_add_fetch(&m_waiters, 1, __ATOMIC_SEQ_CST);
+        msdk_futex_wait(&m_state, 0, NULL);
+        __atomic_sub_fetch(&m_waiters, 1, __ATOMIC_RELAXED);
+    }
+    return MFX_ERR_NONE;
+}
+
+mfxStatus MSDKEvent::TimedWait(mfxU32 msec)
+{
+    if(MFX_INFINITE == msec) return MFX_ERR_UNSUPPORTED;
+
+    mfxU64 deadline = msdk_monotonic_ns() + (mfxU64)msec * 1000000;
+    bool bTimedOut = false;
+
+    while (!msdk_event_try_wait(this))
+    {
+        if (bTimedOut) return MFX_TASK_WORKING;
+
+        __atomic_add_fetch(&m_waiters, 1, __ATOMIC_SEQ_CST);
+        bTimedOut = !msdk_futex_wait_until(&m_state, 0, deadline);
+        __atomic_sub_fetch(&m_waiters, 1, __ATOMIC_RELAXED);
+    }
+    return MFX_ERR_NONE;
+}
+
+/* ****************************************************************************** */
+
+void* msdk_thread_start(void* arg)
+{
+    if (arg)
+    {
+        MSDKThread* thread = (MSDKThread*)arg;
+
+        if (thread->m_func) thread->m_func(thread->m_arg);
+        thread->m_event->Signal();
+    }
+    return NULL;
+}
+
+MSDKThread::MSDKThread(mfxStatus &sts, msdk_thread_callback func, void* arg):
+    msdkThreadHandle(func, arg)
+{
+    m_event = new MSDKEvent(sts, true, false);
+    if (pthread_create(&(m_thread), NULL, msdk_thread_start, this))
+    {
+        delete m_event;
+        throw std::bad_alloc();
+    }
+}
+
+MSDKThread::~MSDKThread(void)
+{
+    // the thread is not waited for here, same as closing the handle on Windows
+    if (!m_joined) pthread_detach(m_thread);
+    delete m_event;
+}
+
+mfxStatus MSDKThread::Wait(void)
+{
+    if (m_joined) return MFX_ERR_NONE;
+
+    int res = pthread_join(m_thread, NULL);
+    if (res) return MFX_ERR_UNKNOWN;
+
+    m_joined = true;
+    return MFX_ERR_NONE;
+}
+
+mfxStatus MSDKThread::TimedWait(mfxU32 msec)
+{
+    if(MFX_INFINITE == msec) return MFX_ERR_UNSUPPORTED;
+
+    mfxStatus mfx_res = m_event->TimedWait(msec);
+
+    // the routine has returned, joining only waits for the thread to unwind
+    if (MFX_ERR_NONE == mfx_res) mfx_res = Wait();
+
+    return mfx_res;
+}
+
+mfxStatus MSDKThread::GetExitCode()
+{
+    return msdk_event_try_wait(m_event) ? MFX_ERR_NONE : MFX_TASK_WORKING;
+}
+
+mfxU32 msdk_get_current_pid()
+{
+    return (mfxU32)getpid();
+}
+
+mfxStatus msdk_setrlimit_vmem(mfxU64 size)
+{
+    struct rlimit limit;
+
+    limit.rlim_cur = size;
+    limit.rlim_max = size;
+    if (setrlimit(RLIMIT_AS, &limit)) return MFX_ERR_UNKNOWN;
+
+    return MFX_ERR_NONE;
+}
+
+#endif // #if !defined(_WIN32) && !defined(_WIN64)
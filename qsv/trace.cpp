@@ -0,0 +1,135 @@
+#include "trace.h"
+
+#include <cstdio>
+#include <vector>
+
+#include "thread_defs.h"
+
+// spans reserved per thread up front, buffers grow beyond that
+#define MSDK_TRACE_RESERVE 16384
+
+volatile bool g_bTraceEnabled = false;
+
+struct sTraceEvent
+{
+	const char* pName;
+	mfxU32 nFrame;
+	mfxU32 nTask;
+	msdk_tick nStart;
+	msdk_tick nEnd;
+};
+
+// owned by the registry, outlives the thread so that its spans can still be written
+struct sTraceThread
+{
+	mfxU32 nId;
+	std::string name;
+	std::vector<sTraceEvent> events;
+};
+
+static MSDKMutex g_TraceMutex; // guards the registry, not the buffers
+static std::vector<sTraceThread*> g_TraceThreads;
+static msdk_tick g_nTraceStart = 0;
+
+static thread_local sTraceThread* g_pTraceThread = NULL;
+
+static sTraceThread* GetTraceThread()
+{
+	if (!g_pTraceThread)
+	{
+		AutomaticMutex lock(g_TraceMutex);
+
+		g_pTraceThread = new sTraceThread;
+		g_pTraceThread->nId = (mfxU32)g_TraceThreads.size() + 1;
+		g_pTraceThread->events.reserve(MSDK_TRACE_RESERVE);
+		g_TraceThreads.push_back(g_pTraceThread);
+	}
+
+	return g_pTraceThread;
+}
+
+void msdk_trace_start()
+{
+	AutomaticMutex lock(g_TraceMutex);
+
+	for (size_t i = 0; i < g_TraceThreads.size(); i++)
+	{
+		g_TraceThreads[i]->events.clear();
+	}
+
+	g_nTraceStart = msdk_time_get_tick();
+	g_bTraceEnabled = true;
+}
+
+void msdk_trace_stop()
+{
+	g_bTraceEnabled = false;
+}
+
+void msdk_trace_set_thread_name(const char* pName)
+{
+	GetTraceThread()->name = pName;
+}
+
+void msdk_trace_record(const char* pName, mfxU32 nFrame, mfxU32 nTask, msdk_tick nStart, msdk_tick nEnd)
+{
+	sTraceEvent event;
+	event.pName = pName;
+	event.nFrame = nFrame;
+	event.nTask = nTask;
+	event.nStart = nStart;
+	event.nEnd = nEnd;
+
+	GetTraceThread()->events.push_back(event);
+}
+
+mfxStatus msdk_trace_write(const std::string& strFileName)
+{
+	AutomaticMutex lock(g_TraceMutex);
+
+	FILE* pFile = fopen(strFileName.c_str(), "wb");
+	MSDK_CHECK_POINTER(pFile, MFX_ERR_NULL_PTR);
+
+	mfxU32 nPid = msdk_get_current_pid();
+	mfxF64 dMicrosecondsPerTick = 1e6 / CTimer::GetFrequency();
+	bool bFirst = true;
+
+	fprintf(pFile, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+	for (size_t i = 0; i < g_TraceThreads.size(); i++)
+	{
+		const sTraceThread& thread = *g_TraceThreads[i];
+
+		if (!thread.name.empty())
+		{
+			fprintf(pFile, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %u, \"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+				bFirst ? "" : ",\n", nPid, thread.nId, thread.name.c_str());
+			bFirst = false;
+		}
+
+		// complete events, frame and task go to the span arguments
+		for (size_t j = 0; j < thread.events.size(); j++)
+		{
+			const sTraceEvent& event = thread.events[j];
+
+			fprintf(pFile, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %u, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": {",
+				bFirst ? "" : ",\n", event.pName, nPid, thread.nId,
+				(event.nStart - g_nTraceStart) * dMicrosecondsPerTick, (event.nEnd - event.nStart) * dMicrosecondsPerTick);
+			bFirst = false;
+
+			if (MSDK_TRACE_NONE != event.nFrame)
+			{
+				fprintf(pFile, "\"frame\": %u%s", event.nFrame, MSDK_TRACE_NONE != event.nTask ? ", " : "");
+			}
+			if (MSDK_TRACE_NONE != event.nTask)
+			{
+				fprintf(pFile, "\"task\": %u", event.nTask);
+			}
+			fprintf(pFile, "}}");
+		}
+	}
+
+	fprintf(pFile, "\n]}\n");
+
+	return fclose(pFile) ? MFX_ERR_UNDEFINED_BEHAVIOR : MFX_ERR_NONE;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+
+#include "mfxstructures.h"
+
+#include "utils.h"
+
+// frame or task is not known for a span
+#define MSDK_TRACE_NONE 0xFFFFFFFF
+
+// Timeline of pipeline spans in the Chrome trace_event format (chrome://tracing, ui.perfetto.dev).
+// Every thread appends to its own buffer, so recording takes no lock; buffers are only read by
+// msdk_trace_write once the threads that recorded into them are done.
+// While tracing is off a span costs a test of g_bTraceEnabled.
+extern volatile bool g_bTraceEnabled;
+
+// drops spans recorded so far and starts recording
+void msdk_trace_start();
+void msdk_trace_stop();
+// names the calling thread in the timeline
+void msdk_trace_set_thread_name(const char* pName);
+void msdk_trace_record(const char* pName, mfxU32 nFrame, mfxU32 nTask, msdk_tick nStart, msdk_tick nEnd);
+mfxStatus msdk_trace_write(const std::string& strFileName);
+
+// records the time from construction to End() or destruction, pName must be a literal
+class CTraceSpan
+{
+public:
+	CTraceSpan(const char* pName, mfxU32 nFrame = MSDK_TRACE_NONE, mfxU32 nTask = MSDK_TRACE_NONE) :
+		m_pName(pName),
+		m_nFrame(nFrame),
+		m_nTask(nTask),
+		m_nStart(g_bTraceEnabled ? msdk_time_get_tick() : 0)
+	{
+	}
+	~CTraceSpan()
+	{
+		End();
+	}
+
+	// for spans whose frame is only known at the end
+	void SetFrame(mfxU32 nFrame) { m_nFrame = nFrame; }
+	void End()
+	{
+		if (m_nStart)
+		{
+			msdk_trace_record(m_pName, m_nFrame, m_nTask, m_nStart, msdk_time_get_tick());
+			m_nStart = 0;
+		}
+	}
+
+private:
+	const char* m_pName;
+	mfxU32 m_nFrame;
+	mfxU32 m_nTask;
+	msdk_tick m_nStart;
+
+	CTraceSpan(const CTraceSpan&);
+	void operator=(const CTraceSpan&);
+};
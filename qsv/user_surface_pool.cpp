@@ -0,0 +1,216 @@
+#include "user_surface_pool.h"
+
+#include <cstring>
+#include <iostream>
+
+CUserSurfacePool::CUserSurfacePool()
+{
+	MSDK_ZERO_MEMORY(m_Info);
+	m_pCallback = NULL;
+	m_pContext = NULL;
+	m_nWrapped = 0;
+}
+
+CUserSurfacePool::~CUserSurfacePool()
+{
+	Close();
+}
+
+mfxStatus CUserSurfacePool::Init(const mfxFrameInfo& info, mfxU16 nPoolSize, UserFrameReleaseCallback pCallback, void* pContext)
+{
+	MSDK_CHECK_ERROR(nPoolSize, 0, MFX_ERR_UNDEFINED_BEHAVIOR);
+	// the frames are handed over as they are, there is nothing to convert them with
+	if (MFX_FOURCC_NV12 != info.FourCC)
+	{
+		return MFX_ERR_UNSUPPORTED;
+	}
+
+	Close();
+
+	m_Info = info;
+	m_pCallback = pCallback;
+	m_pContext = pContext;
+
+	m_Wrappers.resize(nPoolSize);
+	m_FreeList.reserve(nPoolSize);
+
+	// lowest index on top of the stack
+	for (mfxU16 i = nPoolSize; i > 0; i--)
+	{
+		sWrapper& wrapper = m_Wrappers[i - 1];
+		memset(&wrapper, 0, sizeof(wrapper));
+		wrapper.Surface.Info = m_Info;
+
+		m_FreeList.push_back(i - 1);
+	}
+
+	return MFX_ERR_NONE;
+}
+
+void CUserSurfacePool::Close()
+{
+	// nothing can lock the surfaces any more
+	for (size_t i = 0; i < m_Wrappers.size(); i++)
+	{
+		if (m_Wrappers[i].bInUse)
+		{
+			ReleaseFrame(&m_Wrappers[i]);
+		}
+	}
+
+	m_Wrappers.clear();
+	m_FreeList.clear();
+	m_pCallback = NULL;
+	m_pContext = NULL;
+}
+
+mfxStatus CUserSurfacePool::Wrap(const sUserFrame& frame, mfxFrameSurface1** ppSurface)
+{
+	MSDK_CHECK_POINTER(ppSurface, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(frame.pY, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_POINTER(frame.pUV, MFX_ERR_NULL_PTR);
+	MSDK_CHECK_ERROR(m_Wrappers.empty(), true, MFX_ERR_NOT_INITIALIZED);
+
+	// the encoder reads the aligned size, not only the cropped picture
+	if (frame.nPitch < m_Info.Width || frame.nPitch % MSDK_USER_FRAME_ALIGNMENT ||
+		(size_t)frame.pY % MSDK_USER_FRAME_ALIGNMENT || (size_t)frame.pUV % MSDK_USER_FRAME_ALIGNMENT)
+	{
+		std::cerr << "ERROR: frame planes and pitch must be aligned to " << MSDK_USER_FRAME_ALIGNMENT
+			<< " bytes, the pitch at least " << m_Info.Width << std::endl;
+		return MFX_ERR_INVALID_VIDEO_PARAM;
+	}
+
+	// mfxFrameData::Pitch has 16 bits, a wider pitch would wrap and the encoder would read the wrong rows
+	if (frame.nPitch > 0xFFFF)
+	{
+		std::cerr << "ERROR: frame pitch must not exceed 65535 bytes" << std::endl;
+		return MFX_ERR_INVALID_VIDEO_PARAM;
+	}
+
+	if (frame.nLumaSize < (mfxU64)frame.nPitch * m_Info.Height || frame.nChromaSize < (mfxU64)frame.nPitch * (m_Info.Height / 2))
+	{
+		std::cerr << "ERROR: frame buffers must cover " << m_Info.Width << "x" << m_Info.Height << " pixels" << std::endl;
+		return MFX_ERR_INVALID_VIDEO_PARAM;
+	}
+
+	if (m_FreeList.empty())
+	{
+		Recycle();
+		if (m_FreeList.empty())
+		{
+			return MFX_WRN_DEVICE_BUSY;
+		}
+	}
+
+	sWrapper& wrapper = m_Wrappers[m_FreeList.back()];
+	m_FreeList.pop_back();
+
+	wrapper.Frame = frame;
+	wrapper.bInUse = true;
+	wrapper.nPins = 1;
+
+	mfxFrameData& data = wrapper.Surface.Data;
+	memset(&data, 0, sizeof(data));
+	data.Y = frame.pY;
+	data.UV = frame.pUV;
+	data.V = frame.pUV + 1;
+	data.Pitch = (mfxU16)frame.nPitch;
+	data.TimeStamp = frame.nTimeStamp;
+
+	m_nWrapped++;
+	*ppSurface = &wrapper.Surface;
+
+	return MFX_ERR_NONE;
+}
+
+CUserSurfacePool::sWrapper* CUserSurfacePool::Find(mfxFrameSurface1* pSurface)
+{
+	for (size_t i = 0; i < m_Wrappers.size(); i++)
+	{
+		if (pSurface == &m_Wrappers[i].Surface)
+		{
+			return &m_Wrappers[i];
+		}
+	}
+
+	return NULL;
+}
+
+bool CUserSurfacePool::Unwrap(mfxFrameSurface1* pSurface)
+{
+	sWrapper* pWrapper = Find(pSurface);
+	if (!pWrapper)
+	{
+		return false;
+	}
+
+	// the frame stays with the application, which submits it again
+	if (pWrapper->bInUse)
+	{
+		pWrapper->bInUse = false;
+		pWrapper->nPins = 0;
+		m_FreeList.push_back((mfxU16)(pWrapper - &m_Wrappers[0]));
+		m_nWrapped--;
+	}
+	return true;
+}
+
+bool CUserSurfacePool::Pin(mfxFrameSurface1* pSurface)
+{
+	sWrapper* pWrapper = Find(pSurface);
+	if (!pWrapper || !pWrapper->bInUse)
+	{
+		return false;
+	}
+
+	pWrapper->nPins++;
+	return true;
+}
+
+bool CUserSurfacePool::Unpin(mfxFrameSurface1* pSurface)
+{
+	sWrapper* pWrapper = Find(pSurface);
+	if (!pWrapper)
+	{
+		return false;
+	}
+
+	if (pWrapper->nPins)
+	{
+		pWrapper->nPins--;
+	}
+	return true;
+}
+
+void CUserSurfacePool::Recycle()
+{
+	for (size_t i = 0; i < m_Wrappers.size(); i++)
+	{
+		sWrapper& wrapper = m_Wrappers[i];
+
+		if (wrapper.bInUse && !wrapper.nPins && !wrapper.Surface.Data.Locked)
+		{
+			ReleaseFrame(&wrapper);
+			m_FreeList.push_back((mfxU16)i);
+		}
+	}
+}
+
+void CUserSurfacePool::ResetLocks()
+{
+	for (size_t i = 0; i < m_Wrappers.size(); i++)
+	{
+		m_Wrappers[i].Surface.Data.Locked = 0;
+	}
+}
+
+void CUserSurfacePool::ReleaseFrame(sWrapper* pWrapper)
+{
+	pWrapper->bInUse = false;
+	pWrapper->nPins = 0;
+
+	if (m_pCallback)
+	{
+		m_pCallback(&pWrapper->Frame, m_pContext);
+	}
+}
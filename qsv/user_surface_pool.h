@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+
+#include "mfxstructures.h"
+
+#include "utils.h"
+
+// alignment of the planes and pitch of an application frame, for the SIMD loads of the encoder
+#define MSDK_USER_FRAME_ALIGNMENT 16
+
+// an application owned NV12 frame that is encoded in place
+struct sUserFrame
+{
+	mfxU8* pY;
+	mfxU8* pUV; // interleaved chroma
+	mfxU32 nPitch; // of both planes
+	mfxU32 nLumaSize; // bytes from pY on that belong to the frame
+	mfxU32 nChromaSize; // bytes from pUV on that belong to the frame
+	mfxU64 nTimeStamp; // comes back with the packet of the frame
+	void* pUserData; // not touched
+};
+
+// called once the encoder is done with the buffers of pFrame
+typedef void (*UserFrameReleaseCallback)(const sUserFrame* pFrame, void* pContext);
+
+// Wraps application frames as encoder input surfaces instead of copying them into allocator frames.
+// A wrapper has no MemId and points at the application buffers, so an allocator asked to lock it has
+// nothing to do. Wrap pins the surface until the caller submitted it; the wrapper goes back, and its frame
+// to the release callback, once Recycle finds it unpinned and Data.Locked back at zero.
+class CUserSurfacePool
+{
+public:
+	CUserSurfacePool();
+	virtual ~CUserSurfacePool();
+
+	// nPoolSize wrappers for frames of info
+	virtual mfxStatus Init(const mfxFrameInfo& info, mfxU16 nPoolSize, UserFrameReleaseCallback pCallback, void* pContext);
+	// releases every frame still wrapped, the encoder must be closed
+	virtual void Close();
+
+	// checks that frame covers the whole surface with aligned planes and a 16 bit pitch and wraps it;
+	// MFX_WRN_DEVICE_BUSY if every wrapper is in use
+	virtual mfxStatus Wrap(const sUserFrame& frame, mfxFrameSurface1** ppSurface);
+	// gives back a wrapper the encoder did not take, without releasing its frame; false if pSurface is no wrapper
+	virtual bool Unwrap(mfxFrameSurface1* pSurface);
+	// keeps a wrapped surface from being released, e.g. while it waits for a replay; false if pSurface is no wrapper
+	virtual bool Pin(mfxFrameSurface1* pSurface);
+	// false if pSurface is no wrapper
+	virtual bool Unpin(mfxFrameSurface1* pSurface);
+	// releases the frames of the wrappers nobody locks any more, on the calling thread
+	virtual void Recycle();
+	// the encoder was closed: drops its locks and those of the holds, pins stay
+	virtual void ResetLocks();
+
+	mfxU32 GetFramesWrapped() const { return m_nWrapped; }
+
+protected:
+	struct sWrapper
+	{
+		mfxFrameSurface1 Surface;
+		sUserFrame Frame;
+		bool bInUse;
+		mfxU16 nPins; // the pool's own locks, Data.Locked is the encoder's and the holds'
+	};
+
+	sWrapper* Find(mfxFrameSurface1* pSurface);
+	void ReleaseFrame(sWrapper* pWrapper);
+
+	mfxFrameInfo m_Info;
+	std::vector<sWrapper> m_Wrappers;
+	std::vector<mfxU16> m_FreeList;
+	UserFrameReleaseCallback m_pCallback;
+	void* m_pContext;
+	mfxU32 m_nWrapped;
+
+private:
+	CUserSurfacePool(const CUserSurfacePool&);
+	void operator=(const CUserSurfacePool&);
+};
@@ -1,11 +1,27 @@
 #include "utils.h"
 
-#include <windows.h>
-#include <iostream>
+#include "stage_timings.h"
+#include "trace.h"
 
-typedef mfxI64 msdk_tick;
-#define MSDK_GET_TIME(T,S,F) ((mfxF64)((T)-(S))/(mfxF64)(F))
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
 
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32) || defined(_WIN64)
+// QueryPerformanceCounter reads the invariant TSC where the platform has one
 msdk_tick msdk_time_get_tick(void)
 {
 	LARGE_INTEGER t1;
@@ -21,44 +37,18 @@ msdk_tick msdk_time_get_frequency(void)
 	QueryPerformanceFrequency(&t1);
 	return t1.QuadPart;
 }
-
-class CTimer
+#else
+// steady_clock is clock_gettime(CLOCK_MONOTONIC), served from the vDSO off the TSC without a system call
+msdk_tick msdk_time_get_tick(void)
 {
-public:
-	CTimer() :
-		start(0)
-	{
-	}
-	static msdk_tick GetFrequency()
-	{
-		if (!frequency) frequency = msdk_time_get_frequency();
-		return frequency;
-	}
-	static mfxF64 ConvertToSeconds(msdk_tick elapsed)
-	{
-		return MSDK_GET_TIME(elapsed, 0, GetFrequency());
-	}
-
-	inline void Start()
-	{
-		start = msdk_time_get_tick();
-	}
-	inline msdk_tick GetDelta()
-	{
-		return msdk_time_get_tick() - start;
-	}
-	inline mfxF64 GetTime()
-	{
-		return MSDK_GET_TIME(msdk_time_get_tick(), start, GetFrequency());
-	}
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-protected:
-	static msdk_tick frequency;
-	msdk_tick start;
-private:
-	CTimer(const CTimer&);
-	void operator=(const CTimer&);
-};
+msdk_tick msdk_time_get_frequency(void)
+{
+	return 1000000000;
+}
+#endif
 
 msdk_tick CTimer::frequency = 0;
 
@@ -113,6 +103,7 @@ CSmplBitstreamWriter::CSmplBitstreamWriter()
 	m_fSource = NULL;
 	m_bInited = false;
 	m_nProcessedFramesNum = 0;
+	m_nProcessedBytes = 0;
 }
 
 CSmplBitstreamWriter::~CSmplBitstreamWriter()
@@ -154,7 +145,16 @@ mfxStatus CSmplBitstreamWriter::Reset()
 	return Init(m_sFile.c_str());
 }
 
-mfxStatus CSmplBitstreamWriter::WriteNextFrame(mfxBitstream *pMfxBitstream)
+mfxStatus CSmplBitstreamWriter::Flush()
+{
+	if (m_fSource && fflush(m_fSource)) {
+		return MFX_ERR_UNDEFINED_BEHAVIOR;
+	}
+
+	return MFX_ERR_NONE;
+}
+
+mfxStatus CSmplBitstreamWriter::WriteNextFrame(mfxBitstream *pMfxBitstream, mfxU32)
 {
 	// check if writer is initialized
 	MSDK_CHECK_ERROR(m_bInited, false, MFX_ERR_NOT_INITIALIZED);
@@ -170,25 +170,161 @@ mfxStatus CSmplBitstreamWriter::WriteNextFrame(mfxBitstream *pMfxBitstream)
 	// mark that we don't need bit stream data any more
 	pMfxBitstream->DataLength = 0;
 
-	m_nProcessedFramesNum++;
+	mfxU32 nFrames = ++m_nProcessedFramesNum;
+	m_nProcessedBytes += nBytesWritten;
 
 	// print encoding progress to console every certain number of frames (not to affect performance too much)
-	if (1 == m_nProcessedFramesNum || (0 == (m_nProcessedFramesNum % 100)))
+	if (1 == nFrames || (0 == (nFrames % 100)))
 	{
-		std::cout << "Frame number: " << m_nProcessedFramesNum << std::endl;
+		std::cout << "Frame number: " << nFrames << std::endl;
 	}
 
 	return MFX_ERR_NONE;
 }
 
+// maps the whole file read-only; on Windows the handles are not needed once the view exists, elsewhere
+// the descriptor is kept to check the size of the file
+static mfxStatus MapInputFile(const std::string& strFileName, mfxU8** ppBase, mfxU64* pnSize, int* pnFd)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	HANDLE hFile = CreateFileA(strFileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (INVALID_HANDLE_VALUE == hFile)
+	{
+		return MFX_ERR_NULL_PTR;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(hFile, &size) || 0 == size.QuadPart || (mfxU64)size.QuadPart > (mfxU64)(SIZE_T)-1)
+	{
+		CloseHandle(hFile);
+		return MFX_ERR_UNSUPPORTED;
+	}
+
+	HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(hFile);
+	MSDK_CHECK_POINTER(hMapping, MFX_ERR_UNSUPPORTED);
+
+	*ppBase = (mfxU8*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(hMapping);
+	MSDK_CHECK_POINTER(*ppBase, MFX_ERR_UNSUPPORTED);
+
+	*pnSize = (mfxU64)size.QuadPart;
+	*pnFd = -1;
+#else
+	int fd = open(strFileName.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return MFX_ERR_NULL_PTR;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) || 0 == st.st_size)
+	{
+		close(fd);
+		return MFX_ERR_UNSUPPORTED;
+	}
+
+	void* base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == base)
+	{
+		close(fd);
+		return MFX_ERR_UNSUPPORTED;
+	}
+
+	// frames are consumed front to back, let the kernel read ahead aggressively
+	madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+	*ppBase = (mfxU8*)base;
+	*pnSize = (mfxU64)st.st_size;
+	*pnFd = fd;
+#endif
+
+	return MFX_ERR_NONE;
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+static void UnmapInputFile(mfxU8* pBase, mfxU64, int)
+{
+	UnmapViewOfFile(pBase);
+}
+
+// Windows refuses to truncate a file while a view of it exists
+static mfxU64 GetMappedFileSize(int, mfxU64 nMapSize)
+{
+	return nMapSize;
+}
+#else
+static void UnmapInputFile(mfxU8* pBase, mfxU64 nSize, int nFd)
+{
+	munmap(pBase, (size_t)nSize);
+	close(nFd);
+}
+
+// bytes of the mapping the file still backs, touching the pages past the end of a truncated file raises SIGBUS
+static mfxU64 GetMappedFileSize(int nFd, mfxU64 nMapSize)
+{
+	struct stat st;
+	if (fstat(nFd, &st))
+	{
+		return nMapSize;
+	}
+
+	return MSDK_MIN((mfxU64)st.st_size, nMapSize);
+}
+#endif
+
+// asks the OS to start paging in a range we are about to read
+static void PrefetchMappedRange(mfxU8* pData, mfxU64 nSize)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	WIN32_MEMORY_RANGE_ENTRY range;
+	range.VirtualAddress = pData;
+	range.NumberOfBytes = (SIZE_T)nSize;
+	PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	mfxU8* start = (mfxU8*)((size_t)pData & ~(page - 1));
+	madvise(start, (size_t)(pData + nSize - start), MADV_WILLNEED);
+#endif
+}
+
+// stdio offsets of 64 bits, 4K inputs pass 2 GB after a hundred frames
+static int SeekInputFile(FILE* f, mfxU64 nOffset, int nOrigin)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	return _fseeki64(f, (__int64)nOffset, nOrigin);
+#else
+	return fseeko(f, (off_t)nOffset, nOrigin);
+#endif
+}
+
+static mfxU64 TellInputFile(FILE* f)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	return (mfxU64)_ftelli64(f);
+#else
+	return (mfxU64)ftello(f);
+#endif
+}
+
 CSmplYUVReader::CSmplYUVReader()
 {
 	m_bInited = false;
+	m_bMemoryMapped = false;
 	m_ColorFormat = MFX_FOURCC_YV12;
 	shouldShiftP010High = false;
+	m_nRangeOffset = 0;
+	m_nRangeFrames = 0;
+	m_nRangeLoaded = 0;
+	m_nFramesLoaded = 0;
+	m_nBytesLoaded = 0;
+	m_dLoadTime = 0;
+	m_pTimings = NULL;
+	m_nConvertTicks = 0;
+	m_pInterleaveUV = GetInterleaveUVFunc();
 }
 
-mfxStatus CSmplYUVReader::Init(std::list<std::string> inputs, mfxU32 ColorFormat, bool shouldShiftP010)
+mfxStatus CSmplYUVReader::Init(std::list<std::string> inputs, mfxU32 ColorFormat, bool shouldShiftP010, bool bUseMemoryMap)
 {
 	Close();
 
@@ -214,12 +350,34 @@ mfxStatus CSmplYUVReader::Init(std::list<std::string> inputs, mfxU32 ColorFormat
 		return MFX_ERR_UNSUPPORTED;
 	}
 
-	for (ls_iterator it = inputs.begin(); it != inputs.end(); it++)
+	if (bUseMemoryMap)
 	{
-		FILE *f = fopen((*it).c_str(), "rb");
-		MSDK_CHECK_POINTER(f, MFX_ERR_NULL_PTR);
+		m_bMemoryMapped = true;
+		for (ls_iterator it = inputs.begin(); it != inputs.end(); it++)
+		{
+			sMappedFile file = {};
+			mfxStatus sts = MapInputFile(*it, &file.pBase, &file.nMapSize, &file.nFd);
+			if (MFX_ERR_NONE != sts)
+			{
+				std::cout << "WARNING: cannot map " << *it << " into memory, falling back to buffered reads" << std::endl;
+				Close();
+				break;
+			}
 
-		m_files.push_back(f);
+			file.nSize = file.nMapSize;
+			m_mappedFiles.push_back(file);
+		}
+	}
+
+	if (!m_bMemoryMapped)
+	{
+		for (ls_iterator it = inputs.begin(); it != inputs.end(); it++)
+		{
+			FILE *f = fopen((*it).c_str(), "rb");
+			MSDK_CHECK_POINTER(f, MFX_ERR_NULL_PTR);
+
+			m_files.push_back(f);
+		}
 	}
 
 	m_ColorFormat = ColorFormat;
@@ -241,14 +399,245 @@ void CSmplYUVReader::Close()
 		fclose(m_files[i]);
 	}
 	m_files.clear();
+
+	// no surface may point into a mapping that is gone
+	RestoreSurfaces();
+	for (mfxU32 i = 0; i < m_mappedFiles.size(); i++)
+	{
+		UnmapInputFile(m_mappedFiles[i].pBase, m_mappedFiles[i].nMapSize, m_mappedFiles[i].nFd);
+	}
+	m_mappedFiles.clear();
+
+	m_bMemoryMapped = false;
 	m_bInited = false;
+
+	m_nRangeOffset = 0;
+	m_nRangeFrames = 0;
+	m_nRangeLoaded = 0;
+	m_nFramesLoaded = 0;
+	m_nBytesLoaded = 0;
+	m_dLoadTime = 0;
 }
 
 void CSmplYUVReader::Reset()
+{
+	SeekToRange();
+}
+
+void CSmplYUVReader::SeekToRange()
 {
 	for (mfxU32 i = 0; i < m_files.size(); i++)
 	{
-		fseek(m_files[i], 0, SEEK_SET);
+		SeekInputFile(m_files[i], m_nRangeOffset, SEEK_SET);
+	}
+
+	for (mfxU32 i = 0; i < m_mappedFiles.size(); i++)
+	{
+		m_mappedFiles[i].nOffset = MSDK_MIN(m_nRangeOffset, m_mappedFiles[i].nSize);
+	}
+
+	m_nRangeLoaded = 0;
+}
+
+mfxStatus CSmplYUVReader::SetFrameRange(mfxU16 w, mfxU16 h, mfxU32 nFirstFrame, mfxU32 nFrameCount)
+{
+	MSDK_CHECK_ERROR(m_bInited, false, MFX_ERR_NOT_INITIALIZED);
+
+	mfxU32 nFrameSize = GetFrameSize(w, h);
+	MSDK_CHECK_ERROR(nFrameSize, 0, MFX_ERR_UNSUPPORTED);
+
+	// frames have a fixed size, so the range starts at a computed offset
+	m_nRangeOffset = (mfxU64)nFirstFrame * nFrameSize;
+	m_nRangeFrames = nFrameCount;
+	SeekToRange();
+
+	return MFX_ERR_NONE;
+}
+
+mfxU32 CSmplYUVReader::GetFrameCount(mfxU16 w, mfxU16 h)
+{
+	mfxU32 nFrameSize = GetFrameSize(w, h);
+	if (!m_bInited || !nFrameSize)
+	{
+		return 0;
+	}
+
+	mfxU64 nSize = 0;
+	if (m_bMemoryMapped)
+	{
+		nSize = m_mappedFiles[0].nSize;
+	}
+	else
+	{
+		FILE* f = m_files[0];
+		mfxU64 nPosition = TellInputFile(f);
+		SeekInputFile(f, 0, SEEK_END);
+		nSize = TellInputFile(f);
+		SeekInputFile(f, nPosition, SEEK_SET);
+	}
+
+	return (mfxU32)(nSize / nFrameSize);
+}
+
+void CSmplYUVReader::PrintStatistics()
+{
+	if (!m_nFramesLoaded)
+	{
+		return;
+	}
+
+	mfxF64 megabytes = m_nBytesLoaded / (1024. * 1024.);
+	std::cout << "Input: " << m_nFramesLoaded << " frames, " << std::fixed << std::setprecision(1) << megabytes << " MB in "
+		<< std::setprecision(3) << m_dLoadTime << " s, " << std::setprecision(1) << (m_dLoadTime > 0 ? megabytes / m_dLoadTime : 0)
+		<< " MB/s (" << (m_bMemoryMapped ? "mmap" : "stdio") << ")" << std::endl;
+	std::cout.unsetf(std::ios::floatfield);
+}
+
+mfxU32 CSmplYUVReader::GetFrameSize(mfxU16 w, mfxU16 h) const
+{
+	mfxU32 nPixels = (mfxU32)w * h;
+
+	switch (m_ColorFormat)
+	{
+	case MFX_FOURCC_NV12:
+	case MFX_FOURCC_YV12:
+	case MFX_FOURCC_I420:
+		return nPixels + 2 * ((w / 2) * (h / 2));
+	case MFX_FOURCC_YUY2:
+		return nPixels * 2;
+	case MFX_FOURCC_RGB4:
+	case MFX_FOURCC_BGR4:
+		return nPixels * 4;
+	case MFX_FOURCC_P010:
+		return (nPixels + w * (h / 2)) * 2;
+	case MFX_FOURCC_P210:
+		return nPixels * 4;
+	default:
+		return 0;
+	}
+}
+
+// fread replacement, copies from the mapping when the input is memory mapped
+mfxU32 CSmplYUVReader::ReadElements(mfxU32 vid, mfxU8* pDst, mfxU32 nElementSize, mfxU32 nCount)
+{
+	if (!m_bMemoryMapped)
+	{
+		return (mfxU32)fread(pDst, nElementSize, nCount, m_files[vid]);
+	}
+
+	sMappedFile& file = m_mappedFiles[vid];
+	mfxU64 nAvailable = (file.nSize - file.nOffset) / nElementSize;
+	if (nAvailable < nCount)
+	{
+		nCount = (mfxU32)nAvailable;
+	}
+
+	mfxU32 nBytes = nCount * nElementSize;
+	memcpy(pDst, file.pBase + file.nOffset, nBytes);
+	file.nOffset += nBytes;
+
+	return nCount;
+}
+
+// returns a whole plane, straight from the mapping or read into pScratch
+const mfxU8* CSmplYUVReader::ReadPlane(mfxU32 vid, mfxU8* pScratch, mfxU32 nBytes)
+{
+	if (!m_bMemoryMapped)
+	{
+		return (nBytes == fread(pScratch, 1, nBytes, m_files[vid])) ? pScratch : NULL;
+	}
+
+	sMappedFile& file = m_mappedFiles[vid];
+	if (file.nSize - file.nOffset < nBytes)
+	{
+		file.nOffset = file.nSize;
+		return NULL;
+	}
+
+	const mfxU8* pPlane = file.pBase + file.nOffset;
+	file.nOffset += nBytes;
+
+	return pPlane;
+}
+
+// a frame can be referenced in place if its layout in the file matches the surface layout
+bool CSmplYUVReader::CanMapSurface(mfxFrameSurface1* pSurface, mfxU16 w, mfxU16 h) const
+{
+	mfxFrameInfo& pInfo = pSurface->Info;
+
+	if (m_ColorFormat != pInfo.FourCC)
+	{
+		return false;
+	}
+
+	mfxU32 nBytesPerPixel;
+	if (MFX_FOURCC_NV12 == pInfo.FourCC)
+	{
+		nBytesPerPixel = 1;
+	}
+	else if (MFX_FOURCC_P010 == pInfo.FourCC && !shouldShiftP010High)
+	{
+		nBytesPerPixel = 2;
+	}
+	else
+	{
+		return false;
+	}
+
+	return 0 == pInfo.CropX && 0 == pInfo.CropY && h == pInfo.Height && pSurface->Data.Pitch == w * nBytesPerPixel;
+}
+
+// points the surface planes into the mapping, the encoder reads the file pages directly; the allocator's
+// planes are kept for RestoreSurface, the mapping is read-only
+mfxStatus CSmplYUVReader::MapNextFrame(mfxFrameSurface1* pSurface, mfxU16 w, mfxU16 h)
+{
+	mfxFrameData& pData = pSurface->Data;
+	sMappedFile& file = m_mappedFiles[pSurface->Info.FrameId.ViewId];
+	mfxU32 nFrameSize = GetFrameSize(w, h);
+
+	if (file.nSize - file.nOffset < nFrameSize)
+	{
+		return MFX_ERR_MORE_DATA;
+	}
+
+	mfxU32 nChromaStep = (MFX_FOURCC_P010 == pSurface->Info.FourCC) ? 2 : 1;
+
+	sMappedSurface surface;
+	surface.pSurface = pSurface;
+	surface.pY = pData.Y;
+	surface.pUV = pData.UV;
+	surface.pV = pData.V;
+	m_mappedSurfaces.push_back(surface);
+
+	pData.Y = file.pBase + file.nOffset;
+	pData.UV = pData.Y + (mfxU32)pData.Pitch * h;
+	pData.V = pData.UV + nChromaStep;
+	file.nOffset += nFrameSize;
+
+	return MFX_ERR_NONE;
+}
+
+void CSmplYUVReader::RestoreSurface(mfxFrameSurface1* pSurface)
+{
+	for (size_t i = 0; i < m_mappedSurfaces.size(); i++)
+	{
+		if (m_mappedSurfaces[i].pSurface == pSurface)
+		{
+			pSurface->Data.Y = m_mappedSurfaces[i].pY;
+			pSurface->Data.UV = m_mappedSurfaces[i].pUV;
+			pSurface->Data.V = m_mappedSurfaces[i].pV;
+			m_mappedSurfaces[i] = m_mappedSurfaces.back();
+			m_mappedSurfaces.pop_back();
+			return;
+		}
+	}
+}
+
+void CSmplYUVReader::RestoreSurfaces()
+{
+	while (!m_mappedSurfaces.empty())
+	{
+		RestoreSurface(m_mappedSurfaces.back().pSurface);
 	}
 }
 
@@ -258,6 +647,74 @@ mfxStatus CSmplYUVReader::LoadNextFrame(mfxFrameSurface1* pSurface)
 	MSDK_CHECK_ERROR(m_bInited, false, MFX_ERR_NOT_INITIALIZED);
 	MSDK_CHECK_POINTER(pSurface, MFX_ERR_NULL_PTR);
 
+	mfxFrameInfo& pInfo = pSurface->Info;
+	mfxU32 vid = pInfo.FrameId.ViewId;
+
+	if (vid >= (m_bMemoryMapped ? m_mappedFiles.size() : m_files.size()))
+	{
+		return MFX_ERR_UNSUPPORTED;
+	}
+
+	mfxU16 w = (pInfo.CropH > 0 && pInfo.CropW > 0) ? pInfo.CropW : pInfo.Width;
+	mfxU16 h = (pInfo.CropH > 0 && pInfo.CropW > 0) ? pInfo.CropH : pInfo.Height;
+	mfxU32 nFrameSize = GetFrameSize(w, h);
+
+	// every input holds one view of a frame
+	mfxU32 nInputs = (mfxU32)(m_bMemoryMapped ? m_mappedFiles.size() : m_files.size());
+	if (m_nRangeFrames && m_nRangeLoaded >= m_nRangeFrames * nInputs)
+	{
+		return MFX_ERR_MORE_DATA;
+	}
+
+	CTimer t;
+	t.Start();
+	m_nConvertTicks = 0;
+	CTraceSpan loadSpan("load", m_nFramesLoaded);
+
+	mfxStatus sts = MFX_ERR_NONE;
+	if (m_bMemoryMapped)
+	{
+		// the surface may still point at the frame mapped into it last time, every path below writes its own planes
+		RestoreSurface(pSurface);
+
+		// frames past the end of a file truncated under the mapping count as the end of the input
+		sMappedFile& file = m_mappedFiles[vid];
+		file.nSize = MSDK_MIN(file.nSize, GetMappedFileSize(file.nFd, file.nMapSize));
+		file.nOffset = MSDK_MIN(file.nOffset, file.nSize);
+
+		// start paging in the frame after this one while we work on the current one
+		if (file.nSize - file.nOffset >= 2 * (mfxU64)nFrameSize)
+		{
+			PrefetchMappedRange(file.pBase + file.nOffset + nFrameSize, nFrameSize);
+		}
+
+		sts = CanMapSurface(pSurface, w, h) ? MapNextFrame(pSurface, w, h) : ReadNextFrame(pSurface);
+	}
+	else
+	{
+		sts = ReadNextFrame(pSurface);
+	}
+
+	msdk_tick nLoadTicks = t.GetDelta();
+	m_dLoadTime += CTimer::ConvertToSeconds(nLoadTicks);
+	if (MFX_ERR_NONE == sts)
+	{
+		m_nFramesLoaded++;
+		m_nRangeLoaded++;
+		m_nBytesLoaded += nFrameSize;
+
+		if (m_pTimings)
+		{
+			m_pTimings->Record(MSDK_STAGE_READ, nLoadTicks - m_nConvertTicks);
+			m_pTimings->Record(MSDK_STAGE_CONVERT, m_nConvertTicks);
+		}
+	}
+
+	return sts;
+}
+
+mfxStatus CSmplYUVReader::ReadNextFrame(mfxFrameSurface1* pSurface)
+{
 	mfxU32 nBytesRead;
 	mfxU16 w, h, i, pitch;
 	mfxU8 *ptr, *ptr2;
@@ -266,11 +723,6 @@ mfxStatus CSmplYUVReader::LoadNextFrame(mfxFrameSurface1* pSurface)
 
 	mfxU32 vid = pInfo.FrameId.ViewId;
 
-	if (vid > m_files.size())
-	{
-		return MFX_ERR_UNSUPPORTED;
-	}
-
 	if (pInfo.CropH > 0 && pInfo.CropW > 0)
 	{
 		w = pInfo.CropW;
@@ -298,7 +750,7 @@ mfxStatus CSmplYUVReader::LoadNextFrame(mfxFrameSurface1* pSurface)
 
 			for (i = 0; i < h; i++)
 			{
-				nBytesRead = (mfxU32)fread(ptr + i * pitch, 1, 4 * w, m_files[vid]);
+				nBytesRead = ReadElements(vid, ptr + i * pitch, 1, 4 * w);
 
 				if ((mfxU32)4 * w != nBytesRead)
 				{
@@ -312,7 +764,7 @@ mfxStatus CSmplYUVReader::LoadNextFrame(mfxFrameSurface1* pSurface)
 
 			for (i = 0; i < h; i++)
 			{
-				nBytesRead = (mfxU32)fread(ptr + i * pitch, 1, 2 * w, m_files[vid]);
+				nBytesRead = ReadElements(vid, ptr + i * pitch, 1, 2 * w);
 
 				if ((mfxU32)2 * w != nBytesRead)
 				{
@@ -332,7 +784,7 @@ mfxStatus CSmplYUVReader::LoadNextFrame(mfxFrameSurface1* pSurface)
 		// read luminance plane
 		for (i = 0; i < h; i++)
 		{
-			nBytesRead = (mfxU32)fread(ptr + i * pitch, nBytesPerPixel, w, m_files[vid]);
+			nBytesRead = ReadElements(vid, ptr + i * pitch, nBytesPerPixel, w);
 
 			if (w != nBytesRead)
 			{
@@ -359,53 +811,40 @@ mfxStatus CSmplYUVReader::LoadNextFrame(mfxFrameSurface1* pSurface)
 			{
 			case MFX_FOURCC_NV12:
 
-				mfxU8 buf[2048]; // maximum supported chroma width for nv12
-				mfxU32 j, dstOffset[2];
 				w /= 2;
 				h /= 2;
 				ptr = pData.UV + pInfo.CropX + (pInfo.CropY / 2) * pitch;
-				if (w > 2048)
-				{
-					return MFX_ERR_UNSUPPORTED;
-				}
 
-				if (m_ColorFormat == MFX_FOURCC_I420) {
-					dstOffset[0] = 0;
-					dstOffset[1] = 1;
-				}
-				else {
-					dstOffset[0] = 1;
-					dstOffset[1] = 0;
-				}
-
-				// load first chroma plane: U (input == I420) or V (input == YV12)
-				for (i = 0; i < h; i++)
 				{
-					nBytesRead = (mfxU32)fread(buf, 1, w, m_files[vid]);
-					if (w != nBytesRead)
+					// read both chroma planes first so U and V rows can be interleaved in a single pass
+					mfxU32 nPlaneSize = (mfxU32)w * h;
+					if (m_ChromaBuffer.size() < 2 * nPlaneSize)
 					{
-						return MFX_ERR_MORE_DATA;
+						m_ChromaBuffer.resize(2 * nPlaneSize);
 					}
-					for (j = 0; j < w; j++)
+
+					// first plane is U (input == I420) or V (input == YV12)
+					const mfxU8* pFirst = ReadPlane(vid, &m_ChromaBuffer[0], nPlaneSize);
+					if (!pFirst)
 					{
-						ptr[i * pitch + j * 2 + dstOffset[0]] = buf[j];
+						return MFX_ERR_MORE_DATA;
 					}
-				}
 
-				// load second chroma plane: V (input == I420) or U (input == YV12)
-				for (i = 0; i < h; i++)
-				{
-
-					nBytesRead = (mfxU32)fread(buf, 1, w, m_files[vid]);
-
-					if (w != nBytesRead)
+					const mfxU8* pSecond = ReadPlane(vid, &m_ChromaBuffer[nPlaneSize], nPlaneSize);
+					if (!pSecond)
 					{
 						return MFX_ERR_MORE_DATA;
 					}
-					for (j = 0; j < w; j++)
+
+					const mfxU8* pU = (m_ColorFormat == MFX_FOURCC_I420) ? pFirst : pSecond;
+					const mfxU8* pV = (m_ColorFormat == MFX_FOURCC_I420) ? pSecond : pFirst;
+
+					msdk_tick nConvertStart = msdk_time_get_tick();
+					for (i = 0; i < h; i++)
 					{
-						ptr[i * pitch + j * 2 + dstOffset[1]] = buf[j];
+						m_pInterleaveUV(ptr + i * pitch, pU + i * w, pV + i * w, w);
 					}
+					m_nConvertTicks += msdk_time_get_tick() - nConvertStart;
 				}
 
 				break;
@@ -426,7 +865,7 @@ mfxStatus CSmplYUVReader::LoadNextFrame(mfxFrameSurface1* pSurface)
 				for (i = 0; i < h; i++)
 				{
 
-					nBytesRead = (mfxU32)fread(ptr + i * pitch, 1, w, m_files[vid]);
+					nBytesRead = ReadElements(vid, ptr + i * pitch, 1, w);
 
 					if (w != nBytesRead)
 					{
@@ -435,7 +874,7 @@ mfxStatus CSmplYUVReader::LoadNextFrame(mfxFrameSurface1* pSurface)
 				}
 				for (i = 0; i < h; i++)
 				{
-					nBytesRead = (mfxU32)fread(ptr2 + i * pitch, 1, w, m_files[vid]);
+					nBytesRead = ReadElements(vid, ptr2 + i * pitch, 1, w);
 
 					if (w != nBytesRead)
 					{
@@ -457,7 +896,7 @@ mfxStatus CSmplYUVReader::LoadNextFrame(mfxFrameSurface1* pSurface)
 			ptr = pData.UV + pInfo.CropX + (pInfo.CropY / 2) * pitch;
 			for (i = 0; i < h; i++)
 			{
-				nBytesRead = (mfxU32)fread(ptr + i * pitch, nBytesPerPixel, w, m_files[vid]);
+				nBytesRead = ReadElements(vid, ptr + i * pitch, nBytesPerPixel, w);
 
 				if (w != nBytesRead)
 				{
@@ -515,6 +954,50 @@ mfxStatus ConvertFrameRate(mfxF64 dFrameRate, mfxU32* pnFrameRateExtN, mfxU32* p
 	return MFX_ERR_NONE;
 }
 
+static const struct
+{
+	mfxIMPL impl;
+	const char* name;
+} IMPLEMENTATION_NAMES[] = {
+	{ MFX_IMPL_SOFTWARE, "sw" },
+	{ MFX_IMPL_HARDWARE, "hw" },
+	{ MFX_IMPL_HARDWARE2, "hw2" },
+	{ MFX_IMPL_HARDWARE3, "hw3" },
+	{ MFX_IMPL_HARDWARE4, "hw4" },
+	{ MFX_IMPL_HARDWARE_ANY, "hw_any" },
+	{ MFX_IMPL_AUTO, "auto" },
+	{ MFX_IMPL_AUTO_ANY, "auto_any" },
+};
+
+mfxStatus StringToImplementation(const std::string& name, mfxIMPL* pImpl)
+{
+	MSDK_CHECK_POINTER(pImpl, MFX_ERR_NULL_PTR);
+
+	for (size_t i = 0; i < sizeof(IMPLEMENTATION_NAMES) / sizeof(IMPLEMENTATION_NAMES[0]); i++)
+	{
+		if (name == IMPLEMENTATION_NAMES[i].name)
+		{
+			*pImpl = IMPLEMENTATION_NAMES[i].impl;
+			return MFX_ERR_NONE;
+		}
+	}
+
+	return MFX_ERR_UNSUPPORTED;
+}
+
+const char* ImplementationToString(mfxIMPL impl)
+{
+	for (size_t i = 0; i < sizeof(IMPLEMENTATION_NAMES) / sizeof(IMPLEMENTATION_NAMES[0]); i++)
+	{
+		if (MFX_IMPL_BASETYPE(impl) == IMPLEMENTATION_NAMES[i].impl)
+		{
+			return IMPLEMENTATION_NAMES[i].name;
+		}
+	}
+
+	return "unknown";
+}
+
 mfxU16 GetFreeSurfaceIndex(mfxFrameSurface1* pSurfacesPool, mfxU16 nPoolSize)
 {
 	if (pSurfacesPool)
@@ -560,4 +1043,71 @@ mfxU16 GetFreeSurface(mfxFrameSurface1* pSurfacesPool, mfxU16 nPoolSize)
 	}
 
 	return idx;
-}
\ No newline at end of file
+}
+
+void GetProcessMemoryCounters(mfxU64* pnPageFaults, mfxU64* pnResidentBytes)
+{
+	*pnPageFaults = 0;
+	*pnResidentBytes = 0;
+
+#if defined(_WIN32) || defined(_WIN64)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		*pnPageFaults = counters.PageFaultCount;
+		*pnResidentBytes = counters.WorkingSetSize;
+	}
+#else
+	struct rusage usage;
+	if (!getrusage(RUSAGE_SELF, &usage))
+	{
+		*pnPageFaults = (mfxU64)usage.ru_minflt + (mfxU64)usage.ru_majflt;
+	}
+
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f)
+	{
+		unsigned long nPages = 0, nResident = 0;
+		if (2 == fscanf(f, "%lu %lu", &nPages, &nResident))
+		{
+			*pnResidentBytes = (mfxU64)nResident * (mfxU64)sysconf(_SC_PAGESIZE);
+		}
+		fclose(f);
+	}
+#endif
+}
+
+void GetProcessCpuTimes(mfxF64* pdUserTime, mfxF64* pdKernelTime)
+{
+	*pdUserTime = 0;
+	*pdKernelTime = 0;
+
+#if defined(_WIN32) || defined(_WIN64)
+	FILETIME creation, exit, kernel, user;
+	if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+	{
+		// 100 ns units
+		*pdUserTime = (((mfxU64)user.dwHighDateTime << 32) | user.dwLowDateTime) / 1e7;
+		*pdKernelTime = (((mfxU64)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) / 1e7;
+	}
+#else
+	struct rusage usage;
+	if (!getrusage(RUSAGE_SELF, &usage))
+	{
+		*pdUserTime = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+		*pdKernelTime = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	}
+#endif
+}
+
+mfxU32 GetCpuCount()
+{
+#if defined(_WIN32) || defined(_WIN64)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return MSDK_MAX(info.dwNumberOfProcessors, 1);
+#else
+	long nCount = sysconf(_SC_NPROCESSORS_ONLN);
+	return nCount > 0 ? (mfxU32)nCount : 1;
+#endif
+}
@@ -1,11 +1,17 @@
 #pragma once
 
+#include <atomic>
 #include <list>
 #include <string>
 #include <vector>
 
 #include "mfxstructures.h"
 
+#include "convert.h"
+
+class CStageTimings;
+class CFrameLatency;
+
 #define MSDK_SAFE_DELETE_ARRAY(P)                {if (P) {delete[] P; P = NULL;}}
 #define MSDK_SAFE_DELETE(P)                      {if (P) {delete P; P = NULL;}}
 #define MSDK_CHECK_POINTER(P, ...)               {if (!(P)) {return __VA_ARGS__;}}
@@ -21,26 +27,90 @@
 #define MSDK_IGNORE_MFX_STS(P, X)                {if ((X) == (P)) {P = MFX_ERR_NONE;}}
 #define MSDK_BREAK_ON_ERROR(P)                   {if (MFX_ERR_NONE != (P)) break;}
 
+#if defined(_WIN32) || defined(_WIN64)
 #define MSDK_MEMCPY_VAR(dstVarName, src, count) memcpy_s(&(dstVarName), sizeof(dstVarName), (src), (count))
+#else
+#define MSDK_MEMCPY_VAR(dstVarName, src, count) memcpy(&(dstVarName), (src), (count))
+#endif
 
 #define MSDK_DEC_WAIT_INTERVAL 300000
 #define MSDK_ENC_WAIT_INTERVAL 300000
 #define MSDK_VPP_WAIT_INTERVAL 300000
 #define MSDK_SURFACE_WAIT_INTERVAL 20000
 #define MSDK_DEVICE_FREE_WAIT_INTERVAL 30000
+#define MSDK_PREFETCH_WAIT_INTERVAL 1
 #define MSDK_WAIT_INTERVAL MSDK_DEC_WAIT_INTERVAL+3*MSDK_VPP_WAIT_INTERVAL+MSDK_ENC_WAIT_INTERVAL // an estimate for the longest pipeline we have in samples
 #define MSDK_INVALID_SURF_IDX 0xFFFF
+#if defined(_WIN32) || defined(_WIN64)
 #define MSDK_SLEEP(msec) Sleep(msec)
+#else
+#include <unistd.h>
+#define MSDK_SLEEP(msec) usleep(1000 * (msec))
+#endif
 
 enum {
 	MFX_FOURCC_I420 = MFX_MAKEFOURCC('I', '4', '2', '0')
 };
 
+typedef mfxI64 msdk_tick;
+#define MSDK_GET_TIME(T,S,F) ((mfxF64)((T)-(S))/(mfxF64)(F))
+
+msdk_tick msdk_time_get_tick(void);
+msdk_tick msdk_time_get_frequency(void);
+
+class CTimer
+{
+public:
+	CTimer() :
+		start(0)
+	{
+	}
+	static msdk_tick GetFrequency()
+	{
+		if (!frequency) frequency = msdk_time_get_frequency();
+		return frequency;
+	}
+	static mfxF64 ConvertToSeconds(msdk_tick elapsed)
+	{
+		return MSDK_GET_TIME(elapsed, 0, GetFrequency());
+	}
+
+	inline void Start()
+	{
+		start = msdk_time_get_tick();
+	}
+	inline msdk_tick GetDelta()
+	{
+		return msdk_time_get_tick() - start;
+	}
+	inline mfxF64 GetTime()
+	{
+		return MSDK_GET_TIME(msdk_time_get_tick(), start, GetFrequency());
+	}
+
+protected:
+	static msdk_tick frequency;
+	msdk_tick start;
+private:
+	CTimer(const CTimer&);
+	void operator=(const CTimer&);
+};
+
 mfxStatus InitMfxBitstream(mfxBitstream* pBitstream, mfxU32 nSize);
 mfxStatus ExtendMfxBitstream(mfxBitstream* pBitstream, mfxU32 nSize);
 void WipeMfxBitstream(mfxBitstream* pBitstream);
 mfxStatus ConvertFrameRate(mfxF64 dFrameRate, mfxU32* pnFrameRateExtN, mfxU32* pnFrameRateExtD);
+// implementation names as given on the command line: sw, hw, hw2, hw3, hw4, hw_any, auto, auto_any
+mfxStatus StringToImplementation(const std::string& name, mfxIMPL* pImpl);
+// name of the base type, "unknown" for anything else
+const char* ImplementationToString(mfxIMPL impl);
 mfxU16 GetFreeSurface(mfxFrameSurface1* pSurfacesPool, mfxU16 nPoolSize);
+// page faults since process start and the current resident set size
+void GetProcessMemoryCounters(mfxU64* pnPageFaults, mfxU64* pnResidentBytes);
+// user and kernel mode CPU seconds of all threads since process start
+void GetProcessCpuTimes(mfxF64* pdUserTime, mfxF64* pdKernelTime);
+// logical processors available to the process
+mfxU32 GetCpuCount();
 
 class CSmplYUVReader
 {
@@ -50,17 +120,74 @@ public:
 	virtual ~CSmplYUVReader();
 
 	virtual void Close();
-	virtual mfxStatus Init(std::list<std::string> inputs, mfxU32 ColorFormat, bool shouldShiftP010 = false);
+	virtual mfxStatus Init(std::list<std::string> inputs, mfxU32 ColorFormat, bool shouldShiftP010 = false, bool bUseMemoryMap = false);
 	virtual mfxStatus LoadNextFrame(mfxFrameSurface1* pSurface);
 	virtual void Reset();
+	virtual void PrintStatistics();
+	// read and convert times of every frame loaded go to pTimings, NULL stops recording
+	void SetStageTimings(CStageTimings* pTimings) { m_pTimings = pTimings; }
+	mfxU32 GetFramesLoaded() const { return m_nFramesLoaded; }
+	mfxU64 GetBytesLoaded() const { return m_nBytesLoaded; }
+	// restricts reading to nFrameCount frames of w x h from nFirstFrame on, 0 frames reads to the end of the input;
+	// seeks straight to the first frame, Reset returns to it
+	virtual mfxStatus SetFrameRange(mfxU16 w, mfxU16 h, mfxU32 nFirstFrame, mfxU32 nFrameCount);
+	// whole frames of w x h in the first input, from its size
+	mfxU32 GetFrameCount(mfxU16 w, mfxU16 h);
+	// points the surfaces that frames were mapped into back at their own planes; call before the surfaces
+	// are freed and while no LoadNextFrame runs
+	void RestoreSurfaces();
 	mfxU32 m_ColorFormat; // color format of input YUV data, YUV420 or NV12
 
 protected:
+	// input file mapped into the address space as a whole, read with a moving cursor
+	struct sMappedFile
+	{
+		mfxU8* pBase;
+		mfxU64 nMapSize; // of the mapping
+		mfxU64 nSize; // readable, below nMapSize once the file was truncated
+		mfxU64 nOffset;
+		int nFd; // kept open to notice truncation, -1 where a mapped file cannot be truncated
+	};
+
+	// a surface whose planes MapNextFrame pointed into a mapping, with the allocator's planes
+	struct sMappedSurface
+	{
+		mfxFrameSurface1* pSurface;
+		mfxU8* pY;
+		mfxU8* pUV;
+		mfxU8* pV;
+	};
+
+	mfxStatus ReadNextFrame(mfxFrameSurface1* pSurface);
+	mfxU32 GetFrameSize(mfxU16 w, mfxU16 h) const;
+	mfxU32 ReadElements(mfxU32 vid, mfxU8* pDst, mfxU32 nElementSize, mfxU32 nCount);
+	const mfxU8* ReadPlane(mfxU32 vid, mfxU8* pScratch, mfxU32 nBytes);
+	bool CanMapSurface(mfxFrameSurface1* pSurface, mfxU16 w, mfxU16 h) const;
+	mfxStatus MapNextFrame(mfxFrameSurface1* pSurface, mfxU16 w, mfxU16 h);
+	void RestoreSurface(mfxFrameSurface1* pSurface);
+	void SeekToRange();
 
 	std::vector<FILE*> m_files;
+	std::vector<sMappedFile> m_mappedFiles;
+	std::vector<sMappedSurface> m_mappedSurfaces;
+	std::vector<mfxU8> m_ChromaBuffer; // planar chroma of one frame, used for I420/YV12 -> NV12
+	InterleaveUVFunc m_pInterleaveUV;
 
 	bool shouldShiftP010High;
 	bool m_bInited;
+	bool m_bMemoryMapped;
+
+	mfxU64 m_nRangeOffset; // of the first frame of the range, in every input
+	mfxU32 m_nRangeFrames; // of every input, 0 up to the end
+	mfxU32 m_nRangeLoaded; // frames of all inputs loaded since the start of the range
+
+	// read by reports while the prefetch thread loads
+	std::atomic<mfxU32> m_nFramesLoaded;
+	std::atomic<mfxU64> m_nBytesLoaded;
+	mfxF64 m_dLoadTime;
+
+	CStageTimings* m_pTimings;
+	msdk_tick m_nConvertTicks; // part of the current frame's load time spent converting
 };
 
 class CSmplBitstreamWriter
@@ -71,10 +198,19 @@ public:
 	virtual ~CSmplBitstreamWriter();
 
 	virtual mfxStatus Init(const std::string& strFileName);
-	virtual mfxStatus WriteNextFrame(mfxBitstream *pMfxBitstream);
+	// nFrameOrder identifies the frame for a writer that ends its latency, see SetFrameLatency
+	virtual mfxStatus WriteNextFrame(mfxBitstream *pMfxBitstream, mfxU32 nFrameOrder);
+	// a writer that is done with a frame only after WriteNextFrame returned ends the latency of the frame itself and
+	// returns true, the others leave it to the caller
+	virtual bool SetFrameLatency(CFrameLatency* /*pLatency*/, CStageTimings* /*pTimings*/) { return false; }
+	// makes sure everything passed to WriteNextFrame reached the file
+	virtual mfxStatus Flush();
 	virtual mfxStatus Reset();
 	virtual void Close();
-	mfxU32 m_nProcessedFramesNum;
+	virtual void PrintStatistics() {}
+	// written wherever tasks complete, read by reports on the encoding thread
+	std::atomic<mfxU32> m_nProcessedFramesNum;
+	std::atomic<mfxU64> m_nProcessedBytes;
 
 protected:
 	FILE*       m_fSource;